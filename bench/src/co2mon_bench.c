@@ -0,0 +1,638 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for the decode, validation and output paths, and an
+ * end-to-end run through the output thread.  Every benchmark prints one
+ * JSON object per line:
+ *
+ *   {"bench":"decode_batch","ops":1000000,"ns_per_op":2.41,"syscalls_per_op":0.0000}
+ *
+ * syscalls_per_op counts read- and write-type system calls as the kernel
+ * accounts them in /proc/self/io (so calls made inside libc count too);
+ * it is null where that file does not exist.
+ *
+ * The power benchmarks feed records at the pace of a sensor instead, so
+ * their ns_per_op is CPU time, and they add how often the output thread
+ * woke up and how much CPU time went by per second of the run:
+ *
+ *   {"bench":"power_batch_1s","ops":150,...,"wakeups_per_s":1.00,"cpu_us_per_s":210.5}
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "co2mon.h"
+#include "co2mond.h"
+#include "datadir.h"
+#include "output.h"
+#include "report.h"
+#include "sink.h"
+
+#define DEFAULT_OPS 1000000
+#define BATCH_SIZE 256 /* reports per co2mon_decode_batch() call */
+#define TICK_EVERY 1024 /* records between sink ticks */
+#define POWER_RATE 50   /* records per second for the power benchmarks */
+#define POWER_SECONDS 3
+
+/* co2mond's settings, which the sinks read. */
+int multi_device = 0;
+int print_unknown = 0;
+int batch_period = 0;
+struct metric metrics[NMETRICS];
+signed char metric_of[256];
+
+static const char *only = NULL;  /* run only benchmarks with this prefix */
+static char workdir[] = "/tmp/co2mon_bench.XXXXXX";
+static int iofd = -1;
+static long io_overhead = 0;
+
+static co2mon_data_t magic_table;
+static unsigned char *raw;       /* the report stream, 8 bytes each */
+static co2mon_data_t *decoded;
+static struct record *records;
+static size_t nreports;
+
+static int64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read and write system calls so far, or -1 if the kernel does not say. */
+static long
+io_syscalls()
+{
+    char buf[512];
+    if (iofd < 0)
+    {
+        return -1;
+    }
+    ssize_t len = pread(iofd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+    const char *r = strstr(buf, "syscr:");
+    const char *w = strstr(buf, "syscw:");
+    if (!r || !w)
+    {
+        return -1;
+    }
+    return atol(r + 6) + atol(w + 6);
+}
+
+static void
+init_io_counter()
+{
+    iofd = open("/proc/self/io", O_RDONLY);
+    long a = io_syscalls();
+    long b = io_syscalls();
+    io_overhead = (a < 0 || b < 0) ? 0 : b - a;
+}
+
+struct measurement
+{
+    int64_t start;
+    long syscalls;
+    int64_t elapsed;
+    long calls; /* -1 if unknown */
+};
+
+static int
+selected(const char *name)
+{
+    return !only || strncmp(name, only, strlen(only)) == 0;
+}
+
+static void
+begin(struct measurement *m)
+{
+    m->syscalls = io_syscalls();
+    m->start = now_ns();
+}
+
+static void
+stop_clock(struct measurement *m)
+{
+    m->elapsed = now_ns() - m->start;
+    long syscalls = io_syscalls();
+    m->calls = (m->syscalls < 0 || syscalls < 0) ? -1 : syscalls - m->syscalls - io_overhead;
+}
+
+static void
+report(const struct measurement *m, const char *name, size_t ops)
+{
+    char per_op[32] = "null";
+    if (m->calls >= 0)
+    {
+        snprintf(per_op, sizeof(per_op), "%.4f", (double)m->calls / (double)ops);
+    }
+    printf("{\"bench\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,\"syscalls_per_op\":%s}\n",
+           name, (unsigned long)ops, (double)m->elapsed / (double)ops, per_op);
+    fflush(stdout);
+}
+
+static void
+end(struct measurement *m, const char *name, size_t ops)
+{
+    stop_clock(m);
+    report(m, name, ops);
+}
+
+/* The inverse of the device-side decoding, for synthetic streams. */
+static void
+encode_report(unsigned char *out, const co2mon_data_t plain)
+{
+    static const unsigned char magic_word[8] = "Htemp99e";
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        unsigned char c = plain[i] + (unsigned char)((magic_word[i] << 4) | (magic_word[i] >> 4));
+        x = (x << 8) | c;
+    }
+    x = (x << 3) | (x >> 61);
+
+    co2mon_data_t buf;
+    for (int i = 7; i >= 0; --i)
+    {
+        buf[i] = (unsigned char)x ^ magic_table[i];
+        x >>= 8;
+    }
+    static const int from[8] = { 2, 4, 0, 7, 1, 6, 5, 3 };
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = buf[from[i]];
+    }
+}
+
+static int
+make_synthetic(size_t n)
+{
+    raw = malloc(n * sizeof(co2mon_data_t));
+    if (!raw)
+    {
+        return 0;
+    }
+    memset(magic_table, 0, sizeof(magic_table));
+    for (size_t i = 0; i < n; ++i)
+    {
+        co2mon_data_t plain = { 0 };
+        uint16_t value;
+        if (i & 1)
+        {
+            plain[0] = CO2MON_ITEM_CNTR;
+            value = (uint16_t)(400 + (i / 2) % 1600);
+        }
+        else
+        {
+            plain[0] = CO2MON_ITEM_TAMB;
+            value = (uint16_t)(4700 + (i / 2) % 200);
+        }
+        plain[1] = (unsigned char)(value >> 8);
+        plain[2] = (unsigned char)value;
+        plain[3] = plain[0] + plain[1] + plain[2];
+        plain[4] = 0x0d;
+        encode_report(raw + 8 * i, plain);
+    }
+    nreports = n;
+    return 1;
+}
+
+static int
+load_capture(const char *path, size_t max)
+{
+    struct capture_map map;
+    if (!capture_map_open(&map, path))
+    {
+        return 0;
+    }
+    memcpy(magic_table, map.header->magic_table, sizeof(magic_table));
+
+    const struct capture_record *record;
+    const unsigned char *payload;
+    size_t n = 0;
+    while (capture_next(&map, &record, &payload))
+    {
+        n += record->type == CAPTURE_REPORT && record->length == sizeof(co2mon_data_t);
+    }
+    if (n > max)
+    {
+        n = max;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr, "%s: no reports\n", path);
+        capture_map_close(&map);
+        return 0;
+    }
+    raw = malloc(n * sizeof(co2mon_data_t));
+    if (!raw)
+    {
+        capture_map_close(&map);
+        return 0;
+    }
+
+    map.offset = sizeof(struct capture_header);
+    nreports = 0;
+    while (nreports < n && capture_next(&map, &record, &payload))
+    {
+        if (record->type == CAPTURE_REPORT && record->length == sizeof(co2mon_data_t))
+        {
+            memcpy(raw + 8 * nreports++, payload, sizeof(co2mon_data_t));
+        }
+    }
+    capture_map_close(&map);
+    return 1;
+}
+
+static void
+bench_decode()
+{
+    struct measurement m;
+    if (selected("decode_report"))
+    {
+        struct co2mon_decoder decoder = { 0, 0 };
+        begin(&m);
+        for (size_t i = 0; i < nreports; ++i)
+        {
+            co2mon_decode(&decoder, raw + 8 * i, magic_table, decoded[i]);
+        }
+        end(&m, "decode_report", nreports);
+    }
+
+    /* Always run, the following benchmarks need the decoded stream. */
+    begin(&m);
+    size_t nvalid = 0;
+    for (size_t i = 0; i < nreports; i += BATCH_SIZE)
+    {
+        size_t n = nreports - i < BATCH_SIZE ? nreports - i : BATCH_SIZE;
+        nvalid += co2mon_decode_batch(raw + 8 * i, n, magic_table, decoded + i, NULL);
+    }
+    if (selected("decode_batch"))
+    {
+        end(&m, "decode_batch", nreports);
+    }
+    if (nvalid != nreports)
+    {
+        /* Plaintext captures: use them as they are. */
+        memcpy(decoded, raw, nreports * sizeof(co2mon_data_t));
+    }
+}
+
+static void
+bench_parse()
+{
+    struct measurement m;
+    size_t n = 0;
+    begin(&m);
+    for (size_t i = 0; i < nreports; ++i)
+    {
+        if (parse_report(decoded[i], &records[n]))
+        {
+            records[n].timestamp = 1700000000000000000LL + (int64_t)i * 2500000000LL;
+            records[n].device = 0;
+            ++n;
+        }
+    }
+    if (selected("parse_report"))
+    {
+        end(&m, "parse_report", nreports);
+    }
+    nreports = n;
+}
+
+static void
+run_sink(const char *name, struct sink *sink)
+{
+    if (!sink)
+    {
+        return;
+    }
+    struct source source;
+    memset(&source, 0, sizeof(source));
+    snprintf(source.name, DEVNAME_MAX, "bench");
+    if (sink->attach)
+    {
+        sink->attach(sink, &source);
+    }
+
+    struct measurement m;
+    begin(&m);
+    time_t tick = time(NULL);
+    for (size_t i = 0; i < nreports; ++i)
+    {
+        sink->publish(sink, &source, &records[i]);
+        if (sink->flush)
+        {
+            sink->flush(sink);
+        }
+        if (sink->tick && i % TICK_EVERY == TICK_EVERY - 1)
+        {
+            sink->tick(sink, ++tick);
+        }
+    }
+    end(&m, name, nreports);
+
+    if (sink->detach)
+    {
+        sink->detach(sink, &source);
+    }
+    sink->destroy(sink);
+}
+
+static void
+bench_sinks()
+{
+    char path[PATH_MAX];
+    if (selected("sink_stdout"))
+    {
+        /* The results go to stdout as well, so move it aside meanwhile. */
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+
+        struct measurement m;
+        struct sink *sink = stdout_sink_create();
+        struct source source;
+        memset(&source, 0, sizeof(source));
+        begin(&m);
+        for (size_t i = 0; sink && i < nreports; ++i)
+        {
+            sink->publish(sink, &source, &records[i]);
+            sink->flush(sink);
+        }
+        stop_clock(&m);
+        if (sink)
+        {
+            sink->destroy(sink);
+        }
+
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        report(&m, "sink_stdout", nreports);
+    }
+
+    if (selected("sink_datadir"))
+    {
+        static const struct
+        {
+            const char *name;
+            int flags;
+        } variants[] = {
+            { "sink_datadir", 0 },
+            { "sink_datadir_nolock", DATADIR_NO_LOCK },
+            { "sink_datadir_rename", DATADIR_RENAME },
+        };
+        for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+        {
+            if (selected(variants[i].name))
+            {
+                run_sink(variants[i].name, datadir_sink_create(workdir, variants[i].flags, 0));
+            }
+        }
+    }
+
+    if (selected("sink_snapshot"))
+    {
+        snprintf(path, PATH_MAX, "%s/snapshot", workdir);
+        run_sink("sink_snapshot", snapshot_sink_create(path));
+    }
+}
+
+/* Decode, check and queue every report while the output thread feeds the
+ * datadir and snapshot sinks, as co2mond -x -P does. */
+static void
+bench_end_to_end()
+{
+    if (!selected("end_to_end"))
+    {
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/snapshot", workdir);
+    struct sink *sinks = snapshot_sink_create(path);
+    if (!sinks || !(sinks->next = datadir_sink_create(workdir, 0, 0)))
+    {
+        return;
+    }
+
+    struct measurement m;
+    begin(&m);
+    if (!output_start(sinks, NULL, 0))
+    {
+        return;
+    }
+    output_attach(0, "bench");
+    struct co2mon_decoder decoder = { 0, 0 };
+    for (size_t i = 0; i < nreports; ++i)
+    {
+        co2mon_data_t result;
+        struct record record;
+        co2mon_decode(&decoder, raw + 8 * i, magic_table, result);
+        if (!parse_report(result, &record))
+        {
+            continue;
+        }
+        record.timestamp = 1700000000000000000LL + (int64_t)i * 2500000000LL;
+        record.device = 0;
+        while (output_backlog() >= OUTPUT_RING_SIZE)
+        {
+            sched_yield();
+        }
+        output_push(&record);
+    }
+    output_detach(0);
+    output_stop();
+    end(&m, "end_to_end", nreports);
+}
+
+static int64_t
+cpu_ns()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+           ((int64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+/* Paces records through the output thread into the datadir sink as a
+ * sensor sends them, with and without batches (co2mond -b). */
+static void
+bench_power()
+{
+    static const struct
+    {
+        const char *name;
+        int batch;
+    } variants[] = {
+        { "power_unbatched", 0 },
+        { "power_batch_1s", 1 },
+        { "power_batch_2s", 2 },
+    };
+    size_t n = POWER_RATE * POWER_SECONDS < nreports ? POWER_RATE * POWER_SECONDS : nreports;
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v)
+    {
+        if (!selected(variants[v].name))
+        {
+            continue;
+        }
+        struct sink *sinks = datadir_sink_create(workdir, 0, 0);
+        if (!sinks || !output_start(sinks, NULL, variants[v].batch))
+        {
+            return;
+        }
+        output_attach(0, "bench");
+
+        struct measurement m;
+        int64_t cpu = cpu_ns();
+        begin(&m);
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (size_t i = 0; i < n; ++i)
+        {
+            output_push(&records[i]);
+            next.tv_nsec += 1000000000 / POWER_RATE;
+            if (next.tv_nsec >= 1000000000)
+            {
+                next.tv_nsec -= 1000000000;
+                ++next.tv_sec;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+        output_detach(0);
+        unsigned long wakeups = output_wakeups();
+        output_stop();
+        stop_clock(&m);
+        cpu = cpu_ns() - cpu;
+
+        char per_op[32] = "null";
+        if (m.calls >= 0)
+        {
+            snprintf(per_op, sizeof(per_op), "%.4f", (double)m.calls / (double)n);
+        }
+        double seconds = (double)m.elapsed / 1e9;
+        printf("{\"bench\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,\"syscalls_per_op\":%s,"
+               "\"wakeups_per_s\":%.2f,\"cpu_us_per_s\":%.1f}\n",
+               variants[v].name, (unsigned long)n, (double)cpu / (double)n, per_op,
+               (double)wakeups / seconds, (double)cpu / 1000 / seconds);
+        fflush(stdout);
+    }
+}
+
+static void
+remove_workdir()
+{
+    DIR *dir = opendir(workdir);
+    if (dir)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                char path[PATH_MAX];
+                snprintf(path, PATH_MAX, "%s/%s", workdir, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(workdir);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t ops = DEFAULT_OPS;
+    const char *capturefile = NULL;
+
+    if (!init_metrics())
+    {
+        return 1;
+    }
+    int c;
+    while ((c = getopt(argc, argv, "n:P:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            ops = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            capturefile = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: co2mon_bench [-n reports] [-P capturefile] [benchmark-prefix]\n");
+            return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        only = argv[optind];
+    }
+    if (ops == 0)
+    {
+        ops = 1;
+    }
+
+    if (!(capturefile ? load_capture(capturefile, ops) : make_synthetic(ops)))
+    {
+        fprintf(stderr, "co2mon_bench: unable to set up the report stream\n");
+        return 1;
+    }
+    decoded = malloc(nreports * sizeof(co2mon_data_t));
+    records = malloc(nreports * sizeof(struct record));
+    if (!decoded || !records)
+    {
+        fprintf(stderr, "co2mon_bench: out of memory\n");
+        return 1;
+    }
+    if (!mkdtemp(workdir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    init_io_counter();
+
+    bench_decode();
+    bench_parse();
+    bench_sinks();
+    bench_end_to_end();
+    bench_power();
+
+    remove_workdir();
+    free(records);
+    free(decoded);
+    free(raw);
+    return 0;
+}
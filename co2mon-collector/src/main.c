@@ -0,0 +1,691 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Receives the datagrams of co2mond -U from any number of hosts on one
+ * socket and serves the combined snapshot: in a co2mon_shm file (-M) and
+ * as Prometheus metrics over HTTP (-H), with the names co2mond uses and
+ * "<host>/<device>" as the device.  Datagrams are read in batches with
+ * recvmmsg() on Linux; devices are found through an open-addressing hash
+ * of their names and keep their slot for as long as the collector runs.
+ *
+ * Loss is counted from gaps in each device's seq.  A datagram that
+ * arrives after a later one counts as late, and takes one back from the
+ * lost ones if its seq is among the last SEQ_WINDOW ones missing; one
+ * that is not missing there is a duplicate.  A new epoch means the sender
+ * restarted or the device was attached again.
+ */
+
+#define _GNU_SOURCE /* recvmmsg() */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co2mon.h"
+#include "co2mon_shm.h"
+#include "co2mon_udp.h"
+#include "net.h"
+
+#define DEFAULT_LISTEN ":" CO2MON_UDP_PORT
+#define DEFAULT_MAX_DEVICES 4096
+#define RECV_BATCH 64
+#define HTTP_MAX_CONNECTIONS 16
+#define HTTP_REQUEST_MAX 2048
+#define HTTP_TIMEOUT 10 /* seconds */
+#define SEQ_WINDOW 64 /* seqs below next_seq that late datagrams are checked against */
+
+struct node
+{
+    char name[CO2MON_UDP_NAME_MAX + 1];
+    uint32_t epoch;
+    uint32_t next_seq;
+    uint64_t missing;         /* bit k set if seq next_seq - 1 - k is missing */
+    uint64_t received;
+    uint64_t lost;
+    uint64_t late;
+    uint64_t duplicates;
+    uint64_t restarts;
+    int64_t updated;          /* nanoseconds since the Epoch */
+    int64_t timestamp[256];
+    uint16_t data[256];
+    unsigned char seen[256];
+};
+
+struct http_connection
+{
+    int fd;                   /* -1 if the slot is free */
+    time_t opened;
+    char in[HTTP_REQUEST_MAX];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outsize;
+    size_t sent;
+    int responding;
+};
+
+static struct node *nodes;
+static unsigned nnodes = 0;
+static unsigned max_nodes = DEFAULT_MAX_DEVICES;
+static uint32_t *node_index;  /* slot + 1, 0 if empty */
+static uint32_t index_mask;
+
+static uint64_t datagrams = 0;
+static uint64_t invalid = 0;
+static uint64_t rejected = 0; /* from new devices when all slots are taken */
+
+static co2mon_shm *shm = NULL;
+static int listenfd = -1;
+static struct http_connection connections[HTTP_MAX_CONNECTIONS];
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+handle_signal(int signum)
+{
+    (void)signum;
+    stop = 1;
+}
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* FNV-1a */
+static uint32_t
+hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name; ++name)
+    {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static struct node *
+find_node(const char *name)
+{
+    for (uint32_t i = hash_name(name) & index_mask;; i = (i + 1) & index_mask)
+    {
+        uint32_t slot = node_index[i];
+        if (!slot)
+        {
+            if (nnodes == max_nodes)
+            {
+                return NULL;
+            }
+            struct node *n = &nodes[nnodes];
+            snprintf(n->name, sizeof(n->name), "%s", name);
+            node_index[i] = ++nnodes;
+            if (shm)
+            {
+                co2mon_shm_set_name(shm, nnodes - 1, name);
+            }
+            return n;
+        }
+        if (strcmp(nodes[slot - 1].name, name) == 0)
+        {
+            return &nodes[slot - 1];
+        }
+    }
+}
+
+static void
+receive(const unsigned char *buf, size_t len)
+{
+    struct co2mon_udp_record r;
+    ++datagrams;
+    if (!co2mon_udp_unpack(buf, len, &r))
+    {
+        ++invalid;
+        return;
+    }
+    struct node *n = find_node(r.device);
+    if (!n)
+    {
+        ++rejected;
+        return;
+    }
+
+    if (!n->received || r.epoch != n->epoch)
+    {
+        if (n->received)
+        {
+            ++n->restarts;
+        }
+        n->epoch = r.epoch;
+        n->next_seq = r.seq + 1;
+        n->missing = 0;
+    }
+    else
+    {
+        uint32_t gap = r.seq - n->next_seq;
+        if (gap < 0x80000000u)
+        {
+            n->lost += gap;
+            n->next_seq = r.seq + 1;
+            /* The seqs skipped are now 1..gap below the newest one. */
+            n->missing = gap + 1 < SEQ_WINDOW ? n->missing << (gap + 1) : 0;
+            n->missing |= gap + 1 < SEQ_WINDOW ? ((uint64_t)1 << (gap + 1)) - 2 : ~(uint64_t)1;
+        }
+        else
+        {
+            uint32_t k = n->next_seq - 1 - r.seq;
+            uint64_t bit = k < SEQ_WINDOW ? (uint64_t)1 << k : 0;
+            if (bit && !(n->missing & bit))
+            {
+                ++n->duplicates;
+            }
+            else
+            {
+                ++n->late;
+                if (bit)
+                {
+                    n->missing &= ~bit;
+                    --n->lost;
+                }
+            }
+        }
+    }
+    ++n->received;
+
+    if (r.timestamp >= n->timestamp[r.code])
+    {
+        n->data[r.code] = r.value;
+        n->timestamp[r.code] = r.timestamp;
+        n->seen[r.code] = 1;
+        if (shm)
+        {
+            co2mon_shm_update(shm, (unsigned)(n - nodes), r.code, r.value, r.timestamp);
+        }
+    }
+    if (r.timestamp > n->updated)
+    {
+        n->updated = r.timestamp;
+    }
+}
+
+static void
+receive_all(int fd)
+{
+    static unsigned char bufs[RECV_BATCH][CO2MON_UDP_SIZE + 1];
+#ifdef __linux__
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    for (int i = 0; i < RECV_BATCH; ++i)
+    {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n;
+    while ((n = recvmmsg(fd, msgs, RECV_BATCH, 0, NULL)) > 0)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            receive(bufs[i], msgs[i].msg_len);
+        }
+        if (n < RECV_BATCH)
+        {
+            break;
+        }
+    }
+#else
+    ssize_t n;
+    while ((n = recv(fd, bufs[0], sizeof(bufs[0]), 0)) >= 0)
+    {
+        receive(bufs[0], (size_t)n);
+    }
+#endif
+}
+
+static void
+close_connection(struct http_connection *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void
+out_printf(struct http_connection *c, const char *fmt, ...)
+{
+    va_list args;
+    while (1)
+    {
+        size_t room = c->outsize - c->outlen;
+        va_start(args, fmt);
+        int n = vsnprintf(c->out ? c->out + c->outlen : NULL, room, fmt, args);
+        va_end(args);
+        if (n < 0)
+        {
+            return;
+        }
+        if ((size_t)n < room)
+        {
+            c->outlen += (size_t)n;
+            return;
+        }
+        size_t size = c->outsize ? c->outsize * 2 : 65536;
+        while (size - c->outlen <= (size_t)n)
+        {
+            size *= 2;
+        }
+        char *out = realloc(c->out, size);
+        if (!out)
+        {
+            return;
+        }
+        c->out = out;
+        c->outsize = size;
+    }
+}
+
+/* Device names come from the network. */
+static void
+out_label(struct http_connection *c, const char *value)
+{
+    for (; *value; ++value)
+    {
+        if (*value == '\\' || *value == '"')
+        {
+            out_printf(c, "\\%c", *value);
+        }
+        else if (*value == '\n')
+        {
+            out_printf(c, "\\n");
+        }
+        else
+        {
+            out_printf(c, "%c", *value);
+        }
+    }
+}
+
+static void
+render_gauge(struct http_connection *c, const char *name, const char *help, unsigned char code)
+{
+    out_printf(c, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for (unsigned i = 0; i < nnodes; ++i)
+    {
+        if (nodes[i].seen[code])
+        {
+            char value[24];
+            co2mon_item_format(code, co2mon_item_value(code, nodes[i].data[code]), value, sizeof(value));
+            out_printf(c, "%s{device=\"", name);
+            out_label(c, nodes[i].name);
+            out_printf(c, "\"} %s\n", value);
+        }
+    }
+}
+
+static void
+render_node_counter(struct http_connection *c, const char *name, const char *help, size_t offset)
+{
+    out_printf(c, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (unsigned i = 0; i < nnodes; ++i)
+    {
+        out_printf(c, "%s{device=\"", name);
+        out_label(c, nodes[i].name);
+        out_printf(c, "\"} %llu\n", (unsigned long long)*(const uint64_t *)((const char *)&nodes[i] + offset));
+    }
+}
+
+static void
+render_metrics(struct http_connection *c)
+{
+    render_gauge(c, "co2mon_co2_ppm", "CO2 concentration (CntR).", CO2MON_ITEM_CNTR);
+    render_gauge(c, "co2mon_temperature_celsius", "Ambient temperature (Tamb).", CO2MON_ITEM_TAMB);
+    render_gauge(c, "co2mon_humidity_percent", "Relative humidity (Hum).", CO2MON_ITEM_HUM);
+
+    out_printf(c, "# HELP co2mon_item_value Raw value of every item the sensor reports.\n"
+                  "# TYPE co2mon_item_value gauge\n");
+    for (unsigned i = 0; i < nnodes; ++i)
+    {
+        for (int code = 0; code < 256; ++code)
+        {
+            if (nodes[i].seen[code])
+            {
+                out_printf(c, "co2mon_item_value{device=\"");
+                out_label(c, nodes[i].name);
+                out_printf(c, "\",code=\"0x%02x\"} %d\n", code, (int)nodes[i].data[code]);
+            }
+        }
+    }
+
+    out_printf(c, "# HELP co2mon_last_update_timestamp_seconds When the device last sent a valid report.\n"
+                  "# TYPE co2mon_last_update_timestamp_seconds gauge\n");
+    for (unsigned i = 0; i < nnodes; ++i)
+    {
+        out_printf(c, "co2mon_last_update_timestamp_seconds{device=\"");
+        out_label(c, nodes[i].name);
+        out_printf(c, "\"} %.3f\n", (double)nodes[i].updated / 1e9);
+    }
+
+    render_node_counter(c, "co2mon_collector_received_total", "Datagrams received from the device.",
+                        offsetof(struct node, received));
+    render_node_counter(c, "co2mon_collector_lost_total", "Datagrams of the device missing from the sequence.",
+                        offsetof(struct node, lost));
+    render_node_counter(c, "co2mon_collector_late_total", "Datagrams that arrived after a later one.",
+                        offsetof(struct node, late));
+    render_node_counter(c, "co2mon_collector_duplicates_total", "Datagrams of the device received twice.",
+                        offsetof(struct node, duplicates));
+    render_node_counter(c, "co2mon_collector_restarts_total", "Times the sender of the device restarted.",
+                        offsetof(struct node, restarts));
+
+    out_printf(c, "# HELP co2mon_collector_devices Devices heard from.\n# TYPE co2mon_collector_devices gauge\n"
+                  "co2mon_collector_devices %u\n", nnodes);
+    out_printf(c, "# HELP co2mon_collector_datagrams_total Datagrams received.\n"
+                  "# TYPE co2mon_collector_datagrams_total counter\nco2mon_collector_datagrams_total %llu\n",
+               (unsigned long long)datagrams);
+    out_printf(c, "# HELP co2mon_collector_invalid_total Datagrams that were not records.\n"
+                  "# TYPE co2mon_collector_invalid_total counter\nco2mon_collector_invalid_total %llu\n",
+               (unsigned long long)invalid);
+    out_printf(c, "# HELP co2mon_collector_rejected_total Records of new devices beyond -n.\n"
+                  "# TYPE co2mon_collector_rejected_total counter\nco2mon_collector_rejected_total %llu\n",
+               (unsigned long long)rejected);
+}
+
+static void
+respond(struct http_connection *c)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\nContent-Length: ";
+    c->outlen = 0;
+    c->sent = 0;
+    if (strncmp(c->in, "GET /metrics ", 13) != 0 && strncmp(c->in, "GET /metrics?", 13) != 0)
+    {
+        out_printf(c, "HTTP/1.0 404 Not Found\r\nConnection: close\r\nContent-Length: 10\r\n\r\nNot Found\n");
+        c->responding = 1;
+        return;
+    }
+    /* Render the body after room for the header, then put the header in
+     * front once the length is known. */
+    char prefix[sizeof(header) + 24];
+    size_t reserve = sizeof(prefix);
+    out_printf(c, "%*s", (int)reserve, "");
+    render_metrics(c);
+    if (c->outlen < reserve)
+    {
+        close_connection(c);
+        return;
+    }
+    int n = snprintf(prefix, sizeof(prefix), "%s%zu\r\n\r\n", header, c->outlen - reserve);
+    c->sent = reserve - (size_t)n;
+    memcpy(c->out + c->sent, prefix, (size_t)n);
+    c->responding = 1;
+}
+
+static void
+read_request(struct http_connection *c)
+{
+    ssize_t r = read(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (r <= 0)
+    {
+        close_connection(c);
+        return;
+    }
+    c->inlen += (size_t)r;
+    c->in[c->inlen] = '\0';
+    if (strstr(c->in, "\r\n\r\n") || strstr(c->in, "\n\n"))
+    {
+        respond(c);
+    }
+    else if (c->inlen == sizeof(c->in) - 1)
+    {
+        close_connection(c);
+    }
+}
+
+static void
+send_response(struct http_connection *c)
+{
+    while (c->sent < c->outlen)
+    {
+        ssize_t r = send(c->fd, c->out + c->sent, c->outlen - c->sent, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (r <= 0)
+        {
+            break;
+        }
+        c->sent += (size_t)r;
+    }
+    close_connection(c);
+}
+
+static void
+accept_connection()
+{
+    int fd = net_accept(listenfd);
+    if (fd == -1)
+    {
+        return;
+    }
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        struct http_connection *c = &connections[i];
+        if (c->fd == -1)
+        {
+            c->fd = fd;
+            c->opened = monotonic_time();
+            c->inlen = 0;
+            c->responding = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void
+main_loop(int udpfd)
+{
+    while (!stop)
+    {
+        struct pollfd fds[HTTP_MAX_CONNECTIONS + 2];
+        int polled[HTTP_MAX_CONNECTIONS];
+        int nfds = 0;
+        int nconnections = 0;
+        fds[nfds].fd = udpfd;
+        fds[nfds++].events = POLLIN;
+        if (listenfd != -1)
+        {
+            fds[nfds].fd = listenfd;
+            fds[nfds++].events = POLLIN;
+        }
+        time_t now = monotonic_time();
+        for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+        {
+            struct http_connection *c = &connections[i];
+            if (c->fd != -1 && now - c->opened >= HTTP_TIMEOUT)
+            {
+                close_connection(c);
+            }
+            if (c->fd != -1)
+            {
+                fds[nfds].fd = c->fd;
+                fds[nfds++].events = c->responding ? POLLOUT : POLLIN;
+                polled[nconnections++] = i;
+            }
+        }
+
+        if (poll(fds, (nfds_t)nfds, nconnections ? 1000 : -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll");
+                return;
+            }
+            continue;
+        }
+
+        if (fds[0].revents)
+        {
+            receive_all(udpfd);
+        }
+        int first = listenfd != -1 ? 2 : 1;
+        for (int i = 0; i < nconnections; ++i)
+        {
+            struct http_connection *c = &connections[polled[i]];
+            if (!fds[first + i].revents)
+            {
+                continue;
+            }
+            if (c->responding)
+            {
+                send_response(c);
+            }
+            else
+            {
+                read_request(c);
+            }
+        }
+        if (listenfd != -1 && fds[1].revents)
+        {
+            accept_connection();
+        }
+    }
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: co2mon-collector [-h] [-l [addr]:port] [-n devices] [-H [addr]:port] [-M snapshot]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *listenspec = DEFAULT_LISTEN;
+    const char *httpspec = NULL;
+    const char *snapshotfile = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "hl:n:H:M:")) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            listenspec = optarg;
+            break;
+        case 'n':
+            max_nodes = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            httpspec = optarg;
+            break;
+        case 'M':
+            snapshotfile = optarg;
+            break;
+        case 'h':
+            usage();
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  -l [addr]:port\n");
+            fprintf(stderr, "        receive the datagrams of co2mond -U there (%s)\n", DEFAULT_LISTEN);
+            fprintf(stderr, "  -n devices\n");
+            fprintf(stderr, "        the most devices to keep track of (%d)\n", DEFAULT_MAX_DEVICES);
+            fprintf(stderr, "  -H [addr]:port\n");
+            fprintf(stderr, "        serve Prometheus metrics at http://addr:port/metrics\n");
+            fprintf(stderr, "  -M snapshot\n");
+            fprintf(stderr, "        publish the latest values in a memory-mapped file, see co2mon_shm.h\n");
+            exit(1);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc || max_nodes == 0 || max_nodes > 1000000 || (!httpspec && !snapshotfile))
+    {
+        usage();
+        exit(1);
+    }
+
+    uint32_t size = 1;
+    while (size < 2 * max_nodes)
+    {
+        size *= 2;
+    }
+    index_mask = size - 1;
+    nodes = calloc(max_nodes, sizeof(*nodes));
+    node_index = calloc(size, sizeof(*node_index));
+    if (!nodes || !node_index)
+    {
+        fprintf(stderr, "co2mon-collector: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        connections[i].fd = -1;
+    }
+
+    int udpfd = net_listen_udp(listenspec);
+    if (udpfd == -1)
+    {
+        exit(1);
+    }
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(udpfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (httpspec && (listenfd = net_listen_tcp(httpspec)) == -1)
+    {
+        exit(1);
+    }
+    if (snapshotfile && !(shm = co2mon_shm_create(snapshotfile, max_nodes)))
+    {
+        exit(1);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    main_loop(udpfd);
+
+    if (shm)
+    {
+        co2mon_shm_close(shm);
+    }
+    return 0;
+}
@@ -0,0 +1,765 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Aggregates over the archive segments of co2mond -Y.  Segments are mapped
+ * and handed out to worker threads; a segment whose day, footer or device
+ * is out of the query is skipped unread, and so is every block of another
+ * item or time.  Blocks that the query covers whole are summed up from
+ * their headers when possible; only the others are decoded.
+ *
+ * Time above a threshold counts, for every sample above it, the time to
+ * the next sample of its block (the last one of a block gets the step
+ * before it), but at most -g seconds, so that gaps in the data do not
+ * count.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co2mon.h"
+#include "co2mon_archive.h"
+
+#define MAX_THRESHOLDS 8
+#define MAX_PERCENTILES 8
+#define MAX_WANTED 64
+#define MAX_DEPTH 2 /* archivedir/<device>/segment */
+#define DEFAULT_GAP 60
+
+struct job
+{
+    char *path;
+    int device;
+};
+
+/* Exact counts of the raw words, in pages allocated as values show up. */
+struct histogram
+{
+    uint32_t *pages[256];
+};
+
+struct accumulator
+{
+    uint64_t count;
+    uint16_t min;
+    uint16_t max;
+    double sum;
+    double above[MAX_THRESHOLDS]; /* seconds */
+    struct histogram histogram;
+};
+
+struct worker
+{
+    pthread_t thread;
+    struct accumulator *accumulators; /* per device */
+    int64_t *timestamps;
+    uint16_t *values;
+    unsigned long segments;
+    unsigned long blocks;
+    unsigned long skipped_segments;
+    unsigned long skipped_blocks;
+    unsigned long summarized;
+    unsigned long corrupt;
+};
+
+static int code = CO2MON_ITEM_CNTR;
+static int64_t since = INT64_MIN;
+static int64_t until = INT64_MAX;
+static int64_t max_gap = DEFAULT_GAP;
+static double thresholds[MAX_THRESHOLDS];
+static uint16_t raw_thresholds[MAX_THRESHOLDS];
+static int nthresholds = 0;
+static double percentiles[MAX_PERCENTILES];
+static int npercentiles = 0;
+static const char *wanted[MAX_WANTED];
+static int nwanted = 0;
+
+static struct job *jobs = NULL;
+static size_t njobs = 0;
+static size_t jobs_size = 0;
+static size_t next_job = 0;
+static char (*devices)[CO2MON_ARCHIVE_NAME_MAX] = NULL;
+static int ndevices = 0;
+static unsigned long skipped_segments = 0; /* by their header */
+
+static double
+decode_value(double raw)
+{
+    return co2mon_item_value((unsigned char)code, raw);
+}
+
+/* The largest raw word that does not exceed the threshold. */
+static uint16_t
+encode_threshold(double value)
+{
+    const struct co2mon_item *item = &co2mon_items[code];
+    double raw = (value - item->offset) / item->scale;
+    if (raw < 0)
+    {
+        return 0;
+    }
+    return raw > 0xffff ? 0xffff : (uint16_t)floor(raw);
+}
+
+static int
+histogram_add(struct histogram *h, uint16_t value, uint32_t count)
+{
+    uint32_t **page = &h->pages[value >> 8];
+    if (!*page && !(*page = calloc(256, sizeof(uint32_t))))
+    {
+        return 0;
+    }
+    (*page)[value & 0xff] += count;
+    return 1;
+}
+
+/* Nearest rank. */
+static uint16_t
+histogram_percentile(const struct histogram *h, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t)ceil(p / 100 * (double)count);
+    uint64_t seen = 0;
+    rank = rank ? rank : 1;
+    for (int page = 0; page < 256; ++page)
+    {
+        for (int i = 0; h->pages[page] && i < 256; ++i)
+        {
+            seen += h->pages[page][i];
+            if (seen >= rank)
+            {
+                return (uint16_t)(page << 8 | i);
+            }
+        }
+    }
+    return 0xffff;
+}
+
+static void
+merge(struct accumulator *into, const struct accumulator *acc)
+{
+    if (!acc->count)
+    {
+        return;
+    }
+    if (!into->count || acc->min < into->min)
+    {
+        into->min = acc->min;
+    }
+    if (!into->count || acc->max > into->max)
+    {
+        into->max = acc->max;
+    }
+    into->count += acc->count;
+    into->sum += acc->sum;
+    for (int k = 0; k < nthresholds; ++k)
+    {
+        into->above[k] += acc->above[k];
+    }
+    for (int page = 0; page < 256; ++page)
+    {
+        for (int i = 0; acc->histogram.pages[page] && i < 256; ++i)
+        {
+            if (acc->histogram.pages[page][i])
+            {
+                histogram_add(&into->histogram, (uint16_t)(page << 8 | i), acc->histogram.pages[page][i]);
+            }
+        }
+    }
+}
+
+static void
+scan_block(struct worker *w, struct accumulator *acc, const struct co2mon_archive_block *block)
+{
+    long n = co2mon_archive_decode(block, w->timestamps, w->values, CO2MON_ARCHIVE_BLOCK_SAMPLES);
+    if (n < 0)
+    {
+        ++w->corrupt;
+        return;
+    }
+    ++w->blocks;
+    const int64_t *t = w->timestamps;
+    const uint16_t *v = w->values;
+    for (long i = 0; i < n; ++i)
+    {
+        if (t[i] < since || t[i] >= until)
+        {
+            continue;
+        }
+        if (!acc->count || v[i] < acc->min)
+        {
+            acc->min = v[i];
+        }
+        if (!acc->count || v[i] > acc->max)
+        {
+            acc->max = v[i];
+        }
+        acc->count++;
+        acc->sum += v[i];
+        if (npercentiles)
+        {
+            histogram_add(&acc->histogram, v[i], 1);
+        }
+        if (nthresholds)
+        {
+            int64_t hold = i + 1 < n ? t[i + 1] - t[i] : i > 0 ? t[i] - t[i - 1] : 0;
+            hold = hold < 0 ? 0 : hold > max_gap ? max_gap : hold;
+            hold = until - t[i] < hold ? until - t[i] : hold;
+            for (int k = 0; k < nthresholds; ++k)
+            {
+                if (v[i] > raw_thresholds[k])
+                {
+                    acc->above[k] += (double)hold;
+                }
+            }
+        }
+    }
+}
+
+/* A block that lies within the window and below every threshold adds
+ * to the aggregate by its header alone, unless percentiles need its
+ * values. */
+static int
+add_summarized(struct accumulator *acc, const struct co2mon_archive_block *block)
+{
+    if (npercentiles || block->first < since || block->last >= until)
+    {
+        return 0;
+    }
+    for (int k = 0; k < nthresholds; ++k)
+    {
+        if (block->max > raw_thresholds[k])
+        {
+            return 0;
+        }
+    }
+    if (!acc->count || block->min < acc->min)
+    {
+        acc->min = block->min;
+    }
+    if (!acc->count || block->max > acc->max)
+    {
+        acc->max = block->max;
+    }
+    acc->count += block->count;
+    acc->sum += (double)block->sum;
+    return 1;
+}
+
+/* Whether the footer rules the segment out. */
+static int
+segment_excluded(const struct co2mon_archive_segment *segment)
+{
+    if (!segment->footer)
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < segment->footer->nsummaries; ++i)
+    {
+        const struct co2mon_archive_summary *s = &segment->summaries[i];
+        if (s->code == code)
+        {
+            return s->last < since || s->first >= until;
+        }
+    }
+    return 1;
+}
+
+static void
+scan_segment(struct worker *w, const struct job *job)
+{
+    struct co2mon_archive_segment segment;
+    if (!co2mon_archive_map(&segment, job->path))
+    {
+        return;
+    }
+    if (segment_excluded(&segment))
+    {
+        ++w->skipped_segments;
+        co2mon_archive_unmap(&segment);
+        return;
+    }
+    ++w->segments;
+    struct accumulator *acc = &w->accumulators[job->device];
+    const struct co2mon_archive_block *block = NULL;
+    while ((block = co2mon_archive_next_block(&segment, block)) != NULL)
+    {
+        if (block->code != code || block->last < since || block->first >= until)
+        {
+            ++w->skipped_blocks;
+            continue;
+        }
+        if (!co2mon_archive_block_valid(block, segment.end - (size_t)((const char *)block - segment.data)))
+        {
+            ++w->corrupt;
+            continue;
+        }
+        if (add_summarized(acc, block))
+        {
+            ++w->summarized;
+            continue;
+        }
+        scan_block(w, acc, block);
+    }
+    co2mon_archive_unmap(&segment);
+}
+
+static void *
+work(void *arg)
+{
+    struct worker *w = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs)
+    {
+        scan_segment(w, &jobs[i]);
+    }
+    return NULL;
+}
+
+static int
+find_device(const char *name)
+{
+    for (int i = 0; i < ndevices; ++i)
+    {
+        if (strcmp(devices[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    if (nwanted)
+    {
+        int match = 0;
+        for (int i = 0; i < nwanted; ++i)
+        {
+            match |= strcmp(wanted[i], name) == 0;
+        }
+        if (!match)
+        {
+            return -1;
+        }
+    }
+    void *p = realloc(devices, (size_t)(ndevices + 1) * sizeof(*devices));
+    if (!p)
+    {
+        fprintf(stderr, "co2mon-query: out of memory\n");
+        exit(1);
+    }
+    devices = p;
+    snprintf(devices[ndevices], CO2MON_ARCHIVE_NAME_MAX, "%s", name);
+    return ndevices++;
+}
+
+/* Queues a segment unless its header rules it out. */
+static void
+add_segment(const char *path)
+{
+    struct co2mon_archive_header header;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return;
+    }
+    ssize_t r = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    if (r != sizeof(header) || memcmp(header.magic, CO2MON_ARCHIVE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a co2mon archive segment\n", path);
+        return;
+    }
+    header.name[sizeof(header.name) - 1] = '\0';
+    int device = header.day + 86400 <= since || header.day >= until ? -1 : find_device(header.name);
+    if (device == -1)
+    {
+        ++skipped_segments;
+        return;
+    }
+
+    if (njobs == jobs_size)
+    {
+        jobs_size = jobs_size ? jobs_size * 2 : 256;
+        void *p = realloc(jobs, jobs_size * sizeof(*jobs));
+        if (!p)
+        {
+            fprintf(stderr, "co2mon-query: out of memory\n");
+            exit(1);
+        }
+        jobs = p;
+    }
+    jobs[njobs].path = strdup(path);
+    jobs[njobs].device = device;
+    if (!jobs[njobs].path)
+    {
+        fprintf(stderr, "co2mon-query: out of memory\n");
+        exit(1);
+    }
+    ++njobs;
+}
+
+static void
+add_path(const char *path, int depth)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        add_segment(path);
+        return;
+    }
+    if (depth == MAX_DEPTH)
+    {
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        perror(path);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(e->d_name);
+        if (e->d_name[0] == '.')
+        {
+            continue;
+        }
+        char child[4096];
+        if (snprintf(child, sizeof(child), "%s/%s", path, e->d_name) >= (int)sizeof(child))
+        {
+            continue;
+        }
+        if (len > 5 && strcmp(e->d_name + len - 5, ".co2a") == 0)
+        {
+            add_segment(child);
+        }
+        else
+        {
+            add_path(child, depth + 1);
+        }
+    }
+    closedir(dir);
+}
+
+static int64_t
+days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* Seconds since the Epoch, YYYY-MM-DD (UTC), or a negative count of
+ * seconds, minutes, hours or days before now (-3600, -90m, -12h, -90d). */
+static int
+parse_time(const char *arg, int64_t *t)
+{
+    int y, m, d;
+    char c;
+    if (sscanf(arg, "%4d-%2d-%2d%c", &y, &m, &d, &c) == 3)
+    {
+        *t = days_from_civil(y, m, d) * 86400;
+        return 1;
+    }
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+    if (end == arg)
+    {
+        return 0;
+    }
+    long long unit = 1;
+    switch (*end)
+    {
+    case 'd':
+        unit *= 24;
+        /* fall through */
+    case 'h':
+        unit *= 60;
+        /* fall through */
+    case 'm':
+        unit *= 60;
+        /* fall through */
+    case 's':
+        ++end;
+    }
+    if (*end != '\0' || (unit != 1 && n > 0))
+    {
+        return 0;
+    }
+    *t = n < 0 ? (int64_t)time(NULL) + n * unit : n;
+    return 1;
+}
+
+static void
+print_value(double raw, int average)
+{
+    if (co2mon_items[code].precision > 0)
+    {
+        printf("\t%.2f", decode_value(raw));
+    }
+    else
+    {
+        printf(average ? "\t%.1f" : "\t%.0f", raw);
+    }
+}
+
+static void
+print_row(const char *name, const struct accumulator *acc)
+{
+    printf("%s\t%llu", name, (unsigned long long)acc->count);
+    if (!acc->count)
+    {
+        printf("\t-\t-\t-");
+        for (int k = 0; k < npercentiles; ++k)
+        {
+            printf("\t-");
+        }
+    }
+    else
+    {
+        print_value(acc->min, 0);
+        print_value(acc->max, 0);
+        print_value(acc->sum / (double)acc->count, 1);
+        for (int k = 0; k < npercentiles; ++k)
+        {
+            print_value(histogram_percentile(&acc->histogram, acc->count, percentiles[k]), 0);
+        }
+    }
+    for (int k = 0; k < nthresholds; ++k)
+    {
+        printf("\t%.2f", acc->above[k] / 3600);
+    }
+    printf("\n");
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: co2mon-query [-v] [-d device]... [-g seconds] [-i item] [-j threads] [-p percentile]... [-s since] [-t threshold]... [-u until] archive...\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = 0;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    while ((c = getopt(argc, argv, "hvd:g:i:j:p:s:t:u:")) != -1)
+    {
+        switch (c)
+        {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'd':
+            if (nwanted == MAX_WANTED)
+            {
+                fprintf(stderr, "co2mon-query: at most %d devices may be given\n", MAX_WANTED);
+                exit(1);
+            }
+            wanted[nwanted++] = optarg;
+            break;
+        case 'g':
+            max_gap = atoll(optarg);
+            break;
+        case 'i':
+            code = co2mon_item_code(optarg);
+            if (code == -1 || !(co2mon_items[code].flags & CO2MON_ITEM_STORE))
+            {
+                fprintf(stderr, "co2mon-query: unknown item %s, try CntR or Tamb\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            nthreads = atol(optarg);
+            break;
+        case 'p':
+            if (npercentiles == MAX_PERCENTILES)
+            {
+                fprintf(stderr, "co2mon-query: at most %d percentiles may be given\n", MAX_PERCENTILES);
+                exit(1);
+            }
+            percentiles[npercentiles] = atof(optarg);
+            if (percentiles[npercentiles] <= 0 || percentiles[npercentiles] > 100)
+            {
+                fprintf(stderr, "co2mon-query: a percentile is in (0, 100]\n");
+                exit(1);
+            }
+            ++npercentiles;
+            break;
+        case 's':
+        case 'u':
+            if (!parse_time(optarg, c == 's' ? &since : &until))
+            {
+                fprintf(stderr, "co2mon-query: invalid time %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            if (nthresholds == MAX_THRESHOLDS)
+            {
+                fprintf(stderr, "co2mon-query: at most %d thresholds may be given\n", MAX_THRESHOLDS);
+                exit(1);
+            }
+            thresholds[nthresholds++] = atof(optarg);
+            break;
+        case 'h':
+            usage();
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  -v    print what was read and skipped, and how long it took\n");
+            fprintf(stderr, "  -d device\n");
+            fprintf(stderr, "        only this device, may be given several times\n");
+            fprintf(stderr, "  -g seconds\n");
+            fprintf(stderr, "        longest time a sample counts for above a threshold (%d)\n", DEFAULT_GAP);
+            fprintf(stderr, "  -i item\n");
+            fprintf(stderr, "        CntR (the default) or Tamb\n");
+            fprintf(stderr, "  -j threads\n");
+            fprintf(stderr, "        number of threads reading segments (one per CPU)\n");
+            fprintf(stderr, "  -p percentile\n");
+            fprintf(stderr, "        add a percentile column (e.g., 50 or 99.9)\n");
+            fprintf(stderr, "  -s since, -u until\n");
+            fprintf(stderr, "        time window: seconds since the Epoch, YYYY-MM-DD (UTC),\n");
+            fprintf(stderr, "        or before now (e.g., -90d, -12h, -3600)\n");
+            fprintf(stderr, "  -t threshold\n");
+            fprintf(stderr, "        add a column of hours spent above threshold (ppm or C)\n");
+            fprintf(stderr, "\n");
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        usage();
+        exit(1);
+    }
+    for (int k = 0; k < nthresholds; ++k)
+    {
+        raw_thresholds[k] = encode_threshold(thresholds[k]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = optind; i < argc; ++i)
+    {
+        add_path(argv[i], 0);
+    }
+
+    nthreads = nthreads < 1 ? 1 : nthreads;
+    nthreads = (size_t)nthreads > njobs ? (long)njobs : nthreads;
+    struct worker *workers = calloc((size_t)(nthreads ? nthreads : 1), sizeof(*workers));
+    if (!workers)
+    {
+        fprintf(stderr, "co2mon-query: out of memory\n");
+        exit(1);
+    }
+    for (long i = 0; i < nthreads; ++i)
+    {
+        struct worker *w = &workers[i];
+        w->accumulators = calloc((size_t)ndevices, sizeof(*w->accumulators));
+        w->timestamps = malloc(CO2MON_ARCHIVE_BLOCK_SAMPLES * sizeof(*w->timestamps));
+        w->values = malloc(CO2MON_ARCHIVE_BLOCK_SAMPLES * sizeof(*w->values));
+        if (!w->accumulators || !w->timestamps || !w->values)
+        {
+            fprintf(stderr, "co2mon-query: out of memory\n");
+            exit(1);
+        }
+        if (pthread_create(&w->thread, NULL, work, w) != 0)
+        {
+            fprintf(stderr, "co2mon-query: cannot start a thread\n");
+            exit(1);
+        }
+    }
+
+    struct worker totals;
+    memset(&totals, 0, sizeof(totals));
+    struct accumulator *results = calloc((size_t)ndevices + 1, sizeof(*results));
+    if (!results)
+    {
+        fprintf(stderr, "co2mon-query: out of memory\n");
+        exit(1);
+    }
+    for (long i = 0; i < nthreads; ++i)
+    {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        for (int d = 0; d < ndevices; ++d)
+        {
+            merge(&results[d], &w->accumulators[d]);
+        }
+        totals.segments += w->segments;
+        totals.blocks += w->blocks;
+        totals.skipped_segments += w->skipped_segments;
+        totals.skipped_blocks += w->skipped_blocks;
+        totals.summarized += w->summarized;
+        totals.corrupt += w->corrupt;
+    }
+
+    printf("device\tcount\tmin\tmax\tavg");
+    for (int k = 0; k < npercentiles; ++k)
+    {
+        printf("\tp%g", percentiles[k]);
+    }
+    for (int k = 0; k < nthresholds; ++k)
+    {
+        printf("\thours_above_%g", thresholds[k]);
+    }
+    printf("\n");
+    for (int d = 0; d < ndevices; ++d)
+    {
+        print_row(devices[d], &results[d]);
+        if (ndevices > 1)
+        {
+            merge(&results[ndevices], &results[d]);
+        }
+    }
+    if (ndevices > 1)
+    {
+        print_row("*", &results[ndevices]);
+    }
+
+    if (verbose)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "segments: %lu read, %lu skipped by footer, %lu by name or day\n", totals.segments,
+                totals.skipped_segments, skipped_segments);
+        fprintf(stderr, "blocks: %lu decoded, %lu summed up from their header, %lu skipped, %lu corrupt\n", totals.blocks,
+                totals.summarized, totals.skipped_blocks, totals.corrupt);
+        fprintf(stderr, "threads: %ld, time: %.3f ms\n", nthreads,
+                (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    return totals.corrupt ? 2 : 0;
+}
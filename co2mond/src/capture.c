@@ -0,0 +1,266 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE 65536
+
+static FILE *capture_file = NULL;
+static char capture_buffer[CAPTURE_BUFFER_SIZE];
+
+static void
+make_header(struct capture_header *header, const co2mon_data_t magic_table, uint32_t flags)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header->version = CAPTURE_VERSION;
+    header->flags = flags;
+    header->byte_order = CAPTURE_BYTE_ORDER;
+    memcpy(header->magic_table, magic_table, sizeof(co2mon_data_t));
+}
+
+static int
+header_valid(const struct capture_header *header, const char *path)
+{
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+    {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return 0;
+    }
+    if (header->byte_order != CAPTURE_BYTE_ORDER)
+    {
+        fprintf(stderr, "%s: captured on a host with a different byte order\n", path);
+        return 0;
+    }
+    if (header->version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported capture version %u\n", path, (unsigned)header->version);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the length of the valid part of an existing capture, so that a
+ * record cut short by a crash is overwritten instead of appended to. */
+static off_t
+valid_length(const char *path, const co2mon_data_t magic_table, uint32_t flags)
+{
+    struct capture_map map;
+    if (!capture_map_open(&map, path))
+    {
+        return -1;
+    }
+    if (map.header->flags != flags || memcmp(map.header->magic_table, magic_table, sizeof(co2mon_data_t)) != 0)
+    {
+        fprintf(stderr, "%s: captured with different settings, not appending\n", path);
+        capture_map_close(&map);
+        return -1;
+    }
+    const struct capture_record *record;
+    const unsigned char *payload;
+    while (capture_next(&map, &record, &payload))
+    {
+    }
+    off_t length = (off_t)map.offset;
+    capture_map_close(&map);
+    return length;
+}
+
+int
+capture_open(const char *path, const co2mon_data_t magic_table, uint32_t flags)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+    {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror(path);
+        close(fd);
+        return 0;
+    }
+
+    if (st.st_size == 0)
+    {
+        struct capture_header header;
+        make_header(&header, magic_table, flags);
+        if (write(fd, &header, sizeof(header)) != sizeof(header))
+        {
+            perror(path);
+            close(fd);
+            return 0;
+        }
+    }
+    else
+    {
+        off_t length = valid_length(path, magic_table, flags);
+        if (length < 0 || ftruncate(fd, length) != 0 || lseek(fd, length, SEEK_SET) != length)
+        {
+            if (length >= 0)
+            {
+                perror(path);
+            }
+            close(fd);
+            return 0;
+        }
+    }
+
+    capture_file = fdopen(fd, "a");
+    if (!capture_file)
+    {
+        perror(path);
+        close(fd);
+        return 0;
+    }
+    setvbuf(capture_file, capture_buffer, _IOFBF, sizeof(capture_buffer));
+    return 1;
+}
+
+void
+capture_close()
+{
+    if (capture_file)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+int
+capture_active()
+{
+    return capture_file != NULL;
+}
+
+void
+capture_write(int64_t timestamp, int type, int device, const void *payload, size_t length)
+{
+    static const unsigned char padding[8];
+    if (!capture_file)
+    {
+        return;
+    }
+
+    struct capture_record record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.type = (uint8_t)type;
+    record.device = (uint8_t)device;
+    record.length = (uint16_t)length;
+
+    fwrite(&record, sizeof(record), 1, capture_file);
+    fwrite(payload, 1, length, capture_file);
+    fwrite(padding, 1, CAPTURE_PADDED(length) - length, capture_file);
+    if (ferror(capture_file))
+    {
+        perror("capture");
+        capture_close();
+    }
+}
+
+void
+capture_flush()
+{
+    if (capture_file && fflush(capture_file) != 0)
+    {
+        perror("capture");
+        capture_close();
+    }
+}
+
+int
+capture_map_open(struct capture_map *map, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror(path);
+        close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(struct capture_header))
+    {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        close(fd);
+        return 0;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+    posix_madvise(base, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    map->base = base;
+    map->size = (size_t)st.st_size;
+    map->offset = sizeof(struct capture_header);
+    map->header = (const struct capture_header *)map->base;
+    if (!header_valid(map->header, path))
+    {
+        capture_map_close(map);
+        return 0;
+    }
+    return 1;
+}
+
+void
+capture_map_close(struct capture_map *map)
+{
+    munmap((void *)map->base, map->size);
+    map->base = NULL;
+}
+
+int
+capture_next(struct capture_map *map, const struct capture_record **record, const unsigned char **payload)
+{
+    if (map->size - map->offset < sizeof(struct capture_record))
+    {
+        return 0;
+    }
+    const struct capture_record *r = (const struct capture_record *)(map->base + map->offset);
+    size_t length = sizeof(*r) + CAPTURE_PADDED(r->length);
+    if (map->size - map->offset < length)
+    {
+        return 0;
+    }
+    *record = r;
+    *payload = map->base + map->offset + sizeof(*r);
+    map->offset += length;
+    return 1;
+}
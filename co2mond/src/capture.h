@@ -0,0 +1,103 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CO2MOND_CAPTURE_H_INCLUDED_
+#define CO2MOND_CAPTURE_H_INCLUDED_
+
+/*
+ * Capture files keep raw reports exactly as the devices sent them, so a
+ * run can be replayed later without hardware.  A file is a header
+ * followed by records appended in order; every record is 8-byte aligned
+ * and carries its payload length, so replay can skip unknown types.
+ * Fields are in host byte order, which the header records.
+ */
+
+#include <stdint.h>
+
+#include "co2mon.h"
+
+#define CAPTURE_MAGIC "CO2MCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BYTE_ORDER 0x01020304
+
+#define CAPTURE_MULTI_DEVICE 1 /* header flag: names are namespaces */
+
+#define CAPTURE_ATTACH 1 /* payload: device name */
+#define CAPTURE_DETACH 2 /* no payload */
+#define CAPTURE_REPORT 3 /* payload: the 8 raw bytes */
+
+struct capture_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t byte_order;
+    uint32_t reserved;
+    co2mon_data_t magic_table;
+};
+
+struct capture_record
+{
+    int64_t timestamp; /* nanoseconds since the Epoch */
+    uint8_t type;
+    uint8_t device;    /* slot, reused after CAPTURE_DETACH */
+    uint16_t length;   /* of the payload that follows, before padding */
+    uint32_t reserved;
+};
+
+#define CAPTURE_PADDED(length) (((length) + 7) & ~(size_t)7)
+
+/* Writing, from the reader thread.  Appends to an existing capture if its
+ * header matches. */
+
+extern int
+capture_open(const char *path, const co2mon_data_t magic_table, uint32_t flags);
+
+extern void
+capture_close();
+
+extern int
+capture_active();
+
+extern void
+capture_write(int64_t timestamp, int type, int device, const void *payload, size_t length);
+
+extern void
+capture_flush();
+
+/* Reading: the whole file is mapped. */
+
+struct capture_map
+{
+    const unsigned char *base;
+    size_t size;
+    size_t offset; /* of the next record */
+    const struct capture_header *header;
+};
+
+extern int
+capture_map_open(struct capture_map *map, const char *path);
+
+extern void
+capture_map_close(struct capture_map *map);
+
+/* Returns 1 and the next record with its payload, or 0 at the end. */
+extern int
+capture_next(struct capture_map *map, const struct capture_record **record, const unsigned char **payload);
+
+#endif
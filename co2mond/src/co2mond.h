@@ -0,0 +1,71 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_H_INCLUDED_
+#define CO2MOND_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "co2mon.h"
+#include "coalesce.h"
+#include "rolling.h"
+
+#define PATH_MAX 4096
+#define VALUE_MAX 20
+#define DEVNAME_MAX 64
+#define MAX_DEVICES 64
+
+/* Items flagged CO2MON_ITEM_STORE, in the order of their codes.  The
+ * arrays are sized at compile time, so this has to follow co2mon_items by
+ * hand; init_metrics() refuses to run if it does not. */
+#define NMETRICS 2
+
+struct metric
+{
+    const char *name;
+    unsigned char code;
+    struct coalesce_config config;
+    struct rolling_config rolling; /* no windows unless asked for with -W */
+};
+
+/* A valid report, as passed from the reader to the output thread. */
+/* Both times are taken when the report came off the device, see
+ * co2mon_report_time(); a replayed record keeps its captured timestamp
+ * but gets the monotonic time of the replay. */
+struct record
+{
+    int64_t timestamp; /* nanoseconds since the Epoch */
+    int64_t monotonic; /* nanoseconds on CLOCK_MONOTONIC */
+    uint16_t value;
+    uint8_t code;
+    uint8_t device;    /* slot of the device, see struct source */
+};
+
+/* A device as seen by the sinks, valid between attach and detach. */
+struct source
+{
+    int slot;
+    char name[DEVNAME_MAX];
+};
+
+extern int multi_device;
+extern int print_unknown;
+extern int batch_period; /* seconds between output batches, 0 for none (-b) */
+extern struct metric metrics[NMETRICS];
+extern signed char metric_of[256]; /* index into metrics by item code, -1 if none */
+
+#endif
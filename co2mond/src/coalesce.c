@@ -0,0 +1,83 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "coalesce.h"
+
+unsigned long coalesce_suppressed = 0;
+
+int
+coalesce_unchanged(const struct coalesce *c, double value)
+{
+    return (c->written || c->pending) && value == (c->pending ? c->pending_value : c->value);
+}
+
+int
+coalesce_offer(struct coalesce *c, const struct coalesce_config *config, double value, const char *text, time_t now)
+{
+    double base = c->pending ? c->pending_value : c->value;
+    if (c->written || c->pending)
+    {
+        double delta = fabs(value - base);
+        if (delta == 0)
+        {
+            return COALESCE_DROP;
+        }
+        if (delta < config->deadband)
+        {
+            ++coalesce_suppressed;
+            return COALESCE_DROP;
+        }
+    }
+
+    if (c->written && now - c->time < config->interval)
+    {
+        if (c->pending)
+        {
+            ++coalesce_suppressed;
+        }
+        c->pending = 1;
+        c->pending_value = value;
+        snprintf(c->pending_text, COALESCE_TEXT_MAX, "%s", text);
+        return COALESCE_DEFER;
+    }
+
+    return COALESCE_WRITE;
+}
+
+void
+coalesce_written(struct coalesce *c, double value, time_t now)
+{
+    c->written = 1;
+    c->value = value;
+    c->time = now;
+    c->pending = 0;
+}
+
+const char *
+coalesce_due(struct coalesce *c, const struct coalesce_config *config, time_t now, int force, double *value)
+{
+    if (!c->pending || (!force && now - c->time < config->interval))
+    {
+        return NULL;
+    }
+    *value = c->pending_value;
+    return c->pending_text;
+}
@@ -0,0 +1,70 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_COALESCE_H_INCLUDED_
+#define CO2MOND_COALESCE_H_INCLUDED_
+
+/*
+ * Write coalescing for slowly changing metrics: changes within the
+ * deadband are dropped, and a metric is written at most once per interval.
+ * A value that arrives too early is kept and written by coalesce_due()
+ * once the interval has passed.
+ */
+
+#include <time.h>
+
+#define COALESCE_TEXT_MAX 20
+
+#define COALESCE_DROP 0
+#define COALESCE_WRITE 1
+#define COALESCE_DEFER 2
+
+struct coalesce_config
+{
+    double deadband; /* smallest change worth writing, 0 for any change */
+    int interval;    /* seconds between two writes */
+};
+
+struct coalesce
+{
+    int written;
+    double value;
+    time_t time;
+    int pending;
+    double pending_value;
+    char pending_text[COALESCE_TEXT_MAX];
+};
+
+extern unsigned long coalesce_suppressed;
+
+/* Whether value is what was written or is held back, so that there is no
+ * need to format it for coalesce_offer(). */
+extern int
+coalesce_unchanged(const struct coalesce *c, double value);
+
+extern int
+coalesce_offer(struct coalesce *c, const struct coalesce_config *config, double value, const char *text, time_t now);
+
+extern void
+coalesce_written(struct coalesce *c, double value, time_t now);
+
+/* Returns the pending text once it may be written (or at once if force
+ * is set), NULL otherwise. */
+extern const char *
+coalesce_due(struct coalesce *c, const struct coalesce_config *config, time_t now, int force, double *value);
+
+#endif
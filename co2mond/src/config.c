@@ -0,0 +1,620 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* getline */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "datadir.h"
+
+#define DEFAULT_HISTORY_BUDGET (1024 * 1024)
+#define DEFAULT_PERSIST_INTERVAL 600 /* seconds */
+
+/* In the order of the sink list: the history has to come before the
+ * sinks that serve it, persist after those it copies, stdout last. */
+#define SINK_HISTORY 0
+#define SINK_SNAPSHOT 1
+#define SINK_HTTP 2
+#define SINK_MQTT 3
+#define SINK_UDP 4
+#define SINK_SOCKET 5
+#define SINK_ARCHIVE 6
+#define SINK_RRD 7
+#define SINK_DATADIR 8
+#define SINK_PERSIST 9
+#define SINK_STDOUT 10
+#define NSINK_KINDS 11
+
+/* As the sinks call themselves. */
+static const char *const sink_kinds[NSINK_KINDS] = {
+    "history", "snapshot", "http", "mqtt", "udp", "socket", "archive", "rrd", "datadir", "persist", "stdout",
+};
+
+static const struct
+{
+    const char *key;
+    int option;
+    int operand;
+} keys[] = {
+    { "all", 'a', 0 },
+    { "daemon", 'd', 0 },
+    { "unknown", 'u', 0 },
+    { "fast-replay", 'x', 0 },
+    { "datadir-rename", 'A', 0 },
+    { "datadir-no-lock", 'L', 0 },
+    { "heartbeat", 'B', 1 },
+    { "rrdcached", 'C', 1 },
+    { "datadir", 'D', 1 },
+    { "filter", 'F', 1 },
+    { "http", 'H', 1 },
+    { "snapshot", 'M', 1 },
+    { "replay", 'P', 1 },
+    { "capture", 'R', 1 },
+    { "socket", 'S', 1 },
+    { "history", 'T', 1 },
+    { "collector", 'U', 1 },
+    { "window", 'W', 1 },
+    { "archivedir", 'Y', 1 },
+    { "persist", 'Z', 1 },
+    { "batch", 'b', 1 },
+    { "device", 'f', 1 },
+    { "logfile", 'l', 1 },
+    { "mqtt", 'm', 1 },
+    { "pidfile", 'p', 1 },
+    { "rrd", 'r', 1 },
+};
+
+#define NKEYS (sizeof(keys) / sizeof(keys[0]))
+
+void
+config_init(struct config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->history_budget = -1;
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        config->filters[i].deadband = co2mon_items[metrics[i].code].deadband;
+    }
+}
+
+void
+config_free(struct config *config)
+{
+    free(config->datadir);
+    free(config->archivedir);
+    free(config->snapshotfile);
+    free(config->httpspec);
+    free(config->mqttspec);
+    free(config->udpspec);
+    free(config->socketfile);
+    free(config->rrdfile);
+    free(config->rrdcached);
+    free(config->persistdir);
+}
+
+static int
+set_string(char **field, const char *arg)
+{
+    char *s = strdup(arg);
+    if (!s)
+    {
+        fprintf(stderr, "config: out of memory\n");
+        return 0;
+    }
+    free(*field);
+    *field = s;
+    return 1;
+}
+
+static int
+find_metric(const char *arg, const char **rest)
+{
+    const char *colon = strchr(arg, ':');
+    if (!colon)
+    {
+        return -1;
+    }
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        if (strlen(metrics[i].name) == (size_t)(colon - arg) && strncmp(metrics[i].name, arg, colon - arg) == 0)
+        {
+            *rest = colon + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* A number of seconds, 0 or more. */
+static int
+parse_seconds(const char *arg, int *seconds)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || n < 0 || n > INT_MAX)
+    {
+        return 0;
+    }
+    *seconds = (int)n;
+    return 1;
+}
+
+/* Parses "name:deadband[:interval]", e.g. "CntR:5:30". */
+static int
+parse_filter(struct config *config, const char *arg)
+{
+    const char *rest;
+    int i = find_metric(arg, &rest);
+    if (i < 0)
+    {
+        return 0;
+    }
+    struct coalesce_config filter = config->filters[i];
+    char *end;
+    filter.deadband = strtod(rest, &end);
+    if (end == rest || filter.deadband < 0)
+    {
+        return 0;
+    }
+    if (*end == ':')
+    {
+        if (!parse_seconds(end + 1, &filter.interval))
+        {
+            return 0;
+        }
+    }
+    else if (*end != '\0')
+    {
+        return 0;
+    }
+    config->filters[i] = filter;
+    return 1;
+}
+
+/* Parses "name:seconds[:percentile]", e.g. "CntR:3600:95". */
+static int
+parse_window(struct config *config, const char *arg)
+{
+    const char *rest;
+    int i = find_metric(arg, &rest);
+    return i >= 0 && rolling_parse(&config->windows[i], rest);
+}
+
+/* Parses "dir[:seconds]"; a suffix that is not all digits is part of dir. */
+static int
+parse_persist(struct config *config, const char *arg)
+{
+    int interval = DEFAULT_PERSIST_INTERVAL;
+    const char *colon = strrchr(arg, ':');
+    if (colon && (colon[1] == '\0' || strspn(colon + 1, "0123456789") != strlen(colon + 1)))
+    {
+        colon = NULL;
+    }
+    if (colon && (!parse_seconds(colon + 1, &interval) || interval == 0))
+    {
+        return 0;
+    }
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    char *dir = len ? strndup(arg, len) : NULL;
+    if (!dir)
+    {
+        return 0;
+    }
+    free(config->persistdir);
+    config->persistdir = dir;
+    config->persist_interval = interval;
+    return 1;
+}
+
+/* "<number>[K|M|G]" in bytes, -1 if invalid. */
+static long long
+parse_size(const char *arg)
+{
+    char *end;
+    long long size = strtoll(arg, &end, 10);
+    if (end == arg || size < 0)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        ++end;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+int
+config_set(struct config *config, int option, const char *arg)
+{
+    switch (option)
+    {
+    case 'u':
+        config->print_unknown = 1;
+        return 1;
+    case 'A':
+        config->datadir_flags |= DATADIR_RENAME;
+        return 1;
+    case 'L':
+        config->datadir_flags |= DATADIR_NO_LOCK;
+        return 1;
+    case 'B':
+        return parse_seconds(arg, &config->heartbeat_period);
+    case 'C':
+        return set_string(&config->rrdcached, arg);
+    case 'D':
+        return set_string(&config->datadir, arg);
+    case 'F':
+        return parse_filter(config, arg);
+    case 'H':
+        return set_string(&config->httpspec, arg);
+    case 'M':
+        return set_string(&config->snapshotfile, arg);
+    case 'S':
+        return set_string(&config->socketfile, arg);
+    case 'T':
+        return (config->history_budget = parse_size(arg)) >= 0;
+    case 'U':
+        return set_string(&config->udpspec, arg);
+    case 'W':
+        return parse_window(config, arg);
+    case 'Y':
+        return set_string(&config->archivedir, arg);
+    case 'Z':
+        return parse_persist(config, arg);
+    case 'm':
+        return set_string(&config->mqttspec, arg);
+    case 'r':
+        return set_string(&config->rrdfile, arg);
+    }
+    return -1;
+}
+
+const char *
+config_key(int option)
+{
+    for (size_t i = 0; i < NKEYS; ++i)
+    {
+        if (keys[i].option == option)
+        {
+            return keys[i].key;
+        }
+    }
+    return NULL;
+}
+
+int
+config_read(const char *path, int (*set)(void *arg, int option, const char *value), void *arg)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        perror(path);
+        return 0;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    int ok = 1;
+    for (unsigned lineno = 1; ok && getline(&line, &size, f) != -1; ++lineno)
+    {
+        char *key = line;
+        while (isspace((unsigned char)*key))
+        {
+            ++key;
+        }
+        if (*key == '\0' || *key == '#')
+        {
+            continue;
+        }
+        char *value = key;
+        while (*value && !isspace((unsigned char)*value))
+        {
+            ++value;
+        }
+        char *end = value + strlen(value);
+        if (*value)
+        {
+            *value++ = '\0';
+        }
+        while (isspace((unsigned char)*value))
+        {
+            ++value;
+        }
+        while (end > value && isspace((unsigned char)end[-1]))
+        {
+            --end;
+        }
+        *end = '\0';
+
+        size_t i = 0;
+        while (i < NKEYS && strcmp(keys[i].key, key) != 0)
+        {
+            ++i;
+        }
+        if (i == NKEYS)
+        {
+            fprintf(stderr, "%s:%u: unknown option %s\n", path, lineno, key);
+            ok = 0;
+        }
+        else if (keys[i].operand != (*value != '\0'))
+        {
+            fprintf(stderr, "%s:%u: %s %s\n", path, lineno, key, keys[i].operand ? "needs a value" : "takes no value");
+            ok = 0;
+        }
+        else if (!set(arg, keys[i].option, keys[i].operand ? value : NULL))
+        {
+            fprintf(stderr, "%s:%u: invalid %s: %s\n", path, lineno, key, value);
+            ok = 0;
+        }
+    }
+    if (ok && ferror(f))
+    {
+        perror(path);
+        ok = 0;
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+static int
+resolve_dir(char **dir)
+{
+    if (!*dir)
+    {
+        return 1;
+    }
+    char *resolved = realpath(*dir, NULL);
+    if (!resolved)
+    {
+        perror(*dir);
+        return 0;
+    }
+    free(*dir);
+    *dir = resolved;
+    return 1;
+}
+
+int
+config_finish(struct config *config)
+{
+    if (config->history_budget == -1)
+    {
+        config->history_budget = config->httpspec || config->socketfile ? DEFAULT_HISTORY_BUDGET : 0;
+    }
+    if (config->persistdir && !config->datadir && !config->archivedir)
+    {
+        fprintf(stderr, "config: persist needs a datadir or an archivedir\n");
+        return 0;
+    }
+    return resolve_dir(&config->datadir) && resolve_dir(&config->archivedir) && resolve_dir(&config->persistdir);
+}
+
+static int
+same_string(const char *a, const char *b)
+{
+    return a ? b && strcmp(a, b) == 0 : !b;
+}
+
+static int
+sink_wanted(const struct config *config, int kind)
+{
+    switch (kind)
+    {
+    case SINK_HISTORY:
+        return config->history_budget > 0;
+    case SINK_SNAPSHOT:
+        return config->snapshotfile != NULL;
+    case SINK_HTTP:
+        return config->httpspec != NULL;
+    case SINK_MQTT:
+        return config->mqttspec != NULL;
+    case SINK_UDP:
+        return config->udpspec != NULL;
+    case SINK_SOCKET:
+        return config->socketfile != NULL;
+    case SINK_ARCHIVE:
+        return config->archivedir != NULL;
+    case SINK_RRD:
+        return config->rrdfile != NULL;
+    case SINK_DATADIR:
+        return config->datadir != NULL;
+    case SINK_PERSIST:
+        return config->persistdir != NULL;
+    case SINK_STDOUT:
+        return config->stdout_sink;
+    }
+    return 0;
+}
+
+/* Whether a sink of config can stand in for one of old. */
+static int
+sink_unchanged(const struct config *config, const struct config *old, int kind)
+{
+    switch (kind)
+    {
+    case SINK_HISTORY:
+        return config->history_budget == old->history_budget && config->history_series == old->history_series;
+    case SINK_SNAPSHOT:
+        return same_string(config->snapshotfile, old->snapshotfile);
+    case SINK_HTTP:
+        return same_string(config->httpspec, old->httpspec);
+    case SINK_MQTT:
+        return same_string(config->mqttspec, old->mqttspec);
+    case SINK_UDP:
+        return same_string(config->udpspec, old->udpspec);
+    case SINK_SOCKET:
+        return same_string(config->socketfile, old->socketfile);
+    case SINK_ARCHIVE:
+        return same_string(config->archivedir, old->archivedir);
+    case SINK_RRD:
+        return same_string(config->rrdfile, old->rrdfile) && same_string(config->rrdcached, old->rrdcached);
+    case SINK_DATADIR:
+        return same_string(config->datadir, old->datadir) && config->datadir_flags == old->datadir_flags &&
+               config->heartbeat_period == old->heartbeat_period;
+    case SINK_PERSIST:
+        return same_string(config->persistdir, old->persistdir) && config->persist_interval == old->persist_interval &&
+               same_string(config->datadir, old->datadir) && same_string(config->archivedir, old->archivedir);
+    case SINK_STDOUT:
+        return 1;
+    }
+    return 0;
+}
+
+static struct sink *
+create_sink(const struct config *config, int kind)
+{
+    switch (kind)
+    {
+    case SINK_HISTORY:
+        return history_sink_create((size_t)config->history_budget, config->history_series);
+    case SINK_SNAPSHOT:
+        return snapshot_sink_create(config->snapshotfile);
+    case SINK_HTTP:
+        return http_sink_create(config->httpspec);
+    case SINK_MQTT:
+        return mqtt_sink_create(config->mqttspec);
+    case SINK_UDP:
+        return udp_sink_create(config->udpspec);
+    case SINK_SOCKET:
+        return socket_sink_create(config->socketfile);
+    case SINK_ARCHIVE:
+        return archive_sink_create(config->archivedir);
+    case SINK_RRD:
+        return rrd_sink_create(config->rrdfile, config->rrdcached);
+    case SINK_DATADIR:
+        return datadir_sink_create(config->datadir, config->datadir_flags, config->heartbeat_period);
+    case SINK_PERSIST:
+        return persist_sink_create(config->persistdir, config->persist_interval, config->datadir, config->archivedir);
+    case SINK_STDOUT:
+        return stdout_sink_create();
+    }
+    return NULL;
+}
+
+/* Unlinks the sink of a kind from list, NULL if there is none. */
+static struct sink *
+take_sink(struct sink **list, int kind)
+{
+    for (struct sink **p = list; *p; p = &(*p)->next)
+    {
+        if ((*p)->name && strcmp((*p)->name, sink_kinds[kind]) == 0)
+        {
+            struct sink *sink = *p;
+            *p = sink->next;
+            sink->next = NULL;
+            return sink;
+        }
+    }
+    return NULL;
+}
+
+static int
+has_sink(struct sink *list, int kind)
+{
+    for (; list; list = list->next)
+    {
+        if (list->name && strcmp(list->name, sink_kinds[kind]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+config_sinks(const struct config *config, const struct config *old, struct sink **old_sinks, struct sink **sinks)
+{
+    struct sink *created[NSINK_KINDS] = { NULL };
+    int reuse[NSINK_KINDS] = { 0 };
+    int replace_history = 0;
+    for (int kind = 0; kind < NSINK_KINDS; ++kind)
+    {
+        if (!sink_wanted(config, kind))
+        {
+            continue;
+        }
+        if (old && sink_wanted(old, kind) && sink_unchanged(config, old, kind) && has_sink(*old_sinks, kind))
+        {
+            reuse[kind] = 1;
+            continue;
+        }
+        if (kind == SINK_HISTORY && old && has_sink(*old_sinks, kind))
+        {
+            replace_history = 1;
+            continue;
+        }
+        if (!(created[kind] = create_sink(config, kind)))
+        {
+            for (int i = 0; i < kind; ++i)
+            {
+                if (created[i])
+                {
+                    created[i]->destroy(created[i]);
+                }
+            }
+            return 0;
+        }
+    }
+
+    if (replace_history)
+    {
+        struct sink *history = take_sink(old_sinks, SINK_HISTORY);
+        history->destroy(history);
+        if (!(created[SINK_HISTORY] = create_sink(config, SINK_HISTORY)))
+        {
+            fprintf(stderr, "config: continuing without history\n");
+        }
+    }
+
+    struct sink **tail = sinks;
+    for (int kind = 0; kind < NSINK_KINDS; ++kind)
+    {
+        struct sink *sink = reuse[kind] ? take_sink(old_sinks, kind) : created[kind];
+        if (sink)
+        {
+            *tail = sink;
+            tail = &sink->next;
+        }
+    }
+    *tail = NULL;
+    return 1;
+}
+
+void
+config_apply(const struct config *config)
+{
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        metrics[i].config = config->filters[i];
+        metrics[i].rolling = config->windows[i];
+    }
+    print_unknown = config->print_unknown;
+}
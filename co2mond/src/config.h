@@ -0,0 +1,108 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_CONFIG_H_INCLUDED_
+#define CO2MOND_CONFIG_H_INCLUDED_
+
+/*
+ * The part of the configuration that SIGHUP reloads: which sinks there
+ * are, with what settings, and how the metrics are filtered.  It comes
+ * from a file (co2mond -c) with one option per line, overridden by the
+ * command line:
+ *
+ *   # Store CO2 with a deadband of 5 ppm, at most every 30 s
+ *   datadir /var/lib/co2mon
+ *   filter CntR:5:30
+ *   http :9100
+ *
+ * Keys are the long names of the options (see config_read()); options
+ * without an operand stand alone.  Paths should be absolute: a daemon
+ * resolves relative ones against /.
+ */
+
+#include "co2mond.h"
+#include "sink.h"
+
+struct config
+{
+    char *datadir;               /* resolved by config_finish() */
+    int datadir_flags;
+    int heartbeat_period;
+    char *archivedir;            /* resolved by config_finish() */
+    char *snapshotfile;
+    char *httpspec;
+    char *mqttspec;
+    char *udpspec;
+    char *socketfile;
+    char *rrdfile;
+    char *rrdcached;
+    char *persistdir;            /* resolved by config_finish() */
+    int persist_interval;
+    long long history_budget;    /* bytes, -1 for the default */
+    int print_unknown;
+    struct coalesce_config filters[NMETRICS];
+    struct rolling_config windows[NMETRICS];
+
+    /* Set by main() from what cannot change without a restart. */
+    int history_series;
+    int stdout_sink;
+};
+
+/* The defaults, as without any option. */
+extern void
+config_init(struct config *config);
+
+extern void
+config_free(struct config *config);
+
+/* Applies an option given by its letter.  Returns 1, 0 if arg is invalid
+ * and -1 if the option is not part of the reloadable configuration. */
+extern int
+config_set(struct config *config, int option, const char *arg);
+
+/* The long name of an option letter, NULL if there is none. */
+extern const char *
+config_key(int option);
+
+/* Calls set() with the letter and operand (NULL if none) of every option
+ * in the file, in order.  Returns 0 if the file cannot be read, has a
+ * syntax error or set() returned 0. */
+extern int
+config_read(const char *path, int (*set)(void *arg, int option, const char *value), void *arg);
+
+/* Resolves the directories and the defaults that depend on other
+ * options; after the last config_set().  Returns 0 on failure. */
+extern int
+config_finish(struct config *config);
+
+/*
+ * Builds the sink list for config.  With old, the sinks in *old_sinks
+ * whose settings did not change are moved over instead of created again;
+ * what remains in *old_sinks is for the caller to retire.  On failure
+ * nothing is changed and 0 is returned; only a history whose budget
+ * changed is gone if the new one cannot be allocated, as there is only
+ * one history at a time.
+ */
+extern int
+config_sinks(const struct config *config, const struct config *old, struct sink **old_sinks, struct sink **sinks);
+
+/* Puts the metric settings into effect; in the output thread once it
+ * runs. */
+extern void
+config_apply(const struct config *config);
+
+#endif
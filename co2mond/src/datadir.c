@@ -0,0 +1,224 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* openat */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "datadir.h"
+
+int
+lock_file(int fd, short int type)
+{
+    struct flock lock;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    lock.l_whence = SEEK_SET;
+    lock.l_type = type;
+    return fcntl(fd, F_SETLKW, &lock);
+}
+
+int
+datadir_open(struct datadir *dd, const char *path, int flags)
+{
+    dd->flags = flags;
+    dd->nfiles = 0;
+    dd->dirfd = open(path, O_RDONLY);
+    if (dd->dirfd == -1)
+    {
+        perror(path);
+        return 0;
+    }
+    return 1;
+}
+
+void
+datadir_close(struct datadir *dd)
+{
+    for (int i = 0; i < dd->nfiles; ++i)
+    {
+        close(dd->files[i].fd);
+    }
+    dd->nfiles = 0;
+    if (dd->dirfd != -1)
+    {
+        close(dd->dirfd);
+        dd->dirfd = -1;
+    }
+}
+
+/* Sets *opened if the file was not open yet. */
+static int
+open_file(struct datadir *dd, const char *name, int *opened)
+{
+    for (int i = 0; i < dd->nfiles; ++i)
+    {
+        if (strcmp(dd->files[i].name, name) == 0)
+        {
+            return dd->files[i].fd;
+        }
+    }
+    if (dd->nfiles == DATADIR_MAX_FILES || strlen(name) >= DATADIR_NAME_MAX)
+    {
+        fprintf(stderr, "%s: too many files in datadir\n", name);
+        return -1;
+    }
+
+    int fd = openat(dd->dirfd, name, O_CREAT | O_WRONLY, 0666);
+    if (fd == -1)
+    {
+        perror(name);
+        return -1;
+    }
+
+    *opened = 1;
+    struct datadir_file *file = &dd->files[dd->nfiles++];
+    snprintf(file->name, DATADIR_NAME_MAX, "%s", name);
+    file->fd = fd;
+    return fd;
+}
+
+static void
+make_times(struct timespec *times, int64_t timestamp)
+{
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = (time_t)(timestamp / 1000000000);
+    times[1].tv_nsec = (long)(timestamp % 1000000000);
+}
+
+/* Sets the modification time to when the value was read. */
+static int
+set_mtime(int fd, const char *name, int64_t timestamp)
+{
+    if (timestamp <= 0)
+    {
+        return 1;
+    }
+    struct timespec times[2];
+    make_times(times, timestamp);
+    if (futimens(fd, times) != 0)
+    {
+        perror(name);
+        return 0;
+    }
+    return 1;
+}
+
+/* With trim, cuts off what files left by older versions may hold past
+ * the record, once the record is in place, so that readers never see a
+ * file padded with NUL bytes. */
+static int
+write_record(int fd, const char *name, const char *record, int64_t timestamp, int locked, int trim)
+{
+    if (locked && lock_file(fd, F_WRLCK) != 0)
+    {
+        perror("lock");
+        return 0;
+    }
+
+    int result = pwrite(fd, record, DATADIR_RECORD_SIZE, 0) == DATADIR_RECORD_SIZE;
+    if (!result)
+    {
+        perror(name);
+    }
+    else
+    {
+        if (trim && ftruncate(fd, DATADIR_RECORD_SIZE) != 0)
+        {
+            perror(name);
+        }
+        set_mtime(fd, name, timestamp);
+    }
+
+    if (locked && lock_file(fd, F_UNLCK) != 0)
+    {
+        perror("unlock");
+        return 0;
+    }
+
+    return result;
+}
+
+static int
+replace_file(struct datadir *dd, const char *name, const char *record, int64_t timestamp)
+{
+    char tmpname[DATADIR_NAME_MAX + 8];
+    snprintf(tmpname, sizeof(tmpname), ".%s.tmp", name);
+
+    int fd = openat(dd->dirfd, tmpname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1)
+    {
+        perror(tmpname);
+        return 0;
+    }
+    int result = write(fd, record, DATADIR_RECORD_SIZE) == DATADIR_RECORD_SIZE;
+    if (!result)
+    {
+        perror(tmpname);
+    }
+    else
+    {
+        set_mtime(fd, tmpname, timestamp);
+    }
+    close(fd);
+
+    if (result && renameat(dd->dirfd, tmpname, dd->dirfd, name) != 0)
+    {
+        perror(name);
+        result = 0;
+    }
+    return result;
+}
+
+int
+datadir_write(struct datadir *dd, const char *name, const char *value, int64_t timestamp)
+{
+    char record[DATADIR_RECORD_SIZE + 1];
+    snprintf(record, sizeof(record), "%-*.*s\n", DATADIR_RECORD_SIZE - 1, DATADIR_RECORD_SIZE - 1, value);
+
+    if (dd->flags & DATADIR_RENAME)
+    {
+        return replace_file(dd, name, record, timestamp);
+    }
+
+    int opened = 0;
+    int fd = open_file(dd, name, &opened);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    return write_record(fd, name, record, timestamp, !(dd->flags & DATADIR_NO_LOCK), opened);
+}
+
+int
+datadir_touch(struct datadir *dd, const char *name, int64_t timestamp)
+{
+    struct timespec times[2];
+    make_times(times, timestamp);
+    if (utimensat(dd->dirfd, name, times, 0) != 0)
+    {
+        perror(name);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,69 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_DATADIR_H_INCLUDED_
+#define CO2MOND_DATADIR_H_INCLUDED_
+
+/*
+ * Values in the datadir are kept as one file per metric.  Every file holds
+ * a single fixed-width record, so an update is one pwrite() on a file
+ * descriptor opened once, and readers never see a truncated file.  The
+ * modification time of a file is when the sensor last sent its value.
+ */
+
+#include <stdint.h>
+
+#define DATADIR_RECORD_SIZE 20 /* including the trailing newline */
+#define DATADIR_MAX_FILES 48 /* the metrics, their rolling statistics and the heartbeat */
+#define DATADIR_NAME_MAX 48
+
+#define DATADIR_NO_LOCK 1 /* do not take fcntl() locks around updates */
+#define DATADIR_RENAME 2  /* write a temporary file and rename() it */
+
+struct datadir_file
+{
+    char name[DATADIR_NAME_MAX];
+    int fd;
+};
+
+struct datadir
+{
+    int dirfd;
+    int flags;
+    int nfiles;
+    struct datadir_file files[DATADIR_MAX_FILES];
+};
+
+extern int
+lock_file(int fd, short int type);
+
+extern int
+datadir_open(struct datadir *dd, const char *path, int flags);
+
+extern void
+datadir_close(struct datadir *dd);
+
+/* timestamp is in nanoseconds since the Epoch, 0 for now. */
+extern int
+datadir_write(struct datadir *dd, const char *name, const char *value, int64_t timestamp);
+
+/* Sets the modification time of name alone, when the sensor repeated the
+ * value in it. */
+extern int
+datadir_touch(struct datadir *dd, const char *name, int64_t timestamp);
+
+#endif
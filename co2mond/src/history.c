@@ -0,0 +1,508 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "co2mond.h"
+#include "history.h"
+
+#define NS 1000000000LL
+
+/* Full retention of each level, sized for the sensor's pace of about one
+ * sample per item and second. */
+static const struct
+{
+    const char *name;
+    int64_t seconds; /* of a bucket, 0 for raw samples */
+    unsigned capacity;
+} levels[HISTORY_LEVELS] = {
+    { "raw", 0, 3600 },
+    { "1m", 60, 7 * 24 * 60 },
+    { "1h", 3600, 365 * 24 },
+};
+
+/* Buckets of one resolution, indexed by bucket number modulo capacity. */
+struct history_ring
+{
+    unsigned capacity;
+    int64_t newest;   /* bucket number, -1 if none yet */
+    int64_t *bucket;  /* bucket number held by each entry, -1 if empty */
+    uint16_t *min;
+    uint16_t *max;
+    float *avg;
+    uint32_t *count;
+};
+
+struct history_series
+{
+    /* raw samples, oldest at head */
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+    int64_t *timestamp;
+    uint16_t *value;
+
+    struct history_ring rings[HISTORY_LEVELS - 1];
+};
+
+static char *arena;
+static size_t arena_size;
+static size_t arena_used;
+static double scale;
+static int exhausted;
+static struct history_series *series[MAX_DEVICES][NMETRICS];
+static char names[MAX_DEVICES][DEVNAME_MAX];
+static int attached[MAX_DEVICES];
+
+static unsigned
+level_capacity(int level, double f)
+{
+    unsigned capacity = (unsigned)(levels[level].capacity * f);
+    return capacity ? capacity : 1;
+}
+
+static size_t
+align(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static size_t
+series_size(double f)
+{
+    size_t size = align(sizeof(struct history_series));
+    unsigned raw = level_capacity(HISTORY_RAW, f);
+    size += align(raw * sizeof(int64_t)) + align(raw * sizeof(uint16_t));
+    for (int level = 1; level < HISTORY_LEVELS; ++level)
+    {
+        unsigned n = level_capacity(level, f);
+        size += align(n * sizeof(int64_t)) + 2 * align(n * sizeof(uint16_t)) +
+                align(n * sizeof(float)) + align(n * sizeof(uint32_t));
+    }
+    return size;
+}
+
+static void *
+carve(size_t size)
+{
+    void *p = arena + arena_used;
+    arena_used += align(size);
+    return p;
+}
+
+static void
+reset_series(struct history_series *s)
+{
+    s->head = 0;
+    s->count = 0;
+    for (int i = 0; i < HISTORY_LEVELS - 1; ++i)
+    {
+        struct history_ring *r = &s->rings[i];
+        r->newest = -1;
+        for (unsigned k = 0; k < r->capacity; ++k)
+        {
+            r->bucket[k] = -1;
+        }
+    }
+}
+
+static struct history_series *
+new_series()
+{
+    if (arena_size - arena_used < series_size(scale))
+    {
+        if (!exhausted)
+        {
+            fprintf(stderr, "history: memory budget exhausted, not recording more devices\n");
+            exhausted = 1;
+        }
+        return NULL;
+    }
+    struct history_series *s = carve(sizeof(*s));
+    s->capacity = level_capacity(HISTORY_RAW, scale);
+    s->timestamp = carve(s->capacity * sizeof(int64_t));
+    s->value = carve(s->capacity * sizeof(uint16_t));
+    for (int level = 1; level < HISTORY_LEVELS; ++level)
+    {
+        struct history_ring *r = &s->rings[level - 1];
+        r->capacity = level_capacity(level, scale);
+        r->bucket = carve(r->capacity * sizeof(int64_t));
+        r->min = carve(r->capacity * sizeof(uint16_t));
+        r->max = carve(r->capacity * sizeof(uint16_t));
+        r->avg = carve(r->capacity * sizeof(float));
+        r->count = carve(r->capacity * sizeof(uint32_t));
+    }
+    reset_series(s);
+    return s;
+}
+
+int
+history_init(size_t budget, int nseries)
+{
+    if (nseries < 1)
+    {
+        nseries = 1;
+    }
+    scale = (double)budget / nseries / series_size(1.0);
+    if (scale > 1.0)
+    {
+        scale = 1.0;
+    }
+    /* Sizes do not shrink quite linearly, make sure nseries fit. */
+    while (scale > 0 && series_size(scale) * nseries > budget)
+    {
+        scale *= 0.99;
+    }
+    if (scale * levels[HISTORY_RAW].capacity < 1)
+    {
+        fprintf(stderr, "history: a budget of %lu bytes is too small\n", (unsigned long)budget);
+        return 0;
+    }
+
+    arena_size = series_size(scale) * nseries;
+    arena = malloc(arena_size);
+    if (!arena)
+    {
+        fprintf(stderr, "history: out of memory\n");
+        return 0;
+    }
+    arena_used = 0;
+    exhausted = 0;
+    memset(series, 0, sizeof(series));
+    memset(attached, 0, sizeof(attached));
+    return 1;
+}
+
+void
+history_free()
+{
+    free(arena);
+    arena = NULL;
+    arena_size = 0;
+    arena_used = 0;
+}
+
+int
+history_enabled()
+{
+    return arena != NULL;
+}
+
+size_t
+history_memory()
+{
+    return arena_used;
+}
+
+void
+history_attach(int slot, const char *name)
+{
+    if (attached[slot] && strcmp(names[slot], name) == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        if (series[slot][i])
+        {
+            reset_series(series[slot][i]);
+        }
+    }
+    snprintf(names[slot], DEVNAME_MAX, "%s", name);
+    attached[slot] = 1;
+}
+
+static void
+ring_add(struct history_ring *r, int64_t seconds, int64_t bucket_seconds, uint16_t value)
+{
+    int64_t b = seconds / bucket_seconds;
+    if (r->newest != -1 && b <= r->newest - r->capacity)
+    {
+        return; /* older than the ring reaches */
+    }
+    unsigned k = (unsigned)(b % r->capacity);
+    if (r->bucket[k] != b)
+    {
+        r->bucket[k] = b;
+        r->min[k] = value;
+        r->max[k] = value;
+        r->avg[k] = value;
+        r->count[k] = 1;
+    }
+    else
+    {
+        r->min[k] = value < r->min[k] ? value : r->min[k];
+        r->max[k] = value > r->max[k] ? value : r->max[k];
+        r->count[k]++;
+        r->avg[k] += (value - r->avg[k]) / r->count[k];
+    }
+    if (b > r->newest)
+    {
+        r->newest = b;
+    }
+}
+
+void
+history_add(int slot, int code, int64_t timestamp, uint16_t value)
+{
+    int metric = metric_of[code];
+    if (!arena || metric == -1 || timestamp < 0)
+    {
+        return;
+    }
+    struct history_series *s = series[slot][metric];
+    if (!s && !(s = series[slot][metric] = new_series()))
+    {
+        return;
+    }
+
+    unsigned k = (s->head + s->count) % s->capacity;
+    s->timestamp[k] = timestamp;
+    s->value[k] = value;
+    if (s->count < s->capacity)
+    {
+        s->count++;
+    }
+    else
+    {
+        s->head = (s->head + 1) % s->capacity;
+    }
+
+    for (int level = 1; level < HISTORY_LEVELS; ++level)
+    {
+        ring_add(&s->rings[level - 1], timestamp / NS, levels[level].seconds, value);
+    }
+}
+
+/* Averages are not whole words. */
+static double
+decode(int metric, double value)
+{
+    return co2mon_item_value(metrics[metric].code, value);
+}
+
+size_t
+history_query(const struct history_query *q, int (*callback)(void *arg, const struct history_point *point), void *arg)
+{
+    const struct history_series *s = arena ? series[q->slot][q->metric] : NULL;
+    if (!s)
+    {
+        return 0;
+    }
+
+    struct history_point point;
+    size_t n = 0;
+    if (q->level == HISTORY_RAW)
+    {
+        for (unsigned i = 0; i < s->count; ++i)
+        {
+            unsigned k = (s->head + i) % s->capacity;
+            if (s->timestamp[k] < q->since || s->timestamp[k] >= q->until)
+            {
+                continue;
+            }
+            point.timestamp = s->timestamp[k];
+            point.min = point.max = point.avg = decode(q->metric, s->value[k]);
+            point.count = 1;
+            ++n;
+            if (!callback(arg, &point))
+            {
+                break;
+            }
+        }
+        return n;
+    }
+
+    const struct history_ring *r = &s->rings[q->level - 1];
+    int64_t seconds = levels[q->level].seconds;
+    if (r->newest == -1)
+    {
+        return 0;
+    }
+    int64_t first = r->newest - r->capacity + 1;
+    int64_t last = r->newest;
+    if (q->since > first * seconds * NS)
+    {
+        first = q->since / NS / seconds;
+    }
+    if (q->until <= (last + 1) * seconds * NS)
+    {
+        last = (q->until - 1) / NS / seconds;
+    }
+    for (int64_t b = first; b <= last; ++b)
+    {
+        unsigned k = (unsigned)(b % r->capacity);
+        if (r->bucket[k] != b)
+        {
+            continue;
+        }
+        point.timestamp = b * seconds * NS;
+        point.min = decode(q->metric, r->min[k]);
+        point.max = decode(q->metric, r->max[k]);
+        point.avg = decode(q->metric, r->avg[k]);
+        point.count = r->count[k];
+        ++n;
+        if (!callback(arg, &point))
+        {
+            break;
+        }
+    }
+    return n;
+}
+
+static int64_t
+parse_time(const char *value, size_t len, time_t now, int *ok)
+{
+    char buf[32];
+    char *end;
+    if (len == 0 || len >= sizeof(buf))
+    {
+        *ok = 0;
+        return 0;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    double t = strtod(buf, &end);
+    if (*end != '\0' || t > 9e9 || t < -9e9)
+    {
+        *ok = 0;
+        return 0;
+    }
+    if (t < 0)
+    {
+        t += (double)now;
+    }
+    return (int64_t)(t * 1000) * 1000000;
+}
+
+int
+history_parse_query(const char *query, time_t now, struct history_query *q)
+{
+    const char *device = NULL;
+    size_t devicelen = 0;
+    int ok = 1;
+
+    q->slot = -1;
+    q->metric = -1;
+    q->level = HISTORY_RAW;
+    q->since = 0;
+    q->until = INT64_MAX;
+
+    while (*query && ok)
+    {
+        size_t len = strcspn(query, "&");
+        const char *eq = memchr(query, '=', len);
+        if (!eq)
+        {
+            return 0;
+        }
+        size_t keylen = (size_t)(eq - query);
+        const char *value = eq + 1;
+        size_t valuelen = len - keylen - 1;
+
+        if (keylen == 4 && strncmp(query, "item", 4) == 0)
+        {
+            for (int i = 0; i < NMETRICS; ++i)
+            {
+                if (strlen(metrics[i].name) == valuelen && strncmp(metrics[i].name, value, valuelen) == 0)
+                {
+                    q->metric = i;
+                }
+            }
+            ok = q->metric != -1;
+        }
+        else if (keylen == 3 && strncmp(query, "res", 3) == 0)
+        {
+            q->level = -1;
+            for (int i = 0; i < HISTORY_LEVELS; ++i)
+            {
+                if (strlen(levels[i].name) == valuelen && strncmp(levels[i].name, value, valuelen) == 0)
+                {
+                    q->level = i;
+                }
+            }
+            ok = q->level != -1;
+        }
+        else if (keylen == 5 && strncmp(query, "since", 5) == 0)
+        {
+            q->since = parse_time(value, valuelen, now, &ok);
+        }
+        else if (keylen == 5 && strncmp(query, "until", 5) == 0)
+        {
+            q->until = parse_time(value, valuelen, now, &ok);
+        }
+        else if (keylen == 6 && strncmp(query, "device", 6) == 0)
+        {
+            device = value;
+            devicelen = valuelen;
+        }
+        else
+        {
+            ok = 0;
+        }
+        query += len;
+        if (*query == '&')
+        {
+            ++query;
+        }
+    }
+    if (!ok || q->metric == -1)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (!attached[i])
+        {
+            continue;
+        }
+        if (device ? strlen(names[i]) == devicelen && strncmp(names[i], device, devicelen) == 0 : !multi_device)
+        {
+            q->slot = i;
+            break;
+        }
+    }
+    return q->slot != -1;
+}
+
+static int
+format_value(int metric, double value, char *buf, size_t size)
+{
+    return co2mon_item_format(metrics[metric].code, value, buf, size);
+}
+
+int
+history_format(const struct history_query *q, const struct history_point *point, char *line, size_t size)
+{
+    char min[VALUE_MAX];
+    char max[VALUE_MAX];
+    format_value(q->metric, point->min, min, sizeof(min));
+    if (q->level == HISTORY_RAW)
+    {
+        return snprintf(line, size, "%lld.%03d\t%s\n", (long long)(point->timestamp / NS),
+                        (int)(point->timestamp % NS / 1000000), min);
+    }
+    format_value(q->metric, point->max, max, sizeof(max));
+    return snprintf(line, size, "%lld\t%s\t%s\t%.4f\t%u\n", (long long)(point->timestamp / NS), min, max, point->avg,
+                    point->count);
+}
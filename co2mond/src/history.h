@@ -0,0 +1,104 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_HISTORY_H_INCLUDED_
+#define CO2MOND_HISTORY_H_INCLUDED_
+
+/*
+ * Recent history of every metric of every device, kept in memory at three
+ * resolutions: the raw samples of the last hour, 1-minute buckets for a
+ * week and 1-hour buckets for a year, each bucket with min, max, average
+ * and count.  Every level is a ring of parallel arrays carved out of one
+ * allocation of a fixed budget; when the budget is too small for the full
+ * retention, all levels are shortened in proportion.  Adding a sample
+ * costs O(1) and never allocates.
+ *
+ * Only the output thread uses it: the history sink feeds it, and the HTTP
+ * and socket sinks answer queries such as
+ *
+ *   item=CntR&res=1m&since=-86400&device=<name>
+ *
+ * with res one of raw, 1m and 1h, since and until in seconds since the
+ * Epoch (or before now when negative, fractions allowed), and device
+ * needed only when serving several sensors.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HISTORY_RAW 0
+#define HISTORY_MINUTE 1
+#define HISTORY_HOUR 2
+#define HISTORY_LEVELS 3
+
+struct history_query
+{
+    int slot;
+    int metric;
+    int level;
+    int64_t since; /* nanoseconds since the Epoch, inclusive */
+    int64_t until; /* exclusive */
+};
+
+struct history_point
+{
+    int64_t timestamp; /* of the sample, or the start of the bucket */
+    double min;
+    double max;
+    double avg;
+    unsigned count;
+};
+
+/* Allocates budget bytes for nseries (device, metric) pairs.  Returns 0 if
+ * the budget is too small for even a minimal history. */
+extern int
+history_init(size_t budget, int nseries);
+
+extern void
+history_free();
+
+extern int
+history_enabled();
+
+/* Bytes taken by the history so far. */
+extern size_t
+history_memory();
+
+/* Keeps the history of the slot if the same device comes back. */
+extern void
+history_attach(int slot, const char *name);
+
+extern void
+history_add(int slot, int code, int64_t timestamp, uint16_t value);
+
+/* Returns 0 if the query is malformed or names no known device. */
+extern int
+history_parse_query(const char *query, time_t now, struct history_query *q);
+
+/* Calls back for every point in the range, oldest first; returns how many
+ * there were.  A callback returning 0 stops the query. */
+extern size_t
+history_query(const struct history_query *q, int (*callback)(void *arg, const struct history_point *point), void *arg);
+
+/* Formats a point as a text line: "<timestamp>\t<value>\n" for raw
+ * samples, "<start>\t<min>\t<max>\t<avg>\t<count>\n" for buckets, times
+ * in seconds since the Epoch. */
+extern int
+history_format(const struct history_query *q, const struct history_point *point, char *line, size_t size);
+
+#endif
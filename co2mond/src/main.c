@@ -21,45 +21,103 @@
 #define _DEFAULT_SOURCE /* _BSD_SOURCE is deprecated in glibc 2.19+ */
 #define _DARWIN_C_SOURCE /* daemon() on macOS */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
+#include "capture.h"
 #include "co2mon.h"
+#include "co2mon_udp.h"
+#include "co2mond.h"
+#include "config.h"
+#include "datadir.h"
+#include "output.h"
+#include "report.h"
+#include "sink.h"
+#include "stats.h"
+
+#define READ_TIMEOUT 5 /* seconds without a report before reconnecting */
+#define HOTPLUG_SETTLE 3 /* seconds to keep retrying after a hotplug event */
+#define REPORT_ERROR_INTERVAL 60 /* seconds between two messages about bad reports */
+
+struct metric metrics[NMETRICS];
+signed char metric_of[256];
+
+struct device
+{
+    char path[PATH_MAX];       /* empty for the first matching device */
+    char name[DEVNAME_MAX];    /* namespace in datadir and on stdout */
+    int persistent;            /* reopen on errors instead of forgetting it */
+    int used;
+    int error_shown;
+    int64_t report_error_shown; /* monotonic ns of the last bad report message, 0 for none */
+    int opened;                /* has been open before, for STAT_RECONNECTS */
+    co2mon_device hid;
+    co2mon_data_t magic_table;
+    struct co2mon_decoder decoder; /* for replayed reports */
+    time_t last_read;
+    uint16_t data[256];
+    int64_t realtime[256];     /* when data[code] arrived, ns since the Epoch */
+    int64_t monotonic[256];    /* ... and on CLOCK_MONOTONIC */
+};
 
-#define CODE_TAMB 0x42 /* Ambient Temperature */
-#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
+/* An option from the command line, applied over the configuration file
+ * whenever it is loaded. */
+struct option_arg
+{
+    int option;
+    const char *arg;
+};
+
+/* Options that only take effect at startup are written down when the
+ * file is loaded, to tell on reload whether they changed. */
+#define RESTART_OPTIONS_MAX 1024
 
-#define PATH_MAX 4096
-#define VALUE_MAX 20
+struct load
+{
+    struct config *config;
+    int startup;
+    char restart[RESTART_OPTIONS_MAX];
+    size_t restartlen;
+};
 
 int daemonize = 0;
 int print_unknown = 0;
-const char *devicefile = NULL;
-char *datadir;
+int scan_all = 0;
+int multi_device = 0;
+const char *devicefiles[MAX_DEVICES];
+int ndevicefiles = 0;
+const char *capturefile = NULL;
+const char *replayfile = NULL;
+int replay_fast = 0;
+int batch_period = 0;
+const char *pidfile = NULL;
+const char *logfile = NULL;
 
-uint16_t co2mon_data[256];
+const char *configfile = NULL;
+struct option_arg *cmdline;
+int ncmdline = 0;
+char restart_options[RESTART_OPTIONS_MAX];
+int history_series = 0;
 
-static int
-lock(int fd, short int type)
-{
-    struct flock lock;
-    lock.l_start = 0;
-    lock.l_len = 0;
-    lock.l_whence = SEEK_SET;
-    lock.l_type = type;
-    return fcntl(fd, F_SETLKW, &lock);
-}
+struct device devices[MAX_DEVICES];
 
-static double
-decode_temperature(uint16_t w)
-{
-    return (double)w * 0.0625 - 273.15;
-}
+volatile sig_atomic_t stop = 0;
+volatile sig_atomic_t dump_requested = 0;
+volatile sig_atomic_t reload_requested = 0;
 
 static int
 write_data(int fd, const char *value)
@@ -67,7 +125,7 @@ write_data(int fd, const char *value)
     char data[VALUE_MAX + 1];
     snprintf(data, VALUE_MAX + 1, "%s\n", value);
 
-    if (lock(fd, F_WRLCK) != 0)
+    if (lock_file(fd, F_WRLCK) != 0)
     {
         perror("lock");
         return 0;
@@ -86,7 +144,7 @@ write_data(int fd, const char *value)
         return 0;
     }
 
-    if (lock(fd, F_UNLCK) != 0)
+    if (lock_file(fd, F_UNLCK) != 0)
     {
         perror("unlock");
         return 0;
@@ -95,207 +153,814 @@ write_data(int fd, const char *value)
     return 1;
 }
 
-static int
-write_value(const char *name, const char *value)
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int64_t
+realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* What check_report() rejects, as counted by the statistics. */
+static const int report_stats[] = {
+    -1,
+    STAT_BAD_FRAME,
+    STAT_CHECKSUM,
+    STAT_OUT_OF_RANGE,
+};
+
+static void
+process_report(struct device *dev, co2mon_data_t result, int64_t timestamp, int64_t monotonic)
 {
-    if (!datadir)
+    struct record record;
+    int slot = (int)(dev - devices);
+    stats_add(STATS_DEVICE, slot, STAT_REPORTS, 1);
+    int r = check_report(result, &record);
+    if (r != REPORT_OK)
     {
-        return 1;
+        stats_add(STATS_DEVICE, slot, report_stats[r], 1);
+        /* A flaky cable garbles report after report; the statistics count
+         * them all, stderr only gets one now and then. */
+        if (r != REPORT_OUT_OF_RANGE &&
+            (!dev->report_error_shown ||
+             monotonic - dev->report_error_shown >= (int64_t)REPORT_ERROR_INTERVAL * 1000000000))
+        {
+            fprintf(stderr, "%s: %s (report %02hhx %02hhx %02hhx %02hhx %02hhx)\n",
+                dev->name, r == REPORT_BAD_FRAME ? "unexpected data from device" : "checksum error",
+                result[0], result[1], result[2], result[3], result[4]);
+            dev->report_error_shown = monotonic;
+        }
+        return;
     }
+    dev->data[record.code] = record.value;
+    dev->realtime[record.code] = timestamp;
+    dev->monotonic[record.code] = monotonic;
+
+    record.timestamp = timestamp;
+    record.monotonic = monotonic;
+    record.device = (uint8_t)(dev - devices);
+    output_push(&record);
+}
 
-    char filename[PATH_MAX];
-    snprintf(filename, PATH_MAX, "%s/%s", datadir, name);
+static void
+forget_device(struct device *dev)
+{
+    output_detach(dev - devices);
+    capture_write(realtime_ns(), CAPTURE_DETACH, dev - devices, NULL, 0);
+    dev->used = 0;
+}
 
-    int fd = open(filename, O_CREAT | O_WRONLY, 0666);
-    if (fd == -1)
+static void
+forget_all_devices()
+{
+    for (int i = 0; i < MAX_DEVICES; ++i)
     {
-        perror(filename);
-        return 0;
+        if (devices[i].used)
+        {
+            forget_device(&devices[i]);
+        }
     }
-
-    int result = write_data(fd, value);
-    close(fd);
-    return result;
 }
 
 static void
-write_heartbeat()
+close_device(struct device *dev)
 {
-    char buf[VALUE_MAX];
-    snprintf(buf, VALUE_MAX, "%lld", (long long)time(0));
-    write_value("heartbeat", buf);
+    co2mon_close_device(dev->hid);
+    dev->hid = NULL;
+    if (!dev->persistent)
+    {
+        forget_device(dev);
+    }
 }
 
 static void
-device_loop(co2mon_device dev)
+open_device(struct device *dev)
 {
-    co2mon_data_t magic_table = { 0 };
-    co2mon_data_t result;
+    if (dev->path[0])
+    {
+        dev->hid = co2mon_open_device_path(dev->path);
+    }
+    else
+    {
+        dev->hid = co2mon_open_device();
+    }
+
+    if (dev->hid == NULL)
+    {
+        if (!dev->error_shown)
+        {
+            fprintf(stderr, "Unable to open CO2 device%s%s\n", dev->path[0] ? " " : "", dev->path);
+            dev->error_shown = 1;
+        }
+        if (!dev->persistent)
+        {
+            forget_device(dev);
+        }
+        return;
+    }
+    dev->error_shown = 0;
+    if (dev->opened)
+    {
+        stats_add(STATS_DEVICE, (int)(dev - devices), STAT_RECONNECTS, 1);
+    }
+    dev->opened = 1;
 
-    if (!co2mon_send_magic_table(dev, magic_table))
+    memset(dev->magic_table, 0, sizeof(co2mon_data_t));
+    if (!co2mon_send_magic_table(dev->hid, dev->magic_table))
     {
         fprintf(stderr, "Unable to send magic table to CO2 device\n");
+        close_device(dev);
         return;
     }
+    dev->last_read = monotonic_time();
+}
 
+/* Reads everything the device has buffered. */
+static void
+drain_device(struct device *dev)
+{
+    co2mon_data_t result;
     while (1)
     {
-        int r = co2mon_read_data(dev, magic_table, result);
+        int r = co2mon_read_data_nonblock(dev->hid, dev->magic_table, result);
+        if (r == CO2MON_WOULD_BLOCK)
+        {
+            return;
+        }
         if (r <= 0)
         {
-            fprintf(stderr, "Error while reading data from device\n");
-            break;
+            fprintf(stderr, "Error while reading data from device: %s\n", co2mon_strerror(co2mon_last_error(dev->hid)));
+            close_device(dev);
+            return;
         }
+        dev->last_read = monotonic_time();
+        int64_t timestamp, monotonic;
+        co2mon_report_time(dev->hid, &timestamp, &monotonic);
+        if (capture_active())
+        {
+            co2mon_data_t raw;
+            co2mon_raw_report(dev->hid, raw);
+            capture_write(timestamp, CAPTURE_REPORT, dev - devices, raw, sizeof(raw));
+        }
+        process_report(dev, result, timestamp, monotonic);
+    }
+}
 
-        if (result[4] != 0x0d)
+/* Turns a serial number or a device path into a file name. */
+static void
+make_device_name(char *name, const char *s)
+{
+    size_t len = 0;
+    while (*s == '/')
+    {
+        ++s;
+    }
+    for (; *s && len < DEVNAME_MAX - 1; ++s)
+    {
+        char c = *s;
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '.'))
         {
-            fprintf(stderr, "Unexpected data from device (data[4] = %02hhx, want 0x0d)\n", result[4]);
-            continue;
+            c = '_';
         }
+        name[len++] = c;
+    }
+    name[len] = '\0';
+    if (name[0] == '.' || name[0] == '\0')
+    {
+        name[0] = '_';
+        name[len ? len : 1] = '\0';
+    }
+}
 
-        unsigned char r0, r1, r2, r3, checksum;
-        r0 = result[0];
-        r1 = result[1];
-        r2 = result[2];
-        r3 = result[3];
-        checksum = r0 + r1 + r2;
-        if (checksum != r3)
+static int
+device_name_used(const char *name)
+{
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (devices[i].used && strcmp(devices[i].name, name) == 0)
         {
-            fprintf(stderr, "checksum error (%02hhx, await %02hhx)\n", checksum, r3);
-            continue;
+            return 1;
         }
+    }
+    return 0;
+}
 
-        char buf[VALUE_MAX];
-        uint16_t w = (result[1] << 8) + result[2];
+static int
+device_path_used(const char *path)
+{
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (devices[i].used && strcmp(devices[i].path, path) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        switch (r0)
+static struct device *
+add_device(const char *path, const char *serial, int persistent)
+{
+    struct device *dev = NULL;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (!devices[i].used)
         {
-        case CODE_TAMB:
-            snprintf(buf, VALUE_MAX, "%.4f", decode_temperature(w));
+            dev = &devices[i];
+            break;
+        }
+    }
+    if (!dev)
+    {
+        fprintf(stderr, "Too many CO2 devices, ignoring %s\n", path);
+        return NULL;
+    }
 
-            if (!daemonize)
-            {
-                printf("Tamb\t%s\n", buf);
-                fflush(stdout);
-            }
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->path, PATH_MAX, "%s", path);
+    if (serial && serial[0])
+    {
+        make_device_name(dev->name, serial);
+    }
+    if (!dev->name[0] || device_name_used(dev->name))
+    {
+        make_device_name(dev->name, path);
+    }
+    dev->persistent = persistent;
+    dev->used = 1;
+    stats_reset((int)(dev - devices));
+    output_attach(dev - devices, dev->name);
+    capture_write(realtime_ns(), CAPTURE_ATTACH, dev - devices, dev->name, strlen(dev->name));
+    return dev;
+}
 
-            if (co2mon_data[r0] != w)
+static void
+scan_devices()
+{
+    struct co2mon_device_info *infos = co2mon_enumerate();
+    for (struct co2mon_device_info *info = infos; info; info = info->next)
+    {
+        if (!device_path_used(info->path))
+        {
+            struct device *dev = add_device(info->path, info->serial_number, 0);
+            if (dev)
             {
-                if (write_value("Tamb", buf))
-                {
-                    co2mon_data[r0] = w;
-                }
+                open_device(dev);
             }
+        }
+    }
+    co2mon_free_enumeration(infos);
+}
 
-            write_heartbeat();
+/* A whole number of seconds above 0, or 0 if arg is not one. */
+static int
+parse_period(const char *arg)
+{
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    return end != arg && *end == '\0' && seconds > 0 && seconds <= INT_MAX ? (int)seconds : 0;
+}
 
-            break;
-        case CODE_CNTR:
-            if ((unsigned)w > 3000) {
-                // Avoid reading spurious (uninitialized?) data
-                break;
-            }
-            snprintf(buf, VALUE_MAX, "%d", (int)w);
+/* Takes an option that is not part of struct config; only at startup. */
+static int
+set_startup_option(int option, const char *arg)
+{
+    /* Operands from the file do not outlive the line they were read from. */
+    char *copy = NULL;
+    if (arg && !(copy = strdup(arg)))
+    {
+        fprintf(stderr, "co2mond: out of memory\n");
+        return 0;
+    }
+    switch (option)
+    {
+    case 'a':
+        scan_all = 1;
+        return 1;
+    case 'd':
+        daemonize = 1;
+        return 1;
+    case 'x':
+        replay_fast = 1;
+        return 1;
+    case 'b':
+        batch_period = parse_period(copy);
+        free(copy);
+        return batch_period > 0;
+    case 'P':
+        replayfile = copy;
+        return 1;
+    case 'R':
+        capturefile = copy;
+        return 1;
+    case 'f':
+        if (ndevicefiles == MAX_DEVICES)
+        {
+            fprintf(stderr, "Too many devices, at most %d are supported\n", MAX_DEVICES);
+            free(copy);
+            return 0;
+        }
+        devicefiles[ndevicefiles++] = copy;
+        return 1;
+    case 'l':
+        logfile = copy;
+        return 1;
+    case 'p':
+        pidfile = copy;
+        return 1;
+    }
+    free(copy);
+    return 0;
+}
+
+static int
+set_option(void *arg, int option, const char *value)
+{
+    struct load *load = arg;
+    int r = config_set(load->config, option, value);
+    if (r >= 0)
+    {
+        return r;
+    }
+    if (load->restartlen < sizeof(load->restart))
+    {
+        int n = snprintf(load->restart + load->restartlen, sizeof(load->restart) - load->restartlen,
+                         "%c%s\n", option, value ? value : "");
+        load->restartlen += n > 0 ? (size_t)n : 0;
+    }
+    return load->startup ? set_startup_option(option, value) : 1;
+}
+
+/* Reads the configuration file, then the command line over it.  At
+ * startup this sets the other options too; on reload they are left as
+ * they are.  Returns NULL if something is wrong. */
+static struct config *
+load_config(int startup)
+{
+    struct config *config = malloc(sizeof(*config));
+    if (!config)
+    {
+        fprintf(stderr, "co2mond: out of memory\n");
+        return NULL;
+    }
+    config_init(config);
+    struct load load;
+    load.config = config;
+    load.startup = startup;
+    load.restart[0] = '\0';
+    load.restartlen = 0;
+
+    int ok = !configfile || config_read(configfile, set_option, &load);
+    for (int i = 0; ok && i < ncmdline; ++i)
+    {
+        if (!set_option(&load, cmdline[i].option, cmdline[i].arg))
+        {
+            fprintf(stderr, "Invalid %s: %s\n", config_key(cmdline[i].option), cmdline[i].arg);
+            ok = 0;
+        }
+    }
+    config->stdout_sink = !daemonize;
+    config->history_series = history_series;
+    if (!ok || !config_finish(config))
+    {
+        config_free(config);
+        free(config);
+        return NULL;
+    }
+
+    if (startup)
+    {
+        memcpy(restart_options, load.restart, sizeof(restart_options));
+    }
+    else if (strcmp(load.restart, restart_options) != 0)
+    {
+        fprintf(stderr, "Changes to devices, daemon, batch, capture, log and pid files take effect on restart\n");
+    }
+    return config;
+}
+
+/* Loads the configuration again once SIGHUP asked for it, and hands it to
+ * the output thread; the devices stay open all the while. */
+static void
+check_reload_request()
+{
+    if (!reload_requested)
+    {
+        return;
+    }
+    reload_requested = 0;
+    if (!configfile)
+    {
+        fprintf(stderr, "Not reloading: no configuration file (-c)\n");
+        return;
+    }
+    fprintf(stderr, "Reloading %s\n", configfile);
+    struct config *config = load_config(0);
+    if (!config)
+    {
+        fprintf(stderr, "Reload failed, keeping the previous configuration\n");
+        return;
+    }
+    output_reload(config);
+}
+
+/* Writes the statistics to the log once SIGUSR1 asked for them. */
+static void
+check_dump_request()
+{
+    if (!dump_requested)
+    {
+        return;
+    }
+    dump_requested = 0;
+    const char *names[MAX_DEVICES];
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        names[i] = devices[i].used ? devices[i].name : NULL;
+    }
+    stats_dump(stderr, names);
+}
 
-            if (!daemonize)
+/* Closes the open devices that ev is about, or if it does not say which,
+ * those that are no longer there. */
+static void
+unplug_devices(const struct co2mon_hotplug_event *ev)
+{
+    struct co2mon_device_info *infos = NULL;
+    int enumerated = 0;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct device *dev = &devices[i];
+        char path[PATH_MAX];
+        if (!dev->used || !dev->hid || !co2mon_device_path(dev->hid, path, sizeof(path)) || !co2mon_hotplug_covers(path))
+        {
+            continue;
+        }
+        int gone = co2mon_hotplug_match(ev, path);
+        if (gone < 0)
+        {
+            if (!enumerated)
             {
-                printf("CntR\t%s\n", buf);
-                fflush(stdout);
+                infos = co2mon_enumerate();
+                enumerated = 1;
             }
-
-            if (co2mon_data[r0] != w)
+            gone = 1;
+            for (struct co2mon_device_info *info = infos; info; info = info->next)
             {
-                if (write_value("CntR", buf))
+                if (strcmp(info->path, path) == 0)
                 {
-                    co2mon_data[r0] = w;
+                    gone = 0;
                 }
             }
+        }
+        if (gone)
+        {
+            fprintf(stderr, "CO2 device %s unplugged\n", path);
+            close_device(dev);
+        }
+    }
+    co2mon_free_enumeration(infos);
+}
 
-            write_heartbeat();
+/* Takes all pending hotplug events, returns 1 if there were any. */
+static int
+handle_hotplug(co2mon_hotplug hotplug)
+{
+    int seen = 0;
+    struct co2mon_hotplug_event ev;
+    while (co2mon_hotplug_read(hotplug, &ev) > 0)
+    {
+        if (ev.action == CO2MON_HOTPLUG_LEFT)
+        {
+            unplug_devices(&ev);
+        }
+        seen = 1;
+    }
+    return seen;
+}
 
-            break;
-        default:
-            if (print_unknown && !daemonize)
-            {
-                printf("0x%02hhx\t%d\n", r0, (int)w);
-                fflush(stdout);
-            }
-            co2mon_data[r0] = w;
+/* Whether maintain_devices() still has to run every second, rather than
+ * only after hotplug events. */
+static int
+needs_maintenance(co2mon_hotplug hotplug, time_t now, time_t settle_until)
+{
+    if (!hotplug || now < settle_until)
+    {
+        return 1;
+    }
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct device *dev = &devices[i];
+        /* Open devices are watched for READ_TIMEOUT; others that no event
+         * will announce have to be retried. */
+        if (dev->used && (dev->hid || !co2mon_hotplug_covers(dev->path)))
+        {
+            return 1;
         }
     }
+    return 0;
 }
 
-static co2mon_device
-open_device()
+/* When maintain_devices() runs next: in a second, or with batches at the
+ * next batch boundary, when the output thread wakes up too. */
+static time_t
+next_maintenance_time(time_t now)
+{
+    return batch_period ? (now / batch_period + 1) * batch_period : now + 1;
+}
+
+/* Milliseconds until then, -1 for none. */
+static int
+maintenance_timeout(time_t next)
+{
+    if (next < 0)
+    {
+        return -1;
+    }
+    if (!batch_period)
+    {
+        return 1000;
+    }
+    int64_t left = (int64_t)next * 1000 - monotonic_ns() / 1000000;
+    return left > 0 ? (int)left : 0;
+}
+
+/* Reopens lost devices, looks for new ones and gives up on silent ones. */
+static void
+maintain_devices(time_t now)
 {
-    if (devicefile)
+    for (int i = 0; i < MAX_DEVICES; ++i)
     {
-        return co2mon_open_device_path(devicefile);
+        struct device *dev = &devices[i];
+        if (!dev->used)
+        {
+            continue;
+        }
+        if (dev->hid && now - dev->last_read >= READ_TIMEOUT)
+        {
+            stats_add(STATS_DEVICE, i, STAT_TIMEOUTS, 1);
+            fprintf(stderr, "Error while reading data from device\n");
+            close_device(dev);
+        }
+        if (dev->used && !dev->hid)
+        {
+            open_device(dev);
+        }
+    }
+
+    if (scan_all)
+    {
+        scan_devices();
     }
-    return co2mon_open_device();
+    capture_flush();
 }
 
 static void
 main_loop()
 {
-    int error_shown = 0;
-    while (1)
+    if (!multi_device)
     {
-        co2mon_device dev = open_device();
-        if (dev == NULL)
+        add_device(ndevicefiles ? devicefiles[0] : "", NULL, 1);
+    }
+    for (int i = 0; multi_device && i < ndevicefiles; ++i)
+    {
+        add_device(devicefiles[i], NULL, 1);
+    }
+
+    /* With hotplug events, nothing needs to wake up while no sensor is
+     * there; otherwise look for one every second. */
+    co2mon_hotplug hotplug = co2mon_hotplug_open();
+    time_t settle_until = 0;
+    time_t next_maintenance = 0; /* -1 for none until the next event */
+    while (!stop)
+    {
+        time_t now = monotonic_time();
+        if (next_maintenance >= 0 && now >= next_maintenance)
         {
-            if (!error_shown)
+            maintain_devices(now);
+            next_maintenance = needs_maintenance(hotplug, now, settle_until) ? next_maintenance_time(now) : -1;
+        }
+
+        co2mon_device hids[MAX_DEVICES];
+        struct device *open[MAX_DEVICES];
+        int ready[MAX_DEVICES];
+        int n = 0;
+        for (int i = 0; i < MAX_DEVICES; ++i)
+        {
+            if (devices[i].used && devices[i].hid)
             {
-                fprintf(stderr, "Unable to open CO2 device\n");
-                error_shown = 1;
+                hids[n] = devices[i].hid;
+                open[n++] = &devices[i];
             }
+        }
+
+        struct pollfd pfd;
+        pfd.fd = hotplug ? co2mon_hotplug_fd(hotplug) : -1;
+        pfd.events = POLLIN;
+        int r = co2mon_poll_fds(hids, ready, n, &pfd, hotplug ? 1 : 0, maintenance_timeout(next_maintenance));
+        check_dump_request();
+        check_reload_request();
+        if (r < 0 && errno != EINTR)
+        {
             sleep(1);
             continue;
         }
+        for (int i = 0; r > 0 && i < n; ++i)
+        {
+            if (ready[i])
+            {
+                drain_device(open[i]);
+            }
+        }
+        if (r > 0 && hotplug && pfd.revents && handle_hotplug(hotplug))
+        {
+            /* Right away, and a few more times while udev sets up the
+             * device node. */
+            settle_until = monotonic_time() + HOTPLUG_SETTLE;
+            next_maintenance = 0;
+        }
+    }
+
+    if (hotplug)
+    {
+        co2mon_hotplug_close(hotplug);
+    }
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (devices[i].used && devices[i].hid)
+        {
+            close_device(&devices[i]);
+        }
+    }
+    forget_all_devices();
+}
+
+/* Sleeps until the replay clock reaches a record captured at timestamp. */
+static void
+replay_wait(int64_t timestamp, int64_t first, const struct timespec *start)
+{
+    int64_t offset = timestamp - first;
+    if (offset <= 0)
+    {
+        return;
+    }
+    struct timespec until = *start;
+    until.tv_sec += offset / 1000000000;
+    until.tv_nsec += offset % 1000000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+    }
+    while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    {
+        check_dump_request();
+        check_reload_request();
+    }
+}
+
+/* Feeds a capture through process_report() as if the devices were there,
+ * keeping the original timestamps. */
+static void
+replay_loop(struct capture_map *map)
+{
+    const struct capture_record *record;
+    const unsigned char *payload;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t first = -1;
+    unsigned long reports = 0;
+
+    while (!stop && capture_next(map, &record, &payload))
+    {
+        check_dump_request();
+        check_reload_request();
+        struct device *dev = &devices[record->device % MAX_DEVICES];
+        if (first < 0)
+        {
+            first = record->timestamp;
+        }
+        if (replay_fast)
+        {
+            /* Unlike a sensor, a file can wait: do not let the ring drop. */
+            while (output_backlog() >= OUTPUT_RING_SIZE)
+            {
+                sched_yield();
+            }
+        }
         else
         {
-            error_shown = 0;
+            replay_wait(record->timestamp, first, &start);
+        }
+
+        switch (record->type)
+        {
+        case CAPTURE_ATTACH:
+            if (dev->used)
+            {
+                forget_device(dev);
+            }
+            memset(dev, 0, sizeof(*dev));
+            snprintf(dev->name, DEVNAME_MAX, "%.*s", (int)record->length, (const char *)payload);
+            dev->used = 1;
+            stats_reset((int)(dev - devices));
+            output_attach(dev - devices, dev->name);
+            break;
+        case CAPTURE_DETACH:
+            if (dev->used)
+            {
+                forget_device(dev);
+            }
+            break;
+        case CAPTURE_REPORT:
+            if (dev->used && record->length == sizeof(co2mon_data_t))
+            {
+                co2mon_data_t result;
+                co2mon_decode(&dev->decoder, payload, map->header->magic_table, result);
+                process_report(dev, result, record->timestamp, monotonic_ns());
+                ++reports;
+            }
+            break;
         }
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Replayed %lu reports in %.3f s\n", reports, elapsed);
 
-        device_loop(dev);
+    forget_all_devices();
+}
 
-        co2mon_close_device(dev);
+/* With batches nothing needs to wake up on time to the millisecond, so
+ * let the kernel fold the timeouts of both threads, which the output
+ * thread inherits, into other wakeups: 5% of the batch period. */
+static void
+set_timer_slack()
+{
+#ifdef __linux__
+    if (batch_period && prctl(PR_SET_TIMERSLACK, (unsigned long)batch_period * 50000000UL, 0, 0, 0) != 0)
+    {
+        perror("prctl");
     }
+#endif
 }
 
-int main(int argc, char *argv[])
+static void
+handle_signal(int signum)
 {
-    char *reldatadir = 0;
-    char *pidfile = 0;
-    char *logfile = 0;
+    if (signum == SIGUSR1)
+    {
+        dump_requested = 1;
+        return;
+    }
+    if (signum == SIGHUP)
+    {
+        reload_requested = 1;
+        return;
+    }
+    stop = 1;
+}
 
+int main(int argc, char *argv[])
+{
     int c;
     int opterr = 0;
     int show_help = 0;
-    while ((c = getopt(argc, argv, ":dhuD:f:l:p:")) != -1)
+    if (!init_metrics())
+    {
+        exit(1);
+    }
+    if (!(cmdline = calloc((size_t)argc, sizeof(*cmdline))))
+    {
+        fprintf(stderr, "co2mond: out of memory\n");
+        exit(1);
+    }
+    while ((c = getopt(argc, argv, ":adhuxALB:C:D:F:H:M:P:R:S:T:U:W:Y:Z:b:c:f:l:m:p:r:")) != -1)
     {
         switch (c)
         {
-        case 'd':
-            daemonize = 1;
-            break;
         case 'h':
             show_help = 1;
             break;
-        case 'u':
-            print_unknown = 1;
-            break;
-        case 'D':
-            reldatadir = optarg;
-            break;
-        case 'f':
-            devicefile = optarg;
-            break;
-        case 'l':
-            logfile = optarg;
-            break;
-        case 'p':
-            pidfile = optarg;
+        case 'c':
+            configfile = optarg;
             break;
         case ':':
             fprintf(stderr, "Option -%c requires an operand\n", optopt);
@@ -304,45 +969,146 @@ int main(int argc, char *argv[])
         case '?':
             fprintf(stderr, "Unrecognized option: -%c\n", optopt);
             opterr++;
+            break;
+        default:
+            cmdline[ncmdline].option = c;
+            cmdline[ncmdline++].arg = optarg;
         }
     }
     if (show_help || opterr || optind != argc)
     {
-        fprintf(stderr, "usage: co2mond [-dhu] [-D datadir] [-f device] [-p pidfle] [-l logfile]\n");
+        fprintf(stderr, "usage: co2mond [-adhuxAL] [-B seconds] [-C rrdcached] [-D datadir] [-F filter]... [-H [addr]:port] [-M snapshot] [-P capture] [-R capture] [-S socket] [-T budget] [-U collector] [-W window]... [-Y archivedir] [-Z persistdir] [-b seconds] [-c config] [-f device]... [-p pidfle] [-l logfile] [-m broker] [-r rrdfile]\n");
         if (show_help)
         {
             fprintf(stderr, "\n");
+            fprintf(stderr, "  -a    serve all attached sensors\n");
             fprintf(stderr, "  -d    run as a daemon\n");
             fprintf(stderr, "  -h    show this help message\n");
             fprintf(stderr, "  -u    print values for unknown items\n");
+            fprintf(stderr, "  -x    replay as fast as possible instead of in real time\n");
+            fprintf(stderr, "  -A    replace datadir files with rename() instead of rewriting them\n");
+            fprintf(stderr, "  -L    do not lock datadir files while writing them\n");
+            fprintf(stderr, "  -B seconds\n");
+            fprintf(stderr, "        write the heartbeat file at most every so many seconds\n");
+            fprintf(stderr, "  -C address\n");
+            fprintf(stderr, "        send RRD updates through rrdcached at address\n");
+            fprintf(stderr, "        (RRDCACHED_ADDRESS by default)\n");
             fprintf(stderr, "  -D datadir\n");
             fprintf(stderr, "        store values from the sensor in datadir\n");
+            fprintf(stderr, "        (in datadir/<serial or path> when serving several sensors)\n");
+            fprintf(stderr, "  -F metric:deadband[:interval]\n");
+            fprintf(stderr, "        write a metric to datadir only when it changes by at least\n");
+            fprintf(stderr, "        deadband, and at most every interval seconds (e.g., CntR:5:30)\n");
+            fprintf(stderr, "  -H [addr]:port\n");
+            fprintf(stderr, "        serve Prometheus metrics at http://addr:port/metrics\n");
+            fprintf(stderr, "  -M snapshot\n");
+            fprintf(stderr, "        publish the latest values in a memory-mapped file\n");
+            fprintf(stderr, "        (e.g., /dev/shm/co2mon), see co2mon_shm.h\n");
+            fprintf(stderr, "  -P capturefile\n");
+            fprintf(stderr, "        replay reports from capturefile instead of reading sensors\n");
+            fprintf(stderr, "  -R capturefile\n");
+            fprintf(stderr, "        append every raw report to capturefile\n");
+            fprintf(stderr, "  -S socket\n");
+            fprintf(stderr, "        stream records to clients of a Unix socket, see stream.h\n");
+            fprintf(stderr, "  -T bytes\n");
+            fprintf(stderr, "        keep up to so much history for -H and -S (e.g., 512K, 0 for none)\n");
+            fprintf(stderr, "        1M by default, see history.h\n");
+            fprintf(stderr, "  -U host[:port]\n");
+            fprintf(stderr, "        send every record to co2mon-collector (port %s by default)\n", CO2MON_UDP_PORT);
+            fprintf(stderr, "  -W metric:seconds[:percentile]\n");
+            fprintf(stderr, "        publish the EWMA, minimum, maximum and a percentile (95 by\n");
+            fprintf(stderr, "        default) of a metric over a sliding window, up to %d times\n", ROLLING_MAX_WINDOWS);
+            fprintf(stderr, "        per metric (e.g., CntR:300 -W CntR:3600:95)\n");
+            fprintf(stderr, "  -Y archivedir\n");
+            fprintf(stderr, "        keep CntR and Tamb in daily archive segments in archivedir\n");
+            fprintf(stderr, "        (in archivedir/<serial or path> when serving several sensors)\n");
+            fprintf(stderr, "  -Z persistdir[:seconds]\n");
+            fprintf(stderr, "        for a datadir and archivedir on a tmpfs: copy what changed in them\n");
+            fprintf(stderr, "        to persistdir/<their names> every so many seconds (600 by default)\n");
+            fprintf(stderr, "        and on exit, and bring back what is missing on startup\n");
+            fprintf(stderr, "  -b seconds\n");
+            fprintf(stderr, "        low-power mode: hand the values to the outputs in one batch every\n");
+            fprintf(stderr, "        so many seconds, on multiples of them, instead of one by one\n");
+            fprintf(stderr, "  -c configfile\n");
+            fprintf(stderr, "        read options from configfile, one per line by their long names\n");
+            fprintf(stderr, "        (see co2mond.conf.example); the command line overrides it, and\n");
+            fprintf(stderr, "        SIGHUP reloads the outputs and filters without closing the sensors\n");
             fprintf(stderr, "  -f devicefile\n");
 #ifdef __linux__
             fprintf(stderr, "        path to a device (e.g., /dev/hidraw0)\n");
 #else
             fprintf(stderr, "        path to a device\n");
 #endif
+            fprintf(stderr, "        may be given several times to serve several sensors\n");
             fprintf(stderr, "  -p pidfile\n");
             fprintf(stderr, "        write PID to a file named pidfile\n");
             fprintf(stderr, "  -l logfile\n");
             fprintf(stderr, "        write diagnostic information to a file named logfile\n");
+            fprintf(stderr, "  -m host[:port][/prefix][,qos=0|1][,id=client]\n");
+            fprintf(stderr, "        publish retained values to an MQTT broker on prefix/item\n");
+            fprintf(stderr, "        (prefix/<serial or path>/item when serving several sensors)\n");
+            fprintf(stderr, "  -r rrdfile\n");
+            fprintf(stderr, "        store values in a round-robin database, created if missing\n");
+            fprintf(stderr, "        (in rrdfile/<serial or path>.rrd when serving several sensors)\n");
             fprintf(stderr, "\n");
         }
         exit(1);
     }
-    if (daemonize && !reldatadir)
+    /* Found again on reload, after daemon() changed the directory. */
+    if (configfile)
+    {
+        const char *relconfigfile = configfile;
+        if (!(configfile = realpath(relconfigfile, NULL)))
+        {
+            perror(relconfigfile);
+            exit(1);
+        }
+    }
+    struct config *config = load_config(1);
+    if (!config)
+    {
+        exit(1);
+    }
+    if (daemonize && !config->datadir && !config->snapshotfile && !config->httpspec && !config->mqttspec &&
+        !config->udpspec && !config->socketfile && !config->archivedir && !config->rrdfile)
+    {
+        fprintf(stderr, "co2mond: it is useless to use -d without -D, -H, -M, -S, -U, -Y, -m or -r.\n");
+        exit(1);
+    }
+
+    multi_device = scan_all || ndevicefiles > 1;
+
+    struct capture_map replay;
+    if (replayfile)
+    {
+        if (scan_all || ndevicefiles || capturefile)
+        {
+            fprintf(stderr, "co2mond: -P cannot be used with -a, -f or -R.\n");
+            exit(1);
+        }
+        if (!capture_map_open(&replay, replayfile))
+        {
+            exit(1);
+        }
+        multi_device = (replay.header->flags & CAPTURE_MULTI_DEVICE) != 0;
+    }
+
+    /* Plan the history for the sensors given, or a few when looking for
+     * all. */
+    history_series = (scan_all || (replayfile && multi_device) ? 4 : ndevicefiles > 1 ? ndevicefiles : 1) * NMETRICS;
+    config->history_series = history_series;
+    struct sink *sinks;
+    if (!config_sinks(config, NULL, NULL, &sinks))
     {
-        fprintf(stderr, "co2mond: it is useless to use -d without -D.\n");
         exit(1);
     }
+    config_apply(config);
 
-    if (reldatadir)
+    if (capturefile)
     {
-        datadir = realpath(reldatadir, NULL);
-        if (datadir == NULL)
+        const co2mon_data_t magic_table = { 0 };
+        if (!capture_open(capturefile, magic_table, multi_device ? CAPTURE_MULTI_DEVICE : 0))
         {
-            perror(reldatadir);
             exit(1);
         }
     }
@@ -394,19 +1160,43 @@ int main(int argc, char *argv[])
         close(logfd);
     }
 
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    /* Network clients that go away must not kill the daemon. */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
     int r = co2mon_init();
     if (r < 0)
     {
         return r;
     }
 
-    main_loop();
-
-    co2mon_exit();
+    set_timer_slack();
+    if (!output_start(sinks, config, batch_period))
+    {
+        exit(1);
+    }
 
-    if (datadir)
+    if (replayfile)
     {
-        free(datadir);
+        replay_loop(&replay);
+        capture_map_close(&replay);
     }
-    return 1;
+    else
+    {
+        main_loop();
+        capture_close();
+    }
+
+    output_stop();
+
+    co2mon_exit();
+    return 0;
 }
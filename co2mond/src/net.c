@@ -0,0 +1,313 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "net.h"
+
+#define LISTEN_BACKLOG 16
+
+int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        return 0;
+    }
+    return 1;
+}
+
+/* Splits spec into host (NULL for any) and port. */
+static int
+split_host_port(const char *spec, char *host, size_t hostlen, const char **port)
+{
+    const char *colon;
+    const char *start = spec;
+    size_t len;
+    if (spec[0] == '[')
+    {
+        const char *close = strchr(spec, ']');
+        if (!close || close[1] != ':')
+        {
+            return 0;
+        }
+        start = spec + 1;
+        len = (size_t)(close - start);
+        colon = close + 1;
+    }
+    else
+    {
+        colon = strrchr(spec, ':');
+        if (!colon)
+        {
+            return 0;
+        }
+        len = (size_t)(colon - spec);
+    }
+    if (len >= hostlen || colon[1] == '\0')
+    {
+        return 0;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+    *port = colon + 1;
+    return 1;
+}
+
+int
+net_listen_tcp(const char *spec)
+{
+    char host[256];
+    const char *port;
+    if (!split_host_port(spec, host, sizeof(host), &port))
+    {
+        fprintf(stderr, "%s: expected host:port\n", spec);
+        return -1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *res;
+    int r = getaddrinfo(host[0] && strcmp(host, "*") != 0 ? host : NULL, port, &hints, &res);
+    if (r != 0)
+    {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, LISTEN_BACKLOG) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+    {
+        perror(spec);
+        return -1;
+    }
+    if (!set_nonblocking(fd))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+net_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, LISTEN_BACKLOG) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (!set_nonblocking(fd))
+    {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+int
+net_accept(int listenfd)
+{
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (!set_nonblocking(fd))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+net_connect_tcp(const char *host, const char *port, int report)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    int r = getaddrinfo(host, port, &hints, &res);
+    if (r != 0)
+    {
+        if (report)
+        {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(r));
+        }
+        return -1;
+    }
+
+    int fd = -1;
+    int error = 0;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            error = errno;
+            continue;
+        }
+        if (set_nonblocking(fd) && (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS))
+        {
+            break;
+        }
+        error = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1 && report)
+    {
+        fprintf(stderr, "%s:%s: %s\n", host, port, strerror(error));
+    }
+    return fd;
+}
+
+static int
+udp_socket(const char *spec, const char *host, const char *port, int passive)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo *res;
+    int r = getaddrinfo(host, port, &hints, &res);
+    if (r != 0)
+    {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if ((passive ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen)) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+    {
+        perror(spec);
+        return -1;
+    }
+    if (!set_nonblocking(fd))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+net_connect_udp(const char *spec, const char *default_port)
+{
+    char host[256];
+    const char *port;
+    if (!split_host_port(spec, host, sizeof(host), &port))
+    {
+        if (strlen(spec) >= sizeof(host) || spec[0] == '[')
+        {
+            fprintf(stderr, "%s: expected host[:port]\n", spec);
+            return -1;
+        }
+        strcpy(host, spec);
+        port = default_port;
+    }
+    return udp_socket(spec, host, port, 0);
+}
+
+int
+net_listen_udp(const char *spec)
+{
+    char host[256];
+    const char *port;
+    if (!split_host_port(spec, host, sizeof(host), &port))
+    {
+        fprintf(stderr, "%s: expected host:port\n", spec);
+        return -1;
+    }
+    return udp_socket(spec, host[0] && strcmp(host, "*") != 0 ? host : NULL, port, 1);
+}
@@ -0,0 +1,55 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CO2MOND_NET_H_INCLUDED_
+#define CO2MOND_NET_H_INCLUDED_
+
+/*
+ * Socket helpers for the network sinks.  All descriptors are returned
+ * non-blocking and close-on-exec; errors are reported on stderr.
+ */
+
+extern int
+set_nonblocking(int fd);
+
+/* Listens on "host:port", "[host]:port" or ":port" (all addresses). */
+extern int
+net_listen_tcp(const char *spec);
+
+/* Listens on a Unix domain socket, replacing a stale socket file. */
+extern int
+net_listen_unix(const char *path);
+
+extern int
+net_accept(int listenfd);
+
+/* Starts connecting to host:port; the connection is established once the
+ * descriptor is writable and SO_ERROR is 0.  Errors go to stderr only if
+ * report is set. */
+extern int
+net_connect_tcp(const char *host, const char *port, int report);
+
+/* A UDP socket connected to "host[:port]" or "[host]:port". */
+extern int
+net_connect_udp(const char *spec, const char *default_port);
+
+/* A UDP socket bound to "host:port", "[host]:port" or ":port". */
+extern int
+net_listen_udp(const char *spec);
+
+#endif
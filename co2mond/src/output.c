@@ -0,0 +1,699 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "coalesce.h"
+#include "config.h"
+#include "output.h"
+#include "ring.h"
+#include "stats.h"
+
+#define STATS_INTERVAL 3600 /* seconds between reports on suppressed output */
+#define MAX_SINKS 32
+
+#define CONTROL_ATTACH 0
+#define CONTROL_DETACH 1
+#define CONTROL_STOP 2
+#define CONTROL_RELOAD 3
+
+/* Attach, detach, reload and stop requests.  Each one is tagged with the
+ * ring position it was issued at, so it takes effect between the same
+ * records the reader saw it between, even if some of them were dropped. */
+struct control
+{
+    uint64_t pos;
+    int type;
+    struct source *source;
+    struct config *config;
+    struct control *next;
+};
+
+static struct ring ring;
+static struct sink *sinks;
+static struct config *config; /* what the sinks were made from, NULL if unknown */
+static struct source *sources[MAX_DEVICES];
+static struct rolling *rolling[MAX_DEVICES]; /* NMETRICS each, NULL without windows */
+static pthread_t thread;
+static int batch;          /* seconds between batches, 0 to take every record at once */
+static int timerfd = -1;   /* expires at the batch boundaries */
+static unsigned long wakeups;
+
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct control *controls = NULL;
+static struct control **controls_tail = &controls;
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Microseconds from then until now, both on CLOCK_MONOTONIC. */
+static uint64_t
+elapsed_us(int64_t then, int64_t now)
+{
+    return now > then ? (uint64_t)(now - then) / 1000 : 0;
+}
+
+static void
+report_stats()
+{
+    unsigned long dropped = ring_dropped(&ring);
+    if (coalesce_suppressed || dropped)
+    {
+        fprintf(stderr, "%lu datadir writes done, %lu suppressed, %lu records dropped\n",
+            datadir_writes, coalesce_suppressed, dropped);
+    }
+}
+
+static void
+free_config(struct config *c)
+{
+    if (c)
+    {
+        config_free(c);
+        free(c);
+    }
+}
+
+static void
+send_control(int type, struct source *source, struct config *c)
+{
+    struct control *control = calloc(1, sizeof(*control));
+    if (!control)
+    {
+        fprintf(stderr, "output: out of memory\n");
+        free(source);
+        free_config(c);
+        return;
+    }
+    control->type = type;
+    control->source = source;
+    control->config = c;
+
+    pthread_mutex_lock(&control_mutex);
+    control->pos = ring_head(&ring);
+    *controls_tail = control;
+    controls_tail = &control->next;
+    pthread_mutex_unlock(&control_mutex);
+
+    ring_wake(&ring);
+}
+
+static void
+start_rolling(int slot)
+{
+    int windows = 0;
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        windows += metrics[i].rolling.nwindows;
+    }
+    if (!windows || (!rolling[slot] && !(rolling[slot] = malloc(NMETRICS * sizeof(struct rolling)))))
+    {
+        return;
+    }
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        rolling_init(&rolling[slot][i], &metrics[i].rolling, metrics[i].code);
+    }
+}
+
+static void
+stop_rolling(int slot)
+{
+    free(rolling[slot]);
+    rolling[slot] = NULL;
+}
+
+static int
+same_windows(const struct rolling_config *a, const struct rolling_config *b)
+{
+    if (a->nwindows != b->nwindows)
+    {
+        return 0;
+    }
+    for (int i = 0; i < a->nwindows; ++i)
+    {
+        if (a->windows[i].seconds != b->windows[i].seconds || a->windows[i].percentile != b->windows[i].percentile)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+name_sinks()
+{
+    for (struct sink *sink = sinks; sink; sink = sink->next)
+    {
+        sink->latency = stats_sink_latency(sink->name ? sink->name : "unnamed");
+    }
+}
+
+static void
+detach_all(struct sink *sink)
+{
+    if (!sink->detach)
+    {
+        return;
+    }
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (sources[i])
+        {
+            sink->detach(sink, sources[i]);
+        }
+    }
+}
+
+/*
+ * Swaps in the sinks and metric settings of a new configuration between
+ * two records.  Sinks whose settings are the same carry on with their
+ * state and connections; the others get every record up to here, are
+ * flushed and destroyed, and new ones are attached to the open devices.
+ * Rolling statistics only start over for metrics whose windows changed.
+ */
+static void
+reload(struct config *next)
+{
+    struct sink *old[MAX_SINKS];
+    int nold = 0;
+    for (struct sink *sink = sinks; sink && nold < MAX_SINKS; sink = sink->next)
+    {
+        old[nold++] = sink;
+    }
+
+    struct sink *retired = sinks;
+    struct sink *list;
+    if (!config || !config_sinks(next, config, &retired, &list))
+    {
+        fprintf(stderr, "Reload failed, keeping the previous configuration\n");
+        free_config(next);
+        return;
+    }
+    while (retired)
+    {
+        struct sink *following = retired->next;
+        detach_all(retired);
+        if (retired->flush)
+        {
+            retired->flush(retired);
+        }
+        retired->destroy(retired);
+        retired = following;
+    }
+
+    sinks = list;
+    for (struct sink *sink = sinks; sink; sink = sink->next)
+    {
+        int kept = 0;
+        for (int i = 0; i < nold; ++i)
+        {
+            kept |= old[i] == sink;
+        }
+        for (int i = 0; !kept && sink->attach && i < MAX_DEVICES; ++i)
+        {
+            if (sources[i])
+            {
+                sink->attach(sink, sources[i]);
+            }
+        }
+    }
+    name_sinks();
+
+    struct rolling_config before[NMETRICS];
+    int windows = 0;
+    for (int m = 0; m < NMETRICS; ++m)
+    {
+        before[m] = metrics[m].rolling;
+    }
+    config_apply(next);
+    for (int m = 0; m < NMETRICS; ++m)
+    {
+        windows += metrics[m].rolling.nwindows;
+    }
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (!sources[i])
+        {
+            continue;
+        }
+        if (!windows || !rolling[i])
+        {
+            stop_rolling(i);
+            start_rolling(i);
+            continue;
+        }
+        for (int m = 0; m < NMETRICS; ++m)
+        {
+            if (!same_windows(&before[m], &metrics[m].rolling))
+            {
+                rolling_init(&rolling[i][m], &metrics[m].rolling, metrics[m].code);
+            }
+        }
+    }
+
+    free_config(config);
+    config = next;
+    fprintf(stderr, "Configuration reloaded\n");
+}
+
+/* Applies the controls issued before position pos; returns 0 on stop. */
+static int
+apply_controls(uint64_t pos)
+{
+    int running = 1;
+    while (1)
+    {
+        pthread_mutex_lock(&control_mutex);
+        struct control *control = controls;
+        if (control && control->pos <= pos)
+        {
+            controls = control->next;
+            if (!controls)
+            {
+                controls_tail = &controls;
+            }
+        }
+        else
+        {
+            control = NULL;
+        }
+        pthread_mutex_unlock(&control_mutex);
+
+        if (!control)
+        {
+            return running;
+        }
+
+        struct source *source = control->source;
+        switch (control->type)
+        {
+        case CONTROL_ATTACH:
+            free(sources[source->slot]);
+            sources[source->slot] = source;
+            start_rolling(source->slot);
+            for (struct sink *sink = sinks; sink; sink = sink->next)
+            {
+                if (sink->attach)
+                {
+                    sink->attach(sink, source);
+                }
+            }
+            break;
+        case CONTROL_DETACH:
+            source = sources[source->slot];
+            free(control->source);
+            if (source)
+            {
+                for (struct sink *sink = sinks; sink; sink = sink->next)
+                {
+                    if (sink->detach)
+                    {
+                        sink->detach(sink, source);
+                    }
+                }
+                sources[source->slot] = NULL;
+                stop_rolling(source->slot);
+                free(source);
+            }
+            break;
+        case CONTROL_RELOAD:
+            reload(control->config);
+            break;
+        case CONTROL_STOP:
+            running = 0;
+            break;
+        }
+        free(control);
+    }
+}
+
+static void
+dispatch(const struct record *record)
+{
+    const struct source *source = record->device < MAX_DEVICES ? sources[record->device] : NULL;
+    if (!source)
+    {
+        return;
+    }
+    int64_t start = monotonic_ns();
+    histogram_add(&publish_latency, elapsed_us(record->monotonic, start));
+
+    struct rolling_values values;
+    int metric = metric_of[record->code];
+    int has_values = 0;
+    if (rolling[source->slot] && metric != -1 && metrics[metric].rolling.nwindows)
+    {
+        double value = co2mon_item_value(record->code, record->value);
+        rolling_add(&rolling[source->slot][metric], value, record->monotonic, record->timestamp, &values);
+        has_values = 1;
+    }
+
+    for (struct sink *sink = sinks; sink; sink = sink->next)
+    {
+        sink->publish(sink, source, record);
+        if (has_values && sink->publish_stats)
+        {
+            sink->publish_stats(sink, source, &values);
+        }
+        int64_t end = monotonic_ns();
+        if (sink->latency)
+        {
+            histogram_add(sink->latency, elapsed_us(start, end));
+        }
+        start = end;
+    }
+}
+
+static void
+flush_sinks()
+{
+    for (struct sink *sink = sinks; sink; sink = sink->next)
+    {
+        if (sink->flush)
+        {
+            sink->flush(sink);
+        }
+    }
+}
+
+static void
+tick_sinks(time_t now)
+{
+    for (struct sink *sink = sinks; sink; sink = sink->next)
+    {
+        if (sink->tick)
+        {
+            sink->tick(sink, now);
+        }
+    }
+}
+
+/*
+ * Batches start on multiples of the period on CLOCK_MONOTONIC, the same
+ * instants the reader does its maintenance at, so that the two threads
+ * (and other timers aligned the same way) wake up together.
+ */
+static void
+start_batch_timer()
+{
+#ifdef __linux__
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1)
+    {
+        perror("timerfd_create");
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (monotonic_time() / batch + 1) * batch;
+    spec.it_interval.tv_sec = batch;
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+    {
+        perror("timerfd_settime");
+        close(timerfd);
+        timerfd = -1;
+    }
+#endif
+}
+
+/* Milliseconds to sleep for at most. */
+static int
+wait_timeout()
+{
+    if (!batch)
+    {
+        return 1000;
+    }
+    if (timerfd != -1)
+    {
+        return -1;
+    }
+    int64_t period = (int64_t)batch * 1000000000;
+    int64_t now = monotonic_ns();
+    return (int)((period - now % period) / 1000000) + 1;
+}
+
+static void
+wait_sinks(int timeout)
+{
+    struct pollfd fds[RING_MAX_POLLFDS];
+    int counts[MAX_SINKS];
+    int nfds = 0;
+    int nsinks = 0;
+    for (struct sink *sink = sinks; sink && nsinks < MAX_SINKS; sink = sink->next, ++nsinks)
+    {
+        counts[nsinks] = sink->pollfds ? sink->pollfds(sink, fds + nfds, RING_MAX_POLLFDS - nfds - 1) : 0;
+        nfds += counts[nsinks];
+    }
+    if (timerfd != -1)
+    {
+        fds[nfds].fd = timerfd;
+        fds[nfds].events = POLLIN;
+    }
+
+    ring_wait(&ring, timeout, fds, nfds + (timerfd != -1));
+    __atomic_fetch_add(&wakeups, 1, __ATOMIC_RELAXED);
+    if (timerfd != -1 && fds[nfds].revents)
+    {
+        uint64_t expirations;
+        if (read(timerfd, &expirations, sizeof(expirations)) < 0)
+        {
+            /* Already read, or not expired after all. */
+        }
+    }
+
+    nfds = 0;
+    nsinks = 0;
+    for (struct sink *sink = sinks; sink && nsinks < MAX_SINKS; sink = sink->next, ++nsinks)
+    {
+        if (counts[nsinks] > 0)
+        {
+            sink->handle(sink, fds + nfds, counts[nsinks]);
+        }
+        nfds += counts[nsinks];
+    }
+}
+
+static void *
+output_thread(void *arg)
+{
+    (void)arg;
+    time_t next_tick = 0;
+    time_t next_stats = monotonic_time() + STATS_INTERVAL;
+    int running = 1;
+    while (running)
+    {
+        struct record record;
+        uint64_t pos;
+        int n = 0;
+        while (running && ring_pop(&ring, &record, &pos))
+        {
+            running = apply_controls(pos);
+            dispatch(&record);
+            ++n;
+        }
+        if (running)
+        {
+            running = apply_controls(ring_tail(&ring));
+        }
+        if (n)
+        {
+            flush_sinks();
+        }
+
+        time_t now = monotonic_time();
+        if (now >= next_tick)
+        {
+            tick_sinks(now);
+            next_tick = now + 1;
+        }
+        if (now >= next_stats)
+        {
+            report_stats();
+            next_stats = now + STATS_INTERVAL;
+        }
+
+        if (running)
+        {
+            wait_sinks(wait_timeout());
+        }
+    }
+
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (sources[i])
+        {
+            for (struct sink *sink = sinks; sink; sink = sink->next)
+            {
+                if (sink->detach)
+                {
+                    sink->detach(sink, sources[i]);
+                }
+            }
+            free(sources[i]);
+            sources[i] = NULL;
+            stop_rolling(i);
+        }
+    }
+    while (sinks)
+    {
+        struct sink *next = sinks->next;
+        sinks->destroy(sinks);
+        sinks = next;
+    }
+    free_config(config);
+    config = NULL;
+    if (timerfd != -1)
+    {
+        close(timerfd);
+        timerfd = -1;
+    }
+    report_stats();
+    return NULL;
+}
+
+int
+output_start(struct sink *list, struct config *c, int batch_period)
+{
+    if (!ring_init(&ring, OUTPUT_RING_SIZE))
+    {
+        return 0;
+    }
+    sinks = list;
+    config = c;
+    name_sinks();
+    batch = batch_period > 0 ? batch_period : 0;
+    wakeups = 0;
+    if (batch)
+    {
+        /* Only wake up early to keep the ring from overflowing. */
+        ring_defer_wakeups(&ring, OUTPUT_RING_SIZE / 2);
+        start_batch_timer();
+    }
+
+    /* Signals are for the device thread, which may be the only one to
+     * sleep without a timeout. */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int r = pthread_create(&thread, NULL, output_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (r != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(r));
+        ring_destroy(&ring);
+        config = NULL;
+        if (timerfd != -1)
+        {
+            close(timerfd);
+            timerfd = -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+void
+output_stop()
+{
+    send_control(CONTROL_STOP, NULL, NULL);
+    pthread_join(thread, NULL);
+    ring_destroy(&ring);
+}
+
+void
+output_push(const struct record *record)
+{
+    ring_push(&ring, record);
+}
+
+unsigned long
+output_wakeups()
+{
+    return __atomic_load_n(&wakeups, __ATOMIC_RELAXED);
+}
+
+unsigned long
+output_dropped()
+{
+    return ring_dropped(&ring);
+}
+
+size_t
+output_backlog()
+{
+    return (size_t)(ring_head(&ring) - ring_tail(&ring));
+}
+
+void
+output_attach(int slot, const char *name)
+{
+    struct source *source = calloc(1, sizeof(*source));
+    if (!source)
+    {
+        fprintf(stderr, "output: out of memory\n");
+        return;
+    }
+    source->slot = slot;
+    snprintf(source->name, DEVNAME_MAX, "%s", name);
+    send_control(CONTROL_ATTACH, source, NULL);
+}
+
+void
+output_detach(int slot)
+{
+    struct source *source = calloc(1, sizeof(*source));
+    if (!source)
+    {
+        fprintf(stderr, "output: out of memory\n");
+        return;
+    }
+    source->slot = slot;
+    send_control(CONTROL_DETACH, source, NULL);
+}
+
+void
+output_reload(struct config *c)
+{
+    send_control(CONTROL_RELOAD, NULL, c);
+}
@@ -0,0 +1,71 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_OUTPUT_H_INCLUDED_
+#define CO2MOND_OUTPUT_H_INCLUDED_
+
+/*
+ * The output thread: takes records from the reader through a lock-free
+ * ring and hands them to the sinks, so slow outputs never hold up reading.
+ * The output_*() calls below belong to the reader thread.
+ */
+
+#include "co2mond.h"
+#include "config.h"
+#include "sink.h"
+
+#define OUTPUT_RING_SIZE 4096 /* records */
+
+/* Takes over the sinks and config (heap-allocated, NULL if there is
+ * nothing to reload), which they were made from.  With a batch period in
+ * seconds, the output thread sleeps until the next multiple of it instead
+ * of waking up for every record, and hands over all that came meanwhile
+ * in one go; 0 for no batching. */
+extern int
+output_start(struct sink *sinks, struct config *config, int batch_period);
+
+/* Drains what is queued, destroys the sinks and joins the thread. */
+extern void
+output_stop();
+
+extern void
+output_push(const struct record *record);
+
+/* How many times the output thread woke up so far. */
+extern unsigned long
+output_wakeups();
+
+/* Records dropped so far because the output thread fell behind. */
+extern unsigned long
+output_dropped();
+
+/* Number of records queued and not yet taken by the output thread. */
+extern size_t
+output_backlog();
+
+extern void
+output_attach(int slot, const char *name);
+
+extern void
+output_detach(int slot);
+
+/* Hands a new configuration (heap-allocated) to the output thread, which
+ * swaps it in after the records pushed so far. */
+extern void
+output_reload(struct config *config);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "report.h"
+
+int
+check_report(const co2mon_data_t result, struct record *record)
+{
+    if (result[4] != 0x0d)
+    {
+        return REPORT_BAD_FRAME;
+    }
+
+    unsigned char r0, r1, r2, r3, checksum;
+    r0 = result[0];
+    r1 = result[1];
+    r2 = result[2];
+    r3 = result[3];
+    checksum = r0 + r1 + r2;
+    if (checksum != r3)
+    {
+        return REPORT_CHECKSUM;
+    }
+
+    uint16_t w = (result[1] << 8) + result[2];
+    if (!co2mon_item_valid(r0, w))
+    {
+        return REPORT_OUT_OF_RANGE;
+    }
+    record->code = r0;
+    record->value = w;
+    return REPORT_OK;
+}
+
+int
+parse_report(const co2mon_data_t result, struct record *record)
+{
+    return check_report(result, record) == REPORT_OK;
+}
+
+int
+init_metrics()
+{
+    int n = 0;
+    for (int code = 0; code < 256; ++code)
+    {
+        const struct co2mon_item *item = &co2mon_items[code];
+        metric_of[code] = -1;
+        if (!(item->flags & CO2MON_ITEM_STORE))
+        {
+            continue;
+        }
+        if (n < NMETRICS)
+        {
+            metrics[n].name = item->name;
+            metrics[n].code = (unsigned char)code;
+            metrics[n].config.deadband = item->deadband;
+            metrics[n].config.interval = 0;
+            metric_of[code] = (signed char)n;
+        }
+        ++n;
+    }
+    if (n != NMETRICS)
+    {
+        fprintf(stderr, "co2mon_items has %d items to store, but NMETRICS is %d\n", n, NMETRICS);
+        return 0;
+    }
+    return 1;
+}
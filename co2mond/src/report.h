@@ -0,0 +1,45 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CO2MOND_REPORT_H_INCLUDED_
+#define CO2MOND_REPORT_H_INCLUDED_
+
+#include "co2mon.h"
+#include "co2mond.h"
+
+#define REPORT_OK 0
+#define REPORT_BAD_FRAME 1    /* result[4] is not 0x0d */
+#define REPORT_CHECKSUM 2
+#define REPORT_OUT_OF_RANGE 3 /* outside the valid range of the item */
+
+/* Checks a decoded report and fills in record->code and record->value.
+ * Returns REPORT_OK, or why the report should be ignored after
+ * complaining on stderr if it is garbled. */
+extern int
+check_report(const co2mon_data_t result, struct record *record);
+
+/* Returns 1 if check_report() accepts the report, 0 otherwise. */
+extern int
+parse_report(const co2mon_data_t result, struct record *record);
+
+/* Fills in metrics and metric_of from co2mon_items.  Returns 0 if the
+ * number of items to store is not NMETRICS. */
+extern int
+init_metrics();
+
+#endif
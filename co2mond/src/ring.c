@@ -0,0 +1,197 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+int
+ring_init(struct ring *ring, size_t capacity)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        fprintf(stderr, "ring_init: capacity must be a power of two\n");
+        return 0;
+    }
+    ring->records = calloc(capacity, sizeof(struct record));
+    if (!ring->records)
+    {
+        fprintf(stderr, "ring_init: out of memory\n");
+        return 0;
+    }
+    if (pipe(ring->wakefd) != 0)
+    {
+        perror("pipe");
+        free(ring->records);
+        return 0;
+    }
+    fcntl(ring->wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(ring->wakefd[1], F_SETFL, O_NONBLOCK);
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = capacity - 1;
+    ring->dropped = 0;
+    ring->wake_backlog = 1;
+    ring->waiting = 0;
+    return 1;
+}
+
+void
+ring_destroy(struct ring *ring)
+{
+    close(ring->wakefd[0]);
+    close(ring->wakefd[1]);
+    free(ring->records);
+}
+
+static void
+notify(struct ring *ring)
+{
+    char c = 0;
+    if (write(ring->wakefd[1], &c, 1) < 0)
+    {
+        /* The pipe is full, so the consumer is going to wake anyway. */
+    }
+}
+
+void
+ring_push(struct ring *ring, const struct record *record)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head - tail > ring->mask)
+    {
+        /* Full: drop the oldest record unless the consumer just took it. */
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    ring->records[head & ring->mask] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* tail may be stale, which only makes the backlog look longer. */
+    if (head + 1 - tail >= ring->wake_backlog && __atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED))
+    {
+        notify(ring);
+    }
+}
+
+int
+ring_pop(struct ring *ring, struct record *record, uint64_t *pos)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (1)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == head)
+        {
+            return 0;
+        }
+        /* The copy may be torn if the producer drops this very record, but
+         * then the exchange below fails and we move on to the next one. */
+        struct record copy = ring->records[tail & ring->mask];
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *record = copy;
+            *pos = tail;
+            return 1;
+        }
+    }
+}
+
+uint64_t
+ring_head(struct ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t
+ring_tail(struct ring *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+void
+ring_defer_wakeups(struct ring *ring, size_t backlog)
+{
+    ring->wake_backlog = backlog > 0 && backlog <= ring->mask + 1 ? backlog : 1;
+}
+
+void
+ring_wait(struct ring *ring, int timeout, struct pollfd *fds, int nfds)
+{
+    struct pollfd all[RING_MAX_POLLFDS + 1];
+    if (nfds > RING_MAX_POLLFDS)
+    {
+        nfds = RING_MAX_POLLFDS;
+    }
+    all[0].fd = ring->wakefd[0];
+    all[0].events = POLLIN;
+    all[0].revents = 0;
+    for (int i = 0; i < nfds; ++i)
+    {
+        all[i + 1] = fds[i];
+        all[i + 1].revents = 0;
+    }
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >=
+        ring->wake_backlog)
+    {
+        timeout = 0;
+    }
+    if (timeout != 0 || nfds > 0)
+    {
+        poll(all, (nfds_t)nfds + 1, timeout);
+    }
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < nfds; ++i)
+    {
+        fds[i].revents = all[i + 1].revents;
+    }
+
+    char buf[64];
+    while (read(ring->wakefd[0], buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+void
+ring_wake(struct ring *ring)
+{
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    notify(ring);
+}
+
+unsigned long
+ring_dropped(struct ring *ring)
+{
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_RING_H_INCLUDED_
+#define CO2MOND_RING_H_INCLUDED_
+
+/*
+ * Bounded lock-free ring between exactly one producer (the reader) and
+ * one consumer (the output thread).  When the ring is full the producer
+ * drops the oldest record and counts it in `dropped'.
+ */
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "co2mond.h"
+
+struct ring
+{
+    uint64_t head;  /* next position to write, owned by the producer */
+    uint64_t tail;  /* next position to read, also moved by dropping */
+    uint64_t mask;
+    struct record *records;
+    unsigned long dropped;
+    uint64_t wake_backlog; /* records queued before the producer wakes the consumer */
+    int waiting;    /* the consumer sleeps in ring_wait() */
+    int wakefd[2];
+};
+
+extern int
+ring_init(struct ring *ring, size_t capacity);
+
+extern void
+ring_destroy(struct ring *ring);
+
+extern void
+ring_push(struct ring *ring, const struct record *record);
+
+/* Stores the position of the record in *pos; returns 0 if empty. */
+extern int
+ring_pop(struct ring *ring, struct record *record, uint64_t *pos);
+
+extern uint64_t
+ring_head(struct ring *ring);
+
+extern uint64_t
+ring_tail(struct ring *ring);
+
+#define RING_MAX_POLLFDS 128 /* other descriptors ring_wait() can watch */
+
+/* Lets records pile up until backlog of them are queued before the
+ * producer wakes the consumer, which then comes by on its own timer; 1 by
+ * default, for every record. */
+extern void
+ring_defer_wakeups(struct ring *ring, size_t backlog);
+
+/* Sleeps until the producer pushes (the wakeup backlog is reached) or
+ * wakes, one of fds becomes ready, or timeout milliseconds pass.  fds are
+ * polled even if the backlog is reached, just without waiting. */
+extern void
+ring_wait(struct ring *ring, int timeout, struct pollfd *fds, int nfds);
+
+/* Wakes the consumer even if the ring is empty, e.g. for control events. */
+extern void
+ring_wake(struct ring *ring);
+
+extern unsigned long
+ring_dropped(struct ring *ring);
+
+#endif
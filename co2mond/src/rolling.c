@@ -0,0 +1,327 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sliding statistics for co2mond, see rolling.h.  The P-squared algorithm
+ * is R. Jain and I. Chlamtac, "The P2 algorithm for dynamic calculation of
+ * quantiles and histograms without storing observations", CACM 28(10), 1985.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "co2mon.h"
+#include "rolling.h"
+
+#define NS 1000000000
+
+int
+rolling_parse(struct rolling_config *config, const char *arg)
+{
+    if (config->nwindows == ROLLING_MAX_WINDOWS)
+    {
+        return 0;
+    }
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    double percentile = 95;
+    if (*end == ':')
+    {
+        percentile = strtod(end + 1, &end);
+    }
+    if (*end != '\0' || seconds <= 0 || seconds > 86400 * 366 || !(percentile > 0 && percentile < 100))
+    {
+        return 0;
+    }
+    struct rolling_window_config *w = &config->windows[config->nwindows++];
+    w->seconds = (int)seconds;
+    w->percentile = percentile;
+    return 1;
+}
+
+static void
+p2_reset(struct rolling_p2 *e, int64_t start)
+{
+    e->start = start;
+    e->count = 0;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+p2_parabolic(const struct rolling_p2 *e, int i, double d)
+{
+    const double *q = e->q;
+    const double *n = e->n;
+    return q[i] + d / (n[i + 1] - n[i - 1]) *
+        ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+         (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static void
+p2_add(struct rolling_p2 *e, double p, double x)
+{
+    if (e->count < 5)
+    {
+        e->q[e->count++] = x;
+        if (e->count == 5)
+        {
+            qsort(e->q, 5, sizeof(e->q[0]), compare_doubles);
+            for (int i = 0; i < 5; ++i)
+            {
+                e->n[i] = i;
+            }
+            e->want[0] = 0;
+            e->want[1] = 2 * p;
+            e->want[2] = 4 * p;
+            e->want[3] = 2 + 2 * p;
+            e->want[4] = 4;
+        }
+        return;
+    }
+    ++e->count;
+
+    int k;
+    if (x < e->q[0])
+    {
+        e->q[0] = x;
+        k = 0;
+    }
+    else if (x >= e->q[4])
+    {
+        e->q[4] = x;
+        k = 3;
+    }
+    else
+    {
+        for (k = 0; x >= e->q[k + 1]; ++k)
+        {
+        }
+    }
+    for (int i = k + 1; i < 5; ++i)
+    {
+        e->n[i] += 1;
+    }
+    e->want[1] += p / 2;
+    e->want[2] += p;
+    e->want[3] += (1 + p) / 2;
+    e->want[4] += 1;
+
+    for (int i = 1; i < 4; ++i)
+    {
+        double d = e->want[i] - e->n[i];
+        if ((d >= 1 && e->n[i + 1] - e->n[i] > 1) || (d <= -1 && e->n[i - 1] - e->n[i] < -1))
+        {
+            d = d > 0 ? 1 : -1;
+            double q = p2_parabolic(e, i, d);
+            if (e->q[i - 1] < q && q < e->q[i + 1])
+            {
+                e->q[i] = q;
+            }
+            else
+            {
+                int j = i + (int)d;
+                e->q[i] += d * (e->q[j] - e->q[i]) / (e->n[j] - e->n[i]);
+            }
+            e->n[i] += d;
+        }
+    }
+}
+
+static double
+p2_get(const struct rolling_p2 *e, double p)
+{
+    if (e->count >= 5)
+    {
+        return e->q[2];
+    }
+    double sorted[5];
+    memcpy(sorted, e->q, sizeof(sorted));
+    qsort(sorted, (size_t)e->count, sizeof(sorted[0]), compare_doubles);
+    return sorted[(int)floor(p * (e->count - 1) + 0.5)];
+}
+
+static void
+deque_add(struct rolling_deque *d, int64_t index, double value, int max)
+{
+    /* The oldest block falls out of the window. */
+    while (d->size && d->items[d->head].index <= index - ROLLING_BLOCKS)
+    {
+        d->head = (d->head + 1) % (ROLLING_BLOCKS + 1);
+        --d->size;
+    }
+    /* Values that value beats can never be the extreme again. */
+    while (d->size)
+    {
+        struct rolling_block *back = &d->items[(d->head + d->size - 1) % (ROLLING_BLOCKS + 1)];
+        if (max ? back->value > value : back->value < value)
+        {
+            if (back->index == index)
+            {
+                return;
+            }
+            break;
+        }
+        --d->size;
+    }
+    struct rolling_block *b = &d->items[(d->head + d->size) % (ROLLING_BLOCKS + 1)];
+    b->index = index;
+    b->value = value;
+    ++d->size;
+}
+
+void
+rolling_init(struct rolling *r, const struct rolling_config *config, unsigned char code)
+{
+    memset(r, 0, sizeof(*r));
+    r->config = config;
+    r->code = code;
+    for (int i = 0; i < config->nwindows; ++i)
+    {
+        r->windows[i].block_ns = (int64_t)config->windows[i].seconds * NS / ROLLING_BLOCKS;
+        if (r->windows[i].block_ns == 0)
+        {
+            r->windows[i].block_ns = 1;
+        }
+    }
+}
+
+void
+rolling_add(struct rolling *r, double value, int64_t monotonic, int64_t timestamp, struct rolling_values *out)
+{
+    const struct co2mon_item *item = &co2mon_items[r->code];
+    double dt = r->last ? (double)(monotonic - r->last) / NS : 0;
+    if (dt > 0 && dt <= ROLLING_MAX_GAP)
+    {
+        if (item->warning > 0 && r->value >= item->warning)
+        {
+            r->above_warning += dt;
+        }
+        if (item->critical > 0 && r->value >= item->critical)
+        {
+            r->above_critical += dt;
+        }
+    }
+
+    out->code = r->code;
+    out->timestamp = timestamp;
+    out->nwindows = r->config->nwindows;
+    for (int i = 0; i < r->config->nwindows; ++i)
+    {
+        const struct rolling_window_config *config = &r->config->windows[i];
+        struct rolling_window *w = &r->windows[i];
+        int64_t window_ns = (int64_t)config->seconds * NS;
+        double p = config->percentile / 100;
+
+        if (!w->has_ewma)
+        {
+            w->ewma = value;
+            w->has_ewma = 1;
+            p2_reset(&w->p2[0], monotonic);
+            p2_reset(&w->p2[1], monotonic - window_ns / 2);
+        }
+        else if (dt > 0)
+        {
+            w->ewma += (1 - exp(-dt / config->seconds)) * (value - w->ewma);
+        }
+
+        int64_t index = monotonic / w->block_ns;
+        deque_add(&w->min, index, value, 0);
+        deque_add(&w->max, index, value, 1);
+
+        /* Each estimator starts over once it is a window old. */
+        int oldest = 0;
+        for (int j = 0; j < 2; ++j)
+        {
+            struct rolling_p2 *e = &w->p2[j];
+            if (monotonic - e->start >= window_ns)
+            {
+                p2_reset(e, e->start + (monotonic - e->start) / window_ns * window_ns);
+            }
+            p2_add(e, p, value);
+            if (e->start < w->p2[oldest].start)
+            {
+                oldest = j;
+            }
+        }
+
+        out->windows[i].seconds = config->seconds;
+        out->windows[i].percentile = config->percentile;
+        out->windows[i].ewma = w->ewma;
+        out->windows[i].min = w->min.items[w->min.head].value;
+        out->windows[i].max = w->max.items[w->max.head].value;
+        out->windows[i].quantile = p2_get(&w->p2[oldest], p);
+    }
+    out->above_warning = r->above_warning;
+    out->above_critical = r->above_critical;
+
+    r->last = monotonic;
+    r->value = value;
+}
+
+int
+rolling_fields(const struct rolling_values *v, struct rolling_field *fields)
+{
+    const struct co2mon_item *item = &co2mon_items[v->code];
+    char name[8];
+    co2mon_item_name(v->code, name, sizeof(name));
+    int n = 0;
+    for (int i = 0; i < v->nwindows; ++i)
+    {
+        char percentile[16];
+        snprintf(percentile, sizeof(percentile), "%g", v->windows[i].percentile);
+        for (char *c = percentile; *c; ++c)
+        {
+            *c = *c == '.' ? '_' : *c;
+        }
+        int seconds = v->windows[i].seconds;
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.ewma.%d", name, seconds);
+        snprintf(fields[n].value, sizeof(fields[n].value), "%.*f", item->precision + 1, v->windows[i].ewma);
+        ++n;
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.min.%d", name, seconds);
+        co2mon_item_format(v->code, v->windows[i].min, fields[n].value, sizeof(fields[n].value));
+        ++n;
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.max.%d", name, seconds);
+        co2mon_item_format(v->code, v->windows[i].max, fields[n].value, sizeof(fields[n].value));
+        ++n;
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.p%s.%d", name, percentile, seconds);
+        snprintf(fields[n].value, sizeof(fields[n].value), "%.*f", item->precision + 1, v->windows[i].quantile);
+        ++n;
+    }
+    if (item->warning > 0)
+    {
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.above_warning", name);
+        snprintf(fields[n].value, sizeof(fields[n].value), "%.0f", v->above_warning);
+        ++n;
+    }
+    if (item->critical > 0)
+    {
+        snprintf(fields[n].name, ROLLING_NAME_MAX, "%s.above_critical", name);
+        snprintf(fields[n].value, sizeof(fields[n].value), "%.0f", v->above_critical);
+        ++n;
+    }
+    return n;
+}
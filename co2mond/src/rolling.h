@@ -0,0 +1,141 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_ROLLING_H_INCLUDED_
+#define CO2MOND_ROLLING_H_INCLUDED_
+
+/*
+ * Streaming statistics of a metric over sliding windows, in constant
+ * memory per window:
+ *   - an EWMA whose time constant is the window;
+ *   - the minimum and maximum, kept exact to 1/ROLLING_BLOCKS of the
+ *     window by monotonic deques over the extremes of each block;
+ *   - a percentile from two P-squared estimators restarted a window apart,
+ *     half a window out of step, so that the one reported has seen between
+ *     half a window and a window of the latest values;
+ * and the seconds spent at or above the item's warning and critical
+ * levels, see struct co2mon_item.
+ */
+
+#include <stdint.h>
+
+#define ROLLING_MAX_WINDOWS 4
+#define ROLLING_BLOCKS 64
+#define ROLLING_MAX_GAP 60 /* seconds without a value not counted as above a level */
+
+struct rolling_window_config
+{
+    int seconds;
+    double percentile; /* 0 < percentile < 100 */
+};
+
+struct rolling_config
+{
+    int nwindows;
+    struct rolling_window_config windows[ROLLING_MAX_WINDOWS];
+};
+
+struct rolling_p2
+{
+    int64_t start;   /* nanoseconds on CLOCK_MONOTONIC */
+    int count;
+    double q[5];     /* marker heights */
+    double n[5];     /* marker positions */
+    double want[5];  /* desired positions */
+};
+
+struct rolling_block
+{
+    int64_t index;   /* time / block length */
+    double value;
+};
+
+struct rolling_deque
+{
+    int head;
+    int size;
+    struct rolling_block items[ROLLING_BLOCKS + 1];
+};
+
+struct rolling_window
+{
+    int64_t block_ns;
+    int has_ewma;
+    double ewma;
+    struct rolling_deque min;
+    struct rolling_deque max;
+    struct rolling_p2 p2[2];
+};
+
+struct rolling
+{
+    const struct rolling_config *config;
+    unsigned char code;
+    int64_t last;    /* monotonic time of the previous value, 0 if none */
+    double value;
+    double above_warning;  /* seconds */
+    double above_critical;
+    struct rolling_window windows[ROLLING_MAX_WINDOWS];
+};
+
+/* What the sinks get after each value of a metric with windows. */
+struct rolling_values
+{
+    unsigned char code;
+    int64_t timestamp; /* of the value, nanoseconds since the Epoch */
+    int nwindows;
+    struct
+    {
+        int seconds;
+        double percentile;
+        double ewma;
+        double min;
+        double max;
+        double quantile;   /* the value at percentile */
+    } windows[ROLLING_MAX_WINDOWS];
+    double above_warning;  /* seconds, if the item has the level */
+    double above_critical;
+};
+
+/* One statistic as a name and a printed value, e.g. "CntR.ewma.300". */
+#define ROLLING_NAME_MAX 48
+#define ROLLING_MAX_FIELDS (ROLLING_MAX_WINDOWS * 4 + 2)
+
+struct rolling_field
+{
+    char name[ROLLING_NAME_MAX];
+    char value[24];
+};
+
+/* Parses "seconds[:percentile]" into a new window of config, e.g. "300"
+ * or "3600:95" (the default percentile is 95).  Returns 0 if it is invalid
+ * or there are too many windows. */
+extern int
+rolling_parse(struct rolling_config *config, const char *arg);
+
+extern void
+rolling_init(struct rolling *r, const struct rolling_config *config, unsigned char code);
+
+/* Adds the value decoded from a record, monotonic is its monotonic time. */
+extern void
+rolling_add(struct rolling *r, double value, int64_t monotonic, int64_t timestamp, struct rolling_values *out);
+
+/* Returns how many fields are filled in, up to ROLLING_MAX_FIELDS. */
+extern int
+rolling_fields(const struct rolling_values *v, struct rolling_field *fields);
+
+#endif
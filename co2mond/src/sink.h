@@ -0,0 +1,99 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_SINK_H_INCLUDED_
+#define CO2MOND_SINK_H_INCLUDED_
+
+/*
+ * Outputs of co2mond.  All sink methods are called from the output thread
+ * only; optional ones may be NULL.
+ */
+
+#include <poll.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "co2mond.h"
+
+struct sink
+{
+    struct sink *next;
+    const char *name; /* for the statistics */
+    struct histogram *latency; /* of publish(), set by the output thread */
+    void (*attach)(struct sink *sink, const struct source *source);
+    void (*detach)(struct sink *sink, const struct source *source);
+    void (*publish)(struct sink *sink, const struct source *source, const struct record *record);
+    /* Right after publish() for a value of a metric with windows. */
+    void (*publish_stats)(struct sink *sink, const struct source *source, const struct rolling_values *values);
+    void (*flush)(struct sink *sink);            /* after a batch of records */
+    void (*tick)(struct sink *sink, time_t now); /* about once a second or batch */
+    void (*destroy)(struct sink *sink);
+
+    /* Descriptors a sink serves itself: pollfds() fills in at most max and
+     * returns how many, handle() gets them back with revents set. */
+    int (*pollfds)(struct sink *sink, struct pollfd *fds, int max);
+    void (*handle)(struct sink *sink, const struct pollfd *fds, int nfds);
+};
+
+extern unsigned long datadir_writes;
+
+extern struct sink *
+stdout_sink_create();
+
+extern struct sink *
+datadir_sink_create(const char *datadir, int flags, int heartbeat_period);
+
+extern struct sink *
+snapshot_sink_create(const char *path);
+
+/* Appends to daily segments in root, see co2mon_archive.h. */
+extern struct sink *
+archive_sink_create(const char *root);
+
+/* Keeps the history queried through the HTTP and socket sinks, see
+ * history.h. */
+extern struct sink *
+history_sink_create(size_t budget, int nseries);
+
+/* Serves /metrics (and /history) over HTTP on "addr:port", "[addr]:port" or ":port". */
+extern struct sink *
+http_sink_create(const char *spec);
+
+/* Publishes retained values to an MQTT broker at
+ * "host[:port][/prefix][,qos=0|1][,id=client]". */
+extern struct sink *
+mqtt_sink_create(const char *spec);
+
+/* Sends records to co2mon-collector at "host[:port]", see co2mon_udp.h. */
+extern struct sink *
+udp_sink_create(const char *spec);
+
+/* Streams records to any number of clients of a Unix socket. */
+extern struct sink *
+socket_sink_create(const char *path);
+
+/* Copies what changed in datadir and archivedir (either may be NULL) to
+ * persistdir/<their base names> every interval seconds, and restores what
+ * is missing there on creation, for outputs kept on a tmpfs. */
+extern struct sink *
+persist_sink_create(const char *persistdir, int interval, const char *datadir, const char *archivedir);
+
+/* Updates an RRD through librrd, or through rrdcached at daemon if set. */
+extern struct sink *
+rrd_sink_create(const char *path, const char *daemon);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Appends CntR and Tamb to daily archive segments, see co2mon_archive.h:
+ * archivedir/YYYY-MM-DD.co2a, or archivedir/<device>/YYYY-MM-DD.co2a when
+ * serving several sensors.  A block goes to disk when it is full, at the
+ * latest an hour after its first sample.
+ */
+
+#define _XOPEN_SOURCE 700 /* gmtime_r */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "co2mon_archive.h"
+#include "sink.h"
+
+struct archive_device
+{
+    int used;
+    char name[DEVNAME_MAX];
+    char dir[PATH_MAX];
+    int64_t day;
+    co2mon_archive *segment;
+    struct co2mon_archive_encoder *encoders[NMETRICS];
+};
+
+struct archive_sink
+{
+    struct sink sink;
+    char *root;
+    struct archive_device devices[MAX_DEVICES];
+};
+
+static void
+flush_encoder(struct archive_device *dev, int metric)
+{
+    struct co2mon_archive_encoder *enc = dev->encoders[metric];
+    /* A block of a single sample has no payload past its header. */
+    if (enc->block.count > 0 && dev->segment)
+    {
+        co2mon_archive_encoder_finish(enc);
+        co2mon_archive_append(dev->segment, enc);
+    }
+    co2mon_archive_encoder_reset(enc, metrics[metric].code);
+}
+
+static void
+close_segment(struct archive_device *dev)
+{
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        flush_encoder(dev, i);
+    }
+    if (dev->segment)
+    {
+        co2mon_archive_close(dev->segment);
+        dev->segment = NULL;
+    }
+}
+
+static void
+open_segment(struct archive_device *dev, int64_t day)
+{
+    char path[PATH_MAX];
+    char date[16];
+    struct tm tm;
+    time_t t = (time_t)day;
+    gmtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+    dev->day = day;
+    if (snprintf(path, PATH_MAX, "%s/%s.co2a", dev->dir, date) >= PATH_MAX)
+    {
+        fprintf(stderr, "%s: path too long\n", dev->dir);
+        return;
+    }
+    dev->segment = co2mon_archive_open(path, dev->name, day);
+}
+
+static void
+archive_attach(struct sink *sink, const struct source *source)
+{
+    struct archive_sink *s = (struct archive_sink *)sink;
+    struct archive_device *dev = &s->devices[source->slot];
+    dev->used = 0;
+    dev->segment = NULL;
+    dev->day = -1;
+    snprintf(dev->name, DEVNAME_MAX, "%s", source->name);
+
+    if (!multi_device)
+    {
+        snprintf(dev->dir, PATH_MAX, "%s", s->root);
+    }
+    else
+    {
+        snprintf(dev->dir, PATH_MAX, "%s/%s", s->root, source->name);
+        if (mkdir(dev->dir, 0777) != 0 && errno != EEXIST)
+        {
+            perror(dev->dir);
+            return;
+        }
+    }
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        if (!dev->encoders[i] && !(dev->encoders[i] = malloc(sizeof(struct co2mon_archive_encoder))))
+        {
+            fprintf(stderr, "archive: out of memory\n");
+            return;
+        }
+        co2mon_archive_encoder_reset(dev->encoders[i], metrics[i].code);
+    }
+    dev->used = 1;
+}
+
+static void
+archive_detach(struct sink *sink, const struct source *source)
+{
+    struct archive_sink *s = (struct archive_sink *)sink;
+    struct archive_device *dev = &s->devices[source->slot];
+    if (dev->used)
+    {
+        close_segment(dev);
+        dev->used = 0;
+    }
+}
+
+static void
+archive_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct archive_sink *s = (struct archive_sink *)sink;
+    struct archive_device *dev = &s->devices[source->slot];
+    int metric = metric_of[record->code];
+    if (!dev->used || metric == -1 || record->timestamp < 0)
+    {
+        return;
+    }
+
+    int64_t seconds = record->timestamp / 1000000000;
+    int64_t day = seconds - seconds % 86400;
+    if (day != dev->day)
+    {
+        close_segment(dev);
+        open_segment(dev, day);
+    }
+    if (!co2mon_archive_encoder_add(dev->encoders[metric], seconds, record->value))
+    {
+        flush_encoder(dev, metric);
+        co2mon_archive_encoder_add(dev->encoders[metric], seconds, record->value);
+    }
+}
+
+static void
+archive_tick(struct sink *sink, time_t now)
+{
+    struct archive_sink *s = (struct archive_sink *)sink;
+    (void)now;
+    /* Block times are the sensor's, not monotonic. */
+    int64_t wall = (int64_t)time(NULL);
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct archive_device *dev = &s->devices[i];
+        for (int k = 0; dev->used && k < NMETRICS; ++k)
+        {
+            const struct co2mon_archive_block *b = &dev->encoders[k]->block;
+            if (b->count && wall - b->first >= CO2MON_ARCHIVE_BLOCK_SECONDS)
+            {
+                flush_encoder(dev, k);
+            }
+        }
+    }
+}
+
+static void
+archive_destroy(struct sink *sink)
+{
+    struct archive_sink *s = (struct archive_sink *)sink;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct archive_device *dev = &s->devices[i];
+        if (dev->used)
+        {
+            close_segment(dev);
+        }
+        for (int k = 0; k < NMETRICS; ++k)
+        {
+            free(dev->encoders[k]);
+        }
+    }
+    free(s->root);
+    free(s);
+}
+
+struct sink *
+archive_sink_create(const char *root)
+{
+    struct archive_sink *s = calloc(1, sizeof(*s));
+    if (!s || !(s->root = strdup(root)))
+    {
+        fprintf(stderr, "archive_sink_create: out of memory\n");
+        free(s);
+        return NULL;
+    }
+    s->sink.attach = archive_attach;
+    s->sink.detach = archive_detach;
+    s->sink.name = "archive";
+    s->sink.publish = archive_publish;
+    s->sink.tick = archive_tick;
+    s->sink.destroy = archive_destroy;
+    return &s->sink;
+}
@@ -0,0 +1,375 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "coalesce.h"
+#include "datadir.h"
+#include "sink.h"
+#include "stats.h"
+
+unsigned long datadir_writes = 0;
+
+/* A file of rolling statistics, coalesced as its metric is. */
+struct datadir_stat
+{
+    char name[ROLLING_NAME_MAX];
+    struct coalesce value;
+    int64_t pending;
+};
+
+struct datadir_device
+{
+    int used;
+    struct datadir files;
+    struct coalesce values[NMETRICS];
+    int64_t pending[NMETRICS]; /* when the value coalescing holds back arrived */
+    int64_t repeated[NMETRICS]; /* when the value on disk was last repeated, 0 if not since */
+    int64_t heartbeat;         /* time of the last valid report, ns */
+    int heartbeat_pending;
+    time_t heartbeat_written;  /* monotonic time of the last heartbeat write */
+    struct datadir_stat stats[NMETRICS][ROLLING_MAX_FIELDS];
+    /* What arrived since the last flush, as raw words: only the latest of
+     * each metric is formatted and stored, once per batch. */
+    struct record latest[NMETRICS];
+    int has_latest[NMETRICS];
+    struct rolling_values latest_stats[NMETRICS];
+    int has_latest_stats[NMETRICS];
+};
+
+struct datadir_sink
+{
+    struct sink sink;
+    char *root;
+    int flags;
+    int heartbeat_period;
+    struct datadir_device devices[MAX_DEVICES];
+};
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void
+store_value(struct datadir_device *dev, int metric, const struct record *record, time_t now)
+{
+    struct coalesce *c = &dev->values[metric];
+    double value = co2mon_item_value(record->code, record->value);
+    int action = COALESCE_DROP;
+    char text[VALUE_MAX];
+    if (!coalesce_unchanged(c, value))
+    {
+        co2mon_item_format(record->code, value, text, VALUE_MAX);
+        action = coalesce_offer(c, &metrics[metric].config, value, text, now);
+    }
+    switch (action)
+    {
+    case COALESCE_WRITE:
+        ++datadir_writes;
+        if (datadir_write(&dev->files, metrics[metric].name, text, record->timestamp))
+        {
+            coalesce_written(c, value, now);
+            dev->repeated[metric] = 0;
+        }
+        break;
+    case COALESCE_DEFER:
+        dev->pending[metric] = record->timestamp;
+        break;
+    case COALESCE_DROP:
+        /* Close enough to what is on disk, unless a newer value waits. */
+        if (!c->pending && c->written)
+        {
+            dev->repeated[metric] = record->timestamp;
+        }
+        break;
+    }
+}
+
+static void
+store_stat(struct datadir_device *dev, int metric, struct datadir_stat *stat, const char *text, int64_t timestamp, time_t now)
+{
+    double value = strtod(text, NULL);
+    switch (coalesce_offer(&stat->value, &metrics[metric].config, value, text, now))
+    {
+    case COALESCE_WRITE:
+        ++datadir_writes;
+        if (datadir_write(&dev->files, stat->name, text, timestamp))
+        {
+            coalesce_written(&stat->value, value, now);
+        }
+        break;
+    case COALESCE_DEFER:
+        stat->pending = timestamp;
+        break;
+    }
+}
+
+static void
+flush_heartbeat(struct datadir_sink *s, struct datadir_device *dev, time_t now, int force)
+{
+    if (!dev->heartbeat_pending)
+    {
+        return;
+    }
+    if (!force && dev->heartbeat_written && now - dev->heartbeat_written < s->heartbeat_period)
+    {
+        return;
+    }
+
+    char buf[VALUE_MAX];
+    snprintf(buf, VALUE_MAX, "%lld", (long long)(dev->heartbeat / 1000000000));
+    ++datadir_writes;
+    if (datadir_write(&dev->files, "heartbeat", buf, dev->heartbeat))
+    {
+        dev->heartbeat_pending = 0;
+        dev->heartbeat_written = now;
+    }
+    /* Values the sensor repeated are as fresh as the heartbeat says. */
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        if (dev->repeated[i] && datadir_touch(&dev->files, metrics[i].name, dev->repeated[i]))
+        {
+            dev->repeated[i] = 0;
+        }
+    }
+}
+
+static void
+store_stats(struct datadir_device *dev, int metric, time_t now)
+{
+    struct rolling_field fields[ROLLING_MAX_FIELDS];
+    const struct rolling_values *values = &dev->latest_stats[metric];
+    int n = rolling_fields(values, fields);
+    for (int i = 0; i < n; ++i)
+    {
+        struct datadir_stat *stat = &dev->stats[metric][i];
+        snprintf(stat->name, ROLLING_NAME_MAX, "%s", fields[i].name);
+        store_stat(dev, metric, stat, fields[i].value, values->timestamp, now);
+    }
+}
+
+/* Stores what was published since the last flush. */
+static void
+store_latest(struct datadir_sink *s, int slot, time_t now)
+{
+    struct datadir_device *dev = &s->devices[slot];
+    unsigned long suppressed = coalesce_suppressed;
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        if (dev->has_latest[i])
+        {
+            store_value(dev, i, &dev->latest[i], now);
+            dev->has_latest[i] = 0;
+        }
+        if (dev->has_latest_stats[i])
+        {
+            store_stats(dev, i, now);
+            dev->has_latest_stats[i] = 0;
+        }
+    }
+    flush_heartbeat(s, dev, now, 0);
+    if (coalesce_suppressed != suppressed)
+    {
+        stats_add(STATS_OUTPUT, slot, STAT_SUPPRESSED, coalesce_suppressed - suppressed);
+    }
+}
+
+/* Writes the values held back by coalescing once they are due. */
+static void
+flush_values(struct datadir_sink *s, struct datadir_device *dev, time_t now, int force)
+{
+    for (int i = 0; i < NMETRICS; ++i)
+    {
+        double value;
+        const char *text = coalesce_due(&dev->values[i], &metrics[i].config, now, force, &value);
+        if (text)
+        {
+            ++datadir_writes;
+            if (datadir_write(&dev->files, metrics[i].name, text, dev->pending[i]))
+            {
+                coalesce_written(&dev->values[i], value, now);
+                dev->repeated[i] = 0;
+            }
+        }
+        for (int j = 0; j < ROLLING_MAX_FIELDS && dev->stats[i][j].name[0]; ++j)
+        {
+            struct datadir_stat *stat = &dev->stats[i][j];
+            text = coalesce_due(&stat->value, &metrics[i].config, now, force, &value);
+            if (text)
+            {
+                ++datadir_writes;
+                if (datadir_write(&dev->files, stat->name, text, stat->pending))
+                {
+                    coalesce_written(&stat->value, value, now);
+                }
+            }
+        }
+    }
+    flush_heartbeat(s, dev, now, force);
+}
+
+static void
+datadir_attach(struct sink *sink, const struct source *source)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    struct datadir_device *dev = &s->devices[source->slot];
+    memset(dev, 0, sizeof(*dev));
+
+    char path[PATH_MAX];
+    if (!multi_device)
+    {
+        snprintf(path, PATH_MAX, "%s", s->root);
+    }
+    else
+    {
+        snprintf(path, PATH_MAX, "%s/%s", s->root, source->name);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST)
+        {
+            perror(path);
+            return;
+        }
+    }
+    dev->used = datadir_open(&dev->files, path, s->flags);
+}
+
+static void
+datadir_detach(struct sink *sink, const struct source *source)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    struct datadir_device *dev = &s->devices[source->slot];
+    if (dev->used)
+    {
+        store_latest(s, source->slot, monotonic_time());
+        flush_values(s, dev, monotonic_time(), 1);
+        datadir_close(&dev->files);
+        dev->used = 0;
+    }
+}
+
+/* Coalescing counts what it holds back for all devices together; a value
+ * that a newer one replaces before the flush counts as held back too. */
+static void
+supersede(const struct source *source, int *pending)
+{
+    if (*pending)
+    {
+        ++coalesce_suppressed;
+        stats_add(STATS_OUTPUT, source->slot, STAT_SUPPRESSED, 1);
+    }
+    *pending = 1;
+}
+
+static void
+datadir_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    struct datadir_device *dev = &s->devices[source->slot];
+    int metric = metric_of[record->code];
+    if (!dev->used || metric == -1)
+    {
+        return;
+    }
+
+    supersede(source, &dev->has_latest[metric]);
+    dev->latest[metric] = *record;
+    supersede(source, &dev->heartbeat_pending);
+    dev->heartbeat = record->timestamp;
+}
+
+static void
+datadir_publish_stats(struct sink *sink, const struct source *source, const struct rolling_values *values)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    struct datadir_device *dev = &s->devices[source->slot];
+    int metric = metric_of[values->code];
+    if (!dev->used || metric == -1)
+    {
+        return;
+    }
+
+    dev->latest_stats[metric] = *values;
+    dev->has_latest_stats[metric] = 1;
+}
+
+static void
+datadir_flush(struct sink *sink)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    time_t now = monotonic_time();
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (s->devices[i].used)
+        {
+            store_latest(s, i, now);
+        }
+    }
+}
+
+static void
+datadir_tick(struct sink *sink, time_t now)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (s->devices[i].used)
+        {
+            flush_values(s, &s->devices[i], now, 0);
+        }
+    }
+}
+
+static void
+datadir_destroy(struct sink *sink)
+{
+    struct datadir_sink *s = (struct datadir_sink *)sink;
+    free(s->root);
+    free(s);
+}
+
+struct sink *
+datadir_sink_create(const char *root, int flags, int heartbeat_period)
+{
+    struct datadir_sink *s = calloc(1, sizeof(*s));
+    if (!s || !(s->root = strdup(root)))
+    {
+        fprintf(stderr, "datadir_sink_create: out of memory\n");
+        free(s);
+        return NULL;
+    }
+    s->flags = flags;
+    s->heartbeat_period = heartbeat_period;
+    s->sink.attach = datadir_attach;
+    s->sink.detach = datadir_detach;
+    s->sink.name = "datadir";
+    s->sink.publish = datadir_publish;
+    s->sink.publish_stats = datadir_publish_stats;
+    s->sink.flush = datadir_flush;
+    s->sink.tick = datadir_tick;
+    s->sink.destroy = datadir_destroy;
+    return &s->sink;
+}
@@ -0,0 +1,65 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "history.h"
+#include "sink.h"
+
+static void
+history_sink_attach(struct sink *sink, const struct source *source)
+{
+    (void)sink;
+    history_attach(source->slot, source->name);
+}
+
+static void
+history_sink_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    (void)sink;
+    history_add(source->slot, record->code, record->timestamp, record->value);
+}
+
+static void
+history_sink_destroy(struct sink *sink)
+{
+    history_free();
+    free(sink);
+}
+
+struct sink *
+history_sink_create(size_t budget, int nseries)
+{
+    struct sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "history_sink_create: out of memory\n");
+        return NULL;
+    }
+    if (!history_init(budget, nseries))
+    {
+        free(s);
+        return NULL;
+    }
+    s->attach = history_sink_attach;
+    s->name = "history";
+    s->publish = history_sink_publish;
+    s->destroy = history_sink_destroy;
+    return s;
+}
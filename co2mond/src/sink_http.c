@@ -0,0 +1,740 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A small HTTP server for Prometheus: GET /metrics renders the latest
+ * value of every item of every device, plus the daemon's counters.
+ * GET /history?<query> answers a history query, see history.h.  Each
+ * connection keeps its buffers, so once they have grown to fit a scrape
+ * costs no allocations.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coalesce.h"
+#include "history.h"
+#include "net.h"
+#include "output.h"
+#include "sink.h"
+#include "stats.h"
+
+#define HTTP_MAX_CONNECTIONS 16
+#define HTTP_REQUEST_MAX 2048
+#define HTTP_TIMEOUT 10      /* seconds a connection may stay open */
+#define HTTP_HEADER_SPACE 256 /* room kept in front of the body */
+#define HTTP_HISTOGRAM_BUCKETS 25 /* the last one ends at 16.8 s */
+
+struct http_device
+{
+    int used;
+    char name[DEVNAME_MAX];
+    int64_t updated;      /* nanoseconds since the Epoch, 0 if never */
+    uint16_t value[256];
+    int64_t stamp[256];   /* when value[code] arrived */
+    unsigned char seen[256];
+    struct rolling_values stats[NMETRICS]; /* nwindows is 0 until the first */
+};
+
+struct http_buffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct http_connection
+{
+    int fd;             /* -1 if the slot is free */
+    time_t opened;
+    size_t inlen;
+    char in[HTTP_REQUEST_MAX];
+    struct http_buffer out;
+    size_t outpos;      /* start of what is left to send, outlen if done */
+    int responding;
+};
+
+struct http_sink
+{
+    struct sink sink;
+    int listenfd;
+    time_t now;
+    unsigned long scrapes;
+    struct http_connection connections[HTTP_MAX_CONNECTIONS];
+    int polled[HTTP_MAX_CONNECTIONS + 1]; /* connection behind each pollfd */
+    struct http_device devices[MAX_DEVICES];
+};
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int
+buffer_reserve(struct http_buffer *b, size_t extra)
+{
+    if (b->len + extra <= b->size)
+    {
+        return 1;
+    }
+    size_t size = b->size ? b->size : 4096;
+    while (size < b->len + extra)
+    {
+        size *= 2;
+    }
+    char *data = realloc(b->data, size);
+    if (!data)
+    {
+        return 0;
+    }
+    b->data = data;
+    b->size = size;
+    return 1;
+}
+
+static void
+buffer_printf(struct http_buffer *b, const char *format, ...)
+{
+    va_list ap;
+    while (1)
+    {
+        size_t room = b->size - b->len;
+        va_start(ap, format);
+        int n = vsnprintf(b->data + b->len, room, format, ap);
+        va_end(ap);
+        if (n < 0)
+        {
+            return;
+        }
+        if ((size_t)n < room)
+        {
+            b->len += (size_t)n;
+            return;
+        }
+        if (!buffer_reserve(b, (size_t)n + 1))
+        {
+            return;
+        }
+    }
+}
+
+/* Prometheus label values escape backslash, quote and newline. */
+static void
+buffer_label(struct http_buffer *b, const char *value)
+{
+    for (; *value; ++value)
+    {
+        if (*value == '\\' || *value == '"')
+        {
+            buffer_printf(b, "\\%c", *value);
+        }
+        else if (*value == '\n')
+        {
+            buffer_printf(b, "\\n");
+        }
+        else
+        {
+            buffer_printf(b, "%c", *value);
+        }
+    }
+}
+
+static void
+render_gauge(struct http_sink *s, struct http_buffer *b, const char *name, const char *help, int code)
+{
+    buffer_printf(b, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        if (!dev->used || !dev->seen[code])
+        {
+            continue;
+        }
+        char value[VALUE_MAX];
+        co2mon_item_format((unsigned char)code, co2mon_item_value((unsigned char)code, dev->value[code]), value, VALUE_MAX);
+        buffer_printf(b, "%s{device=\"", name);
+        buffer_label(b, dev->name);
+        buffer_printf(b, "\"} %s\n", value);
+    }
+}
+
+static void
+render_counter(struct http_buffer *b, const char *name, const char *help, unsigned long value)
+{
+    buffer_printf(b, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+static const char *const stat_help[NSTATS] = {
+    "Reports read from the device.",
+    "Reports that failed the checksum.",
+    "Reports without the 0x0d terminator.",
+    "Reports dropped as outside the valid range of their item.",
+    "Times the device went silent and was reopened.",
+    "Times a lost device was opened again.",
+    "Datadir writes suppressed by filters for the device.",
+};
+
+static void
+render_device_stats(struct http_sink *s, struct http_buffer *b)
+{
+    uint64_t values[MAX_DEVICES][NSTATS];
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (s->devices[i].used)
+        {
+            stats_get(i, values[i]);
+        }
+    }
+    for (int stat = 0; stat < NSTATS; ++stat)
+    {
+        buffer_printf(b, "# HELP co2mond_%s_total %s\n# TYPE co2mond_%s_total counter\n",
+            stat_names[stat], stat_help[stat], stat_names[stat]);
+        for (int i = 0; i < MAX_DEVICES; ++i)
+        {
+            if (s->devices[i].used)
+            {
+                buffer_printf(b, "co2mond_%s_total{device=\"", stat_names[stat]);
+                buffer_label(b, s->devices[i].name);
+                buffer_printf(b, "\"} %llu\n", (unsigned long long)values[i][stat]);
+            }
+        }
+    }
+}
+
+/* A Prometheus histogram in seconds; label is "" or name="value". */
+static void
+render_histogram(struct http_buffer *b, const char *name, const char *label, const struct histogram *h)
+{
+    struct histogram copy;
+    histogram_get(h, &copy);
+    const char *comma = label[0] ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HTTP_HISTOGRAM_BUCKETS; ++i)
+    {
+        cumulative += copy.buckets[i];
+        buffer_printf(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, comma, (double)histogram_bound(i) / 1e6, (unsigned long long)cumulative);
+    }
+    buffer_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, comma, (unsigned long long)copy.count);
+    const char *open = label[0] ? "{" : "";
+    const char *close = label[0] ? "}" : "";
+    buffer_printf(b, "%s_sum%s%s%s %.6f\n", name, open, label, close, (double)copy.sum / 1e6);
+    buffer_printf(b, "%s_count%s%s%s %llu\n", name, open, label, close, (unsigned long long)copy.count);
+}
+
+static void
+render_latencies(struct http_buffer *b)
+{
+    buffer_printf(b, "# HELP co2mond_publish_latency_seconds From reading a report until the sinks start on it.\n"
+                     "# TYPE co2mond_publish_latency_seconds histogram\n");
+    render_histogram(b, "co2mond_publish_latency_seconds", "", &publish_latency);
+    buffer_printf(b, "# HELP co2mond_sink_publish_seconds Time a sink takes to publish a record.\n"
+                     "# TYPE co2mond_sink_publish_seconds histogram\n");
+    int n = stats_nsinks();
+    for (int i = 0; i < n; ++i)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "sink=\"%s\"", sink_stats[i].name);
+        render_histogram(b, "co2mond_sink_publish_seconds", label, &sink_stats[i].latency);
+    }
+}
+
+#define WINDOW_EWMA 0
+#define WINDOW_MIN 1
+#define WINDOW_MAX 2
+#define WINDOW_QUANTILE 3
+
+static void
+render_window_gauge(struct http_sink *s, struct http_buffer *b, const char *name, const char *help, int which)
+{
+    buffer_printf(b, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        for (int m = 0; dev->used && m < NMETRICS; ++m)
+        {
+            const struct rolling_values *v = &dev->stats[m];
+            for (int w = 0; w < v->nwindows; ++w)
+            {
+                double value = which == WINDOW_EWMA ? v->windows[w].ewma :
+                               which == WINDOW_MIN ? v->windows[w].min :
+                               which == WINDOW_MAX ? v->windows[w].max : v->windows[w].quantile;
+                buffer_printf(b, "%s{device=\"", name);
+                buffer_label(b, dev->name);
+                buffer_printf(b, "\",item=\"%s\",window=\"%d\"", metrics[m].name, v->windows[w].seconds);
+                if (which == WINDOW_QUANTILE)
+                {
+                    buffer_printf(b, ",quantile=\"%g\"", v->windows[w].percentile / 100);
+                }
+                buffer_printf(b, "} %.6g\n", value);
+            }
+        }
+    }
+}
+
+static void
+render_above(struct http_sink *s, struct http_buffer *b, const char *name, const char *help, int critical)
+{
+    buffer_printf(b, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        for (int m = 0; dev->used && m < NMETRICS; ++m)
+        {
+            const struct co2mon_item *item = &co2mon_items[metrics[m].code];
+            const struct rolling_values *v = &dev->stats[m];
+            if (v->nwindows && (critical ? item->critical : item->warning) > 0)
+            {
+                buffer_printf(b, "%s{device=\"", name);
+                buffer_label(b, dev->name);
+                buffer_printf(b, "\",item=\"%s\"} %.3f\n", metrics[m].name, critical ? v->above_critical : v->above_warning);
+            }
+        }
+    }
+}
+
+static void
+render_stats(struct http_sink *s, struct http_buffer *b)
+{
+    int windows = 0;
+    for (int m = 0; m < NMETRICS; ++m)
+    {
+        windows += metrics[m].rolling.nwindows;
+    }
+    if (!windows)
+    {
+        return;
+    }
+    render_window_gauge(s, b, "co2mon_window_ewma", "Exponentially weighted moving average, the window is its time constant.", WINDOW_EWMA);
+    render_window_gauge(s, b, "co2mon_window_min", "Smallest value within the window.", WINDOW_MIN);
+    render_window_gauge(s, b, "co2mon_window_max", "Largest value within the window.", WINDOW_MAX);
+    render_window_gauge(s, b, "co2mon_window_quantile", "Estimated quantile over the last half to whole window.", WINDOW_QUANTILE);
+    render_above(s, b, "co2mon_above_warning_seconds_total", "Time spent at or above the warning level of the item.", 0);
+    render_above(s, b, "co2mon_above_critical_seconds_total", "Time spent at or above the critical level of the item.", 1);
+}
+
+static void
+render_metrics(struct http_sink *s, struct http_buffer *b)
+{
+    render_gauge(s, b, "co2mon_co2_ppm", "CO2 concentration (CntR).", CO2MON_ITEM_CNTR);
+    render_gauge(s, b, "co2mon_temperature_celsius", "Ambient temperature (Tamb).", CO2MON_ITEM_TAMB);
+    render_gauge(s, b, "co2mon_humidity_percent", "Relative humidity (Hum).", CO2MON_ITEM_HUM);
+    render_stats(s, b);
+
+    buffer_printf(b, "# HELP co2mon_item_value Raw value of every item the sensor reports.\n"
+                     "# TYPE co2mon_item_value gauge\n");
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        for (int code = 0; dev->used && code < 256; ++code)
+        {
+            if (dev->seen[code])
+            {
+                buffer_printf(b, "co2mon_item_value{device=\"");
+                buffer_label(b, dev->name);
+                buffer_printf(b, "\",code=\"0x%02x\"} %d\n", code, (int)dev->value[code]);
+            }
+        }
+    }
+
+    buffer_printf(b, "# HELP co2mon_item_timestamp_seconds When the sensor sent the current value of an item.\n"
+                     "# TYPE co2mon_item_timestamp_seconds gauge\n");
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        for (int code = 0; dev->used && code < 256; ++code)
+        {
+            if (dev->seen[code])
+            {
+                buffer_printf(b, "co2mon_item_timestamp_seconds{device=\"");
+                buffer_label(b, dev->name);
+                buffer_printf(b, "\",code=\"0x%02x\"} %.6f\n", code, (double)dev->stamp[code] / 1e9);
+            }
+        }
+    }
+
+    buffer_printf(b, "# HELP co2mon_last_update_timestamp_seconds When the device last sent a valid report.\n"
+                     "# TYPE co2mon_last_update_timestamp_seconds gauge\n");
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct http_device *dev = &s->devices[i];
+        if (dev->used && dev->updated)
+        {
+            buffer_printf(b, "co2mon_last_update_timestamp_seconds{device=\"");
+            buffer_label(b, dev->name);
+            buffer_printf(b, "\"} %.3f\n", (double)dev->updated / 1e9);
+        }
+    }
+
+    render_counter(b, "co2mond_records_dropped_total", "Records dropped because the outputs fell behind.", output_dropped());
+    render_counter(b, "co2mond_datadir_writes_total", "Values written to the datadir.", datadir_writes);
+    render_counter(b, "co2mond_datadir_suppressed_total", "Datadir writes suppressed by filters.", coalesce_suppressed);
+    render_counter(b, "co2mond_http_scrapes_total", "Requests for /metrics.", s->scrapes);
+    render_device_stats(s, b);
+    render_latencies(b);
+    if (history_enabled())
+    {
+        buffer_printf(b, "# HELP co2mond_history_bytes Memory taken by the history.\n"
+                         "# TYPE co2mond_history_bytes gauge\n"
+                         "co2mond_history_bytes %lu\n", (unsigned long)history_memory());
+    }
+}
+
+/* Puts the status line and headers in front of the body that starts at
+ * HTTP_HEADER_SPACE, so the whole response is one contiguous buffer. */
+static void
+finish_response(struct http_connection *c, const char *status, int head)
+{
+    char header[HTTP_HEADER_SPACE];
+    size_t body = c->out.len - HTTP_HEADER_SPACE;
+    int n = snprintf(header, sizeof(header),
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %lu\r\n"
+        "Connection: close\r\n"
+        "\r\n", status, (unsigned long)body);
+    c->outpos = HTTP_HEADER_SPACE - (size_t)n;
+    memcpy(c->out.data + c->outpos, header, (size_t)n);
+    if (head)
+    {
+        c->out.len = HTTP_HEADER_SPACE;
+    }
+    c->responding = 1;
+}
+
+struct history_render
+{
+    struct http_buffer *out;
+    const struct history_query *query;
+};
+
+static int
+render_point(void *arg, const struct history_point *point)
+{
+    struct history_render *r = arg;
+    char line[128];
+    int n = history_format(r->query, point, line, sizeof(line));
+    if (n > 0 && buffer_reserve(r->out, (size_t)n))
+    {
+        memcpy(r->out->data + r->out->len, line, (size_t)n);
+        r->out->len += (size_t)n;
+    }
+    return 1;
+}
+
+static void
+render_history(struct http_connection *c, const char *query, int head)
+{
+    char text[HTTP_REQUEST_MAX];
+    size_t len = strcspn(query, " \r\n");
+    memcpy(text, query, len);
+    text[len] = '\0';
+
+    struct history_query q;
+    if (!history_enabled())
+    {
+        buffer_printf(&c->out, "History is disabled\n");
+        finish_response(c, "404 Not Found", head);
+    }
+    else if (!history_parse_query(text, time(NULL), &q))
+    {
+        buffer_printf(&c->out, "Bad query, e.g. /history?item=CntR&res=1m&since=-3600\n");
+        finish_response(c, "400 Bad Request", head);
+    }
+    else
+    {
+        struct history_render r = { &c->out, &q };
+        history_query(&q, render_point, &r);
+        finish_response(c, "200 OK", head);
+    }
+}
+
+static void
+respond(struct http_sink *s, struct http_connection *c)
+{
+    c->out.len = 0;
+    if (!buffer_reserve(&c->out, HTTP_HEADER_SPACE + 1))
+    {
+        return;
+    }
+    c->out.len = HTTP_HEADER_SPACE;
+
+    int head = strncmp(c->in, "HEAD ", 5) == 0;
+    const char *path = head ? c->in + 5 : strncmp(c->in, "GET ", 4) == 0 ? c->in + 4 : NULL;
+    if (!path)
+    {
+        buffer_printf(&c->out, "Method not allowed\n");
+        finish_response(c, "405 Method Not Allowed", 0);
+        return;
+    }
+    size_t len = strcspn(path, " ?\r\n");
+    if (len == 8 && strncmp(path, "/metrics", 8) == 0)
+    {
+        ++s->scrapes;
+        render_metrics(s, &c->out);
+        finish_response(c, "200 OK", head);
+    }
+    else if (len == 8 && strncmp(path, "/history", 8) == 0)
+    {
+        render_history(c, path[len] == '?' ? path + len + 1 : "", head);
+    }
+    else
+    {
+        buffer_printf(&c->out, "Not found, try /metrics\n");
+        finish_response(c, "404 Not Found", head);
+    }
+}
+
+static void
+close_connection(struct http_connection *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void
+accept_connection(struct http_sink *s)
+{
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        struct http_connection *c = &s->connections[i];
+        if (c->fd == -1)
+        {
+            c->fd = net_accept(s->listenfd);
+            c->opened = s->now;
+            c->inlen = 0;
+            c->outpos = 0;
+            c->responding = 0;
+            return;
+        }
+    }
+}
+
+static void
+read_request(struct http_sink *s, struct http_connection *c)
+{
+    ssize_t r = read(c->fd, c->in + c->inlen, HTTP_REQUEST_MAX - 1 - c->inlen);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (r <= 0)
+    {
+        close_connection(c);
+        return;
+    }
+    c->inlen += (size_t)r;
+    c->in[c->inlen] = '\0';
+    if (strstr(c->in, "\r\n\r\n") || strstr(c->in, "\n\n"))
+    {
+        respond(s, c);
+        if (!c->responding)
+        {
+            close_connection(c);
+        }
+    }
+    else if (c->inlen == HTTP_REQUEST_MAX - 1)
+    {
+        close_connection(c);
+    }
+}
+
+static void
+send_response(struct http_connection *c)
+{
+    ssize_t r = write(c->fd, c->out.data + c->outpos, c->out.len - c->outpos);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (r <= 0)
+    {
+        close_connection(c);
+        return;
+    }
+    c->outpos += (size_t)r;
+    if (c->outpos == c->out.len)
+    {
+        close_connection(c);
+    }
+}
+
+static void
+http_attach(struct sink *sink, const struct source *source)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    struct http_device *dev = &s->devices[source->slot];
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->name, DEVNAME_MAX, "%s", source->name);
+    dev->used = 1;
+}
+
+static void
+http_detach(struct sink *sink, const struct source *source)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    s->devices[source->slot].used = 0;
+}
+
+static void
+http_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    struct http_device *dev = &s->devices[source->slot];
+    dev->value[record->code] = record->value;
+    dev->seen[record->code] = 1;
+    dev->stamp[record->code] = record->timestamp;
+    dev->updated = record->timestamp;
+}
+
+static void
+http_publish_stats(struct sink *sink, const struct source *source, const struct rolling_values *values)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    int metric = metric_of[values->code];
+    if (metric != -1)
+    {
+        s->devices[source->slot].stats[metric] = *values;
+    }
+}
+
+static void
+http_tick(struct sink *sink, time_t now)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    s->now = now;
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        struct http_connection *c = &s->connections[i];
+        if (c->fd != -1 && now - c->opened >= HTTP_TIMEOUT)
+        {
+            close_connection(c);
+        }
+    }
+}
+
+static int
+http_pollfds(struct sink *sink, struct pollfd *fds, int max)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    int n = 0;
+    int room = 0;
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS && n < max; ++i)
+    {
+        struct http_connection *c = &s->connections[i];
+        if (c->fd == -1)
+        {
+            room = 1;
+            continue;
+        }
+        fds[n].fd = c->fd;
+        fds[n].events = c->responding ? POLLOUT : POLLIN;
+        s->polled[n++] = i;
+    }
+    if (room && n < max)
+    {
+        fds[n].fd = s->listenfd;
+        fds[n].events = POLLIN;
+        s->polled[n++] = -1;
+    }
+    return n;
+}
+
+static void
+http_handle(struct sink *sink, const struct pollfd *fds, int nfds)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    for (int i = 0; i < nfds; ++i)
+    {
+        if (!fds[i].revents)
+        {
+            continue;
+        }
+        if (s->polled[i] == -1)
+        {
+            accept_connection(s);
+            continue;
+        }
+        struct http_connection *c = &s->connections[s->polled[i]];
+        if (c->responding)
+        {
+            send_response(c);
+        }
+        else
+        {
+            read_request(s, c);
+        }
+    }
+}
+
+static void
+http_destroy(struct sink *sink)
+{
+    struct http_sink *s = (struct http_sink *)sink;
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        if (s->connections[i].fd != -1)
+        {
+            close_connection(&s->connections[i]);
+        }
+        free(s->connections[i].out.data);
+    }
+    close(s->listenfd);
+    free(s);
+}
+
+struct sink *
+http_sink_create(const char *spec)
+{
+    struct http_sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "http_sink_create: out of memory\n");
+        return NULL;
+    }
+    s->listenfd = net_listen_tcp(spec);
+    if (s->listenfd == -1)
+    {
+        free(s);
+        return NULL;
+    }
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i)
+    {
+        s->connections[i].fd = -1;
+    }
+    s->now = monotonic_time();
+    s->sink.attach = http_attach;
+    s->sink.detach = http_detach;
+    s->sink.name = "http";
+    s->sink.publish = http_publish;
+    s->sink.publish_stats = http_publish_stats;
+    s->sink.tick = http_tick;
+    s->sink.destroy = http_destroy;
+    s->sink.pollfds = http_pollfds;
+    s->sink.handle = http_handle;
+    return &s->sink;
+}
@@ -0,0 +1,722 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Publishes every value as a retained MQTT 3.1.1 message on
+ * <prefix>[/<device>]/<item>, e.g. co2mon/CntR, over one connection that
+ * is reopened with a backoff when the broker goes away.  Messages wait in
+ * a bounded queue (the oldest are dropped when it is full) and go out
+ * together after each batch of records; with QoS 1 at most MQTT_INFLIGHT
+ * wait for their PUBACK, and those are sent again after a reconnect.
+ * <prefix>/status is "online" while connected and "offline" (the will)
+ * otherwise.  Nothing here blocks but the name lookup on reconnects, and
+ * that stalls only the output thread.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "sink.h"
+
+#define MQTT_DEFAULT_PORT "1883"
+#define MQTT_DEFAULT_PREFIX "co2mon"
+#define MQTT_KEEPALIVE 60       /* seconds, unless batches are further apart */
+#define MQTT_KEEPALIVE_MAX 65535
+#define MQTT_CONNECT_TIMEOUT 10 /* seconds for the TCP connection and CONNACK */
+#define MQTT_BACKOFF_MAX 60     /* seconds between reconnects at most */
+#define MQTT_QUEUE_SIZE 1024    /* messages kept while the broker is away */
+#define MQTT_INFLIGHT 16        /* QoS 1 messages without a PUBACK */
+#define MQTT_BUFFER_SIZE 16384
+#define MQTT_TOPIC_MAX 192
+#define MQTT_PAYLOAD_MAX 24
+#define MQTT_ID_MAX 24          /* the 23 characters every broker takes */
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PINGREQ 0xc0
+#define MQTT_PINGRESP 0xd0
+#define MQTT_DISCONNECT 0xe0
+
+#define MQTT_RETAIN 0x01
+#define MQTT_DUP 0x08
+
+#define STATE_DISCONNECTED 0
+#define STATE_CONNECTING 1 /* waiting for the TCP connection */
+#define STATE_HANDSHAKE 2  /* waiting for CONNACK */
+#define STATE_CONNECTED 3
+
+struct mqtt_message
+{
+    char topic[MQTT_TOPIC_MAX];
+    char payload[MQTT_PAYLOAD_MAX];
+    uint16_t id;   /* packet identifier once sent with QoS 1 */
+    int acked;
+};
+
+struct mqtt_sink
+{
+    struct sink sink;
+    char host[256];
+    char port[16];
+    char prefix[64];
+    char client_id[MQTT_ID_MAX];
+    int qos;
+
+    int fd;
+    int state;
+    time_t since;       /* when the state was entered */
+    time_t retry_at;
+    int backoff;
+    int error_shown;
+    int keepalive;      /* seconds, 0 for none */
+    time_t last_sent;
+    time_t ping_sent;   /* 0 if no PINGRESP is due */
+    uint16_t next_id;
+
+    struct mqtt_message *queue;
+    size_t head;
+    size_t count;
+    size_t sent;        /* of the first count messages */
+    unsigned long dropped;
+
+    unsigned char in[256];
+    size_t inlen;
+    unsigned char out[MQTT_BUFFER_SIZE];
+    size_t outlen;
+};
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static struct mqtt_message *
+message_at(struct mqtt_sink *s, size_t i)
+{
+    return &s->queue[(s->head + i) % MQTT_QUEUE_SIZE];
+}
+
+static void
+pop_message(struct mqtt_sink *s)
+{
+    s->head = (s->head + 1) % MQTT_QUEUE_SIZE;
+    --s->count;
+    if (s->sent)
+    {
+        --s->sent;
+    }
+}
+
+static void
+enqueue(struct mqtt_sink *s, const char *topic, const char *payload)
+{
+    if (s->count == MQTT_QUEUE_SIZE)
+    {
+        pop_message(s);
+        ++s->dropped;
+    }
+    struct mqtt_message *m = message_at(s, s->count++);
+    snprintf(m->topic, MQTT_TOPIC_MAX, "%s", topic);
+    snprintf(m->payload, MQTT_PAYLOAD_MAX, "%s", payload);
+    m->id = 0;
+    m->acked = 0;
+}
+
+/* Remaining length, 1 to 4 bytes; returns how many. */
+static size_t
+put_length(unsigned char *p, size_t len)
+{
+    size_t n = 0;
+    do
+    {
+        unsigned char byte = len % 128;
+        len /= 128;
+        p[n++] = byte | (len ? 0x80 : 0);
+    } while (len);
+    return n;
+}
+
+static size_t
+put_string(unsigned char *p, const char *str, size_t len)
+{
+    p[0] = (unsigned char)(len >> 8);
+    p[1] = (unsigned char)len;
+    memcpy(p + 2, str, len);
+    return len + 2;
+}
+
+/* Appends a packet of type with body to the output buffer, 0 if it does
+ * not fit. */
+static int
+put_packet(struct mqtt_sink *s, unsigned char type, const unsigned char *body, size_t len)
+{
+    if (MQTT_BUFFER_SIZE - s->outlen < len + 5)
+    {
+        return 0;
+    }
+    s->out[s->outlen++] = type;
+    s->outlen += put_length(s->out + s->outlen, len);
+    if (len)
+    {
+        memcpy(s->out + s->outlen, body, len);
+        s->outlen += len;
+    }
+    return 1;
+}
+
+static int
+put_publish(struct mqtt_sink *s, const char *topic, const char *payload, int qos, uint16_t id, int dup)
+{
+    unsigned char body[MQTT_TOPIC_MAX + MQTT_PAYLOAD_MAX + 4];
+    size_t len = put_string(body, topic, strlen(topic));
+    if (qos)
+    {
+        body[len++] = (unsigned char)(id >> 8);
+        body[len++] = (unsigned char)id;
+    }
+    size_t payload_len = strlen(payload);
+    memcpy(body + len, payload, payload_len);
+    len += payload_len;
+    unsigned char type = MQTT_PUBLISH | (unsigned char)(qos << 1) | MQTT_RETAIN | (dup ? MQTT_DUP : 0);
+    return put_packet(s, type, body, len);
+}
+
+static void
+put_connect(struct mqtt_sink *s)
+{
+    char will[MQTT_TOPIC_MAX];
+    snprintf(will, sizeof(will), "%s/status", s->prefix);
+    unsigned char body[MQTT_TOPIC_MAX + MQTT_ID_MAX + 32];
+    size_t len = put_string(body, "MQTT", 4);
+    body[len++] = 4;    /* 3.1.1 */
+    body[len++] = 0x02 | 0x04 | 0x20; /* clean session, will, retained will */
+    body[len++] = (unsigned char)(s->keepalive >> 8);
+    body[len++] = (unsigned char)s->keepalive;
+    len += put_string(body + len, s->client_id, strlen(s->client_id));
+    len += put_string(body + len, will, strlen(will));
+    len += put_string(body + len, "offline", 7);
+    put_packet(s, MQTT_CONNECT, body, len);
+}
+
+static void
+disconnect(struct mqtt_sink *s, const char *why)
+{
+    if (!s->error_shown)
+    {
+        fprintf(stderr, "mqtt %s:%s: %s, reconnecting\n", s->host, s->port, why);
+        s->error_shown = 1;
+    }
+    if (s->fd != -1)
+    {
+        close(s->fd);
+        s->fd = -1;
+    }
+    time_t now = monotonic_time();
+    s->state = STATE_DISCONNECTED;
+    s->since = now;
+    s->retry_at = now + s->backoff;
+    s->backoff = s->backoff * 2 > MQTT_BACKOFF_MAX ? MQTT_BACKOFF_MAX : s->backoff * 2;
+    s->outlen = 0;
+    s->inlen = 0;
+    s->ping_sent = 0;
+    /* Messages without a PUBACK go again. */
+    s->sent = 0;
+}
+
+static void
+start_connect(struct mqtt_sink *s)
+{
+    s->fd = net_connect_tcp(s->host, s->port, !s->error_shown);
+    if (s->fd == -1)
+    {
+        disconnect(s, "cannot connect");
+        return;
+    }
+    s->state = STATE_CONNECTING;
+    s->since = monotonic_time();
+}
+
+/* Writes what the socket takes without blocking. */
+static void
+send_out(struct mqtt_sink *s)
+{
+    size_t sent = 0;
+    while (sent < s->outlen)
+    {
+        ssize_t r = send(s->fd, s->out + sent, s->outlen - sent, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (r <= 0)
+        {
+            disconnect(s, r < 0 ? strerror(errno) : "connection closed");
+            return;
+        }
+        sent += (size_t)r;
+    }
+    if (sent)
+    {
+        s->last_sent = monotonic_time();
+    }
+    memmove(s->out, s->out + sent, s->outlen - sent);
+    s->outlen -= sent;
+}
+
+/* Moves queued messages into the output buffer while they fit. */
+static void
+send_queued(struct mqtt_sink *s)
+{
+    if (s->state != STATE_CONNECTED)
+    {
+        return;
+    }
+    while (s->sent < s->count && (!s->qos || s->sent < MQTT_INFLIGHT))
+    {
+        struct mqtt_message *m = message_at(s, s->sent);
+        int dup = m->id != 0;
+        if (s->qos && !m->id)
+        {
+            m->id = s->next_id++;
+            if (!s->next_id)
+            {
+                s->next_id = 1;
+            }
+        }
+        if (!put_publish(s, m->topic, m->payload, s->qos, m->id, dup))
+        {
+            break;
+        }
+        if (s->qos)
+        {
+            ++s->sent;
+        }
+        else
+        {
+            pop_message(s);
+        }
+    }
+    send_out(s);
+}
+
+static void
+handle_puback(struct mqtt_sink *s, uint16_t id)
+{
+    for (size_t i = 0; i < s->sent; ++i)
+    {
+        struct mqtt_message *m = message_at(s, i);
+        if (m->id == id)
+        {
+            m->acked = 1;
+            break;
+        }
+    }
+    while (s->sent && message_at(s, 0)->acked)
+    {
+        pop_message(s);
+    }
+}
+
+static void
+handle_packet(struct mqtt_sink *s, unsigned char type, const unsigned char *body, size_t len)
+{
+    switch (type & 0xf0)
+    {
+    case MQTT_CONNACK:
+        if (s->state != STATE_HANDSHAKE || len < 2 || body[1] != 0)
+        {
+            char why[32];
+            snprintf(why, sizeof(why), "refused (%d)", len < 2 ? -1 : body[1]);
+            disconnect(s, why);
+            return;
+        }
+        if (s->error_shown)
+        {
+            fprintf(stderr, "mqtt %s:%s: connected\n", s->host, s->port);
+            s->error_shown = 0;
+        }
+        if (s->dropped)
+        {
+            fprintf(stderr, "mqtt %s:%s: %lu messages dropped while disconnected\n", s->host, s->port, s->dropped);
+            s->dropped = 0;
+        }
+        s->state = STATE_CONNECTED;
+        s->since = monotonic_time();
+        s->backoff = 1;
+        char status[MQTT_TOPIC_MAX];
+        snprintf(status, sizeof(status), "%s/status", s->prefix);
+        put_publish(s, status, "online", 0, 0, 0);
+        send_queued(s);
+        break;
+    case MQTT_PUBACK:
+        if (len >= 2)
+        {
+            handle_puback(s, (uint16_t)(body[0] << 8 | body[1]));
+        }
+        break;
+    case MQTT_PINGRESP:
+        s->ping_sent = 0;
+        break;
+    }
+}
+
+static void
+read_packets(struct mqtt_sink *s)
+{
+    ssize_t r;
+    while ((r = read(s->fd, s->in + s->inlen, sizeof(s->in) - s->inlen)) > 0)
+    {
+        s->inlen += (size_t)r;
+        size_t pos = 0;
+        /* The broker only sends short packets to a client without
+         * subscriptions, one length byte is enough. */
+        while (s->inlen - pos >= 2)
+        {
+            size_t len = s->in[pos + 1];
+            if (len & 0x80)
+            {
+                disconnect(s, "unexpected packet");
+                return;
+            }
+            if (s->inlen - pos < 2 + len)
+            {
+                break;
+            }
+            handle_packet(s, s->in[pos], s->in + pos + 2, len);
+            if (s->fd == -1)
+            {
+                return;
+            }
+            pos += 2 + len;
+        }
+        memmove(s->in, s->in + pos, s->inlen - pos);
+        s->inlen -= pos;
+    }
+    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        disconnect(s, r == 0 ? "connection closed" : strerror(errno));
+    }
+}
+
+static void
+finish_connect(struct mqtt_sink *s)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0)
+    {
+        disconnect(s, strerror(error ? error : errno));
+        return;
+    }
+    s->state = STATE_HANDSHAKE;
+    s->since = monotonic_time();
+    put_connect(s);
+    send_out(s);
+}
+
+static void
+topic_for(struct mqtt_sink *s, const struct source *source, const char *name, char *topic)
+{
+    if (multi_device)
+    {
+        snprintf(topic, MQTT_TOPIC_MAX, "%s/%s/%s", s->prefix, source->name, name);
+    }
+    else
+    {
+        snprintf(topic, MQTT_TOPIC_MAX, "%s/%s", s->prefix, name);
+    }
+}
+
+static void
+mqtt_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    if (!(co2mon_items[record->code].flags & CO2MON_ITEM_SHOW) && !print_unknown)
+    {
+        return;
+    }
+    char name[VALUE_MAX];
+    char value[VALUE_MAX];
+    char topic[MQTT_TOPIC_MAX];
+    co2mon_item_name(record->code, name, VALUE_MAX);
+    co2mon_item_format(record->code, co2mon_item_value(record->code, record->value), value, VALUE_MAX);
+    topic_for(s, source, name, topic);
+    enqueue(s, topic, value);
+}
+
+static void
+mqtt_publish_stats(struct sink *sink, const struct source *source, const struct rolling_values *values)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    struct rolling_field fields[ROLLING_MAX_FIELDS];
+    int n = rolling_fields(values, fields);
+    for (int i = 0; i < n; ++i)
+    {
+        char topic[MQTT_TOPIC_MAX];
+        topic_for(s, source, fields[i].name, topic);
+        enqueue(s, topic, fields[i].value);
+    }
+}
+
+static void
+mqtt_flush(struct sink *sink)
+{
+    send_queued((struct mqtt_sink *)sink);
+}
+
+static void
+mqtt_tick(struct sink *sink, time_t now)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    switch (s->state)
+    {
+    case STATE_DISCONNECTED:
+        if (now >= s->retry_at)
+        {
+            start_connect(s);
+        }
+        break;
+    case STATE_CONNECTING:
+    case STATE_HANDSHAKE:
+        if (now - s->since >= MQTT_CONNECT_TIMEOUT)
+        {
+            disconnect(s, "timed out");
+        }
+        break;
+    case STATE_CONNECTED:
+        if (!s->keepalive)
+        {
+            break;
+        }
+        if (s->ping_sent && now - s->ping_sent >= s->keepalive)
+        {
+            disconnect(s, "no answer to PINGREQ");
+        }
+        else if (!s->ping_sent && now - s->last_sent >= s->keepalive / 2)
+        {
+            if (put_packet(s, MQTT_PINGREQ, NULL, 0))
+            {
+                s->ping_sent = now;
+                send_out(s);
+            }
+        }
+        break;
+    }
+}
+
+static int
+mqtt_pollfds(struct sink *sink, struct pollfd *fds, int max)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    if (s->fd == -1 || max < 1)
+    {
+        return 0;
+    }
+    fds[0].fd = s->fd;
+    fds[0].events = s->state == STATE_CONNECTING ? POLLOUT : POLLIN | (s->outlen ? POLLOUT : 0);
+    return 1;
+}
+
+static void
+mqtt_handle(struct sink *sink, const struct pollfd *fds, int nfds)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    if (nfds < 1 || !fds[0].revents || s->fd == -1)
+    {
+        return;
+    }
+    if (s->state == STATE_CONNECTING)
+    {
+        finish_connect(s);
+        return;
+    }
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        read_packets(s);
+    }
+    if (s->fd != -1 && (fds[0].revents & POLLOUT))
+    {
+        send_queued(s);
+    }
+}
+
+static void
+mqtt_destroy(struct sink *sink)
+{
+    struct mqtt_sink *s = (struct mqtt_sink *)sink;
+    if (s->state == STATE_CONNECTED)
+    {
+        /* Whatever fits goes out, then a clean DISCONNECT keeps the will
+         * from firing; "offline" is published by hand. */
+        send_queued(s);
+        char status[MQTT_TOPIC_MAX];
+        snprintf(status, sizeof(status), "%s/status", s->prefix);
+        put_publish(s, status, "offline", 0, 0, 0);
+        put_packet(s, MQTT_DISCONNECT, NULL, 0);
+        if (s->fd != -1)
+        {
+            send_out(s);
+        }
+    }
+    if (s->fd != -1)
+    {
+        close(s->fd);
+    }
+    free(s->queue);
+    free(s);
+}
+
+/* Parses "host[:port][/prefix][,qos=N][,id=client]". */
+static int
+parse_spec(struct mqtt_sink *s, const char *spec)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *options = strchr(buf, ',');
+    if (options)
+    {
+        *options++ = '\0';
+    }
+    char *close = buf[0] == '[' ? strchr(buf, ']') : NULL;
+    char *slash = strchr(close ? close : buf, '/');
+    if (slash)
+    {
+        *slash++ = '\0';
+        snprintf(s->prefix, sizeof(s->prefix), "%s", slash);
+    }
+    char *host = buf;
+    const char *port = NULL;
+    if (host[0] == '[')
+    {
+        if (!close || (close[1] != '\0' && close[1] != ':'))
+        {
+            return 0;
+        }
+        *close = '\0';
+        port = close[1] == ':' ? close + 2 : NULL;
+        ++host;
+    }
+    else
+    {
+        char *colon = strrchr(host, ':');
+        if (colon)
+        {
+            *colon = '\0';
+            port = colon + 1;
+        }
+    }
+    if (!port)
+    {
+        port = MQTT_DEFAULT_PORT;
+    }
+    if (!host[0] || strlen(host) >= sizeof(s->host) || !port[0] || strlen(port) >= sizeof(s->port) || !s->prefix[0])
+    {
+        return 0;
+    }
+    strcpy(s->host, host);
+    strcpy(s->port, port);
+
+    for (char *option = options; option; option = options)
+    {
+        if ((options = strchr(option, ',')))
+        {
+            *options++ = '\0';
+        }
+        if (strncmp(option, "qos=", 4) == 0 && (option[4] == '0' || option[4] == '1') && option[5] == '\0')
+        {
+            s->qos = option[4] - '0';
+        }
+        else if (strncmp(option, "id=", 3) == 0 && option[3])
+        {
+            snprintf(s->client_id, sizeof(s->client_id), "%s", option + 3);
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct sink *
+mqtt_sink_create(const char *spec)
+{
+    struct mqtt_sink *s = calloc(1, sizeof(*s));
+    if (!s || !(s->queue = calloc(MQTT_QUEUE_SIZE, sizeof(*s->queue))))
+    {
+        fprintf(stderr, "mqtt_sink_create: out of memory\n");
+        free(s);
+        return NULL;
+    }
+    snprintf(s->prefix, sizeof(s->prefix), "%s", MQTT_DEFAULT_PREFIX);
+    if (!parse_spec(s, spec))
+    {
+        fprintf(stderr, "%s: expected host[:port][/prefix][,qos=0|1][,id=client]\n", spec);
+        free(s->queue);
+        free(s);
+        return NULL;
+    }
+    if (!s->client_id[0])
+    {
+        char hostname[64];
+        if (gethostname(hostname, sizeof(hostname)) != 0)
+        {
+            hostname[0] = '\0';
+        }
+        hostname[sizeof(hostname) - 1] = '\0';
+        snprintf(s->client_id, sizeof(s->client_id), "co2mond-%.8s-%d", hostname, (int)getpid());
+    }
+    /* tick() runs once a batch with -b, and the broker gives up after one
+     * and a half keepalives without a packet: ask for two batches, or for
+     * none if that does not fit. */
+    s->keepalive = MQTT_KEEPALIVE;
+    if (batch_period > MQTT_KEEPALIVE / 2)
+    {
+        s->keepalive = batch_period <= MQTT_KEEPALIVE_MAX / 2 ? 2 * batch_period : 0;
+    }
+    s->fd = -1;
+    s->backoff = 1;
+    s->next_id = 1;
+    s->sink.name = "mqtt";
+    s->sink.publish = mqtt_publish;
+    s->sink.publish_stats = mqtt_publish_stats;
+    s->sink.flush = mqtt_flush;
+    s->sink.tick = mqtt_tick;
+    s->sink.destroy = mqtt_destroy;
+    s->sink.pollfds = mqtt_pollfds;
+    s->sink.handle = mqtt_handle;
+    start_connect(s);
+    return &s->sink;
+}
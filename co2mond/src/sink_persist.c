@@ -0,0 +1,342 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* openat, fdopendir */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+#define PERSIST_MAX_DIRS 2
+#define PERSIST_DEPTH 1 /* subdirectories, one per sensor with several */
+#define COPY_BUFFER 65536
+
+struct persist_dir
+{
+    char *from; /* on the tmpfs */
+    char *to;
+};
+
+struct persist_sink
+{
+    struct sink sink;
+    int interval;
+    time_t next;
+    int ndirs;
+    struct persist_dir dirs[PERSIST_MAX_DIRS];
+};
+
+static time_t
+monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int
+same_mtime(const struct stat *a, const struct stat *b)
+{
+    return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Copies name through a temporary file that replaces it at once, with the
+ * modification time of the original, which the datadir relies on. */
+static int
+copy_file(int fromfd, int tofd, const char *name, const struct stat *st)
+{
+    char tmpname[PATH_MAX];
+    snprintf(tmpname, sizeof(tmpname), ".%s.persist", name);
+
+    int in = openat(fromfd, name, O_RDONLY);
+    if (in == -1)
+    {
+        perror(name);
+        return 0;
+    }
+    int out = openat(tofd, tmpname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (out == -1)
+    {
+        perror(tmpname);
+        close(in);
+        return 0;
+    }
+
+    char buf[COPY_BUFFER];
+    ssize_t len;
+    int ok = 1;
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0)
+    {
+        ok = len > 0 && write(out, buf, (size_t)len) == len;
+    }
+    if (!ok)
+    {
+        perror(name);
+    }
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = st->st_mtim;
+    if (ok && (futimens(out, times) != 0 || fsync(out) != 0))
+    {
+        perror(tmpname);
+        ok = 0;
+    }
+    close(out);
+    close(in);
+
+    if (ok && renameat(tofd, tmpname, tofd, name) != 0)
+    {
+        perror(name);
+        ok = 0;
+    }
+    if (!ok)
+    {
+        unlinkat(tofd, tmpname, 0);
+    }
+    return ok;
+}
+
+/*
+ * Copies the regular files of fromfd that differ in size or modification
+ * time from those in tofd, or only those missing there.  Hidden files are
+ * temporary ones and skipped.  Returns how many files were copied.
+ */
+static int
+mirror(int fromfd, int tofd, int depth, int missing_only)
+{
+    int dupfd = dup(fromfd);
+    DIR *dir = dupfd == -1 ? NULL : fdopendir(dupfd);
+    if (!dir)
+    {
+        perror("persist");
+        if (dupfd != -1)
+        {
+            close(dupfd);
+        }
+        return 0;
+    }
+    rewinddir(dir);
+
+    int copied = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        struct stat from, to;
+        if (name[0] == '.' || fstatat(fromfd, name, &from, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(from.st_mode) && depth > 0)
+        {
+            if (mkdirat(tofd, name, 0777) != 0 && errno != EEXIST)
+            {
+                perror(name);
+                continue;
+            }
+            int subfrom = openat(fromfd, name, O_RDONLY);
+            int subto = openat(tofd, name, O_RDONLY);
+            if (subfrom != -1 && subto != -1)
+            {
+                copied += mirror(subfrom, subto, depth - 1, missing_only);
+            }
+            if (subfrom != -1)
+            {
+                close(subfrom);
+            }
+            if (subto != -1)
+            {
+                close(subto);
+            }
+            continue;
+        }
+        if (!S_ISREG(from.st_mode))
+        {
+            continue;
+        }
+        if (fstatat(tofd, name, &to, 0) == 0 &&
+            (missing_only || (to.st_size == from.st_size && same_mtime(&to, &from))))
+        {
+            continue;
+        }
+        copied += copy_file(fromfd, tofd, name, &from);
+    }
+    closedir(dir);
+
+    if (copied && fsync(tofd) != 0)
+    {
+        perror("persist");
+    }
+    return copied;
+}
+
+static void
+copy_dir(const char *from, const char *to, int missing_only)
+{
+    int fromfd = open(from, O_RDONLY);
+    if (fromfd == -1)
+    {
+        perror(from);
+        return;
+    }
+    int tofd = open(to, O_RDONLY);
+    if (tofd == -1)
+    {
+        perror(to);
+        close(fromfd);
+        return;
+    }
+    mirror(fromfd, tofd, PERSIST_DEPTH, missing_only);
+    close(tofd);
+    close(fromfd);
+}
+
+static void
+persist_all(struct persist_sink *s)
+{
+    for (int i = 0; i < s->ndirs; ++i)
+    {
+        copy_dir(s->dirs[i].from, s->dirs[i].to, 0);
+    }
+}
+
+static void
+persist_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    (void)sink;
+    (void)source;
+    (void)record;
+}
+
+static void
+persist_tick(struct sink *sink, time_t now)
+{
+    struct persist_sink *s = (struct persist_sink *)sink;
+    if (now >= s->next)
+    {
+        persist_all(s);
+        s->next = now + s->interval;
+    }
+}
+
+static void
+free_dirs(struct persist_sink *s)
+{
+    for (int i = 0; i < s->ndirs; ++i)
+    {
+        free(s->dirs[i].from);
+        free(s->dirs[i].to);
+    }
+    free(s);
+}
+
+/* The other sinks are detached and flushed by the time it is destroyed. */
+static void
+persist_destroy(struct sink *sink)
+{
+    struct persist_sink *s = (struct persist_sink *)sink;
+    persist_all(s);
+    free_dirs(s);
+}
+
+/* Adds from, with its copy in persistdir under the same base name. */
+static int
+add_dir(struct persist_sink *s, const char *persistdir, const char *from)
+{
+    size_t end = strlen(from);
+    while (end > 1 && from[end - 1] == '/')
+    {
+        --end;
+    }
+    size_t start = end;
+    while (start > 0 && from[start - 1] != '/')
+    {
+        --start;
+    }
+    int baselen = (int)(end - start);
+    if (baselen == 0)
+    {
+        fprintf(stderr, "%s: cannot keep a copy of /\n", persistdir);
+        return 0;
+    }
+    for (int i = 0; i < s->ndirs; ++i)
+    {
+        const char *other = strrchr(s->dirs[i].to, '/') + 1;
+        if (strlen(other) == (size_t)baselen && strncmp(other, from + start, (size_t)baselen) == 0)
+        {
+            fprintf(stderr, "%s: the datadir and archivedir need different names\n", persistdir);
+            return 0;
+        }
+    }
+
+    struct persist_dir *dir = &s->dirs[s->ndirs];
+    size_t len = strlen(persistdir) + (size_t)baselen + 2;
+    dir->from = strdup(from);
+    dir->to = malloc(len);
+    if (!dir->from || !dir->to)
+    {
+        fprintf(stderr, "persist_sink_create: out of memory\n");
+        free(dir->from);
+        free(dir->to);
+        return 0;
+    }
+    snprintf(dir->to, len, "%s/%.*s", persistdir, baselen, from + start);
+    ++s->ndirs;
+    if (mkdir(dir->to, 0777) != 0 && errno != EEXIST)
+    {
+        perror(dir->to);
+        return 0;
+    }
+    return 1;
+}
+
+struct sink *
+persist_sink_create(const char *persistdir, int interval, const char *datadir, const char *archivedir)
+{
+    struct persist_sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "persist_sink_create: out of memory\n");
+        return NULL;
+    }
+    if ((datadir && !add_dir(s, persistdir, datadir)) || (archivedir && !add_dir(s, persistdir, archivedir)))
+    {
+        free_dirs(s);
+        return NULL;
+    }
+    /* After a reboot the tmpfs starts empty: bring back what was saved. */
+    for (int i = 0; i < s->ndirs; ++i)
+    {
+        copy_dir(s->dirs[i].to, s->dirs[i].from, 1);
+    }
+    s->interval = interval;
+    s->next = monotonic_time() + interval;
+    s->sink.name = "persist";
+    s->sink.publish = persist_publish;
+    s->sink.tick = persist_tick;
+    s->sink.destroy = persist_destroy;
+    return &s->sink;
+}
@@ -0,0 +1,407 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feeds round-robin databases through librrd, or through rrdcached when an
+ * address is given (-C or RRDCACHED_ADDRESS), instead of running rrdtool for
+ * every value.  librrd itself is still needed to create missing files and
+ * read their layout, so the file must be reachable from co2mond as well.
+ *
+ * Values are averaged over each step of the RRD and written in one update
+ * with a data source for every item the file knows: CO2 and TEMP for CntR
+ * and Tamb, the item's name (e.g. Hum) or x<code> (e.g. x6d) for the
+ * others.  Values are decoded as co2mon_items says.  Data sources the step
+ * has no values for are left unknown.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+
+#ifdef CO2MOND_HAVE_RRD
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <rrd.h>
+#include <rrd_client.h>
+
+#define RRD_STEP 5
+#define RRD_MAX_DS 16
+#define RRD_UPDATE_MAX (20 + RRD_MAX_DS * (VALUE_MAX + 1))
+
+struct rrd_device
+{
+    int used;
+    char path[PATH_MAX];
+    unsigned long step;
+    time_t last_update;
+
+    unsigned long ds_count;
+    int code[RRD_MAX_DS]; /* item of each data source, -1 if none */
+    double sum[RRD_MAX_DS];
+    unsigned int count[RRD_MAX_DS];
+
+    int pending;          /* sum and count hold values for a step */
+    time_t pending_time;  /* timestamp of the last of them */
+    time_t pending_since; /* tick at the first of them */
+};
+
+struct rrd_sink
+{
+    struct sink sink;
+    char *path;
+    char *daemon;
+    time_t now;
+    struct rrd_device devices[MAX_DEVICES];
+};
+
+static void
+report_rrd_error(const char *path)
+{
+    fprintf(stderr, "%s: %s\n", path, rrd_get_error());
+    rrd_clear_error();
+}
+
+/* The same layout as graph/rrd/Makefile, so that its graphs work. */
+static int
+create_rrd(const char *path)
+{
+    const char *args[] = {
+        "DS:CO2:GAUGE:60:0:3000",
+        "DS:TEMP:GAUGE:60:0:40",
+        "DS:x6d:GAUGE:60:0:3000",
+        "DS:x56:GAUGE:60:8000:10000",
+        "RRA:AVERAGE:0:1:17280",
+        "RRA:AVERAGE:0.5:12:43200",
+    };
+    if (rrd_create_r(path, RRD_STEP, time(NULL) - 10, sizeof(args) / sizeof(args[0]), args) != 0)
+    {
+        report_rrd_error(path);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+ds_code(const char *name)
+{
+    if (strcmp(name, "CO2") == 0)
+    {
+        return CO2MON_ITEM_CNTR;
+    }
+    if (strcmp(name, "TEMP") == 0)
+    {
+        return CO2MON_ITEM_TAMB;
+    }
+    char *end;
+    if (name[0] == 'x' && name[1] != '\0')
+    {
+        long code = strtol(name + 1, &end, 16);
+        if (*end == '\0' && code >= 0 && code <= 0xff)
+        {
+            return (int)code;
+        }
+    }
+    return co2mon_item_code(name);
+}
+
+static int
+open_rrd(struct rrd_device *dev)
+{
+    if (access(dev->path, F_OK) != 0 && errno == ENOENT && !create_rrd(dev->path))
+    {
+        return 0;
+    }
+
+    rrd_info_t *info = rrd_info_r(dev->path);
+    if (!info)
+    {
+        report_rrd_error(dev->path);
+        return 0;
+    }
+    dev->step = RRD_STEP;
+    for (rrd_info_t *i = info; i; i = i->next)
+    {
+        if (strcmp(i->key, "step") == 0 && i->type == RD_I_CNT)
+        {
+            dev->step = i->value.u_cnt;
+        }
+    }
+    rrd_info_free(info);
+
+    char **names;
+    char **last;
+    if (rrd_lastupdate_r(dev->path, &dev->last_update, &dev->ds_count, &names, &last) != 0)
+    {
+        report_rrd_error(dev->path);
+        return 0;
+    }
+    int known = 0;
+    for (unsigned long i = 0; i < dev->ds_count; ++i)
+    {
+        if (i < RRD_MAX_DS)
+        {
+            dev->code[i] = ds_code(names[i]);
+            known += dev->code[i] != -1;
+        }
+        free(names[i]);
+        free(last[i]);
+    }
+    free(names);
+    free(last);
+
+    if (dev->ds_count > RRD_MAX_DS)
+    {
+        fprintf(stderr, "%s: too many data sources, at most %d are supported\n", dev->path, RRD_MAX_DS);
+        return 0;
+    }
+    if (!known)
+    {
+        fprintf(stderr, "%s: no data sources for the sensor (CO2, TEMP or x<code>)\n", dev->path);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+flush_step(struct rrd_sink *s, struct rrd_device *dev)
+{
+    if (!dev->pending)
+    {
+        return;
+    }
+
+    char update[RRD_UPDATE_MAX];
+    int len = snprintf(update, sizeof(update), "%lld", (long long)dev->pending_time);
+    for (unsigned long i = 0; i < dev->ds_count; ++i)
+    {
+        if (dev->count[i])
+        {
+            len += snprintf(update + len, sizeof(update) - len, ":%.4f", dev->sum[i] / dev->count[i]);
+        }
+        else
+        {
+            len += snprintf(update + len, sizeof(update) - len, ":U");
+        }
+        dev->sum[i] = 0;
+        dev->count[i] = 0;
+    }
+    dev->pending = 0;
+
+    /* A replayed capture may predate what the file already has. */
+    if (dev->pending_time <= dev->last_update)
+    {
+        return;
+    }
+    dev->last_update = dev->pending_time;
+
+    const char *argv[] = { update };
+    int status;
+    if (s->daemon)
+    {
+        status = rrdc_update(dev->path, 1, argv);
+        if (status != 0)
+        {
+            /* rrdcached may have been restarted; reconnect next time. */
+            rrdc_disconnect();
+            rrdc_connect(s->daemon);
+        }
+    }
+    else
+    {
+        status = rrd_update_r(dev->path, NULL, 1, argv);
+    }
+    if (status != 0)
+    {
+        report_rrd_error(dev->path);
+    }
+}
+
+static void
+rrd_attach(struct sink *sink, const struct source *source)
+{
+    struct rrd_sink *s = (struct rrd_sink *)sink;
+    struct rrd_device *dev = &s->devices[source->slot];
+    memset(dev, 0, sizeof(*dev));
+
+    if (!multi_device)
+    {
+        snprintf(dev->path, PATH_MAX, "%s", s->path);
+    }
+    else
+    {
+        snprintf(dev->path, PATH_MAX, "%s/%s.rrd", s->path, source->name);
+    }
+    dev->used = open_rrd(dev);
+}
+
+static void
+rrd_detach(struct sink *sink, const struct source *source)
+{
+    struct rrd_sink *s = (struct rrd_sink *)sink;
+    struct rrd_device *dev = &s->devices[source->slot];
+    if (dev->used)
+    {
+        flush_step(s, dev);
+        dev->used = 0;
+    }
+}
+
+static void
+rrd_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct rrd_sink *s = (struct rrd_sink *)sink;
+    struct rrd_device *dev = &s->devices[source->slot];
+    if (!dev->used)
+    {
+        return;
+    }
+
+    time_t timestamp = (time_t)(record->timestamp / 1000000000);
+    if (dev->pending && (unsigned long)timestamp / dev->step != (unsigned long)dev->pending_time / dev->step)
+    {
+        flush_step(s, dev);
+    }
+
+    for (unsigned long i = 0; i < dev->ds_count; ++i)
+    {
+        if (dev->code[i] == record->code)
+        {
+            dev->sum[i] += co2mon_item_value(record->code, record->value);
+            dev->count[i]++;
+            if (!dev->pending)
+            {
+                dev->pending = 1;
+                dev->pending_since = s->now;
+            }
+            dev->pending_time = timestamp;
+        }
+    }
+}
+
+static void
+rrd_tick(struct sink *sink, time_t now)
+{
+    struct rrd_sink *s = (struct rrd_sink *)sink;
+    s->now = now;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        struct rrd_device *dev = &s->devices[i];
+        /* Don't hold the last step back if the sensor went quiet. */
+        if (dev->used && dev->pending && now - dev->pending_since > (time_t)dev->step)
+        {
+            flush_step(s, dev);
+        }
+    }
+}
+
+static void
+rrd_destroy(struct sink *sink)
+{
+    struct rrd_sink *s = (struct rrd_sink *)sink;
+    for (int i = 0; i < MAX_DEVICES; ++i)
+    {
+        if (s->devices[i].used)
+        {
+            flush_step(s, &s->devices[i]);
+        }
+    }
+    if (s->daemon)
+    {
+        rrdc_disconnect();
+    }
+    free(s->path);
+    free(s->daemon);
+    free(s);
+}
+
+struct sink *
+rrd_sink_create(const char *path, const char *daemon)
+{
+    struct rrd_sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "rrd_sink_create: out of memory\n");
+        return NULL;
+    }
+
+    /* Keep an absolute path for after daemon() changed to /. */
+    char cwd[PATH_MAX];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd)))
+    {
+        s->path = malloc(strlen(cwd) + strlen(path) + 2);
+        if (s->path)
+        {
+            sprintf(s->path, "%s/%s", cwd, path);
+        }
+    }
+    else
+    {
+        s->path = strdup(path);
+    }
+    if (!daemon)
+    {
+        daemon = getenv("RRDCACHED_ADDRESS");
+    }
+    if (daemon && daemon[0])
+    {
+        s->daemon = strdup(daemon);
+    }
+    if (!s->path || (daemon && daemon[0] && !s->daemon))
+    {
+        fprintf(stderr, "rrd_sink_create: out of memory\n");
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+
+    if (s->daemon && rrdc_connect(s->daemon) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", s->daemon, rrd_get_error());
+        free(s->path);
+        free(s->daemon);
+        free(s);
+        return NULL;
+    }
+
+    s->sink.attach = rrd_attach;
+    s->sink.detach = rrd_detach;
+    s->sink.name = "rrd";
+    s->sink.publish = rrd_publish;
+    s->sink.tick = rrd_tick;
+    s->sink.destroy = rrd_destroy;
+    return &s->sink;
+}
+
+#else
+
+struct sink *
+rrd_sink_create(const char *path, const char *daemon)
+{
+    (void)path;
+    (void)daemon;
+    fprintf(stderr, "co2mond: built without librrd, -r is not available\n");
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "co2mon_shm.h"
+#include "sink.h"
+
+struct snapshot_sink
+{
+    struct sink sink;
+    co2mon_shm *shm;
+};
+
+static void
+snapshot_attach(struct sink *sink, const struct source *source)
+{
+    struct snapshot_sink *s = (struct snapshot_sink *)sink;
+    co2mon_shm_set_name(s->shm, source->slot, source->name);
+}
+
+/* Readers must not take a sensor that is gone for a live one. */
+static void
+snapshot_detach(struct sink *sink, const struct source *source)
+{
+    struct snapshot_sink *s = (struct snapshot_sink *)sink;
+    co2mon_shm_clear(s->shm, source->slot);
+}
+
+static void
+snapshot_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct snapshot_sink *s = (struct snapshot_sink *)sink;
+    co2mon_shm_update(s->shm, source->slot, record->code, record->value, record->timestamp);
+}
+
+static void
+snapshot_destroy(struct sink *sink)
+{
+    struct snapshot_sink *s = (struct snapshot_sink *)sink;
+    co2mon_shm_close(s->shm);
+    free(s);
+}
+
+struct sink *
+snapshot_sink_create(const char *path)
+{
+    struct snapshot_sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "snapshot_sink_create: out of memory\n");
+        return NULL;
+    }
+    s->shm = co2mon_shm_create(path, MAX_DEVICES);
+    if (!s->shm)
+    {
+        free(s);
+        return NULL;
+    }
+    s->sink.attach = snapshot_attach;
+    s->sink.detach = snapshot_detach;
+    s->sink.name = "snapshot";
+    s->sink.publish = snapshot_publish;
+    s->sink.destroy = snapshot_destroy;
+    return &s->sink;
+}
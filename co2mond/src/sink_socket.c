@@ -0,0 +1,463 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pushes records to the clients of a Unix socket, see stream.h for the
+ * framing.  Every client has a bounded send buffer: when a client does not
+ * keep up its records are dropped, never the reader's or the other
+ * clients'.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "net.h"
+#include "sink.h"
+#include "stream.h"
+
+#define SOCKET_MAX_CLIENTS 32
+#define SOCKET_BUFFER_SIZE 65536 /* bytes queued per client */
+#define SOCKET_COMMAND_MAX 256
+#define SOCKET_LINE_MAX 160     /* room for a history line */
+
+struct socket_client
+{
+    int fd;            /* -1 if the slot is free */
+    int binary;
+    uint32_t seq;
+    unsigned long dropped; /* not reported yet */
+    size_t outlen;
+    char out[SOCKET_BUFFER_SIZE];
+    size_t inlen;
+    char in[SOCKET_COMMAND_MAX];
+};
+
+struct socket_sink
+{
+    struct sink sink;
+    int listenfd;
+    char *path;
+    struct socket_client *clients[SOCKET_MAX_CLIENTS];
+    int polled[SOCKET_MAX_CLIENTS + 1];
+};
+
+static void
+close_client(struct socket_sink *s, int i)
+{
+    close(s->clients[i]->fd);
+    free(s->clients[i]);
+    s->clients[i] = NULL;
+}
+
+/* Queues len bytes unless they do not fit. */
+static int
+queue(struct socket_client *c, const void *data, size_t len)
+{
+    if (SOCKET_BUFFER_SIZE - c->outlen < len)
+    {
+        return 0;
+    }
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
+    return 1;
+}
+
+static void
+queue_line(struct socket_client *c, const struct source *source, const char *name, const char *value, int64_t timestamp)
+{
+    char line[DEVNAME_MAX + ROLLING_NAME_MAX + 2 * VALUE_MAX + 8];
+    if (c->dropped)
+    {
+        int n = snprintf(line, sizeof(line), "#dropped\t%lu\n", c->dropped);
+        if (!queue(c, line, (size_t)n))
+        {
+            ++c->dropped;
+            return;
+        }
+        c->dropped = 0;
+    }
+    int n = snprintf(line, sizeof(line), "%s\t%s\t%s\t%lld\n", source->name, name, value, (long long)timestamp);
+    if (!queue(c, line, (size_t)n))
+    {
+        ++c->dropped;
+    }
+}
+
+static void
+queue_text(struct socket_client *c, const struct source *source, const struct record *record)
+{
+    char name[VALUE_MAX];
+    char value[VALUE_MAX];
+    co2mon_item_name(record->code, name, VALUE_MAX);
+    co2mon_item_format(record->code, co2mon_item_value(record->code, record->value), value, VALUE_MAX);
+    queue_line(c, source, name, value, record->timestamp);
+}
+
+static void
+queue_binary(struct socket_client *c, const struct record *record)
+{
+    struct stream_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.timestamp = record->timestamp;
+    frame.seq = c->seq++;
+    frame.value = record->value;
+    frame.code = record->code;
+    frame.device = record->device;
+    if (!queue(c, &frame, sizeof(frame)))
+    {
+        ++c->dropped;
+    }
+}
+
+/* Sends what the socket takes without blocking; returns 0 if the client
+ * is gone. */
+static int
+send_queued(struct socket_client *c)
+{
+    size_t sent = 0;
+    while (sent < c->outlen)
+    {
+        ssize_t r = write(c->fd, c->out + sent, c->outlen - sent);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (r <= 0)
+        {
+            return 0;
+        }
+        sent += (size_t)r;
+    }
+    memmove(c->out, c->out + sent, c->outlen - sent);
+    c->outlen -= sent;
+    return 1;
+}
+
+struct history_reply
+{
+    struct socket_client *client;
+    const struct history_query *query;
+    int64_t next;      /* timestamp to continue from if truncated */
+    int truncated;
+};
+
+static int
+queue_point(void *arg, const struct history_point *point)
+{
+    struct history_reply *r = arg;
+    char line[SOCKET_LINE_MAX];
+    int n = snprintf(line, sizeof(line), "#history\t");
+    n += history_format(r->query, point, line + n, sizeof(line) - (size_t)n);
+    /* Keep room for the closing line. */
+    if (SOCKET_BUFFER_SIZE - r->client->outlen < (size_t)n + SOCKET_LINE_MAX)
+    {
+        r->next = point->timestamp;
+        r->truncated = 1;
+        return 0;
+    }
+    queue(r->client, line, (size_t)n);
+    return 1;
+}
+
+/* Answers "history <query>" with "#history\t<line>" lines, then "#end\t<n>"
+ * or, if they did not all fit, "#truncated\t<since>" to ask again from. */
+static void
+answer_history(struct socket_client *c, const char *query)
+{
+    char line[SOCKET_LINE_MAX];
+    struct history_query q;
+    if (!history_enabled() || !history_parse_query(query, time(NULL), &q))
+    {
+        int n = snprintf(line, sizeof(line), "#error\t%s\n", history_enabled() ? "bad query" : "history is disabled");
+        queue(c, line, (size_t)n);
+        return;
+    }
+    struct history_reply r = { c, &q, 0, 0 };
+    size_t count = history_query(&q, queue_point, &r);
+    int n;
+    if (r.truncated)
+    {
+        n = snprintf(line, sizeof(line), "#truncated\t%lld.%03d\n", (long long)(r.next / 1000000000),
+                     (int)(r.next % 1000000000 / 1000000));
+    }
+    else
+    {
+        n = snprintf(line, sizeof(line), "#end\t%lu\n", (unsigned long)count);
+    }
+    queue(c, line, (size_t)n);
+}
+
+/* Handles "binary", "text" and, in text mode, "history" lines; returns 0
+ * if the client is gone. */
+static int
+read_commands(struct socket_client *c)
+{
+    ssize_t r = read(c->fd, c->in + c->inlen, SOCKET_COMMAND_MAX - c->inlen);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return 1;
+    }
+    if (r <= 0)
+    {
+        return 0;
+    }
+    c->inlen += (size_t)r;
+
+    char *line = c->in;
+    char *newline;
+    while ((newline = memchr(line, '\n', c->inlen - (size_t)(line - c->in))) != NULL)
+    {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r')
+        {
+            newline[-1] = '\0';
+        }
+        if (strcmp(line, "binary") == 0)
+        {
+            c->binary = 1;
+        }
+        else if (strcmp(line, "text") == 0)
+        {
+            c->binary = 0;
+        }
+        else if (strncmp(line, "history ", 8) == 0 && !c->binary)
+        {
+            answer_history(c, line + 8);
+        }
+        line = newline + 1;
+    }
+    c->inlen -= (size_t)(line - c->in);
+    memmove(c->in, line, c->inlen);
+    if (c->inlen == SOCKET_COMMAND_MAX)
+    {
+        c->inlen = 0; /* not a command we know */
+    }
+    return 1;
+}
+
+static void
+accept_client(struct socket_sink *s)
+{
+    int fd = net_accept(s->listenfd);
+    if (fd == -1)
+    {
+        return;
+    }
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; ++i)
+    {
+        if (!s->clients[i])
+        {
+            s->clients[i] = calloc(1, sizeof(struct socket_client));
+            if (!s->clients[i])
+            {
+                break;
+            }
+            s->clients[i]->fd = fd;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void
+socket_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; ++i)
+    {
+        struct socket_client *c = s->clients[i];
+        if (!c)
+        {
+            continue;
+        }
+        if (c->binary)
+        {
+            queue_binary(c, record);
+        }
+        else
+        {
+            queue_text(c, source, record);
+        }
+    }
+}
+
+static void
+socket_publish_stats(struct sink *sink, const struct source *source, const struct rolling_values *values)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    struct rolling_field fields[ROLLING_MAX_FIELDS];
+    int n = -1;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; ++i)
+    {
+        struct socket_client *c = s->clients[i];
+        if (!c || c->binary)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            n = rolling_fields(values, fields);
+        }
+        for (int j = 0; j < n; ++j)
+        {
+            queue_line(c, source, fields[j].name, fields[j].value, values->timestamp);
+        }
+    }
+}
+
+static void
+socket_flush(struct sink *sink)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; ++i)
+    {
+        if (s->clients[i] && s->clients[i]->outlen && !send_queued(s->clients[i]))
+        {
+            close_client(s, i);
+        }
+    }
+}
+
+static int
+socket_pollfds(struct sink *sink, struct pollfd *fds, int max)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    int n = 0;
+    int room = 0;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS && n < max; ++i)
+    {
+        struct socket_client *c = s->clients[i];
+        if (!c)
+        {
+            room = 1;
+            continue;
+        }
+        fds[n].fd = c->fd;
+        fds[n].events = POLLIN | (c->outlen ? POLLOUT : 0);
+        s->polled[n++] = i;
+    }
+    if (room && n < max)
+    {
+        fds[n].fd = s->listenfd;
+        fds[n].events = POLLIN;
+        s->polled[n++] = -1;
+    }
+    return n;
+}
+
+static void
+socket_handle(struct sink *sink, const struct pollfd *fds, int nfds)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    for (int i = 0; i < nfds; ++i)
+    {
+        if (!fds[i].revents)
+        {
+            continue;
+        }
+        int k = s->polled[i];
+        if (k == -1)
+        {
+            accept_client(s);
+            continue;
+        }
+        struct socket_client *c = s->clients[k];
+        int alive = 1;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            alive = read_commands(c);
+        }
+        if (alive && (fds[i].revents & POLLOUT))
+        {
+            alive = send_queued(c);
+        }
+        if (!alive)
+        {
+            close_client(s, k);
+        }
+    }
+}
+
+static void
+socket_destroy(struct sink *sink)
+{
+    struct socket_sink *s = (struct socket_sink *)sink;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; ++i)
+    {
+        if (s->clients[i])
+        {
+            send_queued(s->clients[i]);
+            close_client(s, i);
+        }
+    }
+    close(s->listenfd);
+    unlink(s->path);
+    free(s->path);
+    free(s);
+}
+
+struct sink *
+socket_sink_create(const char *path)
+{
+    struct socket_sink *s = calloc(1, sizeof(*s));
+    char cwd[PATH_MAX];
+    if (s && path[0] != '/' && getcwd(cwd, sizeof(cwd)))
+    {
+        /* Keep an absolute path to unlink after daemon() changed to /. */
+        s->path = malloc(strlen(cwd) + strlen(path) + 2);
+        if (s->path)
+        {
+            sprintf(s->path, "%s/%s", cwd, path);
+        }
+    }
+    else if (s)
+    {
+        s->path = strdup(path);
+    }
+    if (!s || !s->path)
+    {
+        fprintf(stderr, "socket_sink_create: out of memory\n");
+        free(s);
+        return NULL;
+    }
+    s->listenfd = net_listen_unix(s->path);
+    if (s->listenfd == -1)
+    {
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+    s->sink.name = "socket";
+    s->sink.publish = socket_publish;
+    s->sink.publish_stats = socket_publish_stats;
+    s->sink.flush = socket_flush;
+    s->sink.destroy = socket_destroy;
+    s->sink.pollfds = socket_pollfds;
+    s->sink.handle = socket_handle;
+    return &s->sink;
+}
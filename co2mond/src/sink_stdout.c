@@ -0,0 +1,93 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sink.h"
+
+static void
+print_value(const struct source *source, const char *name, const char *value)
+{
+    if (multi_device)
+    {
+        printf("%s\t%s\t%s\n", source->name, name, value);
+    }
+    else
+    {
+        printf("%s\t%s\n", name, value);
+    }
+}
+
+static void
+stdout_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    (void)sink;
+    if (!(co2mon_items[record->code].flags & CO2MON_ITEM_SHOW) && !print_unknown)
+    {
+        return;
+    }
+    char name[VALUE_MAX];
+    char buf[VALUE_MAX];
+    co2mon_item_name(record->code, name, VALUE_MAX);
+    co2mon_item_format(record->code, co2mon_item_value(record->code, record->value), buf, VALUE_MAX);
+    print_value(source, name, buf);
+}
+
+static void
+stdout_publish_stats(struct sink *sink, const struct source *source, const struct rolling_values *values)
+{
+    (void)sink;
+    struct rolling_field fields[ROLLING_MAX_FIELDS];
+    int n = rolling_fields(values, fields);
+    for (int i = 0; i < n; ++i)
+    {
+        print_value(source, fields[i].name, fields[i].value);
+    }
+}
+
+static void
+stdout_flush(struct sink *sink)
+{
+    (void)sink;
+    fflush(stdout);
+}
+
+static void
+stdout_destroy(struct sink *sink)
+{
+    fflush(stdout);
+    free(sink);
+}
+
+struct sink *
+stdout_sink_create()
+{
+    struct sink *sink = calloc(1, sizeof(*sink));
+    if (!sink)
+    {
+        fprintf(stderr, "stdout_sink_create: out of memory\n");
+        return NULL;
+    }
+    sink->name = "stdout";
+    sink->publish = stdout_publish;
+    sink->publish_stats = stdout_publish_stats;
+    sink->flush = stdout_flush;
+    sink->destroy = stdout_destroy;
+    return sink;
+}
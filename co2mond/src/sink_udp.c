@@ -0,0 +1,198 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sends every record to co2mon-collector as a datagram, see co2mon_udp.h.
+ * Records are packed as they are published and sent together on flush,
+ * with one sendmmsg() on Linux.  A collector that is down or a full
+ * socket buffer loses records, which the collector sees as gaps in seq.
+ * seq starts over on every attach, so every attach gets its own epoch
+ * and a device that comes back shows up as a restart.
+ */
+
+#define _GNU_SOURCE /* sendmmsg() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co2mon_udp.h"
+#include "net.h"
+#include "sink.h"
+
+#define UDP_BATCH 64 /* datagrams per flush at most */
+#define UDP_ERROR_INTERVAL 60 /* seconds between two messages about send errors */
+
+struct udp_sink
+{
+    struct sink sink;
+    int fd;
+    uint32_t epoch;
+    uint32_t attaches;   /* attach count, gives every attach its own epoch */
+    time_t error_shown;  /* monotonic time of the last message, 0 for none */
+    char device[MAX_DEVICES][CO2MON_UDP_NAME_MAX + 1];
+    uint32_t seq[MAX_DEVICES];
+    uint32_t slot_epoch[MAX_DEVICES];
+    unsigned char batch[UDP_BATCH][CO2MON_UDP_SIZE];
+    int nbatch;
+    unsigned long unsent;
+};
+
+static void
+send_batch(struct udp_sink *s)
+{
+    int sent = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < s->nbatch; ++i)
+    {
+        iov[i].iov_base = s->batch[i];
+        iov[i].iov_len = CO2MON_UDP_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < s->nbatch)
+    {
+        int r = sendmmsg(s->fd, msgs + sent, (unsigned)(s->nbatch - sent), 0);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r <= 0)
+        {
+            break;
+        }
+        sent += r;
+    }
+#else
+    for (; sent < s->nbatch; ++sent)
+    {
+        if (send(s->fd, s->batch[sent], CO2MON_UDP_SIZE, 0) < 0 && errno != EINTR)
+        {
+            break;
+        }
+    }
+#endif
+    if (sent < s->nbatch)
+    {
+        /* ECONNREFUSED after an ICMP error from a collector that is down,
+         * or a full buffer: the collector counts what is missing.  Every
+         * other send succeeds while the collector is down, so only time
+         * tells one outage from the next. */
+        int error = errno;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        errno = error;
+        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+            (!s->error_shown || ts.tv_sec - s->error_shown >= UDP_ERROR_INTERVAL))
+        {
+            perror("udp");
+            s->error_shown = ts.tv_sec;
+        }
+        s->unsent += (unsigned long)(s->nbatch - sent);
+    }
+    s->nbatch = 0;
+}
+
+static void
+udp_attach(struct sink *sink, const struct source *source)
+{
+    struct udp_sink *s = (struct udp_sink *)sink;
+    char host[64];
+    if (gethostname(host, sizeof(host)) != 0)
+    {
+        snprintf(host, sizeof(host), "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    snprintf(s->device[source->slot], sizeof(s->device[source->slot]), "%.20s/%.19s", host, source->name);
+    s->seq[source->slot] = 0;
+    s->slot_epoch[source->slot] = s->epoch + ++s->attaches;
+}
+
+static void
+udp_publish(struct sink *sink, const struct source *source, const struct record *record)
+{
+    struct udp_sink *s = (struct udp_sink *)sink;
+    struct co2mon_udp_record r;
+    r.code = record->code;
+    r.value = record->value;
+    r.seq = s->seq[source->slot]++;
+    r.epoch = s->slot_epoch[source->slot];
+    r.timestamp = record->timestamp;
+    memcpy(r.device, s->device[source->slot], sizeof(r.device));
+    co2mon_udp_pack(s->batch[s->nbatch++], &r);
+    if (s->nbatch == UDP_BATCH)
+    {
+        send_batch(s);
+    }
+}
+
+static void
+udp_flush(struct sink *sink)
+{
+    struct udp_sink *s = (struct udp_sink *)sink;
+    if (s->nbatch)
+    {
+        send_batch(s);
+    }
+}
+
+static void
+udp_destroy(struct sink *sink)
+{
+    struct udp_sink *s = (struct udp_sink *)sink;
+    udp_flush(sink);
+    if (s->unsent)
+    {
+        fprintf(stderr, "udp: %lu records could not be sent\n", s->unsent);
+    }
+    close(s->fd);
+    free(s);
+}
+
+struct sink *
+udp_sink_create(const char *spec)
+{
+    struct udp_sink *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        fprintf(stderr, "udp_sink_create: out of memory\n");
+        return NULL;
+    }
+    if ((s->fd = net_connect_udp(spec, CO2MON_UDP_PORT)) == -1)
+    {
+        free(s);
+        return NULL;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->epoch = (uint32_t)ts.tv_sec ^ (uint32_t)ts.tv_nsec ^ ((uint32_t)getpid() << 16);
+    s->sink.name = "udp";
+    s->sink.attach = udp_attach;
+    s->sink.publish = udp_publish;
+    s->sink.flush = udp_flush;
+    s->sink.destroy = udp_destroy;
+    return &s->sink;
+}
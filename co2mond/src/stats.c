@@ -0,0 +1,204 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <string.h>
+
+#include "stats.h"
+
+uint64_t stats_shards[STATS_SHARDS][MAX_DEVICES][NSTATS];
+
+/* What the counters stood at when the slot was last attached.  Written by
+ * the device thread; good enough for readers without a lock, as a reset
+ * is rare and a torn read only skews one scrape. */
+static uint64_t stats_base[MAX_DEVICES][NSTATS];
+
+const char *const stat_names[NSTATS] = {
+    "reports",
+    "checksum_errors",
+    "frame_errors",
+    "out_of_range",
+    "read_timeouts",
+    "reconnects",
+    "suppressed_writes",
+};
+
+struct histogram publish_latency;
+struct sink_stats sink_stats[STATS_MAX_SINKS];
+static int nsink_stats = 0;
+
+static uint64_t
+stats_sum(int slot, int stat)
+{
+    uint64_t sum = 0;
+    for (int shard = 0; shard < STATS_SHARDS; ++shard)
+    {
+        sum += __atomic_load_n(&stats_shards[shard][slot][stat], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+void
+stats_reset(int slot)
+{
+    for (int i = 0; i < NSTATS; ++i)
+    {
+        __atomic_store_n(&stats_base[slot][i], stats_sum(slot, i), __ATOMIC_RELAXED);
+    }
+}
+
+void
+stats_get(int slot, uint64_t *values)
+{
+    for (int i = 0; i < NSTATS; ++i)
+    {
+        values[i] = stats_sum(slot, i) - __atomic_load_n(&stats_base[slot][i], __ATOMIC_RELAXED);
+    }
+}
+
+static void
+relaxed_add(uint64_t *c, uint64_t n)
+{
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void
+histogram_add(struct histogram *h, uint64_t us)
+{
+    int bucket = 0;
+    if (us > 0)
+    {
+        bucket = 64 - __builtin_clzll(us);
+        if (bucket >= HISTOGRAM_BUCKETS)
+        {
+            bucket = HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    relaxed_add(&h->buckets[bucket], 1);
+    relaxed_add(&h->sum, us);
+    relaxed_add(&h->count, 1);
+}
+
+void
+histogram_get(const struct histogram *h, struct histogram *copy)
+{
+    copy->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        copy->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+struct histogram *
+stats_sink_latency(const char *name)
+{
+    int n = __atomic_load_n(&nsink_stats, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; ++i)
+    {
+        if (strcmp(sink_stats[i].name, name) == 0)
+        {
+            return &sink_stats[i].latency;
+        }
+    }
+    if (n == STATS_MAX_SINKS)
+    {
+        return NULL;
+    }
+    sink_stats[n].name = name;
+    __atomic_store_n(&nsink_stats, n + 1, __ATOMIC_RELEASE);
+    return &sink_stats[n].latency;
+}
+
+int
+stats_nsinks()
+{
+    return __atomic_load_n(&nsink_stats, __ATOMIC_ACQUIRE);
+}
+
+uint64_t
+histogram_bound(int bucket)
+{
+    return (uint64_t)1 << bucket;
+}
+
+/* The bound of the bucket that holds the q-th quantile. */
+static uint64_t
+histogram_quantile(const struct histogram *h, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count)
+    {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+        {
+            return histogram_bound(i);
+        }
+    }
+    return histogram_bound(HISTOGRAM_BUCKETS - 1);
+}
+
+static void
+dump_histogram(FILE *f, const char *what, const struct histogram *h)
+{
+    struct histogram copy;
+    histogram_get(h, &copy);
+    if (!copy.count)
+    {
+        return;
+    }
+    fprintf(f, "stats: %s: %llu samples, mean %.1f us, p50 < %llu us, p99 < %llu us, max < %llu us\n",
+        what, (unsigned long long)copy.count, (double)copy.sum / (double)copy.count,
+        (unsigned long long)histogram_quantile(&copy, 0.5),
+        (unsigned long long)histogram_quantile(&copy, 0.99),
+        (unsigned long long)histogram_quantile(&copy, 1.0));
+}
+
+void
+stats_dump(FILE *f, const char *const *names)
+{
+    for (int slot = 0; slot < MAX_DEVICES; ++slot)
+    {
+        if (!names[slot])
+        {
+            continue;
+        }
+        uint64_t values[NSTATS];
+        stats_get(slot, values);
+        fprintf(f, "stats: device %s:", names[slot]);
+        for (int i = 0; i < NSTATS; ++i)
+        {
+            fprintf(f, " %s %llu%s", stat_names[i], (unsigned long long)values[i], i + 1 < NSTATS ? "," : "\n");
+        }
+    }
+    dump_histogram(f, "publish latency", &publish_latency);
+    int n = stats_nsinks();
+    for (int i = 0; i < n; ++i)
+    {
+        char what[64];
+        snprintf(what, sizeof(what), "%s sink", sink_stats[i].name);
+        dump_histogram(f, what, &sink_stats[i].latency);
+    }
+    fflush(f);
+}
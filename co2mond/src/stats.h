@@ -0,0 +1,117 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_STATS_H_INCLUDED_
+#define CO2MOND_STATS_H_INCLUDED_
+
+/*
+ * Counters and latency histograms of the hot paths.  Each thread writes
+ * only its own shard (the device thread STATS_DEVICE, the output thread
+ * STATS_OUTPUT) with relaxed atomics, so counting costs an add and no
+ * lock; readers sum the shards.  Counters are per device slot and start
+ * over when a device is attached to the slot.
+ *
+ * Histograms have power-of-two buckets in microseconds: bucket 0 counts
+ * durations under 1 us, bucket i those in [2^(i-1), 2^i) us.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "co2mond.h"
+
+#define STATS_DEVICE 0
+#define STATS_OUTPUT 1
+#define STATS_SHARDS 2
+
+#define STAT_REPORTS 0      /* reports read */
+#define STAT_CHECKSUM 1     /* failed the checksum */
+#define STAT_BAD_FRAME 2    /* result[4] != 0x0d */
+#define STAT_OUT_OF_RANGE 3 /* outside the range of its item, see co2mon_item_valid() */
+#define STAT_TIMEOUTS 4     /* silent for READ_TIMEOUT */
+#define STAT_RECONNECTS 5   /* reopened after losing it */
+#define STAT_SUPPRESSED 6   /* datadir writes held back by filters */
+#define NSTATS 7
+
+#define HISTOGRAM_BUCKETS 32
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;       /* microseconds */
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+extern uint64_t stats_shards[STATS_SHARDS][MAX_DEVICES][NSTATS];
+
+/* What co2mond_<name>_total is called on /metrics. */
+extern const char *const stat_names[NSTATS];
+
+/* From a report coming off the device until the sinks get its record. */
+extern struct histogram publish_latency;
+
+/* Time spent in publish(), per kind of sink (its name), so the samples
+ * stay with their sink when a reload adds or removes others.  Entries are
+ * only ever appended, by the output thread: readers look at the first
+ * stats_nsinks() of them without a lock. */
+#define STATS_MAX_SINKS 32
+struct sink_stats
+{
+    const char *name;
+    struct histogram latency;
+};
+extern struct sink_stats sink_stats[STATS_MAX_SINKS];
+
+static inline void
+stats_add(int shard, int slot, int stat, uint64_t n)
+{
+    uint64_t *c = &stats_shards[shard][slot][stat];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Starts the counters of slot over; device thread only. */
+extern void
+stats_reset(int slot);
+
+/* Sums the shards of slot into values[NSTATS]. */
+extern void
+stats_get(int slot, uint64_t *values);
+
+/* Only the thread that owns h may add to it. */
+extern void
+histogram_add(struct histogram *h, uint64_t us);
+
+extern void
+histogram_get(const struct histogram *h, struct histogram *copy);
+
+/* The upper bound of a bucket in microseconds. */
+extern uint64_t
+histogram_bound(int bucket);
+
+/* The latency histogram of the sinks called name, added if it is new;
+ * NULL if the table is full.  Output thread only. */
+extern struct histogram *
+stats_sink_latency(const char *name);
+
+extern int
+stats_nsinks();
+
+/* Writes everything to f, with names[slot] for the devices to show. */
+extern void
+stats_dump(FILE *f, const char *const *names);
+
+#endif
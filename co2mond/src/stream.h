@@ -0,0 +1,57 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CO2MOND_STREAM_H_INCLUDED_
+#define CO2MOND_STREAM_H_INCLUDED_
+
+/*
+ * The record stream served on the -S socket.  A client is subscribed as
+ * soon as it connects and gets text lines first:
+ *
+ *   <device>\t<item>\t<value>\t<timestamp>\n
+ *
+ * with the item named as on stdout (Tamb, CntR or the code as 0x..) and
+ * the timestamp in nanoseconds since the Epoch.  A line "#dropped\t<n>"
+ * tells that n records did not fit into the client's buffer.  Windows
+ * asked for with -W add lines named as in rolling_fields() (e.g.
+ * CntR.ewma.300) after the value they follow; binary frames do not carry
+ * them.
+ *
+ * In text mode the line "history <query>" asks for the history of a
+ * metric (query as in history.h); the answer is a "#history\t<point>" line
+ * per point, formatted by history_format(), and then "#end\t<count>", or
+ * "#truncated\t<since>" when the rest did not fit into the buffer and
+ * should be asked for again from that time on.
+ *
+ * Writing the line "binary" to the socket switches to fixed-size frames,
+ * below, in host byte order; "text" switches back.  Binary frames carry
+ * the device slot instead of the name; gaps in seq show dropped records.
+ */
+
+#include <stdint.h>
+
+struct stream_frame
+{
+    int64_t timestamp; /* nanoseconds since the Epoch */
+    uint32_t seq;      /* per client, counts dropped frames too */
+    uint16_t value;    /* raw value, as in co2mon_record */
+    uint8_t code;
+    uint8_t device;    /* slot */
+};
+
+#endif
@@ -2,31 +2,30 @@ import collectd
 import os
 
 CO2MOND_DATADIR = '/var/lib/co2mon/'
-vl = collectd.Values(plugin='co2mon')
+last_time = {}
 
 def read_metric(name):
-    v = open(os.path.join(CO2MOND_DATADIR, name)).read()
+    with open(os.path.join(CO2MOND_DATADIR, name)) as f:
+        v = f.read()
+        # co2mond sets the modification time to when the value arrived.
+        mtime = os.fstat(f.fileno()).st_mtime
     try:
-        return int(v)
+        return int(v), mtime
     except ValueError:
-        return float(v)
+        return float(v), mtime
+
+
+def dispatch(name, **kwargs):
+    value, mtime = read_metric(name)
+    if last_time.get(name) == mtime:
+        return
+    last_time[name] = mtime
+    collectd.Values(plugin='co2mon', time=mtime).dispatch(values=[value], **kwargs)
 
 
 def read_callback(data=None):
-    global vl
-    try:
-        heartbeat = read_metric('heartbeat')
-    except:
-        heartbeat = None
-    if heartbeat:
-        if heartbeat > vl.time:
-            vl.time = heartbeat
-        else:
-            return
-    co2 = [read_metric('CntR')]
-    temp = [read_metric('Tamb')]
-    vl.dispatch(values=co2, type='gauge', type_instance='co2_ppm')
-    vl.dispatch(values=temp, type='temperature')
+    dispatch('CntR', type='gauge', type_instance='co2_ppm')
+    dispatch('Tamb', type='temperature')
 
 
 def configure_callback(conf):
@@ -0,0 +1,178 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * collectd plugin reading the snapshot of a co2mond started with -M.  Every
+ * read copies the device slots (no system calls, no file parsing) and
+ * dispatches the items updated since the previous read, with the time the
+ * sensor reported them.
+ *
+ *   LoadPlugin co2mon
+ *   <Plugin co2mon>
+ *     Snapshot "/dev/shm/co2mon"
+ *   </Plugin>
+ */
+
+/* collectd.h sets up the environment, it has to come first. */
+#include "collectd.h"
+#include "plugin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "co2mon.h"
+#include "co2mon_shm.h"
+
+#define DEFAULT_SNAPSHOT "/dev/shm/co2mon"
+#define MAX_SLOTS 64
+
+struct item_type
+{
+    unsigned char code;
+    const char *type;
+    const char *type_instance;
+};
+
+/* The names graph/collectd/co2mon.py used; every other item with
+ * CO2MON_ITEM_SHOW goes out as gauge-<item name>. */
+static const struct item_type legacy_types[] = {
+    { CO2MON_ITEM_CNTR, "gauge", "co2_ppm" },
+    { CO2MON_ITEM_TAMB, "temperature", "" },
+    { CO2MON_ITEM_HUM, "humidity", "" },
+};
+
+static const char *config_keys[] = { "Snapshot" };
+
+static char *snapshot_path = NULL;
+static co2mon_shm *shm = NULL;
+static int open_failed = 0;
+static int64_t last[MAX_SLOTS][256];
+
+static int
+co2mon_config(const char *key, const char *value)
+{
+    if (strcasecmp(key, "Snapshot") == 0)
+    {
+        char *path = strdup(value);
+        if (!path)
+        {
+            ERROR("co2mon plugin: out of memory");
+            return -1;
+        }
+        free(snapshot_path);
+        snapshot_path = path;
+        return 0;
+    }
+    return -1;
+}
+
+static void
+dispatch(const char *device, unsigned char code, uint16_t raw, int64_t timestamp)
+{
+    const char *type = "gauge";
+    const char *type_instance = co2mon_items[code].name;
+    for (size_t i = 0; i < sizeof(legacy_types) / sizeof(legacy_types[0]); ++i)
+    {
+        if (legacy_types[i].code == code)
+        {
+            type = legacy_types[i].type;
+            type_instance = legacy_types[i].type_instance;
+        }
+    }
+
+    value_t value;
+    value_list_t vl = VALUE_LIST_INIT;
+
+    value.gauge = (gauge_t)co2mon_item_value(code, raw);
+    vl.values = &value;
+    vl.values_len = 1;
+    vl.time = NS_TO_CDTIME_T(timestamp);
+    snprintf(vl.plugin, sizeof(vl.plugin), "co2mon");
+    snprintf(vl.plugin_instance, sizeof(vl.plugin_instance), "%s", device);
+    snprintf(vl.type, sizeof(vl.type), "%s", type);
+    snprintf(vl.type_instance, sizeof(vl.type_instance), "%s", type_instance);
+    plugin_dispatch_values(&vl);
+}
+
+static int
+co2mon_read(void)
+{
+    const char *path = snapshot_path ? snapshot_path : DEFAULT_SNAPSHOT;
+    if (!shm)
+    {
+        /* co2mond may start after collectd. */
+        if (access(path, R_OK) != 0 || !(shm = co2mon_shm_open(path)))
+        {
+            if (!open_failed)
+            {
+                WARNING("co2mon plugin: cannot open %s, is co2mond running with -M?", path);
+                open_failed = 1;
+            }
+            return -1;
+        }
+        open_failed = 0;
+    }
+
+    unsigned ndevices = co2mon_shm_ndevices(shm);
+    if (ndevices > MAX_SLOTS)
+    {
+        ndevices = MAX_SLOTS;
+    }
+    for (unsigned slot = 0; slot < ndevices; ++slot)
+    {
+        struct co2mon_shm_device dev;
+        if (co2mon_shm_read(shm, slot, &dev) != 1)
+        {
+            continue;
+        }
+        for (int code = 0; code < 256; ++code)
+        {
+            int64_t timestamp = dev.timestamp[code];
+            if ((co2mon_items[code].flags & CO2MON_ITEM_SHOW) && timestamp != 0 && timestamp != last[slot][code])
+            {
+                dispatch(dev.name, (unsigned char)code, dev.data[code], timestamp);
+                last[slot][code] = timestamp;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+co2mon_shutdown(void)
+{
+    if (shm)
+    {
+        co2mon_shm_close(shm);
+        shm = NULL;
+    }
+    free(snapshot_path);
+    snapshot_path = NULL;
+    return 0;
+}
+
+void
+module_register(void)
+{
+    plugin_register_config("co2mon", co2mon_config, config_keys, sizeof(config_keys) / sizeof(config_keys[0]));
+    plugin_register_read("co2mon", co2mon_read);
+    plugin_register_shutdown("co2mon", co2mon_shutdown);
+}
@@ -18,18 +18,130 @@
 #ifndef CO2MON_H_INCLUDED_
 #define CO2MON_H_INCLUDED_
 
-#include <hidapi.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef hid_device *co2mon_device;
+typedef struct co2mon_device_ *co2mon_device;
 
 typedef unsigned char co2mon_data_t[8];
 
+/* Returned by co2mon_read_data_nonblock() when no report is pending. */
+#define CO2MON_WOULD_BLOCK (-2)
+
+/* Error codes, see co2mon_last_error() and co2mon_strerror(). */
+#define CO2MON_OK 0
+#define CO2MON_ERROR_NOT_FOUND 1  /* no sensor attached */
+#define CO2MON_ERROR_NO_MEMORY 2
+#define CO2MON_ERROR_OPEN 3       /* the device is there but cannot be opened */
+#define CO2MON_ERROR_IO 4         /* the transfer failed, e.g. unplugged */
+#define CO2MON_ERROR_TIMEOUT 5    /* no report within the read timeout */
+#define CO2MON_ERROR_SHORT_READ 6 /* a report of the wrong length */
+#define CO2MON_ERROR_CHECKSUM 7   /* a report that does not decode */
+#define CO2MON_ERROR_INVALID 8    /* bad arguments or device path */
+#define CO2MON_ERROR_SYSTEM 9     /* a system call failed */
+
+/* The largest number of devices co2mon_poll() accepts. */
+#define CO2MON_POLL_MAX 256
+
+#define CO2MON_VENDOR_ID 0x04d9
+#define CO2MON_PRODUCT_ID 0xa052
+
+struct co2mon_device_info
+{
+    char *path;
+    char *serial_number;
+    struct co2mon_device_info *next;
+};
+
+/* A decoded report that passed the checksum. */
+struct co2mon_record
+{
+    unsigned char code;
+    uint16_t value;
+    int64_t timestamp; /* nanoseconds since the Epoch */
+    int64_t monotonic; /* nanoseconds on CLOCK_MONOTONIC */
+};
+
+/* Item codes, the first byte of a report. */
+#define CO2MON_ITEM_HUM 0x41  /* Relative Humidity */
+#define CO2MON_ITEM_TAMB 0x42 /* Ambient Temperature */
+#define CO2MON_ITEM_CNTR 0x50 /* Relative Concentration of CO2 */
+
+/* Flags of an item descriptor. */
+#define CO2MON_ITEM_SHOW 0x01  /* printed without asking for unknown items */
+#define CO2MON_ITEM_STORE 0x02 /* kept as a metric: data directory, history, archive */
+
+/*
+ * What an item code means.  The table is indexed by the code; codes
+ * without a descriptor have a NULL name and their words are taken as they
+ * are (scale 1, any word valid).
+ */
+struct co2mon_item
+{
+    const char *name;  /* e.g. "CntR" */
+    double scale;      /* value = word * scale + offset */
+    double offset;
+    uint16_t min;      /* words outside [min, max] are spurious */
+    uint16_t max;
+    double deadband;   /* default smallest change worth writing, in units of the value */
+    double warning;    /* levels worth alerting on (as munin does), 0 for none */
+    double critical;
+    int precision;     /* decimals when printed */
+    unsigned flags;    /* CO2MON_ITEM_* */
+};
+
+extern const struct co2mon_item co2mon_items[256];
+
+typedef void (*co2mon_callback)(co2mon_device dev, const struct co2mon_record *record, void *arg);
+
+/* What happened on a device handle since it was opened. */
+struct co2mon_stats
+{
+    uint64_t reports;         /* reports read, valid or not */
+    uint64_t checksum_errors; /* ... of which did not decode */
+    uint64_t short_reads;
+    uint64_t timeouts;
+    uint64_t io_errors;
+    uint64_t suppressed;      /* log messages dropped by the rate limit */
+};
+
+/*
+ * Diagnostics go to a log callback, stderr by default.  Messages about a
+ * device handle are rate limited per handle (CO2MON_LOG_BURST within
+ * CO2MON_LOG_INTERVAL seconds), so a flaky sensor cannot flood the log;
+ * the read path itself only counts and never blocks on the log.  dev is
+ * NULL for messages that are not about an open handle, such as those of
+ * the snapshot and archive functions.
+ */
+#define CO2MON_LOG_BURST 10
+#define CO2MON_LOG_INTERVAL 60
+
+typedef void (*co2mon_log_callback)(co2mon_device dev, int error, const char *message, void *arg);
+
+/* Set it before opening devices; NULL silences the library. */
+extern void
+co2mon_set_log_callback(co2mon_log_callback callback, void *arg);
+
+/* The default callback. */
+extern void
+co2mon_log_stderr(co2mon_device dev, int error, const char *message, void *arg);
+
+/* A static description of one of CO2MON_OK and CO2MON_ERROR_*. */
+extern const char *
+co2mon_strerror(int error);
+
 extern int
 co2mon_init();
 
 extern void
 co2mon_exit();
 
+extern struct co2mon_device_info *
+co2mon_enumerate();
+
+extern void
+co2mon_free_enumeration(struct co2mon_device_info *devs);
+
 extern co2mon_device
 co2mon_open_device();
 
@@ -42,10 +154,148 @@ co2mon_close_device(co2mon_device dev);
 extern int
 co2mon_device_path(co2mon_device dev, char *str, size_t maxlen);
 
+/* The outcome of the last operation on dev, one of CO2MON_OK and
+ * CO2MON_ERROR_*.  A read of a report that fails the checksum still
+ * succeeds but sets CO2MON_ERROR_CHECKSUM. */
+extern int
+co2mon_last_error(co2mon_device dev);
+
+extern void
+co2mon_device_stats(co2mon_device dev, struct co2mon_stats *stats);
+
+/* Returns a file descriptor that becomes readable when a report arrives,
+ * or -1 if the backend has none; co2mon_poll() copes with both. */
+extern int
+co2mon_device_fd(co2mon_device dev);
+
+/* The callback is invoked by co2mon_read_data*() for every valid report. */
+extern void
+co2mon_set_callback(co2mon_device dev, co2mon_callback callback, void *arg);
+
 extern int
 co2mon_send_magic_table(co2mon_device dev, co2mon_data_t magic_table);
 
 extern int
 co2mon_read_data(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result);
 
+/* Like co2mon_read_data(), but returns CO2MON_WOULD_BLOCK at once when
+ * there is nothing to read. */
+extern int
+co2mon_read_data_nonblock(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result);
+
+/* Newer firmware sends plaintext reports.  The first valid report tells
+ * which kind a device is; a device that sent CO2MON_PROBE_REPORTS reports
+ * without a valid one is treated as encrypted from then on. */
+#define CO2MON_PROBE_REPORTS 8
+
+#define CO2MON_ENCODING_UNKNOWN 0
+#define CO2MON_ENCODING_ENCRYPTED 1
+#define CO2MON_ENCODING_PLAINTEXT 2
+
+/* Returns one of CO2MON_ENCODING_*. */
+extern int
+co2mon_device_encoding(co2mon_device dev);
+
+/* When the report last returned by co2mon_read_data*() arrived, taken
+ * right after the transfer (or when co2mon_poll() picked it up): in
+ * nanoseconds since the Epoch and on CLOCK_MONOTONIC.  Either may be NULL. */
+extern void
+co2mon_report_time(co2mon_device dev, int64_t *realtime, int64_t *monotonic);
+
+/* Copies the undecoded report last returned by co2mon_read_data*(). */
+extern void
+co2mon_raw_report(co2mon_device dev, co2mon_data_t raw);
+
+/* Encoding detection for reports that do not come from a device handle,
+ * e.g. from a capture file.  Start with a zeroed decoder per device. */
+struct co2mon_decoder
+{
+    int encoding;
+    int probed;
+};
+
+extern void
+co2mon_decode(struct co2mon_decoder *dec, const co2mon_data_t raw, const co2mon_data_t magic_table, co2mon_data_t result);
+
+/* Decodes n raw reports stored back to back in raw into out[0..n-1].  If
+ * valid is not NULL, valid[i] is set to 1 for reports that pass the
+ * checksum and 0 otherwise.  Returns the number of valid reports. */
+extern size_t
+co2mon_decode_batch(const unsigned char *raw, size_t n, const co2mon_data_t magic_table, co2mon_data_t *out, unsigned char *valid);
+
+/* Waits up to timeout milliseconds (forever if negative) until some of
+ * devs have data.  Sets ready[i] for those and returns their number,
+ * 0 on timeout or -1 on error (errno is EINTR if a signal arrived). */
+extern int
+co2mon_poll(co2mon_device *devs, int *ready, int ndevs, int timeout);
+
+/* Like co2mon_poll(), but also waits for nfds other file descriptors and
+ * sets their revents as poll() does; they count towards the result. */
+struct pollfd;
+
+extern int
+co2mon_poll_fds(co2mon_device *devs, int *ready, int ndevs, struct pollfd *fds, int nfds, int timeout);
+
+/*
+ * Notifications about sensors being plugged in and unplugged, so that
+ * nobody has to enumerate devices over and over while waiting for one.
+ * libudev (or the kernel's uevent socket) on Linux, IOKit on macOS.
+ */
+typedef struct co2mon_hotplug_ *co2mon_hotplug;
+
+#define CO2MON_HOTPLUG_ARRIVED 1
+#define CO2MON_HOTPLUG_LEFT 2
+
+struct co2mon_hotplug_event
+{
+    int action;    /* CO2MON_HOTPLUG_* */
+    char node[64]; /* the device as the system named it, empty if unknown */
+};
+
+/* Returns NULL if hotplug notifications are not available. */
+extern co2mon_hotplug
+co2mon_hotplug_open();
+
+extern void
+co2mon_hotplug_close(co2mon_hotplug hp);
+
+/* Becomes readable when there are events for co2mon_hotplug_read(). */
+extern int
+co2mon_hotplug_fd(co2mon_hotplug hp);
+
+/* Takes the next event about a sensor.  Returns 1, 0 if there is none
+ * pending or -1 on error. */
+extern int
+co2mon_hotplug_read(co2mon_hotplug hp, struct co2mon_hotplug_event *ev);
+
+/* Whether ev is about the device at path (as returned by co2mon_enumerate()
+ * or co2mon_device_path()): 1 or 0, -1 if the event does not say. */
+extern int
+co2mon_hotplug_match(const struct co2mon_hotplug_event *ev, const char *path);
+
+/* Whether events are sent for a device at path, i.e. it is a real one and
+ * not, e.g., simulated. */
+extern int
+co2mon_hotplug_covers(const char *path);
+
+/* Decodes a word (or an average of words) of item code. */
+extern double
+co2mon_item_value(unsigned char code, double word);
+
+/* Whether word is plausible for item code. */
+extern int
+co2mon_item_valid(unsigned char code, uint16_t word);
+
+/* Prints the decoded value with the item's precision, as snprintf() does. */
+extern int
+co2mon_item_format(unsigned char code, double value, char *buf, size_t size);
+
+/* Prints the item's name, or the code as "0x%02x" if it has none. */
+extern int
+co2mon_item_name(unsigned char code, char *buf, size_t size);
+
+/* Returns the code of the item called name, -1 if there is none. */
+extern int
+co2mon_item_code(const char *name);
+
 #endif
@@ -0,0 +1,196 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MON_ARCHIVE_H_INCLUDED_
+#define CO2MON_ARCHIVE_H_INCLUDED_
+
+/*
+ * Long-term archive of sensor values (co2mond -Y), one segment file per
+ * device and UTC day.  A segment is a header and a sequence of blocks,
+ * appended as they fill up; every block holds the samples of one item
+ * over at most an hour and can be checked (CRC-32C) and skipped by its
+ * header alone.  A closed segment ends with a footer that sums up every
+ * item, so a query can skip the whole file; a segment still being written
+ * has no footer, and the writer drops it (and any torn block) when it
+ * appends again.
+ *
+ * Samples are stored with the precision of a second.  The payload of a
+ * block is a sequence of varints, each a token followed by its operands:
+ *
+ *   token & 1 == 1          the previous sample step repeats token >> 1
+ *                           more times
+ *   token & 3 == 0          value delta zigzag(token >> 2), same time delta
+ *                           as the previous step
+ *   token & 3 == 2          value delta zigzag(token >> 2), followed by the
+ *                           change of the time delta, zigzagged
+ *
+ * The first sample is in the block header and the time delta before it
+ * is 0.  At the sensor's steady pace a step takes one byte, and a run of
+ * steady values a couple of bytes in all.  Fields are in host byte order,
+ * which the header records.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CO2MON_ARCHIVE_MAGIC "CO2MARC"
+#define CO2MON_ARCHIVE_VERSION 2
+#define CO2MON_ARCHIVE_BYTE_ORDER 0x01020304
+#define CO2MON_ARCHIVE_NAME_MAX 64
+
+#define CO2MON_ARCHIVE_BLOCK_MAGIC 0x42324f43  /* "CO2B" */
+#define CO2MON_ARCHIVE_FOOTER_MAGIC 0x46324f43 /* "CO2F" */
+
+#define CO2MON_ARCHIVE_BLOCK_SAMPLES 4096
+#define CO2MON_ARCHIVE_BLOCK_SECONDS 3600
+/* Worst case: a 3-byte token and a 10-byte time delta change per sample. */
+#define CO2MON_ARCHIVE_PAYLOAD_MAX (CO2MON_ARCHIVE_BLOCK_SAMPLES * 13 + 16)
+
+#define CO2MON_ARCHIVE_PADDED(length) (((length) + 7) & ~(size_t)7)
+
+struct co2mon_archive_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int64_t day;                         /* midnight UTC, seconds since the Epoch */
+    char name[CO2MON_ARCHIVE_NAME_MAX];  /* of the device */
+    uint64_t reserved;
+};
+
+struct co2mon_archive_block
+{
+    uint32_t magic;
+    uint32_t crc;          /* of the rest of the header and the payload */
+    int64_t first;         /* seconds since the Epoch */
+    int64_t last;
+    uint64_t sum;          /* of the raw values, for averages without decoding */
+    uint32_t count;        /* samples */
+    uint32_t length;       /* of the payload that follows, before padding */
+    uint8_t code;
+    uint8_t reserved;
+    uint16_t first_value;  /* raw value, as in co2mon_record */
+    uint16_t min;
+    uint16_t max;
+};
+
+/* Per item of a closed segment, in the footer. */
+struct co2mon_archive_summary
+{
+    int64_t first;
+    int64_t last;
+    uint32_t count;
+    uint8_t code;
+    uint8_t reserved;
+    uint16_t min;
+    uint16_t max;
+    uint16_t reserved2[3];
+};
+
+/* Ends a closed segment, after its summaries. */
+struct co2mon_archive_footer
+{
+    uint32_t magic;
+    uint32_t crc;          /* of the summaries and the rest of the footer */
+    uint32_t nsummaries;
+    uint32_t reserved;
+};
+
+extern uint32_t
+co2mon_archive_crc32c(uint32_t crc, const void *data, size_t size);
+
+/* Encoding one block */
+
+struct co2mon_archive_encoder
+{
+    int64_t delta;         /* time delta of the previous step */
+    int stepped;           /* there was a step, for runs */
+    int32_t step_value;
+    uint32_t run;          /* repeats of it not written yet */
+    uint16_t value;
+    /* The block as it goes to the file: the payload follows the header. */
+    struct co2mon_archive_block block;
+    uint8_t payload[CO2MON_ARCHIVE_PAYLOAD_MAX];
+};
+
+extern void
+co2mon_archive_encoder_reset(struct co2mon_archive_encoder *enc, uint8_t code);
+
+/* Returns 0 if the block is full (by samples or time): finish it and add
+ * the sample to the next one. */
+extern int
+co2mon_archive_encoder_add(struct co2mon_archive_encoder *enc, int64_t timestamp, uint16_t value);
+
+/* Completes the header.  Returns the payload length, which is 0 for an
+ * empty block but also for one of a single sample: block.count tells
+ * them apart. */
+extern size_t
+co2mon_archive_encoder_finish(struct co2mon_archive_encoder *enc);
+
+/* Decoding */
+
+/* Checks the magic, length and CRC of the block at data, with size bytes
+ * up to the end of the blocks. */
+extern int
+co2mon_archive_block_valid(const void *data, size_t size);
+
+/* Decodes up to max samples; either array may be NULL if not wanted.
+ * Returns the number of samples, or -1 if the payload is corrupt. */
+extern long
+co2mon_archive_decode(const struct co2mon_archive_block *block, int64_t *timestamps, uint16_t *values, size_t max);
+
+/* Reading segments */
+
+struct co2mon_archive_segment
+{
+    const char *data;
+    size_t size;
+    const struct co2mon_archive_header *header;
+    const struct co2mon_archive_footer *footer; /* NULL if not closed */
+    const struct co2mon_archive_summary *summaries;
+    size_t end;                                 /* of the blocks */
+};
+
+/* Maps a segment read-only.  Returns 0 if it is not a segment. */
+extern int
+co2mon_archive_map(struct co2mon_archive_segment *segment, const char *path);
+
+extern void
+co2mon_archive_unmap(struct co2mon_archive_segment *segment);
+
+/* Iterates over the blocks: pass NULL for the first one.  Returns NULL
+ * after the last.  Only the framing is checked, so that skipping a block
+ * costs nothing: check co2mon_archive_block_valid() before using one. */
+extern const struct co2mon_archive_block *
+co2mon_archive_next_block(const struct co2mon_archive_segment *segment, const struct co2mon_archive_block *block);
+
+/* Writing segments */
+
+typedef struct co2mon_archive_ co2mon_archive;
+
+/* Opens a segment for appending, creating it if needed. */
+extern co2mon_archive *
+co2mon_archive_open(const char *path, const char *name, int64_t day);
+
+extern int
+co2mon_archive_append(co2mon_archive *archive, const struct co2mon_archive_encoder *enc);
+
+/* Writes the footer and closes the segment. */
+extern void
+co2mon_archive_close(co2mon_archive *archive);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MON_SHM_H_INCLUDED_
+#define CO2MON_SHM_H_INCLUDED_
+
+/*
+ * Live snapshot of every sensor served by co2mond, kept in a memory-mapped
+ * file (co2mond -M).  Each device slot is guarded by a sequence lock, so
+ * readers get a consistent copy without any system call or file lock.
+ */
+
+#include <stdint.h>
+
+#define CO2MON_SHM_MAGIC 0x4d324f43 /* "CO2M" */
+#define CO2MON_SHM_VERSION 1
+#define CO2MON_SHM_NAME_MAX 64
+
+struct co2mon_shm_device
+{
+    uint32_t seq;                   /* odd while the slot is being written */
+    uint32_t used;
+    char name[CO2MON_SHM_NAME_MAX];
+    int64_t heartbeat;              /* time of the last update */
+    int64_t timestamp[256];         /* time data[code] was last updated, 0 if never */
+    uint16_t data[256];             /* raw words, indexed by item code */
+};
+
+struct co2mon_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ndevices;
+    uint32_t device_size;
+};
+
+/* All times are nanoseconds since the Epoch. */
+
+typedef struct co2mon_shm_ co2mon_shm;
+
+/* Creates (or resets) the snapshot file for the writer. */
+extern co2mon_shm *
+co2mon_shm_create(const char *path, unsigned ndevices);
+
+/* Maps an existing snapshot file read-only. */
+extern co2mon_shm *
+co2mon_shm_open(const char *path);
+
+extern void
+co2mon_shm_close(co2mon_shm *shm);
+
+extern unsigned
+co2mon_shm_ndevices(const co2mon_shm *shm);
+
+extern void
+co2mon_shm_set_name(co2mon_shm *shm, unsigned slot, const char *name);
+
+/* Empties a slot, e.g. once its device is gone. */
+extern void
+co2mon_shm_clear(co2mon_shm *shm, unsigned slot);
+
+extern void
+co2mon_shm_update(co2mon_shm *shm, unsigned slot, unsigned char code, uint16_t value, int64_t timestamp);
+
+/* Copies a slot.  Returns 1 if the slot is in use, 0 if it is empty and
+ * -1 if the writer kept it busy for too long. */
+extern int
+co2mon_shm_read(const co2mon_shm *shm, unsigned slot, struct co2mon_shm_device *snapshot);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MON_UDP_H_INCLUDED_
+#define CO2MON_UDP_H_INCLUDED_
+
+/*
+ * Records sent by co2mond -U to co2mon-collector, one per datagram of
+ * CO2MON_UDP_SIZE bytes, all integers big-endian:
+ *
+ *   0  magic      "CO2U"
+ *   4  version    CO2MON_UDP_VERSION
+ *   5  code       item code
+ *   6  value      raw word
+ *   8  seq        per device, one more for every record
+ *  12  epoch      chosen when the device is attached; a new one restarts seq
+ *  16  timestamp  nanoseconds since the Epoch
+ *  24  device     "<host>/<device>", NUL-padded
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CO2MON_UDP_MAGIC 0x434f3255 /* "CO2U" */
+#define CO2MON_UDP_VERSION 1
+#define CO2MON_UDP_SIZE 64
+#define CO2MON_UDP_NAME_MAX 40
+#define CO2MON_UDP_PORT "17463"
+
+struct co2mon_udp_record
+{
+    unsigned char code;
+    uint16_t value;
+    uint32_t seq;
+    uint32_t epoch;
+    int64_t timestamp;
+    char device[CO2MON_UDP_NAME_MAX + 1];
+};
+
+extern void
+co2mon_udp_pack(unsigned char *buf, const struct co2mon_udp_record *record);
+
+/* Returns 0 unless buf holds a datagram of this version. */
+extern int
+co2mon_udp_unpack(const unsigned char *buf, size_t len, struct co2mon_udp_record *record);
+
+#endif
@@ -0,0 +1,664 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "co2mon_archive.h"
+#include "device.h"
+
+/* SSE4.2 and ARMv8 have an instruction for CRC-32C, chosen at run time on
+ * x86 like the decoders. */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ARCHIVE_CRC_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define ARCHIVE_CRC_ARM 1
+#include <arm_acle.h>
+#endif
+
+#define BLOCK_CRC_OFFSET offsetof(struct co2mon_archive_block, first)
+
+struct co2mon_archive_
+{
+    int fd;
+    char *path;
+    struct co2mon_archive_summary summaries[256];
+};
+
+/* CRC-32C (Castagnoli), reflected, polynomial 0x82f63b78. */
+static const uint32_t crc_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t
+crc_table_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+    while (size--)
+    {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef ARCHIVE_CRC_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_sse42_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+    uint64_t c = crc;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    while (size--)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef ARCHIVE_CRC_ARM
+static uint32_t
+crc_arm_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    while (size--)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t
+co2mon_archive_crc32c(uint32_t crc, const void *data, size_t size)
+{
+#if defined(ARCHIVE_CRC_SSE42)
+    static int have_sse42 = -1;
+    if (have_sse42 < 0)
+    {
+        have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    if (have_sse42)
+    {
+        return ~crc_sse42_update(~crc, data, size);
+    }
+#elif defined(ARCHIVE_CRC_ARM)
+    return ~crc_arm_update(~crc, data, size);
+#endif
+    return ~crc_table_update(~crc, data, size);
+}
+
+static uint32_t
+block_crc(const struct co2mon_archive_block *block, const void *payload)
+{
+    uint32_t crc = co2mon_archive_crc32c(0, (const char *)block + BLOCK_CRC_OFFSET, sizeof(*block) - BLOCK_CRC_OFFSET);
+    return co2mon_archive_crc32c(crc, payload, block->length);
+}
+
+static uint64_t
+zigzag(int64_t x)
+{
+    return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t x)
+{
+    return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+static void
+put_varint(struct co2mon_archive_encoder *enc, uint64_t x)
+{
+    uint32_t len = enc->block.length;
+    while (x >= 0x80)
+    {
+        enc->payload[len++] = (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    enc->payload[len++] = (uint8_t)x;
+    enc->block.length = len;
+}
+
+/* Returns 0 past the end or on an overlong varint. */
+static int
+get_varint(const uint8_t **p, const uint8_t *end, uint64_t *x)
+{
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (*p == end)
+        {
+            return 0;
+        }
+        uint8_t b = *(*p)++;
+        *x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+co2mon_archive_encoder_reset(struct co2mon_archive_encoder *enc, uint8_t code)
+{
+    memset(&enc->block, 0, sizeof(enc->block));
+    enc->block.magic = CO2MON_ARCHIVE_BLOCK_MAGIC;
+    enc->block.code = code;
+    enc->delta = 0;
+    enc->stepped = 0;
+    enc->step_value = 0;
+    enc->run = 0;
+    enc->value = 0;
+}
+
+static void
+flush_run(struct co2mon_archive_encoder *enc)
+{
+    if (enc->run)
+    {
+        put_varint(enc, (uint64_t)enc->run << 1 | 1);
+        enc->run = 0;
+    }
+}
+
+int
+co2mon_archive_encoder_add(struct co2mon_archive_encoder *enc, int64_t timestamp, uint16_t value)
+{
+    struct co2mon_archive_block *b = &enc->block;
+    if (b->count == 0)
+    {
+        b->first = b->last = timestamp;
+        b->first_value = b->min = b->max = value;
+        b->sum = value;
+        b->count = 1;
+        enc->value = value;
+        return 1;
+    }
+    if (b->count == CO2MON_ARCHIVE_BLOCK_SAMPLES || timestamp - b->first >= CO2MON_ARCHIVE_BLOCK_SECONDS ||
+        timestamp < b->first)
+    {
+        return 0;
+    }
+
+    int32_t dv = (int32_t)value - enc->value;
+    int64_t delta = timestamp - b->last;
+    if (enc->stepped && dv == enc->step_value && delta == enc->delta)
+    {
+        ++enc->run;
+    }
+    else
+    {
+        flush_run(enc);
+        int64_t dod = delta - enc->delta;
+        put_varint(enc, zigzag(dv) << 2 | (dod ? 2 : 0));
+        if (dod)
+        {
+            put_varint(enc, zigzag(dod));
+        }
+        enc->stepped = 1;
+        enc->step_value = dv;
+        enc->delta = delta;
+    }
+
+    b->last = timestamp;
+    b->min = value < b->min ? value : b->min;
+    b->max = value > b->max ? value : b->max;
+    b->sum += value;
+    b->count++;
+    enc->value = value;
+    return 1;
+}
+
+size_t
+co2mon_archive_encoder_finish(struct co2mon_archive_encoder *enc)
+{
+    if (enc->block.count == 0)
+    {
+        return 0;
+    }
+    flush_run(enc);
+    enc->block.crc = block_crc(&enc->block, enc->payload);
+    return enc->block.length;
+}
+
+int
+co2mon_archive_block_valid(const void *data, size_t size)
+{
+    const struct co2mon_archive_block *block = data;
+    return size >= sizeof(*block) && block->magic == CO2MON_ARCHIVE_BLOCK_MAGIC && block->count > 0 &&
+           block->length <= size - sizeof(*block) && block->crc == block_crc(block, block + 1);
+}
+
+long
+co2mon_archive_decode(const struct co2mon_archive_block *block, int64_t *timestamps, uint16_t *values, size_t max)
+{
+    const uint8_t *p = (const uint8_t *)(block + 1);
+    const uint8_t *end = p + block->length;
+    int64_t t = block->first;
+    int64_t delta = 0;
+    int64_t value = block->first_value;
+    int64_t step = 0;
+    size_t n = 0;
+
+    if (max == 0)
+    {
+        return 0;
+    }
+    if (timestamps)
+    {
+        timestamps[n] = t;
+    }
+    if (values)
+    {
+        values[n] = (uint16_t)value;
+    }
+    ++n;
+
+    while (p < end && n < max)
+    {
+        uint64_t token;
+        if (*p < 0x80)
+        {
+            token = *p++; /* the common case: one byte */
+        }
+        else if (!get_varint(&p, end, &token))
+        {
+            return -1;
+        }
+        uint64_t repeat = 1;
+        if (token & 1)
+        {
+            repeat = token >> 1;
+        }
+        else
+        {
+            step = unzigzag(token >> 2);
+            if (token & 2)
+            {
+                uint64_t dod;
+                if (!get_varint(&p, end, &dod))
+                {
+                    return -1;
+                }
+                delta += unzigzag(dod);
+            }
+        }
+        for (; repeat && n < max; --repeat, ++n)
+        {
+            t += delta;
+            value += step;
+            if (value < 0 || value > 0xffff)
+            {
+                return -1;
+            }
+            if (timestamps)
+            {
+                timestamps[n] = t;
+            }
+            if (values)
+            {
+                values[n] = (uint16_t)value;
+            }
+        }
+    }
+    return (long)n;
+}
+
+/* Finds the footer and the end of the blocks of a mapped segment. */
+static int
+check_segment(struct co2mon_archive_segment *segment)
+{
+    const struct co2mon_archive_header *header = (const void *)segment->data;
+    if (segment->size < sizeof(*header) || memcmp(header->magic, CO2MON_ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CO2MON_ARCHIVE_VERSION || header->byte_order != CO2MON_ARCHIVE_BYTE_ORDER)
+    {
+        return 0;
+    }
+    segment->header = header;
+    segment->footer = NULL;
+    segment->summaries = NULL;
+    segment->end = segment->size;
+
+    const struct co2mon_archive_footer *footer;
+    size_t room = segment->size - sizeof(*header);
+    if (room < sizeof(*footer))
+    {
+        return 1;
+    }
+    footer = (const void *)(segment->data + segment->size - sizeof(*footer));
+    size_t length = footer->nsummaries * sizeof(struct co2mon_archive_summary);
+    if (footer->magic != CO2MON_ARCHIVE_FOOTER_MAGIC || footer->nsummaries > 256 ||
+        room - sizeof(*footer) < length)
+    {
+        return 1;
+    }
+    const char *summaries = (const char *)footer - length;
+    uint32_t crc = co2mon_archive_crc32c(0, summaries, length);
+    crc = co2mon_archive_crc32c(crc, &footer->nsummaries, sizeof(*footer) - offsetof(struct co2mon_archive_footer, nsummaries));
+    if (crc == footer->crc)
+    {
+        segment->footer = footer;
+        segment->summaries = (const void *)summaries;
+        segment->end = (size_t)(summaries - segment->data);
+    }
+    return 1;
+}
+
+int
+co2mon_archive_map(struct co2mon_archive_segment *segment, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        close(fd);
+        return 0;
+    }
+    segment->size = (size_t)st.st_size;
+    if (segment->size < sizeof(struct co2mon_archive_header))
+    {
+        co2mon_log(NULL, CO2MON_ERROR_INVALID, "%s: not a co2mon archive segment", path);
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        return 0;
+    }
+    segment->data = map;
+    if (!check_segment(segment))
+    {
+        co2mon_log(NULL, CO2MON_ERROR_INVALID, "%s: not a co2mon archive segment", path);
+        munmap(map, segment->size);
+        return 0;
+    }
+    return 1;
+}
+
+void
+co2mon_archive_unmap(struct co2mon_archive_segment *segment)
+{
+    munmap((void *)segment->data, segment->size);
+}
+
+const struct co2mon_archive_block *
+co2mon_archive_next_block(const struct co2mon_archive_segment *segment, const struct co2mon_archive_block *block)
+{
+    size_t offset = block ? (size_t)((const char *)block - segment->data) + sizeof(*block) + CO2MON_ARCHIVE_PADDED(block->length)
+                          : sizeof(struct co2mon_archive_header);
+    const struct co2mon_archive_block *next = (const void *)(segment->data + offset);
+    if (offset >= segment->end || segment->end - offset < sizeof(*next) || next->magic != CO2MON_ARCHIVE_BLOCK_MAGIC ||
+        next->length > segment->end - offset - sizeof(*next))
+    {
+        return NULL;
+    }
+    return next;
+}
+
+static void
+add_summary(struct co2mon_archive_summary *s, const struct co2mon_archive_block *block)
+{
+    if (s->count == 0)
+    {
+        s->code = block->code;
+        s->first = block->first;
+        s->last = block->last;
+        s->min = block->min;
+        s->max = block->max;
+    }
+    s->first = block->first < s->first ? block->first : s->first;
+    s->last = block->last > s->last ? block->last : s->last;
+    s->min = block->min < s->min ? block->min : s->min;
+    s->max = block->max > s->max ? block->max : s->max;
+    s->count += block->count;
+}
+
+/* Sums up the valid blocks of an existing segment and cuts off what
+ * follows them: the footer, or a block torn by a crash. */
+static int
+resume_segment(co2mon_archive *archive, const struct stat *st, int64_t day)
+{
+    struct co2mon_archive_segment segment;
+    segment.size = (size_t)st->st_size;
+    void *map = mmap(NULL, segment.size, PROT_READ, MAP_SHARED, archive->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, archive->path);
+        return 0;
+    }
+    segment.data = map;
+    if (!check_segment(&segment) || segment.header->day != day)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_INVALID, "%s: not a co2mon archive segment for this day", archive->path);
+        munmap(map, segment.size);
+        return 0;
+    }
+
+    size_t end = sizeof(struct co2mon_archive_header);
+    const struct co2mon_archive_block *block = NULL;
+    while ((block = co2mon_archive_next_block(&segment, block)) != NULL &&
+           co2mon_archive_block_valid(block, segment.end - (size_t)((const char *)block - segment.data)))
+    {
+        add_summary(&archive->summaries[block->code], block);
+        end = (size_t)((const char *)block - segment.data) + sizeof(*block) + CO2MON_ARCHIVE_PADDED(block->length);
+    }
+    munmap(map, segment.size);
+
+    if ((end != segment.size && ftruncate(archive->fd, (off_t)end) != 0) || lseek(archive->fd, (off_t)end, SEEK_SET) == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, archive->path);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+write_header(co2mon_archive *archive, const char *name, int64_t day)
+{
+    struct co2mon_archive_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CO2MON_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = CO2MON_ARCHIVE_VERSION;
+    header.byte_order = CO2MON_ARCHIVE_BYTE_ORDER;
+    header.day = day;
+    strncpy(header.name, name, sizeof(header.name) - 1);
+    if (write(archive->fd, &header, sizeof(header)) != sizeof(header))
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, archive->path);
+        return 0;
+    }
+    return 1;
+}
+
+co2mon_archive *
+co2mon_archive_open(const char *path, const char *name, int64_t day)
+{
+    co2mon_archive *archive = calloc(1, sizeof(*archive));
+    if (!archive || !(archive->path = strdup(path)))
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_archive_open: out of memory");
+        free(archive);
+        return NULL;
+    }
+    archive->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (archive->fd == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        free(archive->path);
+        free(archive);
+        return NULL;
+    }
+
+    struct stat st;
+    int ok;
+    if (fstat(archive->fd, &st) != 0)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        ok = 0;
+    }
+    else if (st.st_size == 0)
+    {
+        ok = write_header(archive, name, day);
+    }
+    else
+    {
+        ok = resume_segment(archive, &st, day);
+    }
+    if (!ok)
+    {
+        close(archive->fd);
+        free(archive->path);
+        free(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+static int
+write_all(co2mon_archive *archive, struct iovec *iov, int iovcnt, size_t total)
+{
+    ssize_t r = writev(archive->fd, iov, iovcnt);
+    if (r != (ssize_t)total)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, archive->path);
+        return 0;
+    }
+    return 1;
+}
+
+int
+co2mon_archive_append(co2mon_archive *archive, const struct co2mon_archive_encoder *enc)
+{
+    static const char padding[8];
+    const struct co2mon_archive_block *block = &enc->block;
+    if (block->count == 0)
+    {
+        return 1;
+    }
+    size_t length = sizeof(*block) + block->length;
+    struct iovec iov[2] = {
+        { (void *)block, length },
+        { (void *)padding, CO2MON_ARCHIVE_PADDED(block->length) - block->length },
+    };
+    if (!write_all(archive, iov, 2, length + iov[1].iov_len))
+    {
+        return 0;
+    }
+    add_summary(&archive->summaries[block->code], block);
+    return 1;
+}
+
+void
+co2mon_archive_close(co2mon_archive *archive)
+{
+    struct co2mon_archive_summary summaries[256];
+    struct co2mon_archive_footer footer;
+    memset(&footer, 0, sizeof(footer));
+    for (int code = 0; code < 256; ++code)
+    {
+        if (archive->summaries[code].count)
+        {
+            summaries[footer.nsummaries++] = archive->summaries[code];
+        }
+    }
+    footer.magic = CO2MON_ARCHIVE_FOOTER_MAGIC;
+    size_t length = footer.nsummaries * sizeof(summaries[0]);
+    footer.crc = co2mon_archive_crc32c(co2mon_archive_crc32c(0, summaries, length), &footer.nsummaries,
+                                      sizeof(footer) - offsetof(struct co2mon_archive_footer, nsummaries));
+
+    struct iovec iov[2] = {
+        { summaries, length },
+        { &footer, sizeof(footer) },
+    };
+    write_all(archive, iov, 2, length + sizeof(footer));
+    close(archive->fd);
+    free(archive->path);
+    free(archive);
+}
@@ -16,134 +16,425 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L /* strdup */
+
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include "co2mon.h"
+#include "device.h"
 
-int
-co2mon_init()
+/* How often co2mon_poll() retries devices that cannot be polled. */
+#define CO2MON_POLL_INTERVAL 10 /* milliseconds */
+
+static const struct co2mon_transport *transports[] = {
+    &sim_transport,
+};
+
+static const struct co2mon_transport *
+find_transport(const char *path)
 {
-    int r = hid_init();
-    if (r < 0)
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); ++i)
     {
-        fprintf(stderr, "hid_init: error\n");
+        if (strncmp(path, transports[i]->prefix, strlen(transports[i]->prefix)) == 0)
+        {
+            return transports[i];
+        }
     }
-    return r;
+    return &backend_transport;
+}
+
+int
+co2mon_init()
+{
+    return backend_init();
 }
 
 void
 co2mon_exit()
 {
-    int r = hid_exit();
-    if (r < 0)
+    backend_exit();
+}
+
+struct co2mon_device_info *
+co2mon_enumerate()
+{
+    return backend_enumerate();
+}
+
+void
+co2mon_free_enumeration(struct co2mon_device_info *devs)
+{
+    while (devs)
     {
-        fprintf(stderr, "hid_exit: error\n");
+        struct co2mon_device_info *next = devs->next;
+        free(devs->path);
+        free(devs->serial_number);
+        free(devs);
+        devs = next;
     }
 }
 
-hid_device *
+co2mon_device
 co2mon_open_device()
 {
-    hid_device *dev = hid_open(0x04d9, 0xa052, NULL);
-    if (!dev)
+    struct co2mon_device_info *devs = co2mon_enumerate();
+    if (!devs)
     {
-        fprintf(stderr, "hid_open: error\n");
+        co2mon_log(NULL, CO2MON_ERROR_NOT_FOUND, "co2mon_open_device: no CO2 device found");
+        return NULL;
     }
+    co2mon_device dev = co2mon_open_device_path(devs->path);
+    co2mon_free_enumeration(devs);
     return dev;
 }
 
-hid_device *
+co2mon_device
 co2mon_open_device_path(const char *path)
 {
-    hid_device *dev = hid_open_path(path);
-    if (!dev)
+    struct co2mon_device_ *dev = calloc(1, sizeof(*dev));
+    if (!dev || !(dev->path = strdup(path)))
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_open_device_path: out of memory");
+        free(dev);
+        return NULL;
+    }
+    dev->transport = find_transport(path);
+    if (!dev->transport->open(dev, path))
     {
-        fprintf(stderr, "hid_open_path: error\n");
+        free(dev->path);
+        free(dev);
+        return NULL;
     }
     return dev;
 }
 
 void
-co2mon_close_device(hid_device *dev)
+co2mon_close_device(co2mon_device dev)
+{
+    dev->transport->close(dev);
+    free(dev->path);
+    free(dev);
+}
+
+int
+co2mon_device_encoding(co2mon_device dev)
+{
+    return dev->decoder.encoding;
+}
+
+void
+co2mon_report_time(co2mon_device dev, int64_t *realtime, int64_t *monotonic)
+{
+    if (realtime)
+    {
+        *realtime = dev->realtime;
+    }
+    if (monotonic)
+    {
+        *monotonic = dev->monotonic;
+    }
+}
+
+void
+co2mon_raw_report(co2mon_device dev, co2mon_data_t raw)
 {
-    hid_close(dev);
+    memcpy(raw, dev->raw, sizeof(co2mon_data_t));
 }
 
 int
-co2mon_device_path(hid_device *dev, char *str, size_t maxlen)
+co2mon_device_path(co2mon_device dev, char *str, size_t maxlen)
 {
-    str[0] = '\0';
+    if (maxlen == 0)
+    {
+        return 0;
+    }
+    size_t len = strlen(dev->path);
+    if (len >= maxlen)
+    {
+        str[0] = '\0';
+        return 0;
+    }
+    memcpy(str, dev->path, len + 1);
     return 1;
 }
 
 int
-co2mon_send_magic_table(hid_device *dev, co2mon_data_t magic_table)
+co2mon_hotplug_covers(const char *path)
+{
+    return find_transport(path) == &backend_transport;
+}
+
+int
+co2mon_last_error(co2mon_device dev)
+{
+    return dev->last_error;
+}
+
+void
+co2mon_device_stats(co2mon_device dev, struct co2mon_stats *stats)
+{
+    *stats = dev->stats;
+}
+
+int
+co2mon_device_fd(co2mon_device dev)
+{
+    return dev->transport->fd(dev);
+}
+
+void
+co2mon_set_callback(co2mon_device dev, co2mon_callback callback, void *arg)
+{
+    dev->callback = callback;
+    dev->callback_arg = arg;
+}
+
+int
+co2mon_send_magic_table(co2mon_device dev, co2mon_data_t magic_table)
 {
-    int r = hid_send_feature_report(dev, magic_table, sizeof(co2mon_data_t));
-    if (r < 0 || r != sizeof(co2mon_data_t))
+    int r = dev->transport->send_feature_report(dev, magic_table, sizeof(co2mon_data_t));
+    if (r != sizeof(co2mon_data_t))
     {
-        fprintf(stderr, "hid_send_feature_report: error\n");
+        dev->last_error = CO2MON_ERROR_IO;
+        co2mon_log(dev, CO2MON_ERROR_IO, "co2mon_send_magic_table: error");
         return 0;
     }
+    dev->last_error = CO2MON_OK;
     return 1;
 }
 
 static void
-swap_char(unsigned char *a, unsigned char *b)
+stamp(int64_t *realtime, int64_t *monotonic)
 {
-    unsigned char tmp = *a;
-    *a = *b;
-    *b = tmp;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *realtime = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *monotonic = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void
-decode_buf(co2mon_data_t result, co2mon_data_t buf, co2mon_data_t magic_table)
+static int
+finish_read(co2mon_device dev, int actual_length, co2mon_data_t data, co2mon_data_t magic_table, co2mon_data_t result)
 {
-    swap_char(&buf[0], &buf[2]);
-    swap_char(&buf[1], &buf[4]);
-    swap_char(&buf[3], &buf[7]);
-    swap_char(&buf[5], &buf[6]);
+    if (actual_length < 0)
+    {
+        dev->last_error = CO2MON_ERROR_IO;
+        ++dev->stats.io_errors;
+        return actual_length;
+    }
+    if (actual_length == 0)
+    {
+        dev->last_error = CO2MON_ERROR_TIMEOUT;
+        ++dev->stats.timeouts;
+        return 0;
+    }
+    if (actual_length != sizeof(co2mon_data_t))
+    {
+        dev->last_error = CO2MON_ERROR_SHORT_READ;
+        ++dev->stats.short_reads;
+        co2mon_log(dev, CO2MON_ERROR_SHORT_READ, "co2mon_read_data: transferred %d bytes, expected %lu bytes", actual_length, (unsigned long)sizeof(co2mon_data_t));
+        return 0;
+    }
 
-    for (int i = 0; i < 8; ++i)
+    memcpy(dev->raw, data, sizeof(co2mon_data_t));
+    co2mon_decode(&dev->decoder, data, magic_table, result);
+    ++dev->stats.reports;
+
+    if (!report_valid(result))
+    {
+        dev->last_error = CO2MON_ERROR_CHECKSUM;
+        ++dev->stats.checksum_errors;
+        return actual_length;
+    }
+    dev->last_error = CO2MON_OK;
+    if (dev->callback)
     {
-        buf[i] ^= magic_table[i];
+        struct co2mon_record record;
+        record.code = result[0];
+        record.value = (uint16_t)((result[1] << 8) | result[2]);
+        record.timestamp = dev->realtime;
+        record.monotonic = dev->monotonic;
+        dev->callback(dev, &record, dev->callback_arg);
     }
+    return actual_length;
+}
 
-    unsigned char tmp = (buf[7] << 5);
-    result[7] = (buf[6] << 5) | (buf[7] >> 3);
-    result[6] = (buf[5] << 5) | (buf[6] >> 3);
-    result[5] = (buf[4] << 5) | (buf[5] >> 3);
-    result[4] = (buf[3] << 5) | (buf[4] >> 3);
-    result[3] = (buf[2] << 5) | (buf[3] >> 3);
-    result[2] = (buf[1] << 5) | (buf[2] >> 3);
-    result[1] = (buf[0] << 5) | (buf[1] >> 3);
-    result[0] = tmp | (buf[0] >> 3);
+/* Hands over a report buffered by co2mon_poll(), if there is one. */
+static int
+take_pending(co2mon_device dev, co2mon_data_t data)
+{
+    if (!dev->pending)
+    {
+        return 0;
+    }
+    dev->pending = 0;
+    memcpy(data, dev->pending_data, sizeof(co2mon_data_t));
+    dev->realtime = dev->pending_realtime;
+    dev->monotonic = dev->pending_monotonic;
+    return 1;
+}
 
-    const unsigned char magic_word[8] = "Htemp99e";
-    for (int i = 0; i < 8; ++i)
+int
+co2mon_read_data(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result)
+{
+    co2mon_data_t data = { 0 };
+    int actual_length = dev->pending_length;
+    if (!take_pending(dev, data))
     {
-        result[i] -= (magic_word[i] << 4) | (magic_word[i] >> 4);
+        actual_length = dev->transport->read(dev, data, sizeof(co2mon_data_t), 5000 /* milliseconds */);
+        stamp(&dev->realtime, &dev->monotonic);
     }
+    return finish_read(dev, actual_length, data, magic_table, result);
 }
 
 int
-co2mon_read_data(hid_device *dev, co2mon_data_t magic_table, co2mon_data_t result)
+co2mon_read_data_nonblock(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result)
 {
     co2mon_data_t data = { 0 };
-    int actual_length = hid_read_timeout(dev, data, sizeof(co2mon_data_t), 5000 /* milliseconds */);
-    if (actual_length < 0)
+    int actual_length = dev->pending_length;
+    if (!take_pending(dev, data))
     {
-        fprintf(stderr, "hid_read_timeout: error\n");
-        return actual_length;
+        actual_length = dev->transport->read(dev, data, sizeof(co2mon_data_t), 0);
+        if (actual_length == 0)
+        {
+            dev->last_error = CO2MON_OK;
+            return CO2MON_WOULD_BLOCK;
+        }
+        stamp(&dev->realtime, &dev->monotonic);
     }
-    if (actual_length != sizeof(co2mon_data_t))
+    return finish_read(dev, actual_length, data, magic_table, result);
+}
+
+/* Non-blocking probe for devices without a file descriptor: a report that
+ * turns up is kept until the next co2mon_read_data*() call. */
+static int
+probe_device(co2mon_device dev)
+{
+    if (dev->pending)
+    {
+        return 1;
+    }
+    int r = dev->transport->read(dev, dev->pending_data, sizeof(co2mon_data_t), 0);
+    if (r == 0)
     {
-        fprintf(stderr, "hid_read_timeout: transferred %d bytes, expected %lu bytes\n", actual_length, (unsigned long)sizeof(co2mon_data_t));
         return 0;
     }
+    stamp(&dev->pending_realtime, &dev->pending_monotonic);
+    dev->pending = 1;
+    dev->pending_length = r;
+    return 1;
+}
 
-    decode_buf(result, data, magic_table);
-    return actual_length;
+static int64_t
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+co2mon_poll(co2mon_device *devs, int *ready, int ndevs, int timeout)
+{
+    return co2mon_poll_fds(devs, ready, ndevs, NULL, 0, timeout);
+}
+
+int
+co2mon_poll_fds(co2mon_device *devs, int *ready, int ndevs, struct pollfd *extra, int nextra, int timeout)
+{
+    struct pollfd fds[CO2MON_POLL_MAX];
+    int index[CO2MON_POLL_MAX];
+    if (ndevs + nextra > CO2MON_POLL_MAX)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_INVALID, "co2mon_poll: too many devices");
+        return -1;
+    }
+
+    int64_t deadline = timeout < 0 ? -1 : monotonic_ms() + timeout;
+    while (1)
+    {
+        int nready = 0;
+        int nfds = 0;
+        int unpollable = 0;
+        for (int i = 0; i < nextra; ++i)
+        {
+            extra[i].revents = 0;
+            fds[nfds++] = extra[i];
+        }
+        for (int i = 0; i < ndevs; ++i)
+        {
+            ready[i] = 0;
+            int fd = co2mon_device_fd(devs[i]);
+            if (fd >= 0 && !devs[i]->pending)
+            {
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                index[nfds++] = i;
+            }
+            else if (probe_device(devs[i]))
+            {
+                ready[i] = 1;
+                ++nready;
+            }
+            else
+            {
+                unpollable = 1;
+            }
+        }
+
+        int wait = -1;
+        if (nready > 0)
+        {
+            wait = 0;
+        }
+        else if (deadline >= 0)
+        {
+            int64_t left = deadline - monotonic_ms();
+            wait = left > 0 ? (int)left : 0;
+        }
+        if (unpollable && (wait < 0 || wait > CO2MON_POLL_INTERVAL))
+        {
+            wait = CO2MON_POLL_INTERVAL;
+        }
+
+        int r = poll(fds, nfds, wait);
+        if (r < 0)
+        {
+            if (errno != EINTR)
+            {
+                co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "poll");
+            }
+            return -1;
+        }
+        for (int i = 0; i < nextra; ++i)
+        {
+            extra[i].revents = fds[i].revents;
+            if (fds[i].revents)
+            {
+                ++nready;
+            }
+        }
+        for (int i = nextra; i < nfds; ++i)
+        {
+            if (fds[i].revents)
+            {
+                ready[index[i]] = 1;
+                ++nready;
+            }
+        }
+
+        if (nready > 0)
+        {
+            return nready;
+        }
+        if (deadline >= 0 && monotonic_ms() >= deadline)
+        {
+            return 0;
+        }
+    }
 }
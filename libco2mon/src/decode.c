@@ -0,0 +1,264 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Report decoding.  decode_buf() of old did, per 8-byte report:
+ *
+ *   swap bytes 0<->2, 1<->4, 3<->7, 5<->6
+ *   xor with the magic table
+ *   rotate the whole report right by 3 bits (byte 0 being the most
+ *   significant one)
+ *   subtract nibble-swapped "Htemp99e" from every byte
+ *
+ * Here each report is one 64-bit lane.  The scalar path works everywhere;
+ * an SSSE3 path (chosen at run time: SSE2 alone has no byte shuffle) and a
+ * NEON path handle two reports or one report per vector.
+ */
+
+#include <string.h>
+
+#include "device.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECODE_SSSE3 1
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DECODE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* "Htemp99e" with nibbles swapped, most significant byte first. */
+#define MAGIC_WORD 0x844756d607939356ULL
+
+#define HIGH_BITS 0x8080808080808080ULL
+
+static uint64_t
+load_be(const unsigned char *p)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+static void
+store_be(unsigned char *p, uint64_t x)
+{
+    for (int i = 7; i >= 0; --i)
+    {
+        p[i] = (unsigned char)x;
+        x >>= 8;
+    }
+}
+
+int
+report_valid(const unsigned char *result)
+{
+    unsigned char checksum = result[0] + result[1] + result[2];
+    return result[4] == 0x0d && checksum == result[3];
+}
+
+static void
+decode_lane(const unsigned char *raw, uint64_t magic, unsigned char *result)
+{
+    uint64_t x = ((uint64_t)raw[2] << 56) | ((uint64_t)raw[4] << 48) |
+                 ((uint64_t)raw[0] << 40) | ((uint64_t)raw[7] << 32) |
+                 ((uint64_t)raw[1] << 24) | ((uint64_t)raw[6] << 16) |
+                 ((uint64_t)raw[5] << 8) | (uint64_t)raw[3];
+    x ^= magic;
+    x = (x >> 3) | (x << 61);
+    /* Bytewise x - MAGIC_WORD without borrows between bytes. */
+    x = ((x | HIGH_BITS) - (MAGIC_WORD & ~HIGH_BITS)) ^ ((x ^ ~MAGIC_WORD) & HIGH_BITS);
+    store_be(result, x);
+}
+
+void
+encode_report(const unsigned char *plain, const unsigned char *magic_table, unsigned char *raw)
+{
+    uint64_t x = load_be(plain);
+    x = ((x & ~HIGH_BITS) + (MAGIC_WORD & ~HIGH_BITS)) ^ ((x ^ MAGIC_WORD) & HIGH_BITS);
+    x = (x << 3) | (x >> 61);
+    x ^= load_be(magic_table);
+    raw[2] = (unsigned char)(x >> 56);
+    raw[4] = (unsigned char)(x >> 48);
+    raw[0] = (unsigned char)(x >> 40);
+    raw[7] = (unsigned char)(x >> 32);
+    raw[1] = (unsigned char)(x >> 24);
+    raw[6] = (unsigned char)(x >> 16);
+    raw[5] = (unsigned char)(x >> 8);
+    raw[3] = (unsigned char)x;
+}
+
+void
+decode_report(const unsigned char *raw, const unsigned char *magic_table, unsigned char *result)
+{
+    decode_lane(raw, load_be(magic_table), result);
+}
+
+void
+co2mon_decode(struct co2mon_decoder *dec, const co2mon_data_t raw, const co2mon_data_t magic_table, co2mon_data_t result)
+{
+    switch (dec->encoding)
+    {
+    case CO2MON_ENCODING_PLAINTEXT:
+        memcpy(result, raw, sizeof(co2mon_data_t));
+        return;
+    case CO2MON_ENCODING_ENCRYPTED:
+        decode_report(raw, magic_table, result);
+        return;
+    }
+
+    /* Not known yet: settle it once a report is valid either way. */
+    decode_report(raw, magic_table, result);
+    if (report_valid(result))
+    {
+        dec->encoding = CO2MON_ENCODING_ENCRYPTED;
+    }
+    else if (report_valid(raw))
+    {
+        dec->encoding = CO2MON_ENCODING_PLAINTEXT;
+        memcpy(result, raw, sizeof(co2mon_data_t));
+    }
+    else if (++dec->probed >= CO2MON_PROBE_REPORTS)
+    {
+        dec->encoding = CO2MON_ENCODING_ENCRYPTED;
+    }
+}
+
+static size_t
+decode_scalar(const unsigned char *raw, size_t n, const unsigned char *magic_table, co2mon_data_t *out, unsigned char *valid)
+{
+    uint64_t magic = load_be(magic_table);
+    size_t nvalid = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        decode_lane(raw + 8 * i, magic, out[i]);
+        int ok = report_valid(out[i]);
+        if (valid)
+        {
+            valid[i] = (unsigned char)ok;
+        }
+        nvalid += ok;
+    }
+    return nvalid;
+}
+
+#ifdef DECODE_SSSE3
+
+__attribute__((target("ssse3")))
+static size_t
+decode_ssse3(const unsigned char *raw, size_t n, const unsigned char *magic_table, co2mon_data_t *out, unsigned char *valid)
+{
+    /* Gathers the swapped report into a little-endian lane, and back. */
+    const __m128i gather = _mm_setr_epi8(3, 5, 6, 1, 7, 0, 4, 2, 11, 13, 14, 9, 15, 8, 12, 10);
+    const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i word = _mm_setr_epi8(
+        (char)0x84, 0x47, 0x56, (char)0xd6, 0x07, (char)0x93, (char)0x93, 0x56,
+        (char)0x84, 0x47, 0x56, (char)0xd6, 0x07, (char)0x93, (char)0x93, 0x56);
+    unsigned char m[16];
+    for (int i = 0; i < 8; ++i)
+    {
+        m[i] = m[i + 8] = magic_table[7 - i];
+    }
+    const __m128i magic = _mm_loadu_si128((const __m128i *)m);
+
+    size_t nvalid = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(raw + 8 * i));
+        x = _mm_shuffle_epi8(x, gather);
+        x = _mm_xor_si128(x, magic);
+        x = _mm_or_si128(_mm_srli_epi64(x, 3), _mm_slli_epi64(x, 61));
+        x = _mm_shuffle_epi8(x, reverse);
+        x = _mm_sub_epi8(x, word);
+        _mm_storeu_si128((__m128i *)out[i], x);
+
+        for (size_t j = i; j < i + 2; ++j)
+        {
+            int ok = report_valid(out[j]);
+            if (valid)
+            {
+                valid[j] = (unsigned char)ok;
+            }
+            nvalid += ok;
+        }
+    }
+    return nvalid + decode_scalar(raw + 8 * i, n - i, magic_table, out + i, valid ? valid + i : NULL);
+}
+
+#endif
+
+#ifdef DECODE_NEON
+
+static size_t
+decode_neon(const unsigned char *raw, size_t n, const unsigned char *magic_table, co2mon_data_t *out, unsigned char *valid)
+{
+    static const uint8_t gather_bytes[8] = { 3, 5, 6, 1, 7, 0, 4, 2 };
+    static const uint8_t word_bytes[8] = { 0x84, 0x47, 0x56, 0xd6, 0x07, 0x93, 0x93, 0x56 };
+    const uint8x8_t gather = vld1_u8(gather_bytes);
+    const uint8x8_t word = vld1_u8(word_bytes);
+    uint8_t m[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        m[i] = magic_table[7 - i];
+    }
+    const uint8x8_t magic = vld1_u8(m);
+
+    size_t nvalid = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint8x8_t x = vtbl1_u8(vld1_u8(raw + 8 * i), gather);
+        x = veor_u8(x, magic);
+        uint64x1_t lane = vreinterpret_u64_u8(x);
+        lane = vorr_u64(vshr_n_u64(lane, 3), vshl_n_u64(lane, 61));
+        x = vsub_u8(vrev64_u8(vreinterpret_u8_u64(lane)), word);
+        vst1_u8(out[i], x);
+
+        int ok = report_valid(out[i]);
+        if (valid)
+        {
+            valid[i] = (unsigned char)ok;
+        }
+        nvalid += ok;
+    }
+    return nvalid;
+}
+
+#endif
+
+size_t
+co2mon_decode_batch(const unsigned char *raw, size_t n, const co2mon_data_t magic_table, co2mon_data_t *out, unsigned char *valid)
+{
+#if defined(DECODE_SSSE3)
+    static int have_ssse3 = -1;
+    if (have_ssse3 < 0)
+    {
+        have_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    if (have_ssse3)
+    {
+        return decode_ssse3(raw, n, magic_table, out, valid);
+    }
+#elif defined(DECODE_NEON)
+    return decode_neon(raw, n, magic_table, out, valid);
+#endif
+    return decode_scalar(raw, n, magic_table, out, valid);
+}
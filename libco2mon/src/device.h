@@ -0,0 +1,114 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MON_DEVICE_H_INCLUDED_
+#define CO2MON_DEVICE_H_INCLUDED_
+
+#include "config.h"
+#include "co2mon.h"
+
+#ifndef CO2MON_BACKEND_HIDRAW
+#include <hidapi.h>
+#endif
+
+/*
+ * A transport moves reports between a device handle and whatever is behind
+ * it.  The native one is implemented by hidapi.c or hidraw.c; others are
+ * picked by a prefix of the device path, e.g. "sim:".
+ *
+ * read() returns the number of bytes read, 0 if nothing arrived within
+ * timeout milliseconds, or a negative value on error.
+ */
+struct co2mon_transport
+{
+    const char *prefix; /* NULL for the native transport */
+    int (*open)(co2mon_device dev, const char *path);
+    void (*close)(co2mon_device dev);
+    int (*fd)(co2mon_device dev);
+    int (*send_feature_report)(co2mon_device dev, const unsigned char *data, size_t length);
+    int (*read)(co2mon_device dev, unsigned char *data, size_t length, int timeout);
+};
+
+struct co2mon_device_
+{
+    const struct co2mon_transport *transport;
+    void *transport_data; /* private to transports other than the native one */
+#ifdef CO2MON_BACKEND_HIDRAW
+    int fd;
+#else
+    hid_device *hid;
+#endif
+    char *path;
+    co2mon_callback callback;
+    void *callback_arg;
+    struct co2mon_decoder decoder;
+    co2mon_data_t raw;
+    int pending;
+    int pending_length;
+    co2mon_data_t pending_data;
+    int64_t pending_realtime;  /* when pending_data arrived */
+    int64_t pending_monotonic;
+    int64_t realtime;          /* when raw arrived */
+    int64_t monotonic;
+    int last_error;
+    struct co2mon_stats stats;
+    int64_t log_window;   /* when the current rate limit window began, ns */
+    unsigned log_count;   /* messages in that window */
+    unsigned log_dropped; /* ... and those dropped from it */
+};
+
+/* Hands a message to the log callback, see co2mon_set_log_callback();
+ * dev may be NULL.  co2mon_log_errno() appends strerror(errno). */
+extern void
+co2mon_log(co2mon_device dev, int error, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 3, 4)))
+#endif
+    ;
+
+extern void
+co2mon_log_errno(co2mon_device dev, int error, const char *what);
+
+/* The native transport and its device enumeration. */
+
+extern int
+backend_init();
+
+extern int
+backend_exit();
+
+extern struct co2mon_device_info *
+backend_enumerate();
+
+extern const struct co2mon_transport backend_transport;
+
+/* Simulated sensors, see sim.c. */
+extern const struct co2mon_transport sim_transport;
+
+/* Shared by co2mon.c and decode.c. */
+
+extern void
+decode_report(const unsigned char *raw, const unsigned char *magic_table, unsigned char *result);
+
+/* The inverse of decode_report(), i.e. what an encrypting device sends. */
+extern void
+encode_report(const unsigned char *plain, const unsigned char *magic_table, unsigned char *raw);
+
+extern int
+report_valid(const unsigned char *result);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* strdup */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "device.h"
+
+int
+backend_init()
+{
+    int r = hid_init();
+    if (r < 0)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_SYSTEM, "hid_init: error");
+    }
+    return r;
+}
+
+int
+backend_exit()
+{
+    int r = hid_exit();
+    if (r < 0)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_SYSTEM, "hid_exit: error");
+    }
+    return r;
+}
+
+static char *
+narrow_string(const wchar_t *s)
+{
+    size_t len = s ? wcslen(s) : 0;
+    char *result = malloc(len + 1);
+    if (!result)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; ++i)
+    {
+        result[i] = (s[i] > 0 && s[i] < 0x80) ? (char)s[i] : '?';
+    }
+    result[len] = '\0';
+    return result;
+}
+
+struct co2mon_device_info *
+backend_enumerate()
+{
+    struct hid_device_info *devs = hid_enumerate(CO2MON_VENDOR_ID, CO2MON_PRODUCT_ID);
+    struct co2mon_device_info *head = NULL;
+    struct co2mon_device_info **tail = &head;
+    for (struct hid_device_info *cur = devs; cur; cur = cur->next)
+    {
+        struct co2mon_device_info *info = calloc(1, sizeof(*info));
+        if (!info)
+        {
+            co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "hid_enumerate: out of memory");
+            break;
+        }
+        info->path = strdup(cur->path);
+        info->serial_number = narrow_string(cur->serial_number);
+        if (!info->path || !info->serial_number)
+        {
+            co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "hid_enumerate: out of memory");
+            free(info->path);
+            free(info->serial_number);
+            free(info);
+            break;
+        }
+        *tail = info;
+        tail = &info->next;
+    }
+    hid_free_enumeration(devs);
+    return head;
+}
+
+static int
+backend_open_path(co2mon_device dev, const char *path)
+{
+    dev->hid = hid_open_path(path);
+    if (!dev->hid)
+    {
+        co2mon_log(dev, CO2MON_ERROR_OPEN, "hid_open_path: error");
+        return 0;
+    }
+    return 1;
+}
+
+static void
+backend_close(co2mon_device dev)
+{
+    hid_close(dev->hid);
+}
+
+static int
+backend_fd(co2mon_device dev)
+{
+    (void)dev;
+    /* hidapi keeps its file descriptors to itself. */
+    return -1;
+}
+
+static int
+backend_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    int r = hid_send_feature_report(dev->hid, data, length);
+    if (r < 0)
+    {
+        co2mon_log(dev, CO2MON_ERROR_IO, "hid_send_feature_report: error");
+    }
+    return r;
+}
+
+static int
+backend_read(co2mon_device dev, unsigned char *data, size_t length, int timeout)
+{
+    int r = hid_read_timeout(dev->hid, data, length, timeout);
+    if (r < 0)
+    {
+        co2mon_log(dev, CO2MON_ERROR_IO, "hid_read_timeout: error");
+    }
+    return r;
+}
+
+const struct co2mon_transport backend_transport = {
+    NULL,
+    backend_open_path,
+    backend_close,
+    backend_fd,
+    backend_send_feature_report,
+    backend_read,
+};
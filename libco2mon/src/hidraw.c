@@ -0,0 +1,219 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* strdup */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/hidraw.h>
+
+#include "device.h"
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+
+int
+backend_init()
+{
+    return 0;
+}
+
+int
+backend_exit()
+{
+    return 0;
+}
+
+/*
+ * Reads HID_ID and HID_UNIQ of the HID device behind a hidraw node, e.g.
+ *
+ *   HID_ID=0003:000004D9:0000A052
+ *   HID_UNIQ=1.40
+ */
+static int
+read_uevent(const char *name, unsigned *vendor, unsigned *product, char *serial, size_t maxlen)
+{
+    char filename[256];
+    snprintf(filename, sizeof(filename), SYSFS_HIDRAW "/%s/device/uevent", name);
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        return 0;
+    }
+
+    int found = 0;
+    char line[256];
+    serial[0] = '\0';
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        unsigned bus;
+        if (sscanf(line, "HID_ID=%x:%x:%x", &bus, vendor, product) == 3)
+        {
+            found = 1;
+        }
+        else if (strncmp(line, "HID_UNIQ=", 9) == 0)
+        {
+            snprintf(serial, maxlen, "%s", line + 9);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+struct co2mon_device_info *
+backend_enumerate()
+{
+    DIR *dir = opendir(SYSFS_HIDRAW);
+    if (!dir)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, SYSFS_HIDRAW);
+        return NULL;
+    }
+
+    struct co2mon_device_info *head = NULL;
+    struct co2mon_device_info **tail = &head;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+        {
+            continue;
+        }
+
+        unsigned vendor, product;
+        char serial[128];
+        if (!read_uevent(entry->d_name, &vendor, &product, serial, sizeof(serial)) ||
+            vendor != CO2MON_VENDOR_ID || product != CO2MON_PRODUCT_ID)
+        {
+            continue;
+        }
+
+        char path[sizeof(entry->d_name) + 5];
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+
+        struct co2mon_device_info *info = calloc(1, sizeof(*info));
+        if (!info || !(info->path = strdup(path)) || !(info->serial_number = strdup(serial)))
+        {
+            co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "hidraw_enumerate: out of memory");
+            if (info)
+            {
+                free(info->path);
+                free(info);
+            }
+            break;
+        }
+        *tail = info;
+        tail = &info->next;
+    }
+    closedir(dir);
+    return head;
+}
+
+static int
+backend_open_path(co2mon_device dev, const char *path)
+{
+    dev->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd == -1)
+    {
+        co2mon_log_errno(dev, CO2MON_ERROR_OPEN, path);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+backend_close(co2mon_device dev)
+{
+    close(dev->fd);
+}
+
+static int
+backend_fd(co2mon_device dev)
+{
+    return dev->fd;
+}
+
+static int
+backend_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    int r = ioctl(dev->fd, HIDIOCSFEATURE(length), data);
+    if (r < 0)
+    {
+        co2mon_log_errno(dev, CO2MON_ERROR_IO, "HIDIOCSFEATURE");
+    }
+    return r;
+}
+
+static int
+backend_read(co2mon_device dev, unsigned char *data, size_t length, int timeout)
+{
+    while (1)
+    {
+        ssize_t r = read(dev->fd, data, length);
+        if (r >= 0)
+        {
+            return (int)r;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            co2mon_log_errno(dev, CO2MON_ERROR_IO, "read");
+            return -1;
+        }
+        if (timeout == 0)
+        {
+            return 0;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = dev->fd;
+        pfd.events = POLLIN;
+        int p = poll(&pfd, 1, timeout);
+        if (p < 0 && errno != EINTR)
+        {
+            co2mon_log_errno(dev, CO2MON_ERROR_SYSTEM, "poll");
+            return -1;
+        }
+        if (p == 0)
+        {
+            return 0;
+        }
+        /* Only a single wait: a read error or another EAGAIN ends the loop. */
+        timeout = 0;
+    }
+}
+
+const struct co2mon_transport backend_transport = {
+    NULL,
+    backend_open_path,
+    backend_close,
+    backend_fd,
+    backend_send_feature_report,
+    backend_read,
+};
@@ -0,0 +1,226 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hotplug notifications on macOS: IOKit matching notifications for the
+ * sensor's IOHIDDevice, delivered on a dispatch queue and passed on
+ * through a pipe so that callers can poll() for them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/hid/IOHIDKeys.h>
+#include <dispatch/dispatch.h>
+
+#include "device.h"
+
+struct co2mon_hotplug_
+{
+    int pipe[2];
+    dispatch_queue_t queue;
+    IONotificationPortRef port;
+    io_iterator_t arrived;
+    io_iterator_t left;
+};
+
+/* Runs on the queue: empties an iterator, which also rearms it. */
+static void
+drain_iterator(struct co2mon_hotplug_ *hp, io_iterator_t iterator, char action)
+{
+    io_object_t service;
+    while ((service = IOIteratorNext(iterator)) != 0)
+    {
+        IOObjectRelease(service);
+        if (action && write(hp->pipe[1], &action, 1) < 0 && errno != EAGAIN)
+        {
+            co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug: write");
+        }
+    }
+}
+
+static void
+on_arrival(void *arg, io_iterator_t iterator)
+{
+    drain_iterator(arg, iterator, CO2MON_HOTPLUG_ARRIVED);
+}
+
+static void
+on_removal(void *arg, io_iterator_t iterator)
+{
+    drain_iterator(arg, iterator, CO2MON_HOTPLUG_LEFT);
+}
+
+static CFMutableDictionaryRef
+sensor_matching()
+{
+    CFMutableDictionaryRef matching = IOServiceMatching(kIOHIDDeviceKey);
+    if (!matching)
+    {
+        return NULL;
+    }
+    int vendor = CO2MON_VENDOR_ID;
+    int product = CO2MON_PRODUCT_ID;
+    CFNumberRef n = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &vendor);
+    CFDictionarySetValue(matching, CFSTR(kIOHIDVendorIDKey), n);
+    CFRelease(n);
+    n = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &product);
+    CFDictionarySetValue(matching, CFSTR(kIOHIDProductIDKey), n);
+    CFRelease(n);
+    return matching;
+}
+
+/* Runs on the queue, so that no callback is in flight. */
+static void
+stop_notifications(void *arg)
+{
+    struct co2mon_hotplug_ *hp = arg;
+    if (hp->arrived)
+    {
+        IOObjectRelease(hp->arrived);
+    }
+    if (hp->left)
+    {
+        IOObjectRelease(hp->left);
+    }
+    if (hp->port)
+    {
+        IONotificationPortDestroy(hp->port);
+    }
+    hp->arrived = hp->left = 0;
+    hp->port = NULL;
+}
+
+co2mon_hotplug
+co2mon_hotplug_open()
+{
+    struct co2mon_hotplug_ *hp = calloc(1, sizeof(*hp));
+    if (!hp)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_hotplug_open: out of memory");
+        return NULL;
+    }
+    if (pipe(hp->pipe) != 0)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: pipe");
+        free(hp);
+        return NULL;
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(hp->pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(hp->pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    hp->queue = dispatch_queue_create("co2mon.hotplug", NULL);
+    hp->port = IONotificationPortCreate(MACH_PORT_NULL);
+    CFMutableDictionaryRef matching = sensor_matching();
+    if (!hp->queue || !hp->port || !matching)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: cannot set up IOKit notifications");
+        if (matching)
+        {
+            CFRelease(matching);
+        }
+        co2mon_hotplug_close(hp);
+        return NULL;
+    }
+    IONotificationPortSetDispatchQueue(hp->port, hp->queue);
+
+    /* Each call consumes a reference to the dictionary. */
+    CFRetain(matching);
+    kern_return_t r = IOServiceAddMatchingNotification(hp->port, kIOFirstMatchNotification, matching, on_arrival, hp, &hp->arrived);
+    if (r == KERN_SUCCESS)
+    {
+        r = IOServiceAddMatchingNotification(hp->port, kIOTerminatedNotification, matching, on_removal, hp, &hp->left);
+    }
+    else
+    {
+        CFRelease(matching);
+    }
+    if (r != KERN_SUCCESS)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: IOServiceAddMatchingNotification failed");
+        co2mon_hotplug_close(hp);
+        return NULL;
+    }
+    /* Sensors that are already there were found by co2mon_enumerate(). */
+    drain_iterator(hp, hp->arrived, 0);
+    drain_iterator(hp, hp->left, 0);
+    return hp;
+}
+
+void
+co2mon_hotplug_close(co2mon_hotplug hp)
+{
+    if (hp->queue)
+    {
+        dispatch_sync_f(hp->queue, hp, stop_notifications);
+        dispatch_release(hp->queue);
+    }
+    else
+    {
+        stop_notifications(hp);
+    }
+    close(hp->pipe[0]);
+    close(hp->pipe[1]);
+    free(hp);
+}
+
+int
+co2mon_hotplug_fd(co2mon_hotplug hp)
+{
+    return hp->pipe[0];
+}
+
+int
+co2mon_hotplug_read(co2mon_hotplug hp, struct co2mon_hotplug_event *ev)
+{
+    char action;
+    ssize_t r = read(hp->pipe[0], &action, 1);
+    if (r < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_read");
+        return -1;
+    }
+    if (r == 0)
+    {
+        return 0;
+    }
+    /* hidapi's paths are not in the notification. */
+    ev->action = action;
+    ev->node[0] = '\0';
+    return 1;
+}
+
+int
+co2mon_hotplug_match(const struct co2mon_hotplug_event *ev, const char *path)
+{
+    (void)ev;
+    (void)path;
+    return -1;
+}
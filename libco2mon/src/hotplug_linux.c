@@ -0,0 +1,361 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hotplug notifications on Linux.  With libudev, events come from udevd
+ * once it has run its rules, so the permissions from udevrules/ are in
+ * place.  Without it, the kernel's uevent socket is used directly; the
+ * device node may then still be root-only for a moment.
+ *
+ * A sensor shows up as a hidraw node whose HID parent is named
+ * "0003:04D9:A052.NNNN", and hidapi-libusb also cares about the USB
+ * device itself (PRODUCT=4d9/a052/...).  Both carry enough in the event
+ * to recognize them on removal, when sysfs is already gone.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* SOCK_NONBLOCK, SOCK_CLOEXEC */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+
+#include "device.h"
+
+#ifdef CO2MON_HAVE_LIBUDEV
+#include <libudev.h>
+#else
+#define UEVENT_BUFFER_SIZE 8192
+#endif
+
+struct co2mon_hotplug_
+{
+#ifdef CO2MON_HAVE_LIBUDEV
+    struct udev *udev;
+    struct udev_monitor *monitor;
+#else
+    int fd;
+#endif
+};
+
+/* What a uevent says about a device, NULL for absent keys. */
+struct uevent
+{
+    const char *action;
+    const char *subsystem;
+    const char *devtype;
+    const char *devpath;
+    const char *devname;
+    const char *product;
+    const char *busnum;
+    const char *devnum;
+};
+
+/* Turns a uevent about a sensor into ev, returns 0 for other devices. */
+static int
+parse_uevent(const struct uevent *u, struct co2mon_hotplug_event *ev)
+{
+    if (!u->action || !u->subsystem)
+    {
+        return 0;
+    }
+    if (strcmp(u->action, "add") == 0)
+    {
+        ev->action = CO2MON_HOTPLUG_ARRIVED;
+    }
+    else if (strcmp(u->action, "remove") == 0)
+    {
+        ev->action = CO2MON_HOTPLUG_LEFT;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (strcmp(u->subsystem, "hidraw") == 0)
+    {
+        char parent[32];
+        snprintf(parent, sizeof(parent), ":%04X:%04X.", CO2MON_VENDOR_ID, CO2MON_PRODUCT_ID);
+        if (!u->devpath || !u->devname || !strstr(u->devpath, parent))
+        {
+            return 0;
+        }
+        /* The kernel names the node relative to /dev, udev does not. */
+        const char *name = strrchr(u->devname, '/');
+        snprintf(ev->node, sizeof(ev->node), "/dev/%s", name ? name + 1 : u->devname);
+        return 1;
+    }
+
+#ifndef CO2MON_BACKEND_HIDRAW
+    if (strcmp(u->subsystem, "usb") == 0 && u->devtype && strcmp(u->devtype, "usb_device") == 0)
+    {
+        char product[32];
+        snprintf(product, sizeof(product), "%x/%x/", CO2MON_VENDOR_ID, CO2MON_PRODUCT_ID);
+        if (!u->product || strncmp(u->product, product, strlen(product)) != 0)
+        {
+            return 0;
+        }
+        /* hidapi-libusb paths are "bus:address:interface" in hex. */
+        ev->node[0] = '\0';
+        if (u->busnum && u->devnum)
+        {
+            snprintf(ev->node, sizeof(ev->node), "%04x:%04x:", atoi(u->busnum), atoi(u->devnum));
+        }
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int
+co2mon_hotplug_match(const struct co2mon_hotplug_event *ev, const char *path)
+{
+    size_t len = strlen(ev->node);
+    if (len == 0)
+    {
+        return -1;
+    }
+    if (ev->node[len - 1] == ':')
+    {
+        return strncmp(path, ev->node, len) == 0;
+    }
+    return strcmp(path, ev->node) == 0;
+}
+
+#ifdef CO2MON_HAVE_LIBUDEV
+
+co2mon_hotplug
+co2mon_hotplug_open()
+{
+    struct co2mon_hotplug_ *hp = calloc(1, sizeof(*hp));
+    if (!hp)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_hotplug_open: out of memory");
+        return NULL;
+    }
+    hp->udev = udev_new();
+    hp->monitor = hp->udev ? udev_monitor_new_from_netlink(hp->udev, "udev") : NULL;
+    if (!hp->monitor ||
+        udev_monitor_filter_add_match_subsystem_devtype(hp->monitor, "hidraw", NULL) < 0 ||
+#ifndef CO2MON_BACKEND_HIDRAW
+        udev_monitor_filter_add_match_subsystem_devtype(hp->monitor, "usb", "usb_device") < 0 ||
+#endif
+        udev_monitor_enable_receiving(hp->monitor) < 0)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: cannot monitor udev events");
+        co2mon_hotplug_close(hp);
+        return NULL;
+    }
+    return hp;
+}
+
+void
+co2mon_hotplug_close(co2mon_hotplug hp)
+{
+    if (hp->monitor)
+    {
+        udev_monitor_unref(hp->monitor);
+    }
+    if (hp->udev)
+    {
+        udev_unref(hp->udev);
+    }
+    free(hp);
+}
+
+int
+co2mon_hotplug_fd(co2mon_hotplug hp)
+{
+    return udev_monitor_get_fd(hp->monitor);
+}
+
+int
+co2mon_hotplug_read(co2mon_hotplug hp, struct co2mon_hotplug_event *ev)
+{
+    struct udev_device *dev;
+    /* The monitor socket is non-blocking, NULL means drained. */
+    while ((dev = udev_monitor_receive_device(hp->monitor)) != NULL)
+    {
+        struct uevent u;
+        u.action = udev_device_get_action(dev);
+        u.subsystem = udev_device_get_subsystem(dev);
+        u.devtype = udev_device_get_devtype(dev);
+        u.devpath = udev_device_get_devpath(dev);
+        u.devname = udev_device_get_devnode(dev);
+        u.product = udev_device_get_property_value(dev, "PRODUCT");
+        u.busnum = udev_device_get_property_value(dev, "BUSNUM");
+        u.devnum = udev_device_get_property_value(dev, "DEVNUM");
+        int found = parse_uevent(&u, ev);
+        udev_device_unref(dev);
+        if (found)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+co2mon_hotplug
+co2mon_hotplug_open()
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: socket");
+        return NULL;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel events */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_open: bind");
+        close(fd);
+        return NULL;
+    }
+
+    struct co2mon_hotplug_ *hp = calloc(1, sizeof(*hp));
+    if (!hp)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_hotplug_open: out of memory");
+        close(fd);
+        return NULL;
+    }
+    hp->fd = fd;
+    return hp;
+}
+
+void
+co2mon_hotplug_close(co2mon_hotplug hp)
+{
+    close(hp->fd);
+    free(hp);
+}
+
+int
+co2mon_hotplug_fd(co2mon_hotplug hp)
+{
+    return hp->fd;
+}
+
+/*
+ * A kernel uevent is "action@devpath" followed by KEY=value strings, all
+ * NUL-terminated, e.g.
+ *
+ *   remove@/devices/.../0003:04D9:A052.0004/hidraw/hidraw3
+ *   ACTION=remove
+ *   SUBSYSTEM=hidraw
+ *   DEVNAME=hidraw3
+ */
+int
+co2mon_hotplug_read(co2mon_hotplug hp, struct co2mon_hotplug_event *ev)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    while (1)
+    {
+        struct sockaddr_nl from;
+        struct iovec iov;
+        struct msghdr msg;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t len = recvmsg(hp->fd, &msg, 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            /* ENOBUFS: events were lost, let the caller look around. */
+            if (errno == ENOBUFS)
+            {
+                ev->action = CO2MON_HOTPLUG_ARRIVED;
+                ev->node[0] = '\0';
+                return 1;
+            }
+            co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_hotplug_read");
+            return -1;
+        }
+        /* Only the kernel may speak here. */
+        if (from.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+        {
+            continue;
+        }
+        buf[len] = '\0';
+
+        struct uevent u;
+        memset(&u, 0, sizeof(u));
+        for (const char *s = buf + strlen(buf) + 1; s < buf + len; s += strlen(s) + 1)
+        {
+            if (strncmp(s, "ACTION=", 7) == 0)
+            {
+                u.action = s + 7;
+            }
+            else if (strncmp(s, "SUBSYSTEM=", 10) == 0)
+            {
+                u.subsystem = s + 10;
+            }
+            else if (strncmp(s, "DEVTYPE=", 8) == 0)
+            {
+                u.devtype = s + 8;
+            }
+            else if (strncmp(s, "DEVPATH=", 8) == 0)
+            {
+                u.devpath = s + 8;
+            }
+            else if (strncmp(s, "DEVNAME=", 8) == 0)
+            {
+                u.devname = s + 8;
+            }
+            else if (strncmp(s, "PRODUCT=", 8) == 0)
+            {
+                u.product = s + 8;
+            }
+            else if (strncmp(s, "BUSNUM=", 7) == 0)
+            {
+                u.busnum = s + 7;
+            }
+            else if (strncmp(s, "DEVNUM=", 7) == 0)
+            {
+                u.devnum = s + 7;
+            }
+        }
+        if (parse_uevent(&u, ev))
+        {
+            return 1;
+        }
+    }
+}
+
+#endif
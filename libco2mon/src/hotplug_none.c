@@ -0,0 +1,61 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * No hotplug notifications on this platform; callers keep looking for
+ * devices themselves.
+ */
+
+#include <stddef.h>
+
+#include "device.h"
+
+co2mon_hotplug
+co2mon_hotplug_open()
+{
+    return NULL;
+}
+
+void
+co2mon_hotplug_close(co2mon_hotplug hp)
+{
+    (void)hp;
+}
+
+int
+co2mon_hotplug_fd(co2mon_hotplug hp)
+{
+    (void)hp;
+    return -1;
+}
+
+int
+co2mon_hotplug_read(co2mon_hotplug hp, struct co2mon_hotplug_event *ev)
+{
+    (void)hp;
+    (void)ev;
+    return 0;
+}
+
+int
+co2mon_hotplug_match(const struct co2mon_hotplug_event *ev, const char *path)
+{
+    (void)ev;
+    (void)path;
+    return -1;
+}
@@ -0,0 +1,84 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The item descriptors: every consumer decodes values with this table, so
+ * a new item needs a row here and nothing else.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+
+#include "co2mon.h"
+
+const struct co2mon_item co2mon_items[256] = {
+    [CO2MON_ITEM_HUM] = { "Hum", 0.01, 0.0, 0, 10000, 0.0, 0.0, 0.0, 2, CO2MON_ITEM_SHOW },
+    [CO2MON_ITEM_TAMB] = { "Tamb", 0.0625, -273.15, 0, 0xffff, 0.0, 30.0, 35.0, 4, CO2MON_ITEM_SHOW | CO2MON_ITEM_STORE },
+    /* Spurious (uninitialized?) words above 3000 come after power-up. */
+    [CO2MON_ITEM_CNTR] = { "CntR", 1.0, 0.0, 0, 3000, 0.0, 800.0, 1200.0, 0, CO2MON_ITEM_SHOW | CO2MON_ITEM_STORE },
+};
+
+double
+co2mon_item_value(unsigned char code, double word)
+{
+    const struct co2mon_item *item = &co2mon_items[code];
+    if (!item->name)
+    {
+        return word;
+    }
+    return word * item->scale + item->offset;
+}
+
+int
+co2mon_item_valid(unsigned char code, uint16_t word)
+{
+    const struct co2mon_item *item = &co2mon_items[code];
+    return !item->name || (word >= item->min && word <= item->max);
+}
+
+int
+co2mon_item_format(unsigned char code, double value, char *buf, size_t size)
+{
+    return snprintf(buf, size, "%.*f", co2mon_items[code].precision, value);
+}
+
+int
+co2mon_item_name(unsigned char code, char *buf, size_t size)
+{
+    const char *name = co2mon_items[code].name;
+    if (name)
+    {
+        return snprintf(buf, size, "%s", name);
+    }
+    return snprintf(buf, size, "0x%02x", code);
+}
+
+int
+co2mon_item_code(const char *name)
+{
+    for (int code = 0; code < 256; ++code)
+    {
+        if (co2mon_items[code].name && strcmp(co2mon_items[code].name, name) == 0)
+        {
+            return code;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,154 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Error codes and the log callback.  Messages are formatted on the stack;
+ * the rate limit keeps its state in the device handle, so threads using
+ * separate handles never share anything here but the callback.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* XSI strerror_r */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+
+#define LOG_MESSAGE_MAX 256
+
+static co2mon_log_callback log_callback = co2mon_log_stderr;
+static void *log_arg = NULL;
+
+void
+co2mon_set_log_callback(co2mon_log_callback callback, void *arg)
+{
+    log_callback = callback;
+    log_arg = arg;
+}
+
+void
+co2mon_log_stderr(co2mon_device dev, int error, const char *message, void *arg)
+{
+    (void)dev;
+    (void)error;
+    (void)arg;
+    fprintf(stderr, "%s\n", message);
+}
+
+const char *
+co2mon_strerror(int error)
+{
+    switch (error)
+    {
+    case CO2MON_OK:
+        return "success";
+    case CO2MON_ERROR_NOT_FOUND:
+        return "no CO2 device found";
+    case CO2MON_ERROR_NO_MEMORY:
+        return "out of memory";
+    case CO2MON_ERROR_OPEN:
+        return "cannot open the device";
+    case CO2MON_ERROR_IO:
+        return "I/O error";
+    case CO2MON_ERROR_TIMEOUT:
+        return "no report within the timeout";
+    case CO2MON_ERROR_SHORT_READ:
+        return "incomplete report";
+    case CO2MON_ERROR_CHECKSUM:
+        return "report with a bad checksum";
+    case CO2MON_ERROR_INVALID:
+        return "invalid argument";
+    case CO2MON_ERROR_SYSTEM:
+        return "system error";
+    default:
+        return "unknown error";
+    }
+}
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether a message about dev may go out now; reports what the previous
+ * window dropped when a new one begins. */
+static int
+rate_limit(co2mon_device dev, int error)
+{
+    int64_t now = monotonic_ns();
+    if (dev->log_count == 0 || now - dev->log_window >= (int64_t)CO2MON_LOG_INTERVAL * 1000000000)
+    {
+        unsigned dropped = dev->log_dropped;
+        dev->log_window = now;
+        dev->log_count = 0;
+        dev->log_dropped = 0;
+        if (dropped)
+        {
+            char message[LOG_MESSAGE_MAX];
+            snprintf(message, sizeof(message), "%s: %u more messages suppressed", dev->path, dropped);
+            log_callback(dev, error, message, log_arg);
+        }
+    }
+    if (dev->log_count >= CO2MON_LOG_BURST)
+    {
+        ++dev->log_dropped;
+        ++dev->stats.suppressed;
+        return 0;
+    }
+    ++dev->log_count;
+    return 1;
+}
+
+static void
+log_message(co2mon_device dev, int error, const char *format, va_list ap)
+{
+    if (!log_callback || (dev && !rate_limit(dev, error)))
+    {
+        return;
+    }
+    char message[LOG_MESSAGE_MAX];
+    vsnprintf(message, sizeof(message), format, ap);
+    log_callback(dev, error, message, log_arg);
+}
+
+void
+co2mon_log(co2mon_device dev, int error, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_message(dev, error, format, ap);
+    va_end(ap);
+}
+
+void
+co2mon_log_errno(co2mon_device dev, int error, const char *what)
+{
+    int saved = errno;
+    char reason[128];
+    if (strerror_r(saved, reason, sizeof(reason)) != 0)
+    {
+        snprintf(reason, sizeof(reason), "error %d", saved);
+    }
+    co2mon_log(dev, error, "%s: %s", what, reason);
+}
@@ -0,0 +1,248 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "co2mon_shm.h"
+#include "device.h"
+
+/* How many times a reader retries a slot the writer keeps changing. */
+#define SHM_READ_RETRIES 10000
+
+struct co2mon_shm_
+{
+    struct co2mon_shm_header *header;
+    size_t size;
+    unsigned nslots;  /* slots inside the mapping */
+};
+
+static struct co2mon_shm_device *
+shm_device(const co2mon_shm *shm, unsigned slot)
+{
+    char *base = (char *)shm->header + sizeof(struct co2mon_shm_header);
+    return (struct co2mon_shm_device *)(base + (size_t)slot * sizeof(struct co2mon_shm_device));
+}
+
+/* The slots that are both in use by the writer and inside our mapping:
+ * the writer may restart with more devices than we mapped. */
+static unsigned
+shm_nslots(const co2mon_shm *shm)
+{
+    unsigned n = __atomic_load_n(&shm->header->ndevices, __ATOMIC_RELAXED);
+    return n < shm->nslots ? n : shm->nslots;
+}
+
+static co2mon_shm *
+shm_map(int fd, size_t size, int prot)
+{
+    void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, "co2mon_shm: mmap");
+        return NULL;
+    }
+    co2mon_shm *shm = malloc(sizeof(*shm));
+    if (!shm)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_NO_MEMORY, "co2mon_shm: out of memory");
+        munmap(map, size);
+        return NULL;
+    }
+    shm->header = map;
+    shm->size = size;
+    shm->nslots = (unsigned)((size - sizeof(struct co2mon_shm_header)) / sizeof(struct co2mon_shm_device));
+    return shm;
+}
+
+static void
+write_begin(struct co2mon_shm_device *dev)
+{
+    __atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct co2mon_shm_device *dev)
+{
+    __atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELEASE);
+}
+
+co2mon_shm *
+co2mon_shm_create(const char *path, unsigned ndevices)
+{
+    size_t size = sizeof(struct co2mon_shm_header) + (size_t)ndevices * sizeof(struct co2mon_shm_device);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        return NULL;
+    }
+    /* Never shrink the file under readers that keep it mapped (such as the
+     * collectd plugin): reset it through the mapping instead. */
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0))
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        close(fd);
+        return NULL;
+    }
+    co2mon_shm *shm = shm_map(fd, size, PROT_READ | PROT_WRITE);
+    close(fd);
+    if (!shm)
+    {
+        return NULL;
+    }
+
+    __atomic_store_n(&shm->header->magic, 0, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < ndevices; ++i)
+    {
+        struct co2mon_shm_device *dev = shm_device(shm, i);
+        dev->seq &= ~1u; /* left odd by a writer that crashed */
+        write_begin(dev);
+        dev->used = 0;
+        memset(dev->name, 0, sizeof(*dev) - offsetof(struct co2mon_shm_device, name));
+        write_end(dev);
+    }
+
+    shm->header->version = CO2MON_SHM_VERSION;
+    shm->header->ndevices = ndevices;
+    shm->header->device_size = sizeof(struct co2mon_shm_device);
+    __atomic_store_n(&shm->header->magic, CO2MON_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+co2mon_shm *
+co2mon_shm_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        co2mon_log_errno(NULL, CO2MON_ERROR_SYSTEM, path);
+        return NULL;
+    }
+
+    struct co2mon_shm_header header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != CO2MON_SHM_MAGIC || header.version != CO2MON_SHM_VERSION ||
+        header.device_size != sizeof(struct co2mon_shm_device) ||
+        (size_t)st.st_size < sizeof(header) + (size_t)header.ndevices * header.device_size)
+    {
+        co2mon_log(NULL, CO2MON_ERROR_INVALID, "%s: not a co2mon snapshot", path);
+        close(fd);
+        return NULL;
+    }
+
+    co2mon_shm *shm = shm_map(fd, sizeof(header) + (size_t)header.ndevices * header.device_size, PROT_READ);
+    close(fd);
+    return shm;
+}
+
+void
+co2mon_shm_close(co2mon_shm *shm)
+{
+    munmap(shm->header, shm->size);
+    free(shm);
+}
+
+unsigned
+co2mon_shm_ndevices(const co2mon_shm *shm)
+{
+    return shm_nslots(shm);
+}
+
+void
+co2mon_shm_set_name(co2mon_shm *shm, unsigned slot, const char *name)
+{
+    if (slot >= shm_nslots(shm))
+    {
+        return;
+    }
+    struct co2mon_shm_device *dev = shm_device(shm, slot);
+    write_begin(dev);
+    memset(dev->name, 0, sizeof(dev->name));
+    strncpy(dev->name, name, sizeof(dev->name) - 1);
+    dev->used = 1;
+    write_end(dev);
+}
+
+void
+co2mon_shm_clear(co2mon_shm *shm, unsigned slot)
+{
+    if (slot >= shm_nslots(shm))
+    {
+        return;
+    }
+    struct co2mon_shm_device *dev = shm_device(shm, slot);
+    write_begin(dev);
+    dev->used = 0;
+    memset(dev->name, 0, sizeof(dev->name));
+    dev->heartbeat = 0;
+    memset(dev->timestamp, 0, sizeof(dev->timestamp));
+    memset(dev->data, 0, sizeof(dev->data));
+    write_end(dev);
+}
+
+void
+co2mon_shm_update(co2mon_shm *shm, unsigned slot, unsigned char code, uint16_t value, int64_t timestamp)
+{
+    if (slot >= shm_nslots(shm))
+    {
+        return;
+    }
+    struct co2mon_shm_device *dev = shm_device(shm, slot);
+    write_begin(dev);
+    dev->data[code] = value;
+    dev->timestamp[code] = timestamp;
+    dev->heartbeat = timestamp;
+    write_end(dev);
+}
+
+int
+co2mon_shm_read(const co2mon_shm *shm, unsigned slot, struct co2mon_shm_device *snapshot)
+{
+    if (slot >= shm_nslots(shm))
+    {
+        return 0;
+    }
+    const struct co2mon_shm_device *dev = shm_device(shm, slot);
+    for (int i = 0; i < SHM_READ_RETRIES; ++i)
+    {
+        uint32_t seq = __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue;
+        }
+        memcpy(snapshot, dev, sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&dev->seq, __ATOMIC_RELAXED) == seq)
+        {
+            snapshot->seq = seq;
+            return snapshot->used ? 1 : 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,397 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulated sensors for load and soak testing.  A device path like
+ *
+ *   sim:rate=50,err=0.01,short=0.01,disconnect=30
+ *
+ * opens a sensor that sends encrypted reports at the given rate, with the
+ * given share of checksum errors and short reads, and drops off about
+ * every so many seconds.  Parameters:
+ *
+ *   rate=N         reports per second (2)
+ *   err=P          probability of a report with a bad checksum (0)
+ *   short=P        probability of a short read (0)
+ *   disconnect=S   mean seconds until the device goes away, 0 for never (0)
+ *   openfail=P     probability that opening fails (0)
+ *   plaintext=1    send unencrypted reports like newer firmware (0)
+ *   seed=N         random seed (derived from the path and the clock)
+ *
+ * On Linux a timerfd paces the reports, so simulated devices can be
+ * polled like real ones.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "device.h"
+
+#define SIM_PREFIX "sim:"
+#define SIM_BUFFERED 64 /* reports the device keeps while nobody reads */
+
+struct sim
+{
+    double rate;
+    double err;
+    double short_read;
+    double disconnect;
+    double open_fail;
+    int plaintext;
+    uint64_t rng;
+
+    int fd;               /* timerfd, or -1 */
+    int64_t interval;     /* nanoseconds between reports */
+    int64_t next;         /* when the next report is due, without a timerfd */
+    uint64_t pending;     /* reports due but not read yet */
+    int64_t disconnect_at;
+
+    co2mon_data_t magic_table;
+    unsigned seq;
+    int co2;
+};
+
+static int64_t
+sim_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t
+sim_random(struct sim *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+sim_uniform(struct sim *sim)
+{
+    return (double)(sim_random(sim) >> 11) / 9007199254740992.0;
+}
+
+static int
+parse_params(co2mon_device dev, struct sim *sim, const char *path)
+{
+    uint64_t seed = 0x9e3779b97f4a7c15ULL ^ (uint64_t)sim_now();
+    for (const char *p = path; *p; ++p)
+    {
+        seed = (seed ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+
+    sim->rate = 2;
+    const char *p = path + strlen(SIM_PREFIX);
+    while (*p)
+    {
+        const char *eq = strchr(p, '=');
+        if (!eq)
+        {
+            break;
+        }
+        size_t len = (size_t)(eq - p);
+        char *end;
+        double value = strtod(eq + 1, &end);
+        if (end == eq + 1 || (*end && *end != ','))
+        {
+            break;
+        }
+        if (len == 4 && strncmp(p, "rate", len) == 0 && value > 0)
+        {
+            sim->rate = value;
+        }
+        else if (len == 3 && strncmp(p, "err", len) == 0)
+        {
+            sim->err = value;
+        }
+        else if (len == 5 && strncmp(p, "short", len) == 0)
+        {
+            sim->short_read = value;
+        }
+        else if (len == 10 && strncmp(p, "disconnect", len) == 0)
+        {
+            sim->disconnect = value;
+        }
+        else if (len == 8 && strncmp(p, "openfail", len) == 0)
+        {
+            sim->open_fail = value;
+        }
+        else if (len == 9 && strncmp(p, "plaintext", len) == 0)
+        {
+            sim->plaintext = value != 0;
+        }
+        else if (len == 4 && strncmp(p, "seed", len) == 0)
+        {
+            seed = (uint64_t)value;
+        }
+        else
+        {
+            break;
+        }
+        p = *end ? end + 1 : end;
+    }
+    if (*p)
+    {
+        co2mon_log(dev, CO2MON_ERROR_INVALID, "%s: bad simulator parameters at \"%s\"", path, p);
+        return 0;
+    }
+    sim->rng = seed ? seed : 1;
+    return 1;
+}
+
+static int
+sim_open(co2mon_device dev, const char *path)
+{
+    struct sim *sim = calloc(1, sizeof(*sim));
+    if (!sim)
+    {
+        co2mon_log(dev, CO2MON_ERROR_NO_MEMORY, "%s: out of memory", path);
+        return 0;
+    }
+    if (!parse_params(dev, sim, path))
+    {
+        free(sim);
+        return 0;
+    }
+    if (sim_uniform(sim) < sim->open_fail)
+    {
+        co2mon_log(dev, CO2MON_ERROR_OPEN, "%s: simulated open failure", path);
+        free(sim);
+        return 0;
+    }
+
+    int64_t now = sim_now();
+    sim->interval = (int64_t)(1e9 / sim->rate);
+    if (sim->interval < 1)
+    {
+        sim->interval = 1;
+    }
+    sim->next = now + sim->interval;
+    if (sim->disconnect > 0)
+    {
+        sim->disconnect_at = now + (int64_t)(2e9 * sim->disconnect * sim_uniform(sim));
+    }
+    sim->co2 = 400 + (int)(sim_random(sim) % 600);
+
+    sim->fd = -1;
+#ifdef __linux__
+    sim->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sim->fd == -1)
+    {
+        co2mon_log_errno(dev, CO2MON_ERROR_SYSTEM, "timerfd_create");
+        free(sim);
+        return 0;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = sim->interval / 1000000000;
+    its.it_interval.tv_nsec = sim->interval % 1000000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(sim->fd, 0, &its, NULL) != 0)
+    {
+        co2mon_log_errno(dev, CO2MON_ERROR_SYSTEM, "timerfd_settime");
+        close(sim->fd);
+        free(sim);
+        return 0;
+    }
+#endif
+
+    dev->transport_data = sim;
+    return 1;
+}
+
+static void
+sim_close(co2mon_device dev)
+{
+    struct sim *sim = dev->transport_data;
+    if (sim->fd != -1)
+    {
+        close(sim->fd);
+    }
+    free(sim);
+    dev->transport_data = NULL;
+}
+
+static int
+sim_fd(co2mon_device dev)
+{
+    struct sim *sim = dev->transport_data;
+    return sim->fd;
+}
+
+static int
+sim_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    struct sim *sim = dev->transport_data;
+    if (length == sizeof(co2mon_data_t))
+    {
+        memcpy(sim->magic_table, data, length);
+    }
+    return (int)length;
+}
+
+/* Adds the reports that fell due since the last call to sim->pending. */
+static void
+collect_due(struct sim *sim)
+{
+    if (sim->fd != -1)
+    {
+        uint64_t expirations;
+        if (read(sim->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+            sim->pending += expirations;
+        }
+    }
+    else
+    {
+        int64_t now = sim_now();
+        if (now >= sim->next)
+        {
+            uint64_t n = (uint64_t)((now - sim->next) / sim->interval) + 1;
+            sim->pending += n;
+            sim->next += (int64_t)n * sim->interval;
+        }
+    }
+    if (sim->pending > SIM_BUFFERED)
+    {
+        sim->pending = SIM_BUFFERED;
+    }
+}
+
+static void
+wait_due(struct sim *sim, int timeout)
+{
+    if (sim->fd != -1)
+    {
+        struct pollfd pfd;
+        pfd.fd = sim->fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, timeout);
+        return;
+    }
+    int64_t wait = sim->next - sim_now();
+    if (timeout >= 0 && wait > (int64_t)timeout * 1000000)
+    {
+        wait = (int64_t)timeout * 1000000;
+    }
+    if (wait > 0)
+    {
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000000;
+        ts.tv_nsec = wait % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void
+make_report(struct sim *sim, co2mon_data_t plain)
+{
+    static const unsigned char codes[] = { CO2MON_ITEM_CNTR, CO2MON_ITEM_TAMB, CO2MON_ITEM_HUM, 0x6d };
+    unsigned char code = codes[sim->seq++ % sizeof(codes)];
+    int value;
+    switch (code)
+    {
+    case CO2MON_ITEM_CNTR:
+        sim->co2 += (int)(sim_random(sim) % 11) - 5;
+        sim->co2 = sim->co2 < 400 ? 400 : sim->co2 > 2500 ? 2500 : sim->co2;
+        value = sim->co2;
+        break;
+    case CO2MON_ITEM_TAMB:
+        value = 4720 + (int)(sim_random(sim) % 16); /* about 22 C */
+        break;
+    case CO2MON_ITEM_HUM:
+        value = 4000 + (int)(sim_random(sim) % 200);
+        break;
+    default:
+        value = 0x1234;
+    }
+
+    memset(plain, 0, sizeof(co2mon_data_t));
+    plain[0] = code;
+    plain[1] = (unsigned char)(value >> 8);
+    plain[2] = (unsigned char)value;
+    plain[3] = plain[0] + plain[1] + plain[2];
+    plain[4] = 0x0d;
+    if (sim_uniform(sim) < sim->err)
+    {
+        plain[3] ^= 0x5a;
+    }
+}
+
+static int
+sim_read(co2mon_device dev, unsigned char *data, size_t length, int timeout)
+{
+    struct sim *sim = dev->transport_data;
+    if (sim->disconnect_at && sim_now() >= sim->disconnect_at)
+    {
+        return -1;
+    }
+
+    collect_due(sim);
+    if (sim->pending == 0 && timeout != 0)
+    {
+        wait_due(sim, timeout);
+        collect_due(sim);
+    }
+    if (sim->pending == 0)
+    {
+        return 0;
+    }
+    --sim->pending;
+
+    co2mon_data_t plain, raw;
+    make_report(sim, plain);
+    if (sim->plaintext)
+    {
+        memcpy(raw, plain, sizeof(raw));
+    }
+    else
+    {
+        encode_report(plain, sim->magic_table, raw);
+    }
+
+    size_t n = length < sizeof(raw) ? length : sizeof(raw);
+    if (sim_uniform(sim) < sim->short_read)
+    {
+        n /= 2;
+    }
+    memcpy(data, raw, n);
+    return (int)n;
+}
+
+const struct co2mon_transport sim_transport = {
+    SIM_PREFIX,
+    sim_open,
+    sim_close,
+    sim_fd,
+    sim_send_feature_report,
+    sim_read,
+};
@@ -0,0 +1,74 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "co2mon_udp.h"
+
+static void
+put_be(unsigned char *p, uint64_t v, int n)
+{
+    for (int i = n - 1; i >= 0; --i)
+    {
+        p[i] = (unsigned char)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t
+get_be(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+void
+co2mon_udp_pack(unsigned char *buf, const struct co2mon_udp_record *record)
+{
+    put_be(buf, CO2MON_UDP_MAGIC, 4);
+    buf[4] = CO2MON_UDP_VERSION;
+    buf[5] = record->code;
+    put_be(buf + 6, record->value, 2);
+    put_be(buf + 8, record->seq, 4);
+    put_be(buf + 12, record->epoch, 4);
+    put_be(buf + 16, (uint64_t)record->timestamp, 8);
+    strncpy((char *)buf + 24, record->device, CO2MON_UDP_NAME_MAX);
+}
+
+int
+co2mon_udp_unpack(const unsigned char *buf, size_t len, struct co2mon_udp_record *record)
+{
+    if (len != CO2MON_UDP_SIZE || get_be(buf, 4) != CO2MON_UDP_MAGIC || buf[4] != CO2MON_UDP_VERSION)
+    {
+        return 0;
+    }
+    record->code = buf[5];
+    record->value = (uint16_t)get_be(buf + 6, 2);
+    record->seq = (uint32_t)get_be(buf + 8, 4);
+    record->epoch = (uint32_t)get_be(buf + 12, 4);
+    record->timestamp = (int64_t)get_be(buf + 16, 8);
+    memcpy(record->device, buf + 24, CO2MON_UDP_NAME_MAX);
+    record->device[CO2MON_UDP_NAME_MAX] = '\0';
+    return record->device[0] != '\0';
+}
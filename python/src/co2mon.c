@@ -0,0 +1,1205 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Python module over libco2mon: device enumeration and reading, batch
+ * decoding of raw reports, the co2mond snapshot (-M) and archive segments
+ * (-Y).
+ *
+ * Bulk data comes back as a Records object, an array of struct
+ * co2mon_record that exports the buffer protocol, so NumPy sees it as a
+ * structured array without copying and without an object per report:
+ *
+ *   import co2mon, numpy
+ *   name, day, records = co2mon.read_archive("archive/dev/2024-01-01.co2a")
+ *   a = numpy.asarray(records)        # fields code, value, timestamp, monotonic
+ *   co2 = a[a["code"] == co2mon.ITEM_CNTR]["value"]
+ *
+ * Indexing a Records object gives co2mon.Record tuples for code without
+ * NumPy.  Blocking reads release the GIL.
+ */
+
+/* Python.h may change the environment, it has to come first. */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <stddef.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "co2mon.h"
+#include "co2mon_archive.h"
+#include "co2mon_shm.h"
+
+#define READ_BATCH 4096 /* reports per poll in Device.read_records() */
+
+/* PEP 3118 layout of struct co2mon_record, checked below. */
+static char record_format[] = "T{B:code:xH:value:4xq:timestamp:q:monotonic:}";
+
+typedef char record_layout_check[
+    offsetof(struct co2mon_record, code) == 0 && offsetof(struct co2mon_record, value) == 2 &&
+    offsetof(struct co2mon_record, timestamp) == 8 && offsetof(struct co2mon_record, monotonic) == 16 &&
+    sizeof(struct co2mon_record) == 24 ? 1 : -1];
+
+static PyObject *error_type;
+
+/* The last library message not about an open handle, for exceptions. */
+static int last_error = CO2MON_OK;
+static char last_message[256];
+
+static void
+log_callback(co2mon_device dev, int error, const char *message, void *arg)
+{
+    if (!dev)
+    {
+        last_error = error;
+        snprintf(last_message, sizeof(last_message), "%s", message);
+    }
+    co2mon_log_stderr(dev, error, message, arg);
+}
+
+static PyObject *
+raise_error(int error, const char *message)
+{
+    PyObject *args = Py_BuildValue("(is)", error, message ? message : co2mon_strerror(error));
+    if (args)
+    {
+        PyErr_SetObject(error_type, args);
+        Py_DECREF(args);
+    }
+    return NULL;
+}
+
+/* Record */
+
+static PyStructSequence_Field record_fields[] = {
+    { "code", "item code" },
+    { "value", "raw word, see item()" },
+    { "timestamp", "nanoseconds since the Epoch" },
+    { "monotonic", "nanoseconds on CLOCK_MONOTONIC, 0 if not known" },
+    { NULL, NULL }
+};
+
+static PyStructSequence_Desc record_desc = {
+    "co2mon.Record",
+    "A decoded report.",
+    record_fields,
+    4
+};
+
+static PyTypeObject record_type;
+
+static PyObject *
+make_record(const struct co2mon_record *r)
+{
+    PyObject *t = PyStructSequence_New(&record_type);
+    if (!t)
+    {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(t, 0, PyLong_FromLong(r->code));
+    PyStructSequence_SET_ITEM(t, 1, PyLong_FromLong(r->value));
+    PyStructSequence_SET_ITEM(t, 2, PyLong_FromLongLong(r->timestamp));
+    PyStructSequence_SET_ITEM(t, 3, PyLong_FromLongLong(r->monotonic));
+    for (int i = 0; i < 4; ++i)
+    {
+        if (!PyStructSequence_GET_ITEM(t, i))
+        {
+            Py_DECREF(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+/* Records */
+
+typedef struct
+{
+    PyObject_HEAD
+    struct co2mon_record *records;
+    Py_ssize_t count;
+    Py_ssize_t size;
+} records_object;
+
+static PyTypeObject records_type;
+
+static records_object *
+records_new(Py_ssize_t size)
+{
+    records_object *self = PyObject_New(records_object, &records_type);
+    if (!self)
+    {
+        return NULL;
+    }
+    self->count = 0;
+    self->size = size > 0 ? size : 1;
+    self->records = PyMem_Malloc((size_t)self->size * sizeof(*self->records));
+    if (!self->records)
+    {
+        Py_DECREF(self);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return self;
+}
+
+static void
+records_dealloc(records_object *self)
+{
+    PyMem_Free(self->records);
+    PyObject_Del(self);
+}
+
+static Py_ssize_t
+records_length(records_object *self)
+{
+    return self->count;
+}
+
+static PyObject *
+records_item(records_object *self, Py_ssize_t i)
+{
+    if (i < 0 || i >= self->count)
+    {
+        PyErr_SetString(PyExc_IndexError, "record index out of range");
+        return NULL;
+    }
+    return make_record(&self->records[i]);
+}
+
+static int
+records_getbuffer(records_object *self, Py_buffer *view, int flags)
+{
+    if (flags & PyBUF_WRITABLE)
+    {
+        PyErr_SetString(PyExc_BufferError, "records are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->records;
+    view->len = self->count * (Py_ssize_t)sizeof(*self->records);
+    view->readonly = 1;
+    view->itemsize = sizeof(*self->records);
+    view->format = (flags & PyBUF_FORMAT) ? record_format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->count : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &view->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PySequenceMethods records_as_sequence = {
+    .sq_length = (lenfunc)records_length,
+    .sq_item = (ssizeargfunc)records_item,
+};
+
+static PyBufferProcs records_as_buffer = {
+    .bf_getbuffer = (getbufferproc)records_getbuffer,
+};
+
+static PyTypeObject records_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "co2mon.Records",
+    .tp_basicsize = sizeof(records_object),
+    .tp_dealloc = (destructor)records_dealloc,
+    .tp_as_sequence = &records_as_sequence,
+    .tp_as_buffer = &records_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Read-only array of decoded reports.  It exports the buffer\n"
+              "protocol with fields code, value, timestamp and monotonic\n"
+              "(see RECORD_DTYPE); indexing gives Record tuples.",
+};
+
+/* Device */
+
+typedef struct
+{
+    PyObject_HEAD
+    co2mon_device dev;
+    co2mon_data_t magic_table;
+    int busy;                  /* a read is running without the GIL */
+} device_object;
+
+static int
+device_usable(device_object *self)
+{
+    if (!self->dev)
+    {
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return 0;
+    }
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "device is being read by another thread");
+        return 0;
+    }
+    return 1;
+}
+
+static int
+device_init(device_object *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "path", NULL };
+    const char *path = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:Device", kwlist, &path))
+    {
+        return -1;
+    }
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "device is being read by another thread");
+        return -1;
+    }
+    if (self->dev)
+    {
+        co2mon_close_device(self->dev);
+        self->dev = NULL;
+    }
+
+    last_error = CO2MON_ERROR_OPEN;
+    last_message[0] = '\0';
+    Py_BEGIN_ALLOW_THREADS
+    self->dev = path ? co2mon_open_device_path(path) : co2mon_open_device();
+    Py_END_ALLOW_THREADS
+    if (!self->dev)
+    {
+        raise_error(last_error, last_message[0] ? last_message : NULL);
+        return -1;
+    }
+
+    memset(self->magic_table, 0, sizeof(co2mon_data_t));
+    if (!co2mon_send_magic_table(self->dev, self->magic_table))
+    {
+        int error = co2mon_last_error(self->dev);
+        co2mon_close_device(self->dev);
+        self->dev = NULL;
+        raise_error(error, "unable to send the magic table");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+device_dealloc(device_object *self)
+{
+    if (self->dev)
+    {
+        co2mon_close_device(self->dev);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int64_t
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Reads valid reports into out[0..max-1] until max are there or timeout
+ * milliseconds (forever if negative) have passed.  Runs without the GIL.
+ * Returns the number of records, or -1 with the error in *error.
+ */
+static Py_ssize_t
+read_reports(device_object *self, struct co2mon_record *out, Py_ssize_t max, int timeout, int *error)
+{
+    int64_t deadline = timeout < 0 ? -1 : monotonic_ms() + timeout;
+    Py_ssize_t n = 0;
+    while (n < max)
+    {
+        co2mon_data_t result;
+        int r = co2mon_read_data_nonblock(self->dev, self->magic_table, result);
+        if (r == CO2MON_WOULD_BLOCK)
+        {
+            int wait = 1000; /* come back now and then, so that signals get handled */
+            if (deadline >= 0)
+            {
+                int64_t left = deadline - monotonic_ms();
+                if (left <= 0)
+                {
+                    break;
+                }
+                if (left < wait)
+                {
+                    wait = (int)left;
+                }
+            }
+            int ready;
+            int polled = co2mon_poll(&self->dev, &ready, 1, wait);
+            if (polled < 0 && errno != EINTR)
+            {
+                *error = CO2MON_ERROR_SYSTEM;
+                return -1;
+            }
+            if (deadline < 0 && polled <= 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (r < 0)
+        {
+            *error = co2mon_last_error(self->dev);
+            return -1;
+        }
+        if (r == 0 || co2mon_last_error(self->dev) != CO2MON_OK)
+        {
+            continue;
+        }
+        struct co2mon_record *rec = &out[n++];
+        rec->code = result[0];
+        rec->value = (uint16_t)((result[1] << 8) | result[2]);
+        co2mon_report_time(self->dev, &rec->timestamp, &rec->monotonic);
+    }
+    return n;
+}
+
+static int
+parse_timeout(PyObject *obj, int *timeout)
+{
+    if (obj == Py_None)
+    {
+        *timeout = -1;
+        return 1;
+    }
+    double seconds = PyFloat_AsDouble(obj);
+    if (seconds == -1.0 && PyErr_Occurred())
+    {
+        return 0;
+    }
+    if (seconds < 0 || seconds > 86400.0 * 24)
+    {
+        PyErr_SetString(PyExc_ValueError, "timeout out of range");
+        return 0;
+    }
+    *timeout = (int)(seconds * 1000);
+    return 1;
+}
+
+/* Without a timeout, reads all max records, coming back to the
+ * interpreter every second to run signal handlers. */
+static Py_ssize_t
+device_read_into(device_object *self, struct co2mon_record *out, Py_ssize_t max, int timeout)
+{
+    Py_ssize_t n = 0;
+    do
+    {
+        int error = CO2MON_OK;
+        Py_ssize_t r;
+        self->busy = 1;
+        Py_BEGIN_ALLOW_THREADS
+        r = read_reports(self, out + n, max - n, timeout, &error);
+        Py_END_ALLOW_THREADS
+        self->busy = 0;
+        if (r < 0)
+        {
+            raise_error(error, NULL);
+            return -1;
+        }
+        n += r;
+        if (timeout < 0 && PyErr_CheckSignals() < 0)
+        {
+            return -1;
+        }
+    } while (timeout < 0 && n < max);
+    return n;
+}
+
+static PyObject *
+device_read(device_object *self, PyObject *args)
+{
+    PyObject *timeout_obj = Py_None;
+    int timeout;
+    if (!PyArg_ParseTuple(args, "|O:read", &timeout_obj) || !parse_timeout(timeout_obj, &timeout) ||
+        !device_usable(self))
+    {
+        return NULL;
+    }
+    struct co2mon_record record;
+    Py_ssize_t n = device_read_into(self, &record, 1, timeout);
+    if (n < 0)
+    {
+        return NULL;
+    }
+    if (n == 0)
+    {
+        Py_RETURN_NONE;
+    }
+    return make_record(&record);
+}
+
+static PyObject *
+device_read_records(device_object *self, PyObject *args)
+{
+    Py_ssize_t max;
+    PyObject *timeout_obj = Py_None;
+    int timeout;
+    if (!PyArg_ParseTuple(args, "n|O:read_records", &max, &timeout_obj) || !parse_timeout(timeout_obj, &timeout) ||
+        !device_usable(self))
+    {
+        return NULL;
+    }
+    if (max < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "need at least one record");
+        return NULL;
+    }
+    records_object *records = records_new(max);
+    if (!records)
+    {
+        return NULL;
+    }
+    Py_ssize_t n = device_read_into(self, records->records, max, timeout);
+    if (n < 0)
+    {
+        Py_DECREF(records);
+        return NULL;
+    }
+    records->count = n;
+    return (PyObject *)records;
+}
+
+static PyObject *
+device_close(device_object *self, PyObject *unused)
+{
+    (void)unused;
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "device is being read by another thread");
+        return NULL;
+    }
+    if (self->dev)
+    {
+        co2mon_close_device(self->dev);
+        self->dev = NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+device_fileno(device_object *self, PyObject *unused)
+{
+    (void)unused;
+    if (!device_usable(self))
+    {
+        return NULL;
+    }
+    return PyLong_FromLong(co2mon_device_fd(self->dev));
+}
+
+static PyObject *
+device_stats(device_object *self, PyObject *unused)
+{
+    (void)unused;
+    if (!device_usable(self))
+    {
+        return NULL;
+    }
+    struct co2mon_stats stats;
+    co2mon_device_stats(self->dev, &stats);
+    return Py_BuildValue("{sKsKsKsKsKsK}",
+                         "reports", (unsigned long long)stats.reports,
+                         "checksum_errors", (unsigned long long)stats.checksum_errors,
+                         "short_reads", (unsigned long long)stats.short_reads,
+                         "timeouts", (unsigned long long)stats.timeouts,
+                         "io_errors", (unsigned long long)stats.io_errors,
+                         "suppressed", (unsigned long long)stats.suppressed);
+}
+
+static PyObject *
+device_enter(device_object *self, PyObject *unused)
+{
+    (void)unused;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+device_exit(device_object *self, PyObject *args)
+{
+    (void)args;
+    return device_close(self, NULL);
+}
+
+static PyObject *
+device_get_path(device_object *self, void *closure)
+{
+    (void)closure;
+    char path[4096];
+    if (!device_usable(self) || !co2mon_device_path(self->dev, path, sizeof(path)))
+    {
+        return NULL;
+    }
+    return PyUnicode_DecodeFSDefault(path);
+}
+
+static PyObject *
+device_get_encoding(device_object *self, void *closure)
+{
+    (void)closure;
+    if (!device_usable(self))
+    {
+        return NULL;
+    }
+    return PyLong_FromLong(co2mon_device_encoding(self->dev));
+}
+
+static PyMethodDef device_methods[] = {
+    { "read", (PyCFunction)device_read, METH_VARARGS,
+      "read(timeout=None) -> Record or None\n\n"
+      "Waits for the next valid report, at most timeout seconds." },
+    { "read_records", (PyCFunction)device_read_records, METH_VARARGS,
+      "read_records(max, timeout=None) -> Records\n\n"
+      "Reads max valid reports, or those that arrive within timeout\n"
+      "seconds." },
+    { "close", (PyCFunction)device_close, METH_NOARGS, "close()" },
+    { "fileno", (PyCFunction)device_fileno, METH_NOARGS,
+      "fileno() -> int\n\nA descriptor that becomes readable when a report arrives, -1 if there is none." },
+    { "stats", (PyCFunction)device_stats, METH_NOARGS,
+      "stats() -> dict\n\nWhat happened on the handle since it was opened." },
+    { "__enter__", (PyCFunction)device_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)device_exit, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef device_getset[] = {
+    { "path", (getter)device_get_path, NULL, "the device path", NULL },
+    { "encoding", (getter)device_get_encoding, NULL, "one of ENCODING_*", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject device_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "co2mon.Device",
+    .tp_basicsize = sizeof(device_object),
+    .tp_dealloc = (destructor)device_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Device(path=None)\n\n"
+              "An open sensor: the first one found, or the one at path as\n"
+              "enumerate() returns it (or a simulated one, \"sim:...\").",
+    .tp_methods = device_methods,
+    .tp_getset = device_getset,
+    .tp_init = (initproc)device_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Snapshot */
+
+typedef struct
+{
+    PyObject_HEAD
+    co2mon_shm *shm;
+} snapshot_object;
+
+static int
+snapshot_init(snapshot_object *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "path", NULL };
+    PyObject *path;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&:Snapshot", kwlist, PyUnicode_FSConverter, &path))
+    {
+        return -1;
+    }
+    if (self->shm)
+    {
+        co2mon_shm_close(self->shm);
+    }
+    last_error = CO2MON_ERROR_SYSTEM;
+    last_message[0] = '\0';
+    self->shm = co2mon_shm_open(PyBytes_AS_STRING(path));
+    if (!self->shm)
+    {
+        raise_error(last_error, last_message[0] ? last_message : NULL);
+        Py_DECREF(path);
+        return -1;
+    }
+    Py_DECREF(path);
+    return 0;
+}
+
+static void
+snapshot_dealloc(snapshot_object *self)
+{
+    if (self->shm)
+    {
+        co2mon_shm_close(self->shm);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+snapshot_usable(snapshot_object *self)
+{
+    if (!self->shm)
+    {
+        PyErr_SetString(PyExc_ValueError, "snapshot is closed");
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *
+snapshot_read(snapshot_object *self, PyObject *args)
+{
+    unsigned slot;
+    if (!PyArg_ParseTuple(args, "I:read", &slot) || !snapshot_usable(self))
+    {
+        return NULL;
+    }
+    if (slot >= co2mon_shm_ndevices(self->shm))
+    {
+        PyErr_SetString(PyExc_IndexError, "slot out of range");
+        return NULL;
+    }
+    struct co2mon_shm_device copy;
+    int r = co2mon_shm_read(self->shm, slot, &copy);
+    if (r < 0)
+    {
+        PyErr_SetString(PyExc_BlockingIOError, "the writer is holding the slot");
+        return NULL;
+    }
+    if (r == 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    records_object *records = records_new(256);
+    if (!records)
+    {
+        return NULL;
+    }
+    for (int code = 0; code < 256; ++code)
+    {
+        if (copy.timestamp[code])
+        {
+            struct co2mon_record *rec = &records->records[records->count++];
+            rec->code = (unsigned char)code;
+            rec->value = copy.data[code];
+            rec->timestamp = copy.timestamp[code];
+            rec->monotonic = 0;
+        }
+    }
+    copy.name[sizeof(copy.name) - 1] = '\0';
+    return Py_BuildValue("(sLN)", copy.name, (long long)copy.heartbeat, records);
+}
+
+static PyObject *
+snapshot_close(snapshot_object *self, PyObject *unused)
+{
+    (void)unused;
+    if (self->shm)
+    {
+        co2mon_shm_close(self->shm);
+        self->shm = NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+snapshot_enter(snapshot_object *self, PyObject *unused)
+{
+    (void)unused;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+snapshot_exit(snapshot_object *self, PyObject *args)
+{
+    (void)args;
+    return snapshot_close(self, NULL);
+}
+
+static Py_ssize_t
+snapshot_length(snapshot_object *self)
+{
+    if (!snapshot_usable(self))
+    {
+        return -1;
+    }
+    return co2mon_shm_ndevices(self->shm);
+}
+
+static PyMethodDef snapshot_methods[] = {
+    { "read", (PyCFunction)snapshot_read, METH_VARARGS,
+      "read(slot) -> (name, heartbeat, Records) or None\n\n"
+      "A consistent copy of a device slot, None if it is empty: the\n"
+      "latest value of every item, with the time it arrived." },
+    { "close", (PyCFunction)snapshot_close, METH_NOARGS, "close()" },
+    { "__enter__", (PyCFunction)snapshot_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)snapshot_exit, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods snapshot_as_sequence = {
+    .sq_length = (lenfunc)snapshot_length,
+};
+
+static PyTypeObject snapshot_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "co2mon.Snapshot",
+    .tp_basicsize = sizeof(snapshot_object),
+    .tp_dealloc = (destructor)snapshot_dealloc,
+    .tp_as_sequence = &snapshot_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Snapshot(path)\n\n"
+              "The snapshot file of co2mond -M or co2mon-collector -M, mapped\n"
+              "read-only; len() is the number of device slots.",
+    .tp_methods = snapshot_methods,
+    .tp_init = (initproc)snapshot_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Module functions */
+
+static PyObject *
+module_enumerate(PyObject *module, PyObject *unused)
+{
+    (void)module;
+    (void)unused;
+    struct co2mon_device_info *devs;
+    Py_BEGIN_ALLOW_THREADS
+    devs = co2mon_enumerate();
+    Py_END_ALLOW_THREADS
+
+    PyObject *list = PyList_New(0);
+    for (struct co2mon_device_info *d = devs; list && d; d = d->next)
+    {
+        PyObject *item = Py_BuildValue("(ss)", d->path, d->serial_number);
+        if (!item || PyList_Append(list, item) < 0)
+        {
+            Py_CLEAR(list);
+        }
+        Py_XDECREF(item);
+    }
+    co2mon_free_enumeration(devs);
+    return list;
+}
+
+static int
+get_magic_table(PyObject *obj, co2mon_data_t magic_table)
+{
+    memset(magic_table, 0, sizeof(co2mon_data_t));
+    if (obj == Py_None)
+    {
+        return 1;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+    {
+        return 0;
+    }
+    int ok = view.len == sizeof(co2mon_data_t);
+    if (ok)
+    {
+        memcpy(magic_table, view.buf, sizeof(co2mon_data_t));
+    }
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "the magic table has 8 bytes");
+    }
+    PyBuffer_Release(&view);
+    return ok;
+}
+
+/* As libco2mon checks a decoded report. */
+static int
+report_valid(const co2mon_data_t result)
+{
+    return result[4] == 0x0d && (unsigned char)(result[0] + result[1] + result[2]) == result[3];
+}
+
+/*
+ * Like co2mon_decode() for a run of reports from one device: the first
+ * reports settle the encoding, the rest go through co2mon_decode_batch()
+ * if they are encrypted.
+ */
+static Py_ssize_t
+decode_reports(const unsigned char *raw, const int64_t *timestamps, Py_ssize_t n,
+               const co2mon_data_t magic_table, struct co2mon_record *out)
+{
+    struct co2mon_decoder dec = { CO2MON_ENCODING_UNKNOWN, 0 };
+    co2mon_data_t batch[256];
+    unsigned char valid[256];
+    Py_ssize_t count = 0;
+    Py_ssize_t i = 0;
+    while (i < n)
+    {
+        size_t m = 1;
+        if (dec.encoding == CO2MON_ENCODING_ENCRYPTED)
+        {
+            m = (size_t)(n - i) < 256 ? (size_t)(n - i) : 256;
+            co2mon_decode_batch(raw + i * 8, m, magic_table, batch, valid);
+        }
+        else
+        {
+            co2mon_decode(&dec, raw + i * 8, magic_table, batch[0]);
+            valid[0] = (unsigned char)report_valid(batch[0]);
+        }
+        for (size_t j = 0; j < m; ++j)
+        {
+            if (valid[j])
+            {
+                struct co2mon_record *rec = &out[count++];
+                rec->code = batch[j][0];
+                rec->value = (uint16_t)((batch[j][1] << 8) | batch[j][2]);
+                rec->timestamp = timestamps ? timestamps[i + (Py_ssize_t)j] : 0;
+                rec->monotonic = 0;
+            }
+        }
+        i += (Py_ssize_t)m;
+    }
+    return count;
+}
+
+/* Checks timestamps, one int64 per report, and gets its buffer. */
+static int
+get_timestamps(PyObject *obj, Py_ssize_t n, Py_buffer *view)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+    {
+        return 0;
+    }
+    const char *format = view->format ? view->format : "B";
+    if (*format == '<' || *format == '=' || *format == '@')
+    {
+        ++format;
+    }
+    if (view->itemsize != 8 || (strcmp(format, "q") != 0 && strcmp(format, "l") != 0) || view->len != n * 8)
+    {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "timestamps must be one int64 per report");
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *
+module_decode(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    (void)module;
+    static char *kwlist[] = { "raw", "timestamps", "magic_table", NULL };
+    Py_buffer raw;
+    PyObject *timestamps_obj = Py_None;
+    PyObject *magic_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|OO:decode", kwlist, &raw, &timestamps_obj, &magic_obj))
+    {
+        return NULL;
+    }
+    Py_ssize_t n = raw.len / 8;
+    co2mon_data_t magic_table;
+    Py_buffer timestamps;
+    timestamps.obj = NULL;
+    records_object *records = NULL;
+    if (raw.len % 8)
+    {
+        PyErr_SetString(PyExc_ValueError, "reports have 8 bytes each");
+    }
+    else if (get_magic_table(magic_obj, magic_table) &&
+             (timestamps_obj == Py_None || get_timestamps(timestamps_obj, n, &timestamps)) &&
+             (records = records_new(n)))
+    {
+        const int64_t *ts = timestamps.obj ? timestamps.buf : NULL;
+        Py_BEGIN_ALLOW_THREADS
+        records->count = decode_reports(raw.buf, ts, n, magic_table, records->records);
+        Py_END_ALLOW_THREADS
+    }
+    if (timestamps.obj)
+    {
+        PyBuffer_Release(&timestamps);
+    }
+    PyBuffer_Release(&raw);
+    return (PyObject *)records;
+}
+
+static PyObject *
+module_read_archive(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    (void)module;
+    static char *kwlist[] = { "path", "code", NULL };
+    PyObject *path;
+    int code = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|i:read_archive", kwlist, PyUnicode_FSConverter, &path, &code))
+    {
+        return NULL;
+    }
+    struct co2mon_archive_segment segment;
+    int mapped;
+    last_error = CO2MON_ERROR_SYSTEM;
+    last_message[0] = '\0';
+    Py_BEGIN_ALLOW_THREADS
+    mapped = co2mon_archive_map(&segment, PyBytes_AS_STRING(path));
+    Py_END_ALLOW_THREADS
+    if (!mapped)
+    {
+        raise_error(last_error, last_message[0] ? last_message : NULL);
+        Py_DECREF(path);
+        return NULL;
+    }
+    Py_DECREF(path);
+
+    /* Sized from the block headers, so decoding needs no reallocation. */
+    Py_ssize_t total = 0;
+    for (const struct co2mon_archive_block *b = NULL; (b = co2mon_archive_next_block(&segment, b));)
+    {
+        if (code < 0 || b->code == code)
+        {
+            total += b->count;
+        }
+    }
+    records_object *records = records_new(total);
+    if (!records)
+    {
+        co2mon_archive_unmap(&segment);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    int64_t timestamps[CO2MON_ARCHIVE_BLOCK_SAMPLES];
+    uint16_t values[CO2MON_ARCHIVE_BLOCK_SAMPLES];
+    for (const struct co2mon_archive_block *b = NULL; (b = co2mon_archive_next_block(&segment, b));)
+    {
+        if ((code >= 0 && b->code != code) ||
+            !co2mon_archive_block_valid(b, segment.end - (size_t)((const char *)b - segment.data)))
+        {
+            continue;
+        }
+        long n = co2mon_archive_decode(b, timestamps, values, CO2MON_ARCHIVE_BLOCK_SAMPLES);
+        if (n < 0 || records->count + n > records->size)
+        {
+            continue;
+        }
+        for (long i = 0; i < n; ++i)
+        {
+            struct co2mon_record *rec = &records->records[records->count++];
+            rec->code = b->code;
+            rec->value = values[i];
+            rec->timestamp = timestamps[i] * 1000000000;
+            rec->monotonic = 0;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    char name[CO2MON_ARCHIVE_NAME_MAX + 1];
+    memcpy(name, segment.header->name, CO2MON_ARCHIVE_NAME_MAX);
+    name[CO2MON_ARCHIVE_NAME_MAX] = '\0';
+    long long day = (long long)segment.header->day;
+    co2mon_archive_unmap(&segment);
+    return Py_BuildValue("(sLN)", name, day, records);
+}
+
+static PyObject *
+module_item(PyObject *module, PyObject *args)
+{
+    (void)module;
+    PyObject *key;
+    if (!PyArg_ParseTuple(args, "O:item", &key))
+    {
+        return NULL;
+    }
+    long code;
+    if (PyUnicode_Check(key))
+    {
+        const char *name = PyUnicode_AsUTF8(key);
+        if (!name)
+        {
+            return NULL;
+        }
+        code = co2mon_item_code(name);
+    }
+    else
+    {
+        code = PyLong_AsLong(key);
+        if (code == -1 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+    }
+    if (code < 0 || code > 255 || !co2mon_items[code].name)
+    {
+        Py_RETURN_NONE;
+    }
+    const struct co2mon_item *item = &co2mon_items[code];
+    return Py_BuildValue("{sis:ssdsdsisisdsdsdsisI}",
+                         "code", (int)code,
+                         "name", item->name,
+                         "scale", item->scale,
+                         "offset", item->offset,
+                         "min", (int)item->min,
+                         "max", (int)item->max,
+                         "deadband", item->deadband,
+                         "warning", item->warning,
+                         "critical", item->critical,
+                         "precision", item->precision,
+                         "flags", item->flags);
+}
+
+static PyMethodDef module_methods[] = {
+    { "enumerate", (PyCFunction)module_enumerate, METH_NOARGS,
+      "enumerate() -> [(path, serial_number)]\n\nThe sensors attached." },
+    { "decode", (PyCFunction)(void (*)(void))module_decode, METH_VARARGS | METH_KEYWORDS,
+      "decode(raw, timestamps=None, magic_table=None) -> Records\n\n"
+      "Decodes raw reports of one device, 8 bytes each back to back, and\n"
+      "keeps those that pass the checksum.  timestamps, if given, holds\n"
+      "one int64 per report (e.g. a NumPy array)." },
+    { "read_archive", (PyCFunction)(void (*)(void))module_read_archive, METH_VARARGS | METH_KEYWORDS,
+      "read_archive(path, code=None) -> (name, day, Records)\n\n"
+      "All samples of an archive segment (co2mond -Y), or those of one\n"
+      "item; blocks that fail their check are skipped.  Timestamps are\n"
+      "whole seconds." },
+    { "item", (PyCFunction)module_item, METH_VARARGS,
+      "item(code_or_name) -> dict or None\n\n"
+      "The descriptor of an item: value = word * scale + offset." },
+    { NULL, NULL, 0, NULL }
+};
+
+static void
+module_free(void *module)
+{
+    (void)module;
+    co2mon_exit();
+}
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "co2mon",
+    .m_doc = "Access to CO2 sensors through libco2mon.",
+    .m_size = -1,
+    .m_methods = module_methods,
+    .m_free = module_free,
+};
+
+static int
+add_type(PyObject *module, const char *name, PyTypeObject *type)
+{
+    if (PyType_Ready(type) < 0)
+    {
+        return 0;
+    }
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, name, (PyObject *)type) < 0)
+    {
+        Py_DECREF(type);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+add_constants(PyObject *module)
+{
+    static const struct
+    {
+        const char *name;
+        int value;
+    } constants[] = {
+        { "ITEM_HUM", CO2MON_ITEM_HUM },
+        { "ITEM_TAMB", CO2MON_ITEM_TAMB },
+        { "ITEM_CNTR", CO2MON_ITEM_CNTR },
+        { "ITEM_SHOW", CO2MON_ITEM_SHOW },
+        { "ITEM_STORE", CO2MON_ITEM_STORE },
+        { "ENCODING_UNKNOWN", CO2MON_ENCODING_UNKNOWN },
+        { "ENCODING_ENCRYPTED", CO2MON_ENCODING_ENCRYPTED },
+        { "ENCODING_PLAINTEXT", CO2MON_ENCODING_PLAINTEXT },
+        { "ERROR_NOT_FOUND", CO2MON_ERROR_NOT_FOUND },
+        { "ERROR_NO_MEMORY", CO2MON_ERROR_NO_MEMORY },
+        { "ERROR_OPEN", CO2MON_ERROR_OPEN },
+        { "ERROR_IO", CO2MON_ERROR_IO },
+        { "ERROR_TIMEOUT", CO2MON_ERROR_TIMEOUT },
+        { "ERROR_SHORT_READ", CO2MON_ERROR_SHORT_READ },
+        { "ERROR_CHECKSUM", CO2MON_ERROR_CHECKSUM },
+        { "ERROR_INVALID", CO2MON_ERROR_INVALID },
+        { "ERROR_SYSTEM", CO2MON_ERROR_SYSTEM },
+    };
+    for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); ++i)
+    {
+        if (PyModule_AddIntConstant(module, constants[i].name, constants[i].value) < 0)
+        {
+            return 0;
+        }
+    }
+
+    /* For numpy.dtype(), where the buffer format is not taken as is. */
+    PyObject *dtype = Py_BuildValue("{s[ssss]s[ssss]s[nnnn]sn}",
+                                    "names", "code", "value", "timestamp", "monotonic",
+                                    "formats", "u1", "u2", "i8", "i8",
+                                    "offsets",
+                                    (Py_ssize_t)offsetof(struct co2mon_record, code),
+                                    (Py_ssize_t)offsetof(struct co2mon_record, value),
+                                    (Py_ssize_t)offsetof(struct co2mon_record, timestamp),
+                                    (Py_ssize_t)offsetof(struct co2mon_record, monotonic),
+                                    "itemsize", (Py_ssize_t)sizeof(struct co2mon_record));
+    if (!dtype || PyModule_AddObject(module, "RECORD_DTYPE", dtype) < 0)
+    {
+        Py_XDECREF(dtype);
+        return 0;
+    }
+    return 1;
+}
+
+PyMODINIT_FUNC
+PyInit_co2mon(void)
+{
+    if (record_type.tp_name == NULL && PyStructSequence_InitType2(&record_type, &record_desc) < 0)
+    {
+        return NULL;
+    }
+    PyObject *module = PyModule_Create(&module_def);
+    if (!module)
+    {
+        return NULL;
+    }
+    error_type = PyErr_NewExceptionWithDoc("co2mon.Error",
+                                           "A libco2mon error: args are (ERROR_* code, message).",
+                                           NULL, NULL);
+    Py_XINCREF(error_type);
+    if (!error_type || PyModule_AddObject(module, "Error", error_type) < 0)
+    {
+        Py_XDECREF(error_type);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&record_type);
+    if (PyModule_AddObject(module, "Record", (PyObject *)&record_type) < 0 ||
+        !add_type(module, "Records", &records_type) ||
+        !add_type(module, "Device", &device_type) ||
+        !add_type(module, "Snapshot", &snapshot_type) ||
+        !add_constants(module))
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    co2mon_set_log_callback(log_callback, NULL);
+    if (co2mon_init() < 0)
+    {
+        Py_DECREF(module);
+        return raise_error(CO2MON_ERROR_SYSTEM, "unable to initialize libco2mon");
+    }
+    return module;
+}